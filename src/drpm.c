@@ -56,6 +56,8 @@ const char *drpm_strerror(int error)
         return "file changed";
     case DRPM_ERR_NOINSTALL:
         return "old RPM not installed";
+    case DRPM_ERR_CANCELED:
+        return "canceled by caller";
     default:
         return "(undefined error value)";
     }
@@ -159,6 +161,9 @@ int drpm_get_ulong(struct drpm *delta, int tag, unsigned long *ret)
     case DRPM_TAG_PAYLOADFMTOFF:
         *ret = (unsigned long)delta->payload_fmt_off;
         break;
+    case DRPM_TAG_SELFWINDOW:
+        *ret = (unsigned long)delta->self_window;
+        break;
     default:
         return DRPM_ERR_ARGS;
     }
@@ -199,6 +204,9 @@ int drpm_get_ullong(struct drpm *delta, int tag, unsigned long long *ret)
     case DRPM_TAG_INTDATALEN:
         *ret = (unsigned long long)delta->int_data_len;
         break;
+    case DRPM_TAG_SELFWINDOW:
+        *ret = (unsigned long long)delta->self_window;
+        break;
     default:
         return DRPM_ERR_ARGS;
     }
@@ -270,6 +278,10 @@ int drpm_get_ulong_array(struct drpm *delta, int tag, unsigned long **ret_array,
         array = delta->ext_copies;
         *ret_size = (unsigned long)delta->ext_copies_size;
         break;
+    case DRPM_TAG_SELFCOPIES:
+        array = delta->self_copies;
+        *ret_size = (unsigned long)delta->self_copies_size;
+        break;
     default:
         return DRPM_ERR_ARGS;
     }
@@ -297,6 +309,7 @@ int drpm_make(const char *old_rpm_name, const char *new_rpm_name,
     drpm_make_options opts = {0};
     const bool rpm_only = (user_opts != NULL && user_opts->rpm_only);
     const bool alone = (old_rpm_name == NULL || new_rpm_name == NULL);
+    unsigned threads;
 
     const char *solo_rpm_name = NULL;
     struct rpm *solo_rpm = NULL;
@@ -316,9 +329,20 @@ int drpm_make(const char *old_rpm_name, const char *new_rpm_name,
     uint32_t new_header_len = 0;
 
     unsigned short payload_format;
+    uint64_t xz_block_size;
+    unsigned short zstd_window_log;
+    bool zstd_checksum;
+    bool zstd_workers;
+    bool zstd_reproducible;
     struct rpm_patches *patches = NULL;
 
     struct deltarpm delta = {0};
+    struct progress prog;
+    unsigned char old_sigmd5[MD5_DIGEST_LENGTH];
+    bool has_old_sigmd5 = false;
+    struct cache_entry *index_entry = NULL;
+    struct diff_seed *seeds = NULL;
+    size_t seeds_count = 0;
 
     if (deltarpm_name == NULL || (old_rpm_name == NULL && new_rpm_name == NULL))
         return DRPM_ERR_ARGS;
@@ -331,18 +355,36 @@ int drpm_make(const char *old_rpm_name, const char *new_rpm_name,
     else
         drpm_make_options_copy(&opts, user_opts);
 
-    if (rpm_only && opts.version < 3)
-        return DRPM_ERR_ARGS;
+    if (rpm_only && opts.version < 3) {
+        error = DRPM_ERR_ARGS;
+        goto cleanup;
+    }
+
+    threads = threads_resolve(opts.threads);
+    progress_init(&prog, opts.progress, opts.progress_data);
 
     delta.filename = deltarpm_name;
+    delta.dict_file = opts.dict;
+    delta.comp_auto = opts.comp_auto;
+    delta.comp_slack = opts.comp_slack;
+    delta.stats = opts.stats;
+    delta.progress = &prog;
     delta.type = rpm_only ? DRPM_TYPE_RPMONLY : DRPM_TYPE_STANDARD;
     delta.version = opts.version;
 
+    if (opts.stats != NULL) {
+        const struct drpm_make_stats stats_init = {0};
+        *opts.stats = stats_init;
+    }
+
     if (!opts.comp_from_rpm) {
         delta.comp = opts.comp;
         delta.comp_level = opts.comp_level;
     }
 
+    if ((error = progress_report(&prog, DRPM_PHASE_READ, 0, 0, 0)) != DRPM_ERR_OK)
+        goto cleanup;
+
     /* no diff to perform for identity rpm-only deltarpms */
     if (alone && rpm_only) {
         if ((error = fill_nodiff_deltarpm(&delta, solo_rpm_name, opts.comp_from_rpm)) != DRPM_ERR_OK)
@@ -355,8 +397,8 @@ int drpm_make(const char *old_rpm_name, const char *new_rpm_name,
 
     /* reading RPM(s) (also creating MD5 sums and determining compressor from archive) */
     if (alone) {
-        if ((error = rpm_read(&solo_rpm, solo_rpm_name, RPM_ARCHIVE_READ_DECOMP,
-                              &delta.tgt_comp, NULL, delta.tgt_md5)) != DRPM_ERR_OK)
+        if ((error = rpm_read(&solo_rpm, solo_rpm_name, RPM_ARCHIVE_READ_DECOMP, threads,
+                              &delta.tgt_comp, NULL, delta.tgt_md5, opts.cache, &prog)) != DRPM_ERR_OK)
             goto cleanup;
     } else {
         if (rpm_only) {
@@ -366,10 +408,10 @@ int drpm_make(const char *old_rpm_name, const char *new_rpm_name,
             }
             delta.sequence_len = MD5_DIGEST_LENGTH;
         }
-        if ((error = rpm_read(&old_rpm, old_rpm_name, RPM_ARCHIVE_READ_DECOMP,
-                              NULL, rpm_only ? delta.sequence : NULL, NULL)) != DRPM_ERR_OK ||
-            (error = rpm_read(&new_rpm, new_rpm_name, RPM_ARCHIVE_READ_DECOMP,
-                              &delta.tgt_comp, NULL, delta.tgt_md5)) != DRPM_ERR_OK)
+        if ((error = rpm_read(&old_rpm, old_rpm_name, RPM_ARCHIVE_READ_DECOMP, threads,
+                              NULL, rpm_only ? delta.sequence : NULL, NULL, opts.cache, &prog)) != DRPM_ERR_OK ||
+            (error = rpm_read(&new_rpm, new_rpm_name, RPM_ARCHIVE_READ_DECOMP, threads,
+                              &delta.tgt_comp, NULL, delta.tgt_md5, opts.cache, &prog)) != DRPM_ERR_OK)
             goto cleanup;
     }
 
@@ -385,12 +427,43 @@ int drpm_make(const char *old_rpm_name, const char *new_rpm_name,
     if ((error = rpm_get_comp_level(alone ? solo_rpm : new_rpm, &delta.tgt_comp_level)) != DRPM_ERR_OK)
         goto cleanup;
 
+    /* recording the block layout of multi-block xz payloads,
+     * so that they can be recompressed in parallel when applying;
+     * deltarpm refuses target compression parameters, so only in version 4 */
+    if (delta.tgt_comp == DRPM_COMP_XZ && delta.version >= 4) {
+        if ((error = rpm_get_xz_block_size(alone ? solo_rpm : new_rpm, &xz_block_size)) != DRPM_ERR_OK ||
+            (xz_block_size > 0 && (error = deltarpm_set_xz_blocks(&delta, xz_block_size)) != DRPM_ERR_OK))
+            goto cleanup;
+    }
+
+    /* recording zstd frame parameters to reproduce rpm's threaded output,
+     * in version 4 only and if plain recompression does not reproduce it */
+    if (delta.tgt_comp == DRPM_COMP_ZSTD && delta.version >= 4) {
+        if ((error = rpm_get_zstd_params(alone ? solo_rpm : new_rpm, &zstd_window_log,
+                                         &zstd_checksum, &zstd_workers)) != DRPM_ERR_OK ||
+            (zstd_workers &&
+             (error = rpm_payload_reproducible(alone ? solo_rpm : new_rpm,
+                                               alone ? solo_rpm_name : new_rpm_name,
+                                               delta.tgt_comp, delta.tgt_comp_level,
+                                               &zstd_reproducible)) != DRPM_ERR_OK) ||
+            (zstd_workers && !zstd_reproducible &&
+             (error = deltarpm_set_zstd_params(&delta, zstd_window_log,
+                                               zstd_checksum, zstd_workers)) != DRPM_ERR_OK))
+            goto cleanup;
+    }
+
     /* matching RPM compression if no compression specified by user */
     if (opts.comp_from_rpm) {
         delta.comp = delta.tgt_comp;
         delta.comp_level = delta.tgt_comp_level;
     }
 
+    /* only zstd can make use of a trained dictionary */
+    if (opts.dict != NULL && (delta.comp_auto || delta.comp != DRPM_COMP_ZSTD)) {
+        error = DRPM_ERR_ARGS;
+        goto cleanup;
+    }
+
     if (!rpm_only)
         delta.head.tgt_rpm = alone ? solo_rpm : new_rpm;
 
@@ -451,13 +524,36 @@ int drpm_make(const char *old_rpm_name, const char *new_rpm_name,
         (error = rpm_find_payload_format_offset(alone ? solo_rpm : new_rpm, &delta.payload_fmt_off)) != DRPM_ERR_OK)
         goto cleanup;
 
+    /* match indexes of popular old RPMs are kept warm by drpmd */
+    if (opts.cache != NULL && patches == NULL) {
+        if ((error = rpm_signature_get_md5(alone ? solo_rpm : old_rpm, old_sigmd5, &has_old_sigmd5)) != DRPM_ERR_OK ||
+            (has_old_sigmd5 && (error = cache_get_index(opts.cache, old_sigmd5, rpm_only,
+                                                        hash_effort_chained(opts.effort), opts.index_spacing,
+                                                        old_cpio, old_cpio_len, threads,
+                                                        &index_entry, &prog)) != DRPM_ERR_OK))
+            goto cleanup;
+    }
+
+    /* files with the same digest need not be searched for
+     * (above the default effort, which keeps makedeltarpm's output) */
+    if (opts.effort > DRPM_EFFORT_DEFAULT &&
+        (error = diff_seeds_find(alone ? solo_rpm : old_rpm, old_cpio, old_cpio_len, old_header_len,
+                                 alone ? solo_rpm : new_rpm, new_cpio, new_cpio_len, new_header_len,
+                                 &seeds, &seeds_count)) != DRPM_ERR_OK)
+        goto cleanup;
+
     /* diff algorithm, creating deltarpm diff data */
     if ((error = make_diff(old_cpio, old_cpio_len, new_cpio, new_cpio_len,
                            &delta.int_data.ptrs, &delta.int_data_len,
                            &delta.ext_copies, &delta.ext_copies_count,
                            &delta.int_copies, &delta.int_copies_count,
                            opts.addblk ? &delta.add_data : NULL, opts.addblk ? &delta.add_data_len : NULL,
-                           opts.addblk_comp, opts.addblk_comp_level)) != DRPM_ERR_OK)
+                           opts.addblk_comp, opts.addblk_comp_level,
+                           opts.effort, opts.index_spacing, threads,
+                           (index_entry != NULL) ? cache_entry_data(index_entry) : NULL,
+                           seeds, seeds_count, (delta.version >= 4) ? SELF_WINDOW : 0,
+                           &delta.self_copies, &delta.self_copies_count, &delta.self_window,
+                           &prog)) != DRPM_ERR_OK)
         goto cleanup;
 
     delta.int_data_as_ptrs = true;
@@ -465,7 +561,8 @@ int drpm_make(const char *old_rpm_name, const char *new_rpm_name,
 
 write_files:
 
-    if ((error = write_deltarpm(&delta)) != DRPM_ERR_OK)
+    if ((error = progress_report(&prog, DRPM_PHASE_WRITE, 0, 0, 0)) != DRPM_ERR_OK ||
+        (error = write_deltarpm(&delta)) != DRPM_ERR_OK)
         goto cleanup;
 
     if (opts.seqfile != NULL)
@@ -473,6 +570,9 @@ write_files:
 
 cleanup:
 
+    if (index_entry != NULL)
+        cache_release(opts.cache, index_entry);
+
     free_deltarpm(&delta);
 
     rpm_destroy(&old_rpm);
@@ -483,12 +583,14 @@ cleanup:
     free(new_cpio);
     free(old_header);
     free(new_header);
+    free(seeds);
 
     patches_destroy(&patches);
 
     free(opts.seqfile);
     free(opts.oldrpmprint);
     free(opts.oldpatchrpm);
+    free(opts.dict);
 
     return error;
 }
@@ -496,8 +598,15 @@ cleanup:
 /***************************** drpm apply *****************************/
 
 int drpm_apply(const char *old_rpm_name, const char *deltarpm_name, const char *new_rpm_name)
+{
+    return drpm_apply_with_options(old_rpm_name, deltarpm_name, new_rpm_name, NULL);
+}
+
+int drpm_apply_with_options(const char *old_rpm_name, const char *deltarpm_name,
+                            const char *new_rpm_name, const drpm_apply_options *user_opts)
 {
     int error = DRPM_ERR_OK;
+    drpm_apply_options opts = {0};
     struct deltarpm delta = {0};
     const bool from_rpm = (old_rpm_name != NULL);
     bool rpm_only;
@@ -529,6 +638,12 @@ int drpm_apply(const char *old_rpm_name, const char *deltarpm_name, const char *
     uint32_t int_copies_count;
     size_t int_copy_len;
     const unsigned char *int_data;
+    uint64_t int_copies_done = 0;
+    const uint32_t *self_copies;
+    uint32_t self_copies_left;
+    uint64_t next_self;
+    size_t self_dist;
+    struct out_window *window = NULL;
     const uint32_t *ext_copies;
     uint32_t ext_copies_count;
     size_t ext_copy_len;
@@ -538,14 +653,40 @@ int drpm_apply(const char *old_rpm_name, const char *deltarpm_name, const char *
     size_t blk_id;
     unsigned char *comp_data = NULL;
     size_t comp_data_len;
+    struct file_info *tgt_files = NULL;
+    size_t tgt_file_count = 0;
+    unsigned short tgt_digest_algo;
+    struct file_verifier *verifier = NULL;
+    uint64_t xz_block_size;
+    unsigned short zstd_window_log;
+    bool zstd_checksum;
+    bool zstd_workers;
+    struct progress prog;
+    uint64_t bytes_done = 0;
 
     if (deltarpm_name == NULL || new_rpm_name == NULL)
         return DRPM_ERR_ARGS;
 
-    if ((filedesc = creat(new_rpm_name, CREAT_MODE)) < 0)
+    if (user_opts == NULL)
+        drpm_apply_options_defaults(&opts);
+    else
+        drpm_apply_options_copy(&opts, user_opts);
+
+    if (opts.bad_file != NULL)
+        *opts.bad_file = NULL;
+
+    progress_init(&prog, opts.progress, opts.progress_data);
+
+    if ((filedesc = creat(new_rpm_name, CREAT_MODE)) < 0) {
+        free(opts.dict_dir);
         return DRPM_ERR_IO;
+    }
+
+    if ((error = progress_report(&prog, DRPM_PHASE_READ, 0, 0, 0)) != DRPM_ERR_OK)
+        goto cleanup;
 
     /* reading DeltaRPM */
+    delta.dict_dir = opts.dict_dir;
     if ((error = read_deltarpm(&delta, deltarpm_name)) != DRPM_ERR_OK)
         goto cleanup;
     rpm_only = (delta.type == DRPM_TYPE_RPMONLY);
@@ -553,7 +694,8 @@ int drpm_apply(const char *old_rpm_name, const char *deltarpm_name, const char *
 
     if (from_rpm) {
         /* reading old RPM */
-        if ((error = rpm_read(&old_rpm, old_rpm_name, RPM_ARCHIVE_READ_DECOMP, NULL, NULL, NULL)) != DRPM_ERR_OK)
+        if ((error = rpm_read(&old_rpm, old_rpm_name, RPM_ARCHIVE_READ_DECOMP,
+                              threads_resolve(opts.threads), NULL, NULL, NULL, NULL, &prog)) != DRPM_ERR_OK)
             goto cleanup;
         if (rpm_only) {
             /* comparing signature MD5 with DeltaRPM sequence */
@@ -569,12 +711,12 @@ int drpm_apply(const char *old_rpm_name, const char *deltarpm_name, const char *
             }
         }
     } else {
-        // rpm-only deltarpms do not work from filesystem
-        if (rpm_only)
-            return DRPM_ERR_ARGS;
-        // cannot reconstruct source RPMs from filesystem
-        if (rpm_is_sourcerpm(delta.head.tgt_rpm))
-            return DRPM_ERR_ARGS;
+        // rpm-only deltarpms do not work from filesystem,
+        // nor can source RPMs be reconstructed from it
+        if (rpm_only || rpm_is_sourcerpm(delta.head.tgt_rpm)) {
+            error = DRPM_ERR_ARGS;
+            goto cleanup;
+        }
         /* reading old RPM header from database */
         if ((error = rpm_read_header(&old_rpm, delta.src_nevr, NULL)) != DRPM_ERR_OK)
             goto cleanup;
@@ -614,15 +756,16 @@ int drpm_apply(const char *old_rpm_name, const char *deltarpm_name, const char *
     }
 
     /* creating blocks for reading external data */
-    if ((error = blocks_create(&blks, delta.ext_data_len, files,
+    if ((error = blocks_create(&blks, delta.ext_data_len, files, file_count,
                                cpio_files, cpio_files_len,
                                delta.ext_copies, delta.ext_copies_count,
-                               from_rpm ? old_rpm : NULL, rpm_only)) != DRPM_ERR_OK)
+                               from_rpm ? old_rpm : NULL, rpm_only,
+                               opts.open_files, opts.io_threads)) != DRPM_ERR_OK)
         goto cleanup;
 
     /* setting up add block */
     if (delta.add_data_len > 0) {
-        if ((error = decompstrm_init(&addblk_strm, -1, NULL, NULL, delta.add_data, delta.add_data_len)) != DRPM_ERR_OK)
+        if ((error = decompstrm_init(&addblk_strm, -1, NULL, NULL, delta.add_data, delta.add_data_len, 1)) != DRPM_ERR_OK)
             goto cleanup;
         if ((addblk_buf = malloc(block_size())) == NULL) {
             error = DRPM_ERR_MEMORY;
@@ -670,13 +813,44 @@ int drpm_apply(const char *old_rpm_name, const char *deltarpm_name, const char *
                                        filedesc, delta.tgt_comp, delta.tgt_comp_level)) != DRPM_ERR_OK)
         goto cleanup;
 
+    /* multi-block xz payloads are recompressed block by block in parallel */
+    if (deltarpm_get_xz_blocks(&delta, &xz_block_size) &&
+        (error = compstrm_wrapper_set_xz_blocks(csw, xz_block_size,
+                                                threads_resolve(opts.threads))) != DRPM_ERR_OK)
+        goto cleanup;
+
+    /* zstd payloads get the same frame parameters and threading mode as the original */
+    if (deltarpm_get_zstd_params(&delta, &zstd_window_log, &zstd_checksum, &zstd_workers) &&
+        (error = compstrm_wrapper_set_zstd_params(csw, zstd_window_log, zstd_checksum,
+                                                  zstd_workers ? threads_resolve(opts.threads) : 0)) != DRPM_ERR_OK)
+        goto cleanup;
+
+    /* verifying files of the new RPM as they are reconstructed */
+    if (opts.verify_files && !rpm_only) {
+        if ((error = rpm_get_file_info(delta.head.tgt_rpm, &tgt_files, &tgt_file_count, NULL)) != DRPM_ERR_OK ||
+            (error = rpm_get_digest_algo(delta.head.tgt_rpm, &tgt_digest_algo)) != DRPM_ERR_OK ||
+            (error = file_verifier_start(&verifier, tgt_files, tgt_file_count, tgt_digest_algo)) != DRPM_ERR_OK)
+            goto cleanup;
+    }
+
     /* reconstructing from diff data */
 
+    if ((error = progress_report(&prog, DRPM_PHASE_APPLY, 0, 0, delta.ext_copies_count)) != DRPM_ERR_OK)
+        goto cleanup;
+
     int_copies = delta.int_copies;
     int_copies_count = delta.int_copies_count;
     ext_copies = delta.ext_copies;
     ext_copies_count = delta.ext_copies_count;
     int_data = delta.int_data.bytes;
+    self_copies = delta.self_copies;
+    self_copies_left = delta.self_copies_count;
+    next_self = (self_copies_left > 0) ? self_copies[0] : UINT64_MAX;
+
+    /* keeping recent output for internal copies taken from it */
+    if (self_copies_left > 0 &&
+        (error = out_window_create(&window, delta.self_window)) != DRPM_ERR_OK)
+        goto cleanup;
 
     while (int_copies_count--) {
         ext_copies_todo = *int_copies++;
@@ -707,12 +881,21 @@ int drpm_apply(const char *old_rpm_name, const char *deltarpm_name, const char *
                         buffer[i] += (signed char)addblk_buf[i];
                 }
 
-                if ((error = compstrm_wrapper_write(csw, buffer, buffer_len)) != DRPM_ERR_OK)
+                if ((verifier != NULL &&
+                     (error = file_verifier_feed(verifier, buffer, buffer_len)) != DRPM_ERR_OK) ||
+                    (error = compstrm_wrapper_write(csw, buffer, buffer_len)) != DRPM_ERR_OK)
                     goto cleanup;
+                if (window != NULL)
+                    out_window_push(window, buffer, buffer_len);
 
                 ext_copy_len -= buffer_len;
                 ext_offset += buffer_len;
                 blk_id++;
+                bytes_done += buffer_len;
+
+                if ((error = progress_report(&prog, DRPM_PHASE_APPLY, bytes_done, ext_copies_done,
+                                             delta.ext_copies_count)) != DRPM_ERR_OK)
+                    goto cleanup;
             }
 
             ext_copies_done++;
@@ -720,13 +903,50 @@ int drpm_apply(const char *old_rpm_name, const char *deltarpm_name, const char *
 
         int_copy_len = *int_copies++;
 
-        /* performing internal copy */
-        if ((error = compstrm_wrapper_write(csw, int_data, int_copy_len)) != DRPM_ERR_OK)
+        if (int_copies_done++ == next_self) {
+            /* performing internal copy from earlier output */
+            self_dist = self_copies[1];
+            self_copies += 2;
+            next_self = (--self_copies_left > 0) ? next_self + 1 + self_copies[0] : UINT64_MAX;
+
+            while (int_copy_len > 0) {
+                buffer_len = MIN(int_copy_len, block_size());
+                if ((error = out_window_fetch(window, self_dist, buffer, buffer_len)) != DRPM_ERR_OK ||
+                    (verifier != NULL &&
+                     (error = file_verifier_feed(verifier, buffer, buffer_len)) != DRPM_ERR_OK) ||
+                    (error = compstrm_wrapper_write(csw, buffer, buffer_len)) != DRPM_ERR_OK)
+                    goto cleanup;
+                out_window_push(window, buffer, buffer_len);
+                int_copy_len -= buffer_len;
+                bytes_done += buffer_len;
+
+                if ((error = progress_report(&prog, DRPM_PHASE_APPLY, bytes_done, ext_copies_done,
+                                             delta.ext_copies_count)) != DRPM_ERR_OK)
+                    goto cleanup;
+            }
+        } else {
+            /* performing internal copy */
+            if ((verifier != NULL &&
+                 (error = file_verifier_feed(verifier, int_data, int_copy_len)) != DRPM_ERR_OK) ||
+                (error = compstrm_wrapper_write(csw, int_data, int_copy_len)) != DRPM_ERR_OK)
+                goto cleanup;
+            if (window != NULL)
+                out_window_push(window, int_data, int_copy_len);
+            int_data += int_copy_len;
+            bytes_done += int_copy_len;
+        }
+
+        if ((error = progress_report(&prog, DRPM_PHASE_APPLY, bytes_done, ext_copies_done,
+                                     delta.ext_copies_count)) != DRPM_ERR_OK)
             goto cleanup;
-        int_data += int_copy_len;
     }
 
-    if ((error = compstrm_wrapper_finish(csw, &comp_data, &comp_data_len)) != DRPM_ERR_OK)
+    if (verifier != NULL &&
+        (error = file_verifier_finish(verifier, opts.bad_file)) != DRPM_ERR_OK)
+        goto cleanup;
+
+    if ((error = progress_report(&prog, DRPM_PHASE_WRITE, bytes_done, 0, 0)) != DRPM_ERR_OK ||
+        (error = compstrm_wrapper_finish(csw, &comp_data, &comp_data_len)) != DRPM_ERR_OK)
         goto cleanup;
 
     /* finalizing MD5 of written data */
@@ -758,12 +978,29 @@ cleanup:
 
     close(filedesc);
 
+    /* not leaving a partial RPM behind if the caller gave up on it */
+    if (error == DRPM_ERR_CANCELED)
+        unlink(new_rpm_name);
+
+    if (verifier != NULL) {
+        /* reporting the file that failed verification while feeding the verifier */
+        if (error == DRPM_ERR_MISMATCH && opts.bad_file != NULL && *opts.bad_file == NULL)
+            file_verifier_finish(verifier, opts.bad_file);
+        file_verifier_destroy(&verifier);
+    }
+
     for (size_t i = 0; i < file_count; i++) {
         free(files[i].name);
         free(files[i].md5);
         free(files[i].linkto);
     }
     free(files);
+    for (size_t i = 0; i < tgt_file_count; i++) {
+        free(tgt_files[i].name);
+        free(tgt_files[i].md5);
+        free(tgt_files[i].linkto);
+    }
+    free(tgt_files);
     free_deltarpm(&delta);
     rpm_destroy(&old_rpm);
     free(old_rpm_nevr);
@@ -771,15 +1008,129 @@ cleanup:
     blocks_destroy(&blks);
     decompstrm_destroy(&addblk_strm);
     compstrm_wrapper_destroy(&csw);
+    out_window_destroy(&window);
     free(cpio_files);
     free(addblk_buf);
     free(buffer);
     free(header);
     free(comp_data);
+    free(opts.dict_dir);
+
+    return error;
+}
+
+int drpm_estimate_apply(drpm_apply_estimate **estimate, const char *old_rpm_name,
+                        const char *deltarpm_name, const drpm_apply_options *user_opts)
+{
+    int error = DRPM_ERR_OK;
+    drpm_apply_options opts = {0};
+    struct deltarpm delta = {0};
+    const bool from_rpm = (old_rpm_name != NULL);
+    struct rpm *old_rpm = NULL;
+    char *old_rpm_nevr = NULL;
+    unsigned short old_comp = DRPM_COMP_NONE;
+
+    if (estimate == NULL || deltarpm_name == NULL)
+        return DRPM_ERR_ARGS;
+
+    *estimate = NULL;
+
+    if (user_opts == NULL)
+        drpm_apply_options_defaults(&opts);
+    else
+        drpm_apply_options_copy(&opts, user_opts);
+
+    /* reading DeltaRPM up to the copies, skipping add and internal data */
+    delta.dict_dir = opts.dict_dir;
+    delta.copies_only = true;
+    if ((error = read_deltarpm(&delta, deltarpm_name)) != DRPM_ERR_OK)
+        goto cleanup;
+
+    if (from_rpm) {
+        /* reading old RPM header only, for its NEVR and payload compression */
+        if ((error = rpm_read(&old_rpm, old_rpm_name, RPM_ARCHIVE_DONT_READ,
+                              1, NULL, NULL, NULL, NULL, NULL)) != DRPM_ERR_OK ||
+            (error = rpm_get_comp(old_rpm, &old_comp)) != DRPM_ERR_OK ||
+            (error = rpm_get_nevr(old_rpm, &old_rpm_nevr)) != DRPM_ERR_OK)
+            goto cleanup;
+        if (strcmp(delta.src_nevr, old_rpm_nevr) != 0) {
+            error = DRPM_ERR_MISMATCH;
+            goto cleanup;
+        }
+    } else if (delta.type == DRPM_TYPE_RPMONLY) {
+        // rpm-only deltarpms do not work from filesystem
+        error = DRPM_ERR_ARGS;
+        goto cleanup;
+    }
+
+    if ((*estimate = malloc(sizeof(struct drpm_apply_estimate))) == NULL) {
+        error = DRPM_ERR_MEMORY;
+        goto cleanup;
+    }
+
+    if ((error = apply_estimate(*estimate, &delta, from_rpm, old_comp,
+                                threads_resolve(opts.threads))) != DRPM_ERR_OK) {
+        free(*estimate);
+        *estimate = NULL;
+    }
+
+cleanup:
+    free_deltarpm(&delta);
+    rpm_destroy(&old_rpm);
+    free(old_rpm_nevr);
+    free(opts.dict_dir);
 
     return error;
 }
 
+int drpm_apply_estimate_destroy(drpm_apply_estimate **estimate)
+{
+    if (estimate == NULL || *estimate == NULL)
+        return DRPM_ERR_ARGS;
+
+    free(*estimate);
+    *estimate = NULL;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_estimate_get(const drpm_apply_estimate *estimate, int item, unsigned long long *ret)
+{
+    if (estimate == NULL || ret == NULL)
+        return DRPM_ERR_ARGS;
+
+    switch (item) {
+    case DRPM_ESTIMATE_MEMORY:
+        *ret = (unsigned long long)estimate->memory;
+        break;
+    case DRPM_ESTIMATE_TIME:
+        *ret = (unsigned long long)estimate->msecs;
+        break;
+    case DRPM_ESTIMATE_BLOCKS:
+        *ret = (unsigned long long)estimate->blocks;
+        break;
+    case DRPM_ESTIMATE_EXTREAD:
+        *ret = (unsigned long long)estimate->ext_read;
+        break;
+    case DRPM_ESTIMATE_EXTREREAD:
+        *ret = (unsigned long long)estimate->ext_reread;
+        break;
+    case DRPM_ESTIMATE_DECOMP:
+        *ret = (unsigned long long)estimate->decomp;
+        break;
+    case DRPM_ESTIMATE_RECOMP:
+        *ret = (unsigned long long)estimate->recomp;
+        break;
+    case DRPM_ESTIMATE_RECOMPCOMP:
+        *ret = (unsigned long long)estimate->recomp_comp;
+        break;
+    default:
+        return DRPM_ERR_ARGS;
+    }
+
+    return DRPM_ERR_OK;
+}
+
 int drpm_check(const char *deltarpm_name, int check_mode)
 {
     int error = DRPM_ERR_OK;
@@ -888,7 +1239,7 @@ int drpm_check_sequence(const char *old_rpm_name, const char *sequence, int chec
         rpm_only = false;
     } else {
         /* reading old RPM */
-        if ((error = rpm_read(&old_rpm, old_rpm_name, RPM_ARCHIVE_DONT_READ, NULL, NULL, NULL)) != DRPM_ERR_OK ||
+        if ((error = rpm_read(&old_rpm, old_rpm_name, RPM_ARCHIVE_DONT_READ, 1, NULL, NULL, NULL, NULL, NULL)) != DRPM_ERR_OK ||
             (error = rpm_signature_get_md5(old_rpm, sigmd5, &has_md5)) != DRPM_ERR_OK)
             goto cleanup;
         // determining type of delta
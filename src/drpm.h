@@ -57,6 +57,8 @@
  * providing the same functionality as
  * [applydeltarpm(8)](http://linux.die.net/man/8/applydeltarpm).
  * @{
+ * @defgroup drpmApplyOptions DRPM Apply Options
+ * Tools for customizing DeltaRPM application.
  * @defgroup drpmCheck DRPM Check
  * Tools for checking if the reconstruction is possible
  * (like <tt>applydeltarpm { -c | -C }</tt>).
@@ -64,6 +66,9 @@
  *
  * @defgroup drpmRead DRPM Read
  * Tools for extracting information from DeltaRPM files.
+ *
+ * @defgroup drpmCache DRPM Payload Cache
+ * Tools for reusing decompressed RPM payloads across operations.
  */
 
 /**
@@ -81,6 +86,7 @@
 #define DRPM_ERR_PROG 8         /**< internal programming error */
 #define DRPM_ERR_MISMATCH 9     /**< file changed */
 #define DRPM_ERR_NOINSTALL 10   /**< old RPM not installed */
+#define DRPM_ERR_CANCELED 11    /**< canceled by caller */
 /** @} */
 
 /**
@@ -139,6 +145,8 @@
 #define DRPM_TAG_EXTCOPIES 16       /**< copies from external data (offset adjustment of external copy & length of external copy) */
 #define DRPM_TAG_EXTDATALEN 17      /**< length of external data */
 #define DRPM_TAG_INTDATALEN 18      /**< length of internal data */
+#define DRPM_TAG_SELFWINDOW 19      /**< longest distance of copies from earlier output (version 4) */
+#define DRPM_TAG_SELFCOPIES 20      /**< internal copies taken from earlier output (number of internal copies skipped since previous one & distance back into output) */
 /** @} */
 
 /**
@@ -148,6 +156,15 @@
 #define DRPM_COMP_LEVEL_DEFAULT 0   /**< default compression level for given compression type */
 /** @} */
 
+/**
+ * @name Diff Effort Levels
+ * @{
+ */
+#define DRPM_EFFORT_MIN 1       /**< fastest search for matches */
+#define DRPM_EFFORT_DEFAULT 4   /**< search for matches as done by makedeltarpm */
+#define DRPM_EFFORT_MAX 9       /**< most thorough search for matches */
+/** @} */
+
 /**
  * @name Check Modes
  * @{
@@ -157,6 +174,30 @@
 #define DRPM_CHECK_FILESIZES 2      /**< only checking if filesizes have changed */
 /** @} */
 
+/**
+ * @name Progress Phases
+ * @{
+ */
+#define DRPM_PHASE_READ 0       /**< reading (and decompressing) input */
+#define DRPM_PHASE_DIFF 1       /**< comparing old and new payloads */
+#define DRPM_PHASE_APPLY 2      /**< reconstructing the new payload */
+#define DRPM_PHASE_WRITE 3      /**< writing the DeltaRPM or new RPM */
+/** @} */
+
+/**
+ * @name Apply Estimates
+ * @{
+ */
+#define DRPM_ESTIMATE_MEMORY 0      /**< peak memory use (bytes) */
+#define DRPM_ESTIMATE_TIME 1        /**< time taken (milliseconds) */
+#define DRPM_ESTIMATE_BLOCKS 2      /**< peak size of old data held in memory blocks (bytes) */
+#define DRPM_ESTIMATE_EXTREAD 3     /**< old data read into blocks, re-reads included (bytes) */
+#define DRPM_ESTIMATE_EXTREREAD 4   /**< old data read again after its block was evicted (bytes) */
+#define DRPM_ESTIMATE_DECOMP 5      /**< data decompressed (bytes) */
+#define DRPM_ESTIMATE_RECOMP 6      /**< data compressed into the new payload (bytes) */
+#define DRPM_ESTIMATE_RECOMPCOMP 7  /**< compression type of the new payload */
+/** @} */
+
 /**
  * @brief DeltaRPM package info
  * @ingroup drpmRead
@@ -169,6 +210,40 @@ typedef struct drpm drpm;
  */
 typedef struct drpm_make_options drpm_make_options;
 
+/**
+ * @brief Statistics collected by drpm_make()
+ * @ingroup drpmMakeOptions
+ */
+typedef struct drpm_make_stats drpm_make_stats;
+
+/**
+ * @brief Options for drpm_apply_with_options()
+ * @ingroup drpmApplyOptions
+ */
+typedef struct drpm_apply_options drpm_apply_options;
+
+/**
+ * @brief Predicted cost of drpm_apply_with_options()
+ * @ingroup drpmApply
+ */
+typedef struct drpm_apply_estimate drpm_apply_estimate;
+
+/**
+ * @brief Progress callback for drpm_make() and drpm_apply_with_options().
+ * @param [in]  data    User data passed along with the callback.
+ * @param [in]  phase   Current phase (see @ref DRPM_PHASE_READ "Progress Phases").
+ * @param [in]  bytes   Bytes processed so far in this phase.
+ * @param [in]  done    Units of work done in this phase.
+ * @param [in]  total   Units of work in this phase (@c 0 if unknown).
+ * @return @c 0 to continue, anything else to cancel.
+ * @note When diffing, units are bytes of the new payload; when applying,
+ * they are external copies.
+ * @see drpm_make_options_set_progress()
+ * @see drpm_apply_options_set_progress()
+ */
+typedef int (*drpm_progress_cb)(void *data, int phase, unsigned long long bytes,
+                                unsigned long long done, unsigned long long total);
+
 /**
  * @ingroup drpmApply
  * @brief Applies a DeltaRPM to an old RPM or on-disk data to re-create a new RPM.
@@ -180,6 +255,74 @@ typedef struct drpm_make_options drpm_make_options;
 DRPM_VISIBLE
 int drpm_apply(const char *oldrpm, const char *deltarpm, const char *newrpm);
 
+/**
+ * @ingroup drpmApply
+ * @brief Same as drpm_apply(), but with options.
+ * @code
+ * drpm_apply_options *opts;
+ *
+ * drpm_apply_options_init(&opts);
+ * drpm_apply_options_set_threads(opts, 4);
+ *
+ * drpm_apply_with_options("foo.rpm", "fg.drpm", "goo.rpm", opts);
+ *
+ * drpm_apply_options_destroy(&opts);
+ * @endcode
+ * @param [in]  oldrpm      Name of old RPM file (if @c NULL, filesystem data is used).
+ * @param [in]  deltarpm    Name of DeltaRPM file.
+ * @param [in]  newrpm      Name of new RPM file to be (re-)created.
+ * @param [in]  opts        Options (if @c NULL, defaults used).
+ * @return Error code.
+ * @warning If not @c NULL, @p opts should have been initialized with
+ * drpm_apply_options_init(), otherwise behaviour is undefined.
+ */
+DRPM_VISIBLE
+int drpm_apply_with_options(const char *oldrpm, const char *deltarpm, const char *newrpm, const drpm_apply_options *opts);
+
+/**
+ * @ingroup drpmApply
+ * @brief Predicts the memory and time drpm_apply_with_options() would take.
+ * Only the DeltaRPM's copy instructions are read (and the header of
+ * the old RPM, if given), without touching installed files.
+ * The way old data would be cached in blocks is simulated exactly,
+ * while time is derived from rough throughputs of each compression type,
+ * which makes it suited for comparing with the time a download would take
+ * rather than for an accurate prediction.
+ * @param [out] estimate    Address of estimate pointer.
+ * @param [in]  oldrpm      Name of old RPM file (if @c NULL, filesystem data is used).
+ * @param [in]  deltarpm    Name of DeltaRPM file.
+ * @param [in]  opts        Options of the apply (if @c NULL, defaults used).
+ * @return Error code.
+ * @note Blocks are only ever spilled to the page file for prelinked files,
+ * so evicted blocks are re-read from old data instead (see
+ * ::DRPM_ESTIMATE_EXTREREAD).
+ * @see drpm_apply_estimate_get()
+ * @see drpm_apply_estimate_destroy()
+ */
+DRPM_VISIBLE
+int drpm_estimate_apply(drpm_apply_estimate **estimate, const char *oldrpm,
+                        const char *deltarpm, const drpm_apply_options *opts);
+
+/**
+ * @ingroup drpmApply
+ * @brief Fetches a figure predicted by drpm_estimate_apply().
+ * @param [in]  estimate    Estimate made by drpm_estimate_apply().
+ * @param [in]  item        What to fetch (see @ref DRPM_ESTIMATE_MEMORY "Apply Estimates").
+ * @param [out] ret         Predicted value.
+ * @return Error code.
+ */
+DRPM_VISIBLE
+int drpm_apply_estimate_get(const drpm_apply_estimate *estimate, int item, unsigned long long *ret);
+
+/**
+ * @ingroup drpmApply
+ * @brief Frees an estimate made by drpm_estimate_apply().
+ * @param [out] estimate    Address of estimate pointer.
+ * @return Error code.
+ */
+DRPM_VISIBLE
+int drpm_apply_estimate_destroy(drpm_apply_estimate **estimate);
+
 /**
  * @ingroup drpmCheck
  * @brief Checks if the reconstruction is possible based on DeltaRPM file.
@@ -346,8 +489,17 @@ int drpm_make_options_set_type(drpm_make_options *opts, unsigned short type);
  * @brief Sets DeltaRPM version.
  * The default DeltaRPM format is V3, but an older version may also be
  * specified.
+ * Version 4 is an extension of V3 in which internal copies may also
+ * be taken from earlier output, so that data repeated within the new
+ * RPM is only stored once. Such DeltaRPMs are smaller, but need a window
+ * of recent output (up to 32 MiB) to be kept when applying and cannot
+ * be applied by deltarpm.
+ * Version 4 also records the block layout of multi-block xz payloads,
+ * so that they can be recompressed in parallel, and the frame parameters
+ * of zstd payloads that rpm compressed with threads, if recompressing
+ * them without threads does not give back the same payload.
  * @param [out] opts    Structure specifying options for drpm_make().
- * @param [in]  version Version (1-3).
+ * @param [in]  version Version (1-4).
  * @return Error code.
  * @see drpm_make()
  */
@@ -380,6 +532,26 @@ int drpm_make_options_set_delta_comp(drpm_make_options *opts, unsigned short com
 DRPM_VISIBLE
 int drpm_make_options_get_delta_comp_from_rpm(drpm_make_options *opts);
 
+/**
+ * @brief Picks DeltaRPM compression by trial compression.
+ * drpm_make() compresses a sample of the DeltaRPM body (at most 1 MiB
+ * taken from across the whole body) with several candidate methods and
+ * levels, then uses the fastest candidate whose output is at most
+ * @p slack percent bigger than the smallest output.
+ * A @p slack of @c 0 thus picks the best ratio, while e.g. @c 3 prefers
+ * a much cheaper method if it only costs a few percent in size.
+ * @param [out] opts    Structure specifying options for drpm_make().
+ * @param [in]  slack   Permitted size overhead in percent (0-100).
+ * @return Error code.
+ * @note As the choice depends on measured time, repeated runs may
+ * pick different methods for DeltaRPMs close to the threshold.
+ * The choice is reported through drpm_make_options_set_stats().
+ * @see drpm_make()
+ * @see drpm_make_stats_get_delta_comp()
+ */
+DRPM_VISIBLE
+int drpm_make_options_set_delta_comp_auto(drpm_make_options *opts, unsigned short slack);
+
 /**
  * @brief Forbids add block creation.
  * An "add block" is a highly compressible block used to store
@@ -437,6 +609,171 @@ int drpm_make_options_set_seqfile(drpm_make_options *opts, const char *seqfile);
 DRPM_VISIBLE
 int drpm_make_options_add_patches(drpm_make_options *opts, const char *oldrpmprint, const char *oldpatchrpm);
 
+/**
+ * @brief Sets the number of threads used for decompressing RPM payloads.
+ * Multi-block xz payloads and zstd payloads made up of several frames
+ * can be decompressed in parallel, other payloads are decompressed
+ * serially regardless of this option.
+ * The threads also build the index of the old payload that matches are
+ * searched for in. The DeltaRPM does not depend on the number of threads.
+ * The default is a single thread.
+ * @param [out] opts    Structure specifying options for drpm_make().
+ * @param [in]  threads Number of threads (@c 0 for one per online CPU).
+ * @return Error code.
+ * @see drpm_make()
+ * @see drpm_apply_options_set_threads()
+ */
+DRPM_VISIBLE
+int drpm_make_options_set_threads(drpm_make_options *opts, unsigned threads);
+
+/**
+ * @brief Sets how hard drpm_make() tries to find matches.
+ * Similarly to compression levels, higher levels make smaller DeltaRPMs
+ * at the cost of more CPU time. Levels below the default only probe
+ * some positions of the new payload for matches, levels above it
+ * keep several candidate matches per position and wait longer for
+ * a longer match before taking one. Levels above the default also copy
+ * files with the same digest in both RPMs without searching for them.
+ * The default level makes the same DeltaRPMs as makedeltarpm.
+ * @param [out] opts    Structure specifying options for drpm_make().
+ * @param [in]  effort  Level from ::DRPM_EFFORT_MIN to ::DRPM_EFFORT_MAX
+ *                      (default is ::DRPM_EFFORT_DEFAULT).
+ * @return Error code.
+ * @note Levels above the default need a larger index (by about a fifth).
+ * @see drpm_make()
+ */
+DRPM_VISIBLE
+int drpm_make_options_set_effort(drpm_make_options *opts, unsigned short effort);
+
+/**
+ * @brief Indexes only content-defined anchors of the old payload.
+ * Normally every 16-byte block of the old payload is indexed for
+ * finding matches, which takes about twice the size of the payload
+ * in memory. With a sparse index, only blocks at positions chosen by
+ * their content are indexed, one every @p spacing bytes on average,
+ * so the index takes about 32 / @p spacing times the payload size.
+ * Matches are then only found at those positions and extended from
+ * there, so larger spacings make larger DeltaRPMs.
+ * Meant for very large payloads (e.g. debuginfo) on builders
+ * with little memory.
+ * @param [out] opts    Structure specifying options for drpm_make().
+ * @param [in]  spacing Average distance of anchors in bytes, a power
+ *                      of two from 32 to 1048576, or @c 0 to index
+ *                      every block (default).
+ * @return Error code.
+ * @note A sparse index is never chained, so effort levels above
+ * ::DRPM_EFFORT_DEFAULT only search longer for matches with it.
+ * @see drpm_make()
+ * @see drpm_make_options_set_effort()
+ */
+DRPM_VISIBLE
+int drpm_make_options_set_sparse_index(drpm_make_options *opts, unsigned spacing);
+
+/**
+ * @brief Compresses the DeltaRPM with a trained zstd dictionary.
+ * Deltas of similar packages share a lot of structure, so a dictionary
+ * trained on a corpus of existing DeltaRPMs can make small deltas
+ * noticeably smaller.
+ * The dictionary ID is recorded in the zstd frame header, and
+ * drpm_apply_with_options() looks up the same dictionary by that ID.
+ * Requires zstd compression of the DeltaRPM.
+ * @param [out] opts        Structure specifying options for drpm_make().
+ * @param [in]  dictfile    Name of a dictionary file created by
+ *                          @c drpm-train-dict or @c zstd @c --train.
+ * @return Error code.
+ * @note If @p dictfile is @c NULL, no dictionary is used (default).
+ * @see drpm_make()
+ * @see drpm_make_options_set_delta_comp()
+ * @see drpm_apply_options_set_dict_dir()
+ */
+DRPM_VISIBLE
+int drpm_make_options_set_delta_dict(drpm_make_options *opts, const char *dictfile);
+
+/**
+ * @brief Requests statistics about the created DeltaRPM.
+ * drpm_make() will fill in @p stats, which has to stay valid
+ * for the duration of the call.
+ * @param [out] opts    Structure specifying options for drpm_make().
+ * @param [in]  stats   Statistics structure or @c NULL (default).
+ * @return Error code.
+ * @see drpm_make()
+ * @see drpm_make_stats_init()
+ */
+DRPM_VISIBLE
+int drpm_make_options_set_stats(drpm_make_options *opts, drpm_make_stats *stats);
+
+/**
+ * @brief Sets a callback reporting the progress of drpm_make().
+ * The callback is called whenever a phase starts and then at least every
+ * few megabytes processed. If it returns non-zero, drpm_make() stops as
+ * soon as possible and fails with ::DRPM_ERR_CANCELED.
+ * @param [out] opts        Structure specifying options for drpm_make().
+ * @param [in]  callback    Progress callback or @c NULL (default).
+ * @param [in]  data        User data passed to @p callback.
+ * @return Error code.
+ * @see drpm_make()
+ */
+DRPM_VISIBLE
+int drpm_make_options_set_progress(drpm_make_options *opts, drpm_progress_cb callback, void *data);
+
+/**
+ * @brief Initializes empty ::drpm_make_stats.
+ * @param [out] stats   Address of statistics structure pointer.
+ * @return Error code.
+ * @see drpm_make_options_set_stats()
+ */
+DRPM_VISIBLE
+int drpm_make_stats_init(drpm_make_stats **stats);
+
+/**
+ * @brief Frees ::drpm_make_stats.
+ * @param [out] stats   Address of statistics structure pointer.
+ * @return Error code.
+ * @see drpm_make_options_set_stats()
+ */
+DRPM_VISIBLE
+int drpm_make_stats_destroy(drpm_make_stats **stats);
+
+/**
+ * @brief Fetches the compression used for the DeltaRPM.
+ * @param [in]  stats   Statistics filled in by drpm_make().
+ * @param [out] comp    Compression type.
+ * @param [out] level   Compression level.
+ * @return Error code.
+ * @see drpm_make_options_set_stats()
+ */
+DRPM_VISIBLE
+int drpm_make_stats_get_delta_comp(const drpm_make_stats *stats, unsigned short *comp, unsigned short *level);
+
+/**
+ * @brief Fetches the number of compression trials.
+ * Trials are only made if drpm_make_options_set_delta_comp_auto()
+ * was used, otherwise @p *count is @c 0.
+ * @param [in]  stats       Statistics filled in by drpm_make().
+ * @param [out] count       Number of trials.
+ * @param [out] sample_len  Size of the sample that was compressed.
+ * @return Error code.
+ * @see drpm_make_stats_get_comp_trial()
+ */
+DRPM_VISIBLE
+int drpm_make_stats_get_comp_trials(const drpm_make_stats *stats, unsigned *count, unsigned long *sample_len);
+
+/**
+ * @brief Fetches the result of a compression trial.
+ * @param [in]  stats       Statistics filled in by drpm_make().
+ * @param [in]  index       Index of trial (less than count of trials).
+ * @param [out] comp        Compression type tried.
+ * @param [out] level       Compression level tried.
+ * @param [out] comp_len    Size of the compressed sample.
+ * @param [out] usecs       Time taken in microseconds.
+ * @return Error code.
+ * @see drpm_make_stats_get_comp_trials()
+ */
+DRPM_VISIBLE
+int drpm_make_stats_get_comp_trial(const drpm_make_stats *stats, unsigned index,
+                                   unsigned short *comp, unsigned short *level,
+                                   unsigned long *comp_len, unsigned long *usecs);
+
 /**
  * @brief Limits memory usage.
  * As drpm_make() normally needs about three to four times the size of
@@ -452,6 +789,148 @@ int drpm_make_options_add_patches(drpm_make_options *opts, const char *oldrpmpri
 
 /** @} */
 
+/**
+ * @addtogroup drpmApplyOptions
+ * @{
+ */
+
+/**
+ * @brief Initializes ::drpm_apply_options with default options.
+ * Passing @p *opts to drpm_apply_with_options() immediately after would
+ * have the same effect as calling drpm_apply().
+ * @param [out] opts    Address of options structure pointer.
+ * @return Error code.
+ * @see drpm_apply_with_options()
+ */
+DRPM_VISIBLE
+int drpm_apply_options_init(drpm_apply_options **opts);
+
+/**
+ * @brief Frees ::drpm_apply_options.
+ * @param [out] opts    Address of options structure pointer.
+ * @return Error code.
+ * @see drpm_apply_with_options()
+ */
+DRPM_VISIBLE
+int drpm_apply_options_destroy(drpm_apply_options **opts);
+
+/**
+ * @brief Resets options to default values.
+ * @param [out] opts    Structure specifying options for drpm_apply_with_options().
+ * @return Error code.
+ * @see drpm_apply_with_options()
+ */
+DRPM_VISIBLE
+int drpm_apply_options_defaults(drpm_apply_options *opts);
+
+/**
+ * @brief Copies ::drpm_apply_options.
+ * Copies data from @p src to @p dst.
+ * @param [out] dst Destination options.
+ * @param [in]  src Source options.
+ * @return Error code.
+ * @warning @p dst should have also been initialized with
+ * drpm_apply_options_init() previously, otherwise behaviour is undefined.
+ * @see drpm_apply_with_options()
+ */
+DRPM_VISIBLE
+int drpm_apply_options_copy(drpm_apply_options *dst, const drpm_apply_options *src);
+
+/**
+ * @brief Sets the number of threads used for decompressing the old RPM payload.
+ * Same as drpm_make_options_set_threads(), but for drpm_apply_with_options().
+ * @param [out] opts    Structure specifying options for drpm_apply_with_options().
+ * @param [in]  threads Number of threads (@c 0 for one per online CPU).
+ * @return Error code.
+ * @see drpm_apply_with_options()
+ * @see drpm_make_options_set_threads()
+ */
+DRPM_VISIBLE
+int drpm_apply_options_set_threads(drpm_apply_options *opts, unsigned threads);
+
+/**
+ * @brief Sets the directory holding zstd dictionaries.
+ * DeltaRPMs compressed with a trained dictionary are decompressed using
+ * the file @c <ID>.dict from this directory, where @c <ID> is the
+ * dictionary ID recorded in the DeltaRPM.
+ * @param [out] opts    Structure specifying options for drpm_apply_with_options().
+ * @param [in]  dir     Dictionary directory.
+ * @return Error code.
+ * @note If @p dir is @c NULL, the directory configured at build time
+ * is used (default).
+ * @see drpm_apply_with_options()
+ * @see drpm_make_options_set_delta_dict()
+ */
+DRPM_VISIBLE
+int drpm_apply_options_set_dict_dir(drpm_apply_options *opts, const char *dir);
+
+/**
+ * @brief Sets how many installed files may be kept open at once.
+ * When applying a DeltaRPM against installed files, recently read files
+ * are kept open so that they need not be reopened when their data is
+ * needed again.
+ * @param [out] opts    Structure specifying options for drpm_apply_with_options().
+ * @param [in]  count   Maximum number of open files (@c 0 for automatic).
+ * @return Error code.
+ * @note By default (@c 0), the limit is derived from the process's
+ * @c RLIMIT_NOFILE, leaving half of the descriptors for the caller.
+ * @see drpm_apply_with_options()
+ */
+DRPM_VISIBLE
+int drpm_apply_options_set_open_files(drpm_apply_options *opts, unsigned count);
+
+/**
+ * @brief Sets the number of threads reading installed files ahead.
+ * When applying a DeltaRPM against installed files, these threads read
+ * the data needed by upcoming external copies while the new RPM is being
+ * reconstructed, so that reconstruction only waits for data that has not
+ * been read yet.
+ * @param [out] opts    Structure specifying options for drpm_apply_with_options().
+ * @param [in]  threads Number of threads (@c 0 to read on demand only).
+ * @return Error code.
+ * @note Default is @c 2.
+ * @see drpm_apply_with_options()
+ */
+DRPM_VISIBLE
+int drpm_apply_options_set_io_threads(drpm_apply_options *opts, unsigned threads);
+
+/**
+ * @brief Verifies files of the new RPM while it is being reconstructed.
+ * Each regular file in the reconstructed payload is checked against the
+ * digest in the new RPM header as soon as it has been reconstructed, on
+ * a separate thread, so that a corrupted reconstruction (e.g. due to a
+ * modified installed file) is detected early instead of only after the
+ * whole RPM has been written.
+ * drpm_apply_with_options() then fails with ::DRPM_ERR_MISMATCH.
+ * @param [out] opts        Structure specifying options for drpm_apply_with_options().
+ * @param [out] bad_file    Where to store the name of the first file that
+ * failed verification (or @c NULL if none did), or @c NULL.
+ * @return Error code.
+ * @note The name stored in @p *bad_file has to be freed by the caller.
+ * @note Only standard DeltaRPMs are verified this way.
+ * @see drpm_apply_with_options()
+ */
+DRPM_VISIBLE
+int drpm_apply_options_verify_files(drpm_apply_options *opts, char **bad_file);
+
+/**
+ * @brief Sets a callback reporting the progress of drpm_apply_with_options().
+ * The callback is called whenever a phase starts and then at least every
+ * few megabytes reconstructed, with the number of external copies done
+ * out of the total. If it returns non-zero, drpm_apply_with_options()
+ * stops as soon as possible, removes the partially written new RPM and
+ * fails with ::DRPM_ERR_CANCELED.
+ * @param [out] opts        Structure specifying options for drpm_apply_with_options().
+ * @param [in]  callback    Progress callback or @c NULL (default).
+ * @param [in]  data        User data passed to @p callback.
+ * @return Error code.
+ * @see drpm_apply_with_options()
+ */
+DRPM_VISIBLE
+int drpm_apply_options_set_progress(drpm_apply_options *opts, drpm_progress_cb callback, void *data);
+
+/** @} */
+
 /**
  * @addtogroup drpmRead
  * @{
@@ -539,6 +1018,7 @@ int drpm_get_uint(drpm *delta, int tag, unsigned *target);
  * @see DRPM_TAG_TGTSIZE
  * @see DRPM_TAG_TGTHEADERLEN
  * @see DRPM_TAG_PAYLOADFMTOFF
+ * @see DRPM_TAG_SELFWINDOW
  */
 DRPM_VISIBLE
 int drpm_get_ulong(drpm *delta, int tag, unsigned long *target);
@@ -569,6 +1049,7 @@ int drpm_get_ulong(drpm *delta, int tag, unsigned long *target);
  * drpm_read(), otherwise behaviour is undefined.
  * @see DRPM_TAG_EXTDATALEN
  * @see DRPM_TAG_INTDATALEN
+ * @see DRPM_TAG_SELFWINDOW
  */
 DRPM_VISIBLE
 int drpm_get_ullong(drpm *delta, int tag, unsigned long long *target);
@@ -646,6 +1127,7 @@ int drpm_get_string(drpm *delta, int tag, char **target);
  * @see DRPM_TAG_ADJELEMS
  * @see DRPM_TAG_INTCOPIES
  * @see DRPM_TAG_EXTCOPIES
+ * @see DRPM_TAG_SELFCOPIES
  */
 DRPM_VISIBLE
 int drpm_get_ulong_array(drpm *delta, int tag, unsigned long **target, unsigned long *size);
@@ -673,6 +1155,80 @@ int drpm_destroy(drpm **delta);
 
 /** @} */
 
+/**
+ * @addtogroup drpmCache
+ * @{
+ */
+
+/**
+ * @brief Enables a process-wide cache of decompressed RPM payloads.
+ * Once enabled, drpm_make() and the apply functions decompress the
+ * payload of each RPM file they read only once, looking it up by the
+ * MD5 digest in its signature afterwards. This pays off when the same
+ * RPM is used for several deltas (e.g. as old RPM for a batch of
+ * drpm_make() calls, or when applying a chain of deltas).
+ *
+ * If @p dir is given, payloads are also stored there as files, so that
+ * they are found again by later processes using the same directory.
+ * The directory must be owned by the calling user and must not be
+ * writable by group or others. Stored payloads are checked against
+ * their digest before use and decompressed again if they do not match.
+ * Least recently used payloads are removed once the cache grows
+ * beyond @p mbytes (on disk, files left by earlier processes are
+ * counted as well when the cache is enabled).
+ *
+ * Example of usage:
+ * @code
+ * int error = drpm_cache_enable(2048, "/var/cache/drpm");
+ *
+ * if (error != DRPM_ERR_OK) {
+ *    fprintf(stderr, "drpm error: %s\n", drpm_strerror(error));
+ *    return;
+ * }
+ * @endcode
+ * @param [in]  mbytes  Size limit of the cache in megabytes.
+ * @param [in]  dir     Existing directory to store payloads in,
+ * or @c NULL to keep them in memory only.
+ * @return Error code (@c DRPM_ERR_ARGS for a directory that others
+ * may write to).
+ * @note Calling drpm_cache_enable() again replaces the cache
+ * (statistics start over).
+ * @note The cache may be enabled, replaced or disabled while other
+ * @c drpm functions are running in other threads. Those keep using the
+ * cache they started with, which is freed once they are done.
+ * @see drpm_cache_disable()
+ * @see drpm_cache_get_stats()
+ */
+DRPM_VISIBLE
+int drpm_cache_enable(unsigned long mbytes, const char *dir);
+
+/**
+ * @brief Disables the process-wide payload cache.
+ * Frees all payloads cached in memory, once functions still using
+ * the cache are done. Files in the cache directory are kept for later use.
+ * Does nothing if the cache is not enabled.
+ * @return Error code.
+ * @see drpm_cache_enable()
+ */
+DRPM_VISIBLE
+int drpm_cache_disable(void);
+
+/**
+ * @brief Fetches statistics of the process-wide payload cache.
+ * All values are zero if the cache is not enabled.
+ * @param [out] hits    Number of payloads found in the cache.
+ * @param [out] misses  Number of payloads that had to be decompressed.
+ * @param [out] count   Number of payloads currently cached.
+ * @param [out] size    Total size of payloads currently cached (in bytes).
+ * @return Error code.
+ * @see drpm_cache_enable()
+ */
+DRPM_VISIBLE
+int drpm_cache_get_stats(unsigned long *hits, unsigned long *misses,
+                         unsigned long *count, unsigned long long *size);
+
+/** @} */
+
 /**
  * @brief Returns description of error code as a string.
  * Works very similarly to
@@ -19,6 +19,8 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE
+
 #include "drpm.h"
 #include "drpm_private.h"
 
@@ -26,15 +28,41 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <pthread.h>
 #include <openssl/md5.h>
 #include <openssl/sha.h>
+#ifdef WITH_IO_URING
+#include <liburing.h>
+#endif
 
 #define BUFFER_SIZE 4096
 
+/* io_uring checks work on this many files at a time,
+ * reading each in chunks of this size */
+#define URING_WINDOW 32
+#define URING_READ_SIZE (64 * 1024)
+
+/* size of the buffer through which the reconstructed payload
+ * is handed over to the file verifier thread */
+#define VERIFY_BUFFER_SIZE (1024 * 1024)
+
+/* rough figures for predicting apply time (MiB/s on one core) */
+#define ESTIMATE_FS_READ_SPEED 200
+#define ESTIMATE_ZSTD_FAST_LEVEL 9 // levels up to this compress much faster
+#define ESTIMATE_ZSTD_FAST_SPEED 150
+
+/* states of the file verifier's CPIO parser */
+#define VERIFY_HEADER 0
+#define VERIFY_NAME 1
+#define VERIFY_CONTENT 2
+#define VERIFY_SKIP 3
+#define VERIFY_END 4
+
 struct checksum {
     unsigned short digest_algo;
     union {
@@ -43,14 +71,96 @@ struct checksum {
     } ctx;
 };
 
+/* expected digest of a file in the new RPM */
+struct verify_file {
+    const char *name;
+    uint64_t size;
+    unsigned char digest[MAX(MD5_DIGEST_LENGTH, SHA256_DIGEST_LENGTH)];
+};
+
+/* thread verifying files of the reconstructed CPIO archive against the
+ * digests in the new RPM header while the archive is being recompressed */
+struct file_verifier {
+    struct verify_file *files; // sorted by name
+    size_t file_count;
+    unsigned short digest_algo;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // data added or consumed, or verification over
+    unsigned char *ring;
+    size_t head; // total number of bytes added
+    size_t tail; // total number of bytes consumed
+    bool eof;
+    bool done;
+    bool running;
+    int error;
+    char *bad_file;
+    /* parser state, only touched by the thread */
+    int state;
+    int next_state; // after skipping padding
+    char header[CPIO_HEADER_SIZE + 1];
+    struct cpio_header cpio_hdr;
+    char *name;
+    size_t left; // bytes left in the current part of the archive
+    const struct verify_file *current;
+    struct checksum chsm;
+};
+
+/* rough throughput (MiB/s on one core) of decompressing and of
+ * compressing at the default level, for each compression type */
+static const struct {
+    unsigned decomp;
+    unsigned comp;
+} comp_speeds[] = {
+    [DRPM_COMP_NONE] = {4096, 4096},
+    [DRPM_COMP_GZIP] = {300, 20},
+    [DRPM_COMP_BZIP2] = {40, 12},
+    [DRPM_COMP_LZMA] = {80, 3},
+    [DRPM_COMP_XZ] = {80, 3},
+    [DRPM_COMP_LZIP] = {70, 3},
+    [DRPM_COMP_ZSTD] = {1000, 4}
+};
+
+/* the most recent output, for internal copies taken from it */
+struct out_window {
+    unsigned char *buf;
+    size_t size;
+    size_t pos; // where the next byte goes
+    uint64_t total; // bytes output so far
+};
+
+#ifdef WITH_IO_URING
+/* state of a file being checked through io_uring */
+struct uring_file {
+    int filedesc;
+    int error;
+    bool fallback; // to be checked synchronously
+    struct statx stats;
+    struct checksum chsm;
+    size_t offset;
+    size_t left;
+};
+#endif
+
 static int check_filesize(const char *, unsigned short, const unsigned char *, size_t);
 static int check_full(const char *, unsigned short, const unsigned char *, size_t);
 static int check_prelink(const char *, unsigned short, const unsigned char *, size_t);
+#ifdef WITH_IO_URING
+static int check_files_uring(const struct check_file *, size_t, unsigned short);
+static int uring_drain(struct io_uring *, struct uring_file *, size_t, bool);
+static int uring_next(struct io_uring *, size_t *, int *);
+#endif
 static size_t checksum_digest_len(struct checksum);
 static int checksum_final(struct checksum *, unsigned char *);
 static int checksum_init(struct checksum *, unsigned short);
 static int checksum_update(struct checksum *, const void *, size_t);
 static uint16_t elf16(const unsigned char *, bool);
+static uint64_t estimate_msecs(uint64_t, unsigned);
+static int verify_file_cmp(const void *, const void *);
+static int verifier_mismatch(struct file_verifier *);
+static int verifier_next(struct file_verifier *);
+static int verifier_parse(struct file_verifier *, const unsigned char *, size_t);
+static void *verifier_thread(void *);
 static uint32_t elf32(const unsigned char *, bool);
 static uint64_t elf64(const unsigned char *, bool, bool);
 
@@ -68,6 +178,8 @@ int expand_sequence(struct cpio_file **seqfiles_ret, size_t *seqfiles_len_ret,
     struct cpio_file *seqfiles = NULL;
     size_t *positions;
     size_t positions_len = 0;
+    struct check_file *checks = NULL;
+    size_t checks_len = 0;
     MD5_CTX seq_md5;
     unsigned char seq_md5_digest[MD5_DIGEST_LENGTH];
     unsigned char digest[MAX(MD5_DIGEST_LENGTH, SHA256_DIGEST_LENGTH)];
@@ -79,29 +191,18 @@ int expand_sequence(struct cpio_file **seqfiles_ret, size_t *seqfiles_len_ret,
     size_t num = 0;
     size_t num_buf = 0;
     size_t pos = 0;
-    uint32_t filesize;
+    uint64_t filesize;
     uint16_t rdev;
     char *filename;
     size_t header_len;
     size_t off = 0;
-    int (*check)(const char *, unsigned short, const unsigned char *, size_t);
 
     if (sequence == NULL || sequence_len < MD5_DIGEST_LENGTH)
         return DRPM_ERR_PROG;
 
-    switch (check_mode) {
-    case DRPM_CHECK_NONE:
-        check = NULL;
-        break;
-    case DRPM_CHECK_FULL:
-        check = check_full;
-        break;
-    case DRPM_CHECK_FILESIZES:
-        check = check_filesize;
-        break;
-    default:
+    if (check_mode != DRPM_CHECK_NONE && check_mode != DRPM_CHECK_FULL &&
+        check_mode != DRPM_CHECK_FILESIZES)
         return DRPM_ERR_PROG;
-    }
 
     if ((positions = malloc(file_count * sizeof(size_t))) == NULL)
         return DRPM_ERR_MEMORY;
@@ -165,6 +266,12 @@ int expand_sequence(struct cpio_file **seqfiles_ret, size_t *seqfiles_len_ret,
         goto cleanup_fail;
     }
 
+    if (check_mode != DRPM_CHECK_NONE && positions_len > 0 &&
+        (checks = malloc(positions_len * sizeof(struct check_file))) == NULL) {
+        error = DRPM_ERR_MEMORY;
+        goto cleanup_fail;
+    }
+
     if (MD5_Init(&seq_md5) != 1) {
         error = DRPM_ERR_OTHER;
         goto cleanup_fail;
@@ -176,12 +283,7 @@ int expand_sequence(struct cpio_file **seqfiles_ret, size_t *seqfiles_len_ret,
     for (size_t i, pos = 0; pos < positions_len; pos++) {
         i = positions[pos];
 
-        if (S_ISREG(files[i].mode))
-            filesize = files[i].size;
-        else if (S_ISLNK(files[i].mode))
-            filesize = strlen(files[i].linkto);
-        else
-            filesize = 0;
+        filesize = cpio_filesize(&files[i]);
 
         if (S_ISBLK(files[i].mode) || S_ISCHR(files[i].mode))
             rdev = files[i].rdev;
@@ -194,7 +296,9 @@ int expand_sequence(struct cpio_file **seqfiles_ret, size_t *seqfiles_len_ret,
 
         if (MD5_Update(&seq_md5, filename, strlen(filename) + 1) != 1 ||
             md5_update_be32(&seq_md5, files[i].mode) != 1 ||
-            md5_update_be32(&seq_md5, filesize) != 1 ||
+            (filesize > CPIO_FILESIZE_MAX ?
+             md5_update_be64(&seq_md5, filesize) :
+             md5_update_be32(&seq_md5, filesize)) != 1 ||
             md5_update_be32(&seq_md5, rdev) != 1) {
             error = DRPM_ERR_OTHER;
             goto cleanup_fail;
@@ -228,14 +332,21 @@ int expand_sequence(struct cpio_file **seqfiles_ret, size_t *seqfiles_len_ret,
                 }
                 break;
             }
-            if (check != NULL && (error = check(files[i].name, digest_algo, digest, filesize)) != DRPM_ERR_OK)
-                goto cleanup;
+            if (checks != NULL) {
+                checks[checks_len].name = files[i].name;
+                memcpy(checks[checks_len].digest, digest, sizeof(checks[checks_len].digest));
+                checks[checks_len].filesize = filesize;
+                checks_len++;
+            }
         }
 
         if (want_seq) {
             seqfiles[pos].index = i;
 
-            header_len = CPIO_HEADER_SIZE + strlen(filename) + 3; // "./" prefix
+            if (filesize > CPIO_FILESIZE_MAX)
+                header_len = CPIO_STRIPPED_HEADER_SIZE;
+            else
+                header_len = CPIO_HEADER_SIZE + strlen(filename) + 3; // "./" prefix
             seqfiles[pos].header_len = header_len + CPIO_PADDING(header_len);
 
             seqfiles[pos].content_len = filesize + CPIO_PADDING(filesize);
@@ -245,6 +356,11 @@ int expand_sequence(struct cpio_file **seqfiles_ret, size_t *seqfiles_len_ret,
         }
     }
 
+    /* checking that files have not changed */
+    if (checks != NULL &&
+        (error = check_files(checks, checks_len, digest_algo, check_mode, true)) != DRPM_ERR_OK)
+        goto cleanup_fail;
+
     if (MD5_Final(seq_md5_digest, &seq_md5) != 1) {
         error = DRPM_ERR_OTHER;
         goto cleanup_fail;
@@ -276,12 +392,251 @@ cleanup_fail:
 
 cleanup:
     free(positions);
+    free(checks);
 
     return error;
 }
 
 /******************************* check ********************************/
 
+/* Checks installed files, in order, stopping at the first one that
+ * fails. With <batch> (and io_uring support), full checks open, stat()
+ * and read the files a window at a time through io_uring, otherwise (or if
+ * io_uring is not available at run time) they are checked one by one.
+ * Size-only checks always stat() synchronously, as batching them through
+ * io_uring was measured to be slower. */
+int check_files(const struct check_file *files, size_t count,
+                unsigned short digest_algo, int check_mode, bool batch)
+{
+    int error;
+    int (*check)(const char *, unsigned short, const unsigned char *, size_t);
+
+    switch (check_mode) {
+    case DRPM_CHECK_FULL:
+        check = check_full;
+        break;
+    case DRPM_CHECK_FILESIZES:
+        check = check_filesize;
+        break;
+    default:
+        return DRPM_ERR_PROG;
+    }
+
+#ifdef WITH_IO_URING
+    if (batch && count > 1 && check_mode == DRPM_CHECK_FULL &&
+        (error = check_files_uring(files, count, digest_algo)) != DRPM_ERR_OTHER)
+        return error;
+#else
+    (void)batch;
+#endif
+
+    for (size_t i = 0; i < count; i++)
+        if ((error = check(files[i].name, digest_algo, files[i].digest, files[i].filesize)) != DRPM_ERR_OK)
+            return error;
+
+    return DRPM_ERR_OK;
+}
+
+#ifdef WITH_IO_URING
+/* waits for the next completion, returning the index of its file */
+int uring_next(struct io_uring *ring, size_t *index, int *res)
+{
+    struct io_uring_cqe *cqe;
+    int ret;
+
+    while ((ret = io_uring_wait_cqe(ring, &cqe)) == -EINTR);
+
+    if (ret < 0)
+        return DRPM_ERR_IO;
+
+    *index = (size_t)io_uring_cqe_get_data(cqe);
+    *res = cqe->res;
+    io_uring_cqe_seen(ring, cqe);
+
+    return DRPM_ERR_OK;
+}
+
+/* Waits for the <pending> submissions still in flight, so that none of
+ * them reads into a buffer after it has been freed. Files opened in the
+ * meantime (while <opening>) are recorded in <ufiles> to be closed. */
+int uring_drain(struct io_uring *ring, struct uring_file *ufiles, size_t pending, bool opening)
+{
+    int error;
+    size_t k;
+    int res;
+
+    io_uring_submit(ring);
+
+    for ( ; pending > 0; pending--) {
+        if ((error = uring_next(ring, &k, &res)) != DRPM_ERR_OK)
+            return error;
+        if (opening && res >= 0)
+            ufiles[k].filedesc = res;
+    }
+
+    return DRPM_ERR_OK;
+}
+
+/* Checks files a window at a time, batching statx, openat and read
+ * submissions. Files that need special handling (e.g. prelinked files)
+ * are left to the synchronous checks. Returns DRPM_ERR_OTHER without
+ * having checked anything if io_uring cannot be used. */
+int check_files_uring(const struct check_file *files, size_t count,
+                      unsigned short digest_algo)
+{
+    int error = DRPM_ERR_OK;
+    struct io_uring ring;
+    struct io_uring_sqe *sqe;
+    struct uring_file *ufiles;
+    unsigned char *buffers = NULL;
+    unsigned char chsm_digest[MAX(MD5_DIGEST_LENGTH, SHA256_DIGEST_LENGTH)];
+    size_t window = 0;
+    size_t pending = 0;
+    bool opening = false;
+    size_t k;
+    size_t read_len;
+    int res;
+
+    if ((ufiles = malloc(URING_WINDOW * sizeof(struct uring_file))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    if ((buffers = malloc(URING_WINDOW * URING_READ_SIZE)) == NULL) {
+        free(ufiles);
+        return DRPM_ERR_MEMORY;
+    }
+
+    if (io_uring_queue_init(URING_WINDOW, &ring, 0) < 0) {
+        free(ufiles);
+        free(buffers);
+        return DRPM_ERR_OTHER;
+    }
+
+    for (size_t base = 0; base < count && error == DRPM_ERR_OK; base += window) {
+        window = MIN(count - base, URING_WINDOW);
+
+        for (k = 0; k < window; k++) {
+            ufiles[k].filedesc = -1;
+            ufiles[k].error = DRPM_ERR_OK;
+            ufiles[k].fallback = false;
+        }
+
+        /* opening */
+        for (k = 0; k < window; k++) {
+            sqe = io_uring_get_sqe(&ring);
+            io_uring_prep_openat(sqe, AT_FDCWD, files[base + k].name, O_RDONLY, 0);
+            io_uring_sqe_set_data(sqe, (void *)k);
+        }
+        io_uring_submit(&ring);
+        opening = true;
+        for (pending = window; pending > 0; pending--) {
+            if ((error = uring_next(&ring, &k, &res)) != DRPM_ERR_OK)
+                goto cleanup;
+            if (res < 0)
+                ufiles[k].error = DRPM_ERR_IO;
+            else
+                ufiles[k].filedesc = res;
+        }
+        opening = false;
+
+        /* checking sizes */
+        for (k = 0, pending = 0; k < window; k++) {
+            if (ufiles[k].filedesc < 0)
+                continue;
+            sqe = io_uring_get_sqe(&ring);
+            io_uring_prep_statx(sqe, ufiles[k].filedesc, "", AT_EMPTY_PATH, STATX_SIZE, &ufiles[k].stats);
+            io_uring_sqe_set_data(sqe, (void *)k);
+            pending++;
+        }
+        io_uring_submit(&ring);
+        for ( ; pending > 0; pending--) {
+            if ((error = uring_next(&ring, &k, &res)) != DRPM_ERR_OK)
+                goto cleanup;
+            if (res < 0)
+                ufiles[k].error = DRPM_ERR_NOINSTALL;
+            else if (ufiles[k].stats.stx_size > files[base + k].filesize)
+                ufiles[k].fallback = true;
+        }
+
+        /* reading and hashing */
+        for (k = 0, pending = 0; k < window; k++) {
+            if (ufiles[k].filedesc < 0 || ufiles[k].error != DRPM_ERR_OK || ufiles[k].fallback)
+                continue;
+            if ((ufiles[k].error = checksum_init(&ufiles[k].chsm, digest_algo)) != DRPM_ERR_OK)
+                continue;
+            ufiles[k].offset = 0;
+            ufiles[k].left = files[base + k].filesize;
+            sqe = io_uring_get_sqe(&ring);
+            io_uring_prep_read(sqe, ufiles[k].filedesc, buffers + k * URING_READ_SIZE,
+                               MIN(ufiles[k].left, URING_READ_SIZE), 0);
+            io_uring_sqe_set_data(sqe, (void *)k);
+            pending++;
+        }
+        io_uring_submit(&ring);
+        while (pending > 0) {
+            if ((error = uring_next(&ring, &k, &res)) != DRPM_ERR_OK)
+                goto cleanup;
+            pending--;
+            if (res > 0) {
+                read_len = MIN((size_t)res, ufiles[k].left);
+                if ((ufiles[k].error = checksum_update(&ufiles[k].chsm, buffers + k * URING_READ_SIZE, read_len)) != DRPM_ERR_OK)
+                    continue;
+                ufiles[k].offset += read_len;
+                ufiles[k].left -= read_len;
+                if (ufiles[k].left > 0) {
+                    sqe = io_uring_get_sqe(&ring);
+                    io_uring_prep_read(sqe, ufiles[k].filedesc, buffers + k * URING_READ_SIZE,
+                                       MIN(ufiles[k].left, URING_READ_SIZE), ufiles[k].offset);
+                    io_uring_sqe_set_data(sqe, (void *)k);
+                    io_uring_submit(&ring);
+                    pending++;
+                    continue;
+                }
+            }
+            if (res < 0) {
+                ufiles[k].error = DRPM_ERR_IO;
+                continue;
+            }
+            /* whole file read (or end of file reached early) */
+            if ((ufiles[k].error = checksum_final(&ufiles[k].chsm, chsm_digest)) == DRPM_ERR_OK &&
+                memcmp(chsm_digest, files[base + k].digest, checksum_digest_len(ufiles[k].chsm)) != 0)
+                ufiles[k].error = DRPM_ERR_MISMATCH;
+        }
+
+        for (k = 0; k < window; k++) {
+            if (!(ufiles[k].filedesc < 0))
+                close(ufiles[k].filedesc);
+            ufiles[k].filedesc = -1;
+        }
+
+        /* reporting the first failure in sequence order */
+        for (k = 0; k < window; k++) {
+            if (ufiles[k].fallback)
+                ufiles[k].error = check_full(files[base + k].name, digest_algo,
+                                             files[base + k].digest, files[base + k].filesize);
+            if ((error = ufiles[k].error) != DRPM_ERR_OK)
+                break;
+        }
+    }
+
+cleanup:
+    /* if completions cannot be waited for, reads may still land in the
+     * buffers, so they are left allocated rather than freed under them */
+    if (pending > 0 && uring_drain(&ring, ufiles, pending, opening) != DRPM_ERR_OK) {
+        io_uring_queue_exit(&ring);
+        return error;
+    }
+    if (error != DRPM_ERR_OK)
+        for (k = 0; k < window; k++)
+            if (!(ufiles[k].filedesc < 0))
+                close(ufiles[k].filedesc);
+    io_uring_queue_exit(&ring);
+    free(ufiles);
+    free(buffers);
+
+    return error;
+}
+#endif
+
 int check_filesize(const char *filename, unsigned short digest_algo,
                    const unsigned char *digest, size_t filesize)
 {
@@ -358,7 +713,12 @@ int check_full(const char *filename, unsigned short digest_algo,
         }
     }
 
-    while (filesize > 0 && (read_len = read(filedesc, buf, BUFFER_SIZE)) > 0) {
+    while (filesize > 0 && (read_len = read(filedesc, buf, BUFFER_SIZE)) != 0) {
+        /* same as a failed read through io_uring */
+        if (read_len < 0) {
+            error = DRPM_ERR_IO;
+            goto cleanup;
+        }
         if ((size_t)read_len > filesize)
             read_len = filesize;
         if ((error = checksum_update(&chsm, buf, read_len)) != DRPM_ERR_OK)
@@ -423,6 +783,405 @@ cleanup:
     return error;
 }
 
+/****************************** verify ********************************/
+
+int verify_file_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct verify_file *)a)->name, ((const struct verify_file *)b)->name);
+}
+
+/* Starts a thread verifying the regular files in the CPIO archive that
+ * will be passed to file_verifier_feed() against the digests from <files>
+ * (file information from the new RPM header, which must outlive the
+ * verifier). */
+int file_verifier_start(struct file_verifier **verifier,
+                        const struct file_info *files, size_t file_count,
+                        unsigned short digest_algo)
+{
+    struct file_verifier *v;
+    bool parsed;
+
+    if (verifier == NULL || (files == NULL && file_count > 0))
+        return DRPM_ERR_PROG;
+
+    if ((v = calloc(1, sizeof(struct file_verifier))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    v->digest_algo = digest_algo;
+    v->state = VERIFY_HEADER;
+    v->left = CPIO_HEADER_SIZE;
+
+    if ((file_count > 0 && (v->files = malloc(file_count * sizeof(struct verify_file))) == NULL) ||
+        (v->ring = malloc(VERIFY_BUFFER_SIZE)) == NULL) {
+        file_verifier_destroy(&v);
+        return DRPM_ERR_MEMORY;
+    }
+
+    for (size_t i = 0; i < file_count; i++) {
+        if (!S_ISREG(files[i].mode) || files[i].size == 0 ||
+            files[i].md5 == NULL || files[i].md5[0] == '\0')
+            continue;
+        parsed = (digest_algo == DIGESTALGO_MD5) ?
+                 parse_md5(v->files[v->file_count].digest, files[i].md5) :
+                 parse_sha256(v->files[v->file_count].digest, files[i].md5);
+        if (!parsed) {
+            file_verifier_destroy(&v);
+            return DRPM_ERR_FORMAT;
+        }
+        v->files[v->file_count].name = files[i].name;
+        v->files[v->file_count].size = files[i].size;
+        v->file_count++;
+    }
+
+    if (v->file_count > 0)
+        qsort(v->files, v->file_count, sizeof(struct verify_file), verify_file_cmp);
+
+    if (pthread_mutex_init(&v->lock, NULL) != 0) {
+        file_verifier_destroy(&v);
+        return DRPM_ERR_OTHER;
+    }
+    if (pthread_cond_init(&v->cond, NULL) != 0) {
+        pthread_mutex_destroy(&v->lock);
+        file_verifier_destroy(&v);
+        return DRPM_ERR_OTHER;
+    }
+    if (pthread_create(&v->thread, NULL, verifier_thread, v) != 0) {
+        pthread_cond_destroy(&v->cond);
+        pthread_mutex_destroy(&v->lock);
+        file_verifier_destroy(&v);
+        return DRPM_ERR_OTHER;
+    }
+    v->running = true;
+
+    *verifier = v;
+
+    return DRPM_ERR_OK;
+}
+
+/* Hands the next <len> bytes of the CPIO archive over to the verifier.
+ * Only blocks if the verifier is more than a buffer behind.
+ * Returns DRPM_ERR_MISMATCH once a file has failed verification. */
+int file_verifier_feed(struct file_verifier *v, const unsigned char *buf, size_t len)
+{
+    size_t pos;
+    size_t n;
+    int error;
+
+    if (v == NULL || (buf == NULL && len > 0))
+        return DRPM_ERR_PROG;
+
+    pthread_mutex_lock(&v->lock);
+    while (len > 0 && !v->done) {
+        while (!v->done && v->head - v->tail == VERIFY_BUFFER_SIZE)
+            pthread_cond_wait(&v->cond, &v->lock);
+        if (v->done)
+            break;
+        pos = v->head % VERIFY_BUFFER_SIZE;
+        n = MIN(len, MIN(VERIFY_BUFFER_SIZE - (v->head - v->tail), VERIFY_BUFFER_SIZE - pos));
+        // the thread only reads between tail and head
+        pthread_mutex_unlock(&v->lock);
+        memcpy(v->ring + pos, buf, n);
+        pthread_mutex_lock(&v->lock);
+        v->head += n;
+        pthread_cond_broadcast(&v->cond);
+        buf += n;
+        len -= n;
+    }
+    error = v->done ? v->error : DRPM_ERR_OK;
+    pthread_mutex_unlock(&v->lock);
+
+    return error;
+}
+
+/* Waits for the verifier to go through all data fed to it.
+ * If a file failed verification, returns DRPM_ERR_MISMATCH and stores
+ * its name in <*bad_file> (unless NULL), to be freed by the caller. */
+int file_verifier_finish(struct file_verifier *v, char **bad_file)
+{
+    if (v == NULL)
+        return DRPM_ERR_PROG;
+
+    if (bad_file != NULL)
+        *bad_file = NULL;
+
+    if (v->running) {
+        pthread_mutex_lock(&v->lock);
+        v->eof = true;
+        pthread_cond_broadcast(&v->cond);
+        pthread_mutex_unlock(&v->lock);
+        pthread_join(v->thread, NULL);
+        pthread_cond_destroy(&v->cond);
+        pthread_mutex_destroy(&v->lock);
+        v->running = false;
+    }
+
+    if (bad_file != NULL) {
+        *bad_file = v->bad_file;
+        v->bad_file = NULL;
+    }
+
+    return v->error;
+}
+
+/* Stops the verifier (if still running) and frees it. */
+int file_verifier_destroy(struct file_verifier **v)
+{
+    if (v == NULL || *v == NULL)
+        return DRPM_ERR_PROG;
+
+    if ((*v)->running) {
+        pthread_mutex_lock(&(*v)->lock);
+        (*v)->done = true; // abandoned, the thread need not go on
+        pthread_mutex_unlock(&(*v)->lock);
+        file_verifier_finish(*v, NULL);
+    }
+
+    free((*v)->files);
+    free((*v)->ring);
+    free((*v)->bad_file);
+    free((*v)->name);
+    free(*v);
+    *v = NULL;
+
+    return DRPM_ERR_OK;
+}
+
+void *verifier_thread(void *arg)
+{
+    struct file_verifier *v = arg;
+    size_t pos;
+    size_t n;
+    int error = DRPM_ERR_OK;
+
+    pthread_mutex_lock(&v->lock);
+    while (!v->done) {
+        while (!v->done && !v->eof && v->head == v->tail)
+            pthread_cond_wait(&v->cond, &v->lock);
+        if (v->done || v->head == v->tail)
+            break;
+        pos = v->tail % VERIFY_BUFFER_SIZE;
+        n = MIN(v->head - v->tail, VERIFY_BUFFER_SIZE - pos);
+        pthread_mutex_unlock(&v->lock);
+        error = verifier_parse(v, v->ring + pos, n);
+        pthread_mutex_lock(&v->lock);
+        v->tail += n;
+        if (error != DRPM_ERR_OK || v->state == VERIFY_END) {
+            v->error = error;
+            v->done = true;
+        }
+        pthread_cond_broadcast(&v->cond);
+    }
+    v->done = true;
+    pthread_cond_broadcast(&v->cond);
+    pthread_mutex_unlock(&v->lock);
+
+    return NULL;
+}
+
+/* Moves the parser on to the next part of the CPIO archive
+ * once the current one (of <v->left> bytes) has been consumed. */
+int verifier_next(struct file_verifier *v)
+{
+    struct verify_file key;
+    unsigned char digest[MAX(MD5_DIGEST_LENGTH, SHA256_DIGEST_LENGTH)];
+    char *name_tmp;
+    int error;
+
+    switch (v->state) {
+    case VERIFY_HEADER:
+        if (cpio_header_read(&v->cpio_hdr, v->header) != DRPM_ERR_OK ||
+            v->cpio_hdr.namesize == 0 ||
+            (name_tmp = realloc(v->name, v->cpio_hdr.namesize)) == NULL) {
+            v->state = VERIFY_END;
+            break;
+        }
+        v->name = name_tmp;
+        v->state = VERIFY_NAME;
+        v->left = v->cpio_hdr.namesize;
+        break;
+
+    case VERIFY_NAME:
+        v->name[v->cpio_hdr.namesize - 1] = '\0';
+        if (strcmp(v->name, CPIO_TRAILER) == 0) {
+            v->state = VERIFY_END;
+            break;
+        }
+        /* "./usr/bin/foo" in the archive, "/usr/bin/foo" in the header */
+        v->current = NULL;
+        if (S_ISREG(v->cpio_hdr.mode) && v->cpio_hdr.filesize > 0 &&
+            v->name[0] == '.' && v->file_count > 0) {
+            key.name = v->name + 1;
+            v->current = bsearch(&key, v->files, v->file_count,
+                                 sizeof(struct verify_file), verify_file_cmp);
+        }
+        if (v->current != NULL) {
+            if (v->current->size != v->cpio_hdr.filesize)
+                return verifier_mismatch(v);
+            if ((error = checksum_init(&v->chsm, v->digest_algo)) != DRPM_ERR_OK)
+                return error;
+        }
+        v->state = VERIFY_SKIP;
+        v->next_state = VERIFY_CONTENT;
+        v->left = CPIO_PADDING(CPIO_HEADER_SIZE + v->cpio_hdr.namesize);
+        break;
+
+    case VERIFY_CONTENT:
+        if (v->current != NULL) {
+            if ((error = checksum_final(&v->chsm, digest)) != DRPM_ERR_OK)
+                return error;
+            if (memcmp(digest, v->current->digest, checksum_digest_len(v->chsm)) != 0)
+                return verifier_mismatch(v);
+        }
+        v->state = VERIFY_SKIP;
+        v->next_state = VERIFY_HEADER;
+        v->left = CPIO_PADDING(v->cpio_hdr.filesize);
+        break;
+
+    case VERIFY_SKIP:
+        v->state = v->next_state;
+        v->left = (v->state == VERIFY_CONTENT) ? v->cpio_hdr.filesize : CPIO_HEADER_SIZE;
+        break;
+    }
+
+    return DRPM_ERR_OK;
+}
+
+/* Records the file being parsed as the one that failed verification. */
+int verifier_mismatch(struct file_verifier *v)
+{
+    v->state = VERIFY_END;
+
+    if ((v->bad_file = malloc(strlen(v->current->name) + 1)) == NULL)
+        return DRPM_ERR_MEMORY;
+    strcpy(v->bad_file, v->current->name);
+
+    return DRPM_ERR_MISMATCH;
+}
+
+/* Parses the next <len> bytes of the CPIO archive, hashing the content
+ * of regular files with a known digest. Anything that does not parse as
+ * a new ASCII CPIO archive (including stripped headers of large-file
+ * payloads) ends verification (the final MD5 check of the new RPM
+ * remains). */
+int verifier_parse(struct file_verifier *v, const unsigned char *buf, size_t len)
+{
+    size_t n;
+    int error;
+
+    while (len > 0 && v->state != VERIFY_END) {
+        n = MIN(len, v->left);
+
+        switch (v->state) {
+        case VERIFY_HEADER:
+            memcpy(v->header + CPIO_HEADER_SIZE - v->left, buf, n);
+            break;
+        case VERIFY_NAME:
+            memcpy(v->name + v->cpio_hdr.namesize - v->left, buf, n);
+            break;
+        case VERIFY_CONTENT:
+            if (v->current != NULL &&
+                (error = checksum_update(&v->chsm, buf, n)) != DRPM_ERR_OK)
+                return error;
+            break;
+        }
+
+        buf += n;
+        len -= n;
+        v->left -= n;
+
+        /* parts may be empty (padding, file content) */
+        while (v->left == 0 && v->state != VERIFY_END) {
+            if ((error = verifier_next(v)) != DRPM_ERR_OK)
+                return error;
+        }
+    }
+
+    return DRPM_ERR_OK;
+}
+
+/*************************** output window ****************************/
+
+int out_window_create(struct out_window **win, size_t size)
+{
+    if (win == NULL || size == 0)
+        return DRPM_ERR_PROG;
+
+    if ((*win = malloc(sizeof(struct out_window))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    if (((*win)->buf = malloc(size)) == NULL) {
+        free(*win);
+        *win = NULL;
+        return DRPM_ERR_MEMORY;
+    }
+
+    (*win)->size = size;
+    (*win)->pos = 0;
+    (*win)->total = 0;
+
+    return DRPM_ERR_OK;
+}
+
+void out_window_destroy(struct out_window **win)
+{
+    if (*win == NULL)
+        return;
+
+    free((*win)->buf);
+    free(*win);
+    *win = NULL;
+}
+
+/* Keeps the last window size of <len> bytes of <buf> just output. */
+void out_window_push(struct out_window *win, const unsigned char *buf, size_t len)
+{
+    size_t chunk;
+
+    win->total += len;
+
+    if (len > win->size) {
+        buf += len - win->size;
+        len = win->size;
+    }
+
+    while (len > 0) {
+        chunk = MIN(len, win->size - win->pos);
+        memcpy(win->buf + win->pos, buf, chunk);
+        win->pos = (win->pos + chunk) % win->size;
+        buf += chunk;
+        len -= chunk;
+    }
+}
+
+/* Copies <len> bytes output from <dist> bytes back into <buf>.
+ * If <dist> is less than <len>, the bytes repeat with a period of <dist>
+ * (as if copied one at a time from the output as it grew). */
+int out_window_fetch(const struct out_window *win, size_t dist,
+                     unsigned char *buf, size_t len)
+{
+    size_t start;
+    size_t chunk;
+    size_t done;
+
+    if (dist == 0 || dist > win->size || dist > win->total)
+        return DRPM_ERR_FORMAT;
+
+    start = (win->pos + win->size - dist) % win->size;
+
+    for (done = 0; done < MIN(len, dist); done += chunk) {
+        chunk = MIN(MIN(len, dist) - done, win->size - start);
+        memcpy(buf + done, win->buf + start, chunk);
+        start = (start + chunk) % win->size;
+    }
+
+    for ( ; done < len; done += chunk) {
+        chunk = MIN(done, len - done);
+        memcpy(buf + done, buf, chunk);
+    }
+
+    return DRPM_ERR_OK;
+}
+
 /***************************** MD5/SHA256 *****************************/
 
 int checksum_init(struct checksum *chsm, unsigned short digest_algo)
@@ -659,3 +1418,86 @@ int prelink_open(const char *filename, int *filedesc)
     return DRPM_ERR_OK;
 }
 
+uint64_t estimate_msecs(uint64_t bytes, unsigned mib_per_sec)
+{
+    return bytes * 1000 / ((uint64_t)mib_per_sec << 20);
+}
+
+/* Predicts what applying <delta> (read with copies only) will take,
+ * reading the external data from the old RPM (its payload compressed
+ * with <old_comp>) if <from_rpm>, or from installed files otherwise.
+ * The block cache is simulated on the external copies, while the rest
+ * is derived from data lengths and rough codec throughputs. */
+int apply_estimate(struct drpm_apply_estimate *est, const struct deltarpm *delta,
+                   bool from_rpm, unsigned short old_comp, unsigned threads)
+{
+    int error;
+    size_t cache_memory;
+    size_t core_blocks;
+    size_t fills;
+    size_t refills;
+    uint64_t ext_len = 0;
+    uint64_t int_len = 0;
+    uint64_t copies_len;
+    uint64_t body_len;
+    uint64_t xz_block_size;
+    unsigned short zstd_window_log;
+    bool zstd_checksum;
+    bool zstd_workers;
+    unsigned comp_speed;
+
+    if (est == NULL || delta == NULL)
+        return DRPM_ERR_PROG;
+
+    if ((error = blocks_estimate(delta->ext_data_len, delta->ext_copies, delta->ext_copies_count,
+                                 &cache_memory, &core_blocks, &fills, &refills)) != DRPM_ERR_OK)
+        return error;
+
+    for (uint32_t i = 0; i < delta->ext_copies_count; i++)
+        ext_len += delta->ext_copies[2 * i + 1];
+    for (uint32_t i = 0; i < delta->int_copies_count; i++)
+        int_len += delta->int_copies[2 * i + 1];
+
+    copies_len = 8 * ((uint64_t)delta->offadj_elems_count + delta->int_copies_count +
+                      delta->ext_copies_count + delta->self_copies_count);
+    body_len = delta->sequence_len + delta->tgt_comp_param_len + delta->tgt_leadsig_len +
+               copies_len + delta->add_data_len + delta->int_data_len;
+
+    est->blocks = (uint64_t)core_blocks * block_size();
+    est->ext_read = (uint64_t)fills * block_size();
+    est->ext_reread = (uint64_t)refills * block_size();
+
+    // an included target header is written uncompressed
+    est->recomp = ext_len + int_len - MIN(delta->tgt_header_len, ext_len + int_len);
+    est->recomp_comp = delta->tgt_comp;
+
+    // the add block is as long as the external copies
+    est->decomp = body_len + (delta->add_data_len > 0 ? ext_len : 0) +
+                  (from_rpm ? delta->ext_data_len : 0);
+
+    // the old payload is decompressed whole, while the new one is kept
+    // compressed in memory and copied once more when finished
+    est->memory = cache_memory + copies_len + delta->add_data_len + delta->int_data_len +
+                  (from_rpm ? delta->ext_data_len : 0) + 2 * delta->tgt_size;
+    if (delta->self_copies_count > 0)
+        est->memory += delta->self_window;
+
+    comp_speed = comp_speeds[delta->tgt_comp].comp;
+    if (delta->tgt_comp == DRPM_COMP_ZSTD && delta->tgt_comp_level != DRPM_COMP_LEVEL_DEFAULT &&
+        delta->tgt_comp_level <= ESTIMATE_ZSTD_FAST_LEVEL)
+        comp_speed = ESTIMATE_ZSTD_FAST_SPEED;
+    if (deltarpm_get_xz_blocks(delta, &xz_block_size) ||
+        (deltarpm_get_zstd_params(delta, &zstd_window_log, &zstd_checksum, &zstd_workers) && zstd_workers))
+        comp_speed *= MAX(threads, 1);
+
+    est->msecs = estimate_msecs(body_len, comp_speeds[delta->comp].decomp) +
+                 estimate_msecs(est->recomp, comp_speed);
+    if (delta->add_data_len > 0)
+        est->msecs += estimate_msecs(ext_len, comp_speeds[delta->add_comp].decomp);
+    if (from_rpm)
+        est->msecs += estimate_msecs(delta->ext_data_len, comp_speeds[old_comp].decomp);
+    else
+        est->msecs += estimate_msecs(est->ext_read, ESTIMATE_FS_READ_SPEED);
+
+    return DRPM_ERR_OK;
+}
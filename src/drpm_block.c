@@ -19,6 +19,8 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE
+
 #include "drpm.h"
 #include "drpm_private.h"
 
@@ -29,13 +31,21 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #define MAX_OPEN_FILES 50
+#define MAX_OPEN_FILES_AUTO 4096
+#define MAX_OPEN_DIRS 16
 #define MAX_CORE_BLOCKS 5000
+#define MIN_PAGE_AREA_BLOCKS 256
+#define MAX_PREFETCH_BLOCKS 256
 
 #define BLOCK_SIZE (1 << 13)
 
@@ -44,6 +54,11 @@
 #define BLK_CORE_NOPAGE 2
 #define BLK_PAGE 3
 
+#define PREFETCH_EMPTY 0
+#define PREFETCH_FILLING 1
+#define PREFETCH_READY 2
+#define PREFETCH_FAILED 3
+
 #define BLOCKS(size) (1 + ((size) - 1) / BLOCK_SIZE)
 
 /* a list of open files */
@@ -53,15 +68,36 @@ struct open_file {
     int filedesc;
     const char *name;
     off_t offset;
+    size_t index; // into cpio_files
+};
+
+/* an open directory of installed files (path includes trailing slash) */
+struct open_dir {
+    char *path;
+    size_t path_len;
+    int filedesc;
+};
+
+/* location of a file within the old (decompressed) CPIO archive */
+struct old_cpio_entry {
+    uint64_t offset; // start of CPIO header
+    uint64_t header_len; // header, name and padding (0 if file not in archive)
+    uint64_t size; // file size without padding
+};
+
+/* old CPIO archive entry while building the index */
+struct cpio_name {
+    char *name;
+    struct old_cpio_entry entry;
 };
 
 /* a block */
 struct block {
     struct block *next;
     int type;
-    unsigned id;
-    /* core blocks store the buffer directly, while page blocks
-     * only store an offset within a temporary file from which to read
+    size_t id;
+    /* core blocks point into the core slab, while page blocks
+     * only store an offset within the page area from which to read
      * the data */
     union {
         off_t offset;
@@ -69,56 +105,126 @@ struct block {
     } data;
 };
 
+/* a prefetched block, in slot <position % slot_count> of the window */
+struct prefetch_slot {
+    int state;
+    unsigned char *buffer;
+};
+
+/* threads filling blocks from installed files ahead of the apply */
+struct prefetch {
+    const struct blocks *blks;
+    pthread_mutex_t lock;
+    pthread_cond_t filled; // a slot has been filled
+    pthread_cond_t space; // the window has moved
+    size_t *schedule; // block IDs in the order the external copies fill them
+    size_t schedule_len;
+    size_t next; // next position to be handed out to a thread
+    size_t cursor; // position following the last one taken by the apply
+    size_t hits; // fills that were found in the schedule
+    struct prefetch_slot *slots;
+    unsigned char *buffers;
+    size_t slot_count;
+    pthread_t *workers;
+    unsigned worker_count;
+    bool stop;
+};
+
 struct blocks {
     struct block *free_core_blocks;
     struct block *core_blocks;
     size_t core_blocks_count;
+    size_t core_blocks_max;
+    /* all core blocks and their buffers are carved out of two slabs,
+     * the buffers living in a single anonymous mapping */
+    struct block *core_slab;
+    unsigned char *core_buffers;
+    bool core_buffers_mapped;
 
     struct block *page_blocks;
     size_t page_blocks_count;
+    /* page blocks are spilled to an unlinked file (or memfd),
+     * which is mapped whole so that paging is a memory copy
+     * (page_map is NULL if mapping failed, then pread/pwrite is used) */
     int page_filedesc;
+    unsigned char *page_map;
+    size_t page_area_blocks;
 
     struct block **blocks_table;
     size_t *blocks_max;
 
     unsigned char *cpio_buffer;
+    size_t cpio_buffer_len;
     const char *linkto;
     ssize_t cpio_files_index;
 
     const struct cpio_file *cpio_files;
     size_t cpio_files_len;
     const struct file_info *files;
+    size_t file_count;
 
     bool from_rpm;
     union {
         struct {
             struct open_file *files_head;
             struct open_file *files_tail;
-            unsigned short file_count;
+            unsigned file_count;
+            unsigned file_count_max;
             struct open_file **open_files;
+            bool *checked; // file is known not to be prelinked
+            struct open_dir dirs[MAX_OPEN_DIRS]; // most recently used first
+            bool noatime_denied;
         } from_filesytem;
         struct {
             struct rpm *old_rpm;
-            unsigned rpm_id;
-            uint64_t left;
+            uint64_t ext_data_len;
             unsigned char *old_header;
             size_t old_header_size;
-            size_t old_header_offset;
+            struct old_cpio_entry *old_cpio; // parallel to cpio_files
         } from_rpm;
     } rpm_files;
 
     struct block *last_block;
+    size_t cleanup_count; // get_block() calls while core blocks are added
+
+    struct prefetch *prefetch;
+
+    /* replays only count fills, <filled> marking the blocks
+     * that have been filled before and <fill_order> listing
+     * the blocks filled in order (when building a schedule) */
+    bool *filled;
+    size_t *fill_order;
+    size_t fills;
+    size_t refills;
 
     int (*fill_block)(struct blocks *, struct block *, size_t, size_t);
 };
 
+static void blocks_max_fill(size_t *, const uint32_t *, size_t);
+static int blocks_replay(struct blocks **, size_t, const uint32_t *, size_t,
+                         int (*)(struct blocks *, struct block *, size_t, size_t));
+static int cpio_index_build(struct blocks *);
+static void cpio_header_synth(const struct file_info *, ssize_t, unsigned char *);
+static int cpio_name_cmp(const void *, const void *);
+static int fillblock_estimate(struct blocks *, struct block *, size_t, size_t);
 static int fillblock_filesystem(struct blocks *, struct block *, size_t, size_t);
 static int fillblock_prelink(struct blocks *, struct block *, size_t, size_t, const struct cpio_file *);
 static int fillblock_rpm_rpmonly(struct blocks *, struct block *, size_t, size_t);
 static int fillblock_rpm_standard(struct blocks *, struct block *, size_t, size_t);
+static int fillblock_schedule(struct blocks *, struct block *, size_t, size_t);
 static struct block *get_free_core_block(struct blocks *);
 static int get_block(struct blocks *, struct block **, size_t, size_t);
 static int new_core_block(struct blocks *, struct block **);
+static int open_installed(struct blocks *, const char *);
+static unsigned open_files_max(unsigned);
+static int openat_noatime(int, const char *, bool *);
+static int page_area_reserve(struct blocks *, size_t);
+static bool prefetch_fill(const struct blocks *, int *, ssize_t *, bool *, unsigned char *, unsigned char *, size_t);
+static void prefetch_free(struct prefetch *);
+static int prefetch_start(struct blocks *, size_t, const uint32_t *, size_t, unsigned);
+static void prefetch_stop(struct blocks *);
+static bool prefetch_take(struct prefetch *, unsigned char *, size_t);
+static void *prefetch_worker(void *);
 static int push_block(struct blocks *, const struct block *, size_t);
 static int read_page_block(struct blocks *, struct block *, const struct block *);
 static int write_page_block(struct blocks *, const struct block *, size_t);
@@ -138,55 +244,62 @@ size_t block_id(uint64_t offset)
 /* creates blocks for reading external data */
 int blocks_create(struct blocks **blks_ret,
                   uint64_t ext_data_len, const struct file_info *files,
-                  const struct cpio_file *cpio_files, size_t cpio_files_len,
+                  size_t file_count, const struct cpio_file *cpio_files, size_t cpio_files_len,
                   const uint32_t *ext_copies, size_t ext_copies_count,
-                  struct rpm *old_rpm, bool rpm_only)
+                  struct rpm *old_rpm, bool rpm_only, unsigned open_files,
+                  unsigned io_threads)
 {
     int error = DRPM_ERR_OK;
     const size_t block_count = BLOCKS(ext_data_len);
-    uint64_t off = 0;
     size_t max_cpio_header_len;
     uint32_t old_header_size;
     struct blocks blks = {
+        .core_blocks_max = MIN(block_count, MAX_CORE_BLOCKS),
         .page_filedesc = -1,
         .cpio_files_index = -1,
         .cpio_files = cpio_files,
         .cpio_files_len = cpio_files_len,
         .files = files,
+        .file_count = file_count,
         .from_rpm = (old_rpm != NULL)
     };
 
     if (blks_ret == NULL)
         return DRPM_ERR_PROG;
 
-    if (block_count >= UINT32_MAX)
+    if (BLOCKS(ext_data_len) > SIZE_MAX / sizeof(struct block *))
         return DRPM_ERR_OVERFLOW;
 
     if (blks.from_rpm) {
         blks.rpm_files.from_rpm.old_rpm = old_rpm;
-        blks.rpm_files.from_rpm.rpm_id = 0;
+        blks.rpm_files.from_rpm.ext_data_len = ext_data_len;
         if (rpm_only) {
-            blks.rpm_files.from_rpm.left = ext_data_len;
+            blks.rpm_files.from_rpm.old_cpio = NULL;
             if ((error = rpm_fetch_header(old_rpm, &blks.rpm_files.from_rpm.old_header, &old_header_size)) != DRPM_ERR_OK)
                 goto cleanup;
             blks.rpm_files.from_rpm.old_header_size = old_header_size;
-            blks.rpm_files.from_rpm.old_header_offset = 0;
             blks.fill_block = fillblock_rpm_rpmonly;
         } else {
-            blks.rpm_files.from_rpm.left = 0;
             blks.rpm_files.from_rpm.old_header = NULL;
             blks.rpm_files.from_rpm.old_header_size = 0;
-            blks.rpm_files.from_rpm.old_header_offset = 0;
+            blks.rpm_files.from_rpm.old_cpio = NULL;
             blks.fill_block = fillblock_rpm_standard;
+            if ((error = cpio_index_build(&blks)) != DRPM_ERR_OK)
+                goto cleanup;
         }
     } else {
-        if ((blks.rpm_files.from_filesytem.open_files = calloc(cpio_files_len, sizeof(struct open_file *))) == NULL) {
+        if ((blks.rpm_files.from_filesytem.open_files = calloc(cpio_files_len, sizeof(struct open_file *))) == NULL ||
+            (blks.rpm_files.from_filesytem.checked = calloc(cpio_files_len, sizeof(bool))) == NULL) {
             error = DRPM_ERR_MEMORY;
             goto cleanup;
         }
         blks.rpm_files.from_filesytem.files_head = NULL;
         blks.rpm_files.from_filesytem.files_tail = NULL;
         blks.rpm_files.from_filesytem.file_count = 0;
+        blks.rpm_files.from_filesytem.file_count_max = open_files_max(open_files);
+        for (unsigned short i = 0; i < MAX_OPEN_DIRS; i++)
+            blks.rpm_files.from_filesytem.dirs[i].path = NULL;
+        blks.rpm_files.from_filesytem.noatime_denied = false;
         blks.fill_block = fillblock_filesystem;
     }
 
@@ -197,14 +310,7 @@ int blocks_create(struct blocks **blks_ret,
         goto cleanup;
     }
 
-    for (size_t blk_i, blk_l, i = 0; i < ext_copies_count; i++) {
-        off += (int32_t)ext_copies[2 * i];
-        blk_i = off / BLOCK_SIZE;
-        off += ext_copies[2 * i + 1];
-        blk_l = BLOCKS(off);
-        for ( ; blk_i < blk_l; blk_i++)
-            blks.blocks_max[blk_i] = i;
-    }
+    blocks_max_fill(blks.blocks_max, ext_copies, ext_copies_count);
 
     max_cpio_header_len = CPIO_HEADER_SIZE + strlen(CPIO_TRAILER) + 1;
     max_cpio_header_len += CPIO_PADDING(max_cpio_header_len);
@@ -216,13 +322,24 @@ int blocks_create(struct blocks **blks_ret,
         error = DRPM_ERR_MEMORY;
         goto cleanup;
     }
+    blks.cpio_buffer_len = max_cpio_header_len;
 
     **blks_ret = blks;
 
+    if (!blks.from_rpm && io_threads > 0 &&
+        (error = prefetch_start(*blks_ret, block_count, ext_copies, ext_copies_count, io_threads)) != DRPM_ERR_OK)
+        goto cleanup;
+
     return DRPM_ERR_OK;
 
 cleanup:
     free(*blks_ret);
+    if (blks.from_rpm) {
+        free(blks.rpm_files.from_rpm.old_cpio);
+    } else {
+        free(blks.rpm_files.from_filesytem.open_files);
+        free(blks.rpm_files.from_filesytem.checked);
+    }
     free(blks.blocks_table);
     free(blks.blocks_max);
     free(blks.cpio_buffer);
@@ -230,19 +347,268 @@ cleanup:
     return error;
 }
 
+/* records for each block the index of the last external copy reading it */
+void blocks_max_fill(size_t *blocks_max, const uint32_t *ext_copies, size_t ext_copies_count)
+{
+    uint64_t off = 0;
+
+    for (size_t blk_i, blk_l, i = 0; i < ext_copies_count; i++) {
+        off += (int32_t)ext_copies[2 * i];
+        blk_i = off / BLOCK_SIZE;
+        off += ext_copies[2 * i + 1];
+        blk_l = BLOCKS(off);
+        for ( ; blk_i < blk_l; blk_i++)
+            blocks_max[blk_i] = i;
+    }
+}
+
+/* Replays the external copies through the block cache the way applying
+ * does, but with blocks that are only counted by <fill_block> instead of
+ * being filled. The replayed cache is returned in <blks_ret>. */
+int blocks_replay(struct blocks **blks_ret, size_t block_count,
+                  const uint32_t *ext_copies, size_t ext_copies_count,
+                  int (*fill_block)(struct blocks *, struct block *, size_t, size_t))
+{
+    int error = DRPM_ERR_OK;
+    struct blocks *blks;
+    struct block *blk = NULL;
+    uint64_t off = 0;
+    size_t blk_l;
+
+    if (block_count > SIZE_MAX / sizeof(struct block *))
+        return DRPM_ERR_OVERFLOW;
+
+    if ((blks = calloc(1, sizeof(struct blocks))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    blks->core_blocks_max = MIN(block_count, MAX_CORE_BLOCKS);
+    blks->page_filedesc = -1;
+    blks->cpio_files_index = -1;
+    blks->fill_block = fill_block;
+
+    if ((blks->blocks_table = calloc(block_count, sizeof(struct block *))) == NULL ||
+        (blks->blocks_max = calloc(block_count, sizeof(size_t))) == NULL ||
+        (blks->filled = calloc(block_count, sizeof(bool))) == NULL) {
+        error = DRPM_ERR_MEMORY;
+        goto cleanup;
+    }
+
+    blocks_max_fill(blks->blocks_max, ext_copies, ext_copies_count);
+
+    /* same lookups as blocks_next() */
+    for (size_t i = 0; i < ext_copies_count; i++) {
+        off += (int32_t)ext_copies[2 * i];
+        if (ext_copies[2 * i + 1] == 0)
+            continue;
+        blk_l = BLOCKS(off + ext_copies[2 * i + 1]);
+        for (size_t id = off / BLOCK_SIZE; id < blk_l; id++) {
+            if (blk != NULL && blk->id == id)
+                continue;
+            blk = blks->blocks_table[id];
+            if ((blk == NULL || blk->type == BLK_PAGE) &&
+                (error = get_block(blks, &blk, id, i)) != DRPM_ERR_OK)
+                goto cleanup;
+        }
+        off += ext_copies[2 * i + 1];
+    }
+
+    *blks_ret = blks;
+
+    return DRPM_ERR_OK;
+
+cleanup:
+    blocks_destroy(&blks);
+
+    return error;
+}
+
+/* Replays the external copies through the block cache the way applying
+ * does, but with blocks that are only counted instead of filled.
+ * Reports the memory taken by the cache at its peak, the peak number of
+ * core blocks, the number of blocks filled and how many of those fills
+ * were of blocks evicted before they had been read for the last time. */
+int blocks_estimate(uint64_t ext_data_len, const uint32_t *ext_copies, size_t ext_copies_count,
+                    size_t *memory_ret, size_t *core_blocks_ret, size_t *fills_ret, size_t *refills_ret)
+{
+    int error;
+    const size_t block_count = BLOCKS(ext_data_len);
+    struct blocks *blks;
+
+    if (memory_ret == NULL || core_blocks_ret == NULL || fills_ret == NULL || refills_ret == NULL)
+        return DRPM_ERR_PROG;
+
+    *memory_ret = *core_blocks_ret = *fills_ret = *refills_ret = 0;
+
+    if (ext_copies_count == 0)
+        return DRPM_ERR_OK;
+
+    if ((error = blocks_replay(&blks, block_count, ext_copies, ext_copies_count,
+                               fillblock_estimate)) != DRPM_ERR_OK)
+        return error;
+
+    *memory_ret = blks->core_blocks_count * (BLOCK_SIZE + sizeof(struct block)) +
+                  block_count * (sizeof(struct block *) + sizeof(size_t));
+    *core_blocks_ret = blks->core_blocks_count;
+    *fills_ret = blks->fills;
+    *refills_ret = blks->refills;
+
+    blocks_destroy(&blks);
+
+    return DRPM_ERR_OK;
+}
+
+int cpio_name_cmp(const void *a, const void *b)
+{
+    const struct cpio_name *x = a;
+    const struct cpio_name *y = b;
+    int cmp;
+
+    if ((cmp = strcmp(x->name, y->name)) != 0)
+        return cmp;
+
+    return (x->entry.offset > y->entry.offset) - (x->entry.offset < y->entry.offset);
+}
+
+/* Indexes the old CPIO archive by file name once, so that filling
+ * blocks can jump straight to each file in the sequence (in any order)
+ * instead of parsing every intervening header. */
+int cpio_index_build(struct blocks *blks)
+{
+    int error = DRPM_ERR_OK;
+    struct rpm *old_rpm = blks->rpm_files.from_rpm.old_rpm;
+    struct cpio_name *names = NULL;
+    size_t names_len = 0;
+    struct cpio_header cpio_hdr;
+    char cpio_buf[CPIO_HEADER_SIZE + 1] = {0};
+    uint64_t offset = 0;
+    uint64_t header_len;
+    uint64_t filesize;
+    uint64_t skip;
+    char *name = NULL;
+    const char *file_name;
+    ssize_t index;
+
+    if ((blks->rpm_files.from_rpm.old_cpio = calloc(blks->cpio_files_len, sizeof(struct old_cpio_entry))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    if ((error = rpm_archive_rewind(old_rpm)) != DRPM_ERR_OK)
+        return error;
+
+    while (true) {
+        if ((error = cpio_header_fetch(old_rpm, &cpio_hdr, cpio_buf)) != DRPM_ERR_OK)
+            goto cleanup;
+
+        if (cpio_hdr.stripped) {
+            /* large-file payload, the rest comes from the RPM header */
+            if (cpio_hdr.file_index >= blks->file_count) {
+                error = DRPM_ERR_FORMAT;
+                goto cleanup;
+            }
+            file_name = blks->files[cpio_hdr.file_index].name;
+            if (file_name[0] == '/')
+                file_name++;
+            if ((name = malloc(strlen(file_name) + 1)) == NULL) {
+                error = DRPM_ERR_MEMORY;
+                goto cleanup;
+            }
+            strcpy(name, file_name);
+            filesize = cpio_filesize(&blks->files[cpio_hdr.file_index]);
+        } else {
+            if (cpio_hdr.namesize == 0) {
+                error = DRPM_ERR_FORMAT;
+                goto cleanup;
+            }
+
+            if ((name = malloc(cpio_hdr.namesize)) == NULL) {
+                error = DRPM_ERR_MEMORY;
+                goto cleanup;
+            }
+
+            if ((error = rpm_archive_read_chunk(old_rpm, name, cpio_hdr.namesize)) != DRPM_ERR_OK)
+                goto cleanup;
+            name[cpio_hdr.namesize - 1] = '\0';
+
+            if (strcmp(name, CPIO_TRAILER) == 0)
+                break;
+
+            if (strncmp(name, "./", 2) == 0)
+                memmove(name, name + 2, strlen(name + 2) + 1);
+
+            filesize = cpio_hdr.filesize;
+        }
+
+        header_len = CPIO_HEADER_LEN(&cpio_hdr) + cpio_hdr.namesize;
+        header_len += CPIO_PADDING(header_len);
+
+        if (!resize16((void **)&names, names_len, sizeof(struct cpio_name))) {
+            error = DRPM_ERR_MEMORY;
+            goto cleanup;
+        }
+        names[names_len].name = name;
+        names[names_len].entry.offset = offset;
+        names[names_len].entry.header_len = header_len;
+        names[names_len].entry.size = filesize;
+        names_len++;
+        name = NULL;
+
+        skip = header_len - CPIO_HEADER_LEN(&cpio_hdr) - cpio_hdr.namesize +
+               filesize + CPIO_PADDING(filesize);
+        if (skip > SIZE_MAX) {
+            error = DRPM_ERR_OVERFLOW;
+            goto cleanup;
+        }
+        if ((error = rpm_archive_read_chunk(old_rpm, NULL, skip)) != DRPM_ERR_OK)
+            goto cleanup;
+        offset += CPIO_HEADER_LEN(&cpio_hdr) + cpio_hdr.namesize + skip;
+    }
+
+    if (names_len > 0)
+        qsort(names, names_len, sizeof(struct cpio_name), cpio_name_cmp);
+
+    for (size_t lo, hi, mid, i = 0; i < blks->cpio_files_len; i++) {
+        if ((index = blks->cpio_files[i].index) < 0)
+            continue;
+        file_name = blks->files[index].name;
+        if (file_name[0] == '/')
+            file_name++;
+        /* first entry of that name (files not in the archive keep header_len 0) */
+        for (lo = 0, hi = names_len; lo < hi; ) {
+            mid = lo + (hi - lo) / 2;
+            if (strcmp(names[mid].name, file_name) < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo < names_len && strcmp(names[lo].name, file_name) == 0)
+            blks->rpm_files.from_rpm.old_cpio[i] = names[lo].entry;
+    }
+
+    error = rpm_archive_rewind(old_rpm);
+
+cleanup:
+    for (size_t i = 0; i < names_len; i++)
+        free(names[i].name);
+    free(names);
+    free(name);
+
+    return error;
+}
+
 /* frees block data */
 int blocks_destroy(struct blocks **blks_ref)
 {
     struct blocks *blks;
-    struct block *blk_lists[3];
 
     if (blks_ref == NULL || *blks_ref == NULL)
         return DRPM_ERR_PROG;
 
     blks = *blks_ref;
 
+    prefetch_stop(blks);
+
     if (blks->from_rpm) {
         free(blks->rpm_files.from_rpm.old_header);
+        free(blks->rpm_files.from_rpm.old_cpio);
     } else {
         for (struct open_file *tmp, *file = blks->rpm_files.from_filesytem.files_head; file != NULL; ) {
             close(file->filedesc);
@@ -251,28 +617,35 @@ int blocks_destroy(struct blocks **blks_ref)
             free(tmp);
         }
         free(blks->rpm_files.from_filesytem.open_files);
+        free(blks->rpm_files.from_filesytem.checked);
+        for (unsigned short i = 0; i < MAX_OPEN_DIRS && blks->rpm_files.from_filesytem.dirs[i].path != NULL; i++) {
+            close(blks->rpm_files.from_filesytem.dirs[i].filedesc);
+            free(blks->rpm_files.from_filesytem.dirs[i].path);
+        }
     }
 
-    blk_lists[0] = blks->core_blocks;
-    blk_lists[1] = blks->free_core_blocks;
-    blk_lists[2] = blks->page_blocks;
-
-    for (unsigned short i = 0; i < 3; i++) {
-        for (struct block *blk = blk_lists[i], *tmp; blk != NULL; ) {
-            if (blk->type != BLK_PAGE)
-                free(blk->data.buffer);
-            tmp = blk;
-            blk = blk->next;
-            free(tmp);
-        }
+    for (struct block *blk = blks->page_blocks, *tmp; blk != NULL; ) {
+        tmp = blk;
+        blk = blk->next;
+        free(tmp);
     }
 
+    free(blks->core_slab);
+    if (blks->core_buffers_mapped)
+        munmap(blks->core_buffers, blks->core_blocks_max * BLOCK_SIZE);
+    else
+        free(blks->core_buffers);
+
+    if (blks->page_map != NULL)
+        munmap(blks->page_map, blks->page_area_blocks * BLOCK_SIZE);
     if (!(blks->page_filedesc < 0))
         close(blks->page_filedesc);
 
     free(blks->blocks_table);
     free(blks->blocks_max);
     free(blks->cpio_buffer);
+    free(blks->filled);
+    free(blks->fill_order);
 
     free(*blks_ref);
 
@@ -306,10 +679,16 @@ int blocks_next(struct blocks *blks, unsigned char buffer[BLOCK_SIZE], size_t *b
     return DRPM_ERR_OK;
 }
 
+/* Returns the number of blocks filled so far that the prefetch
+ * schedule had foreseen (whether or not they had been read yet). */
+size_t blocks_prefetched(const struct blocks *blks)
+{
+    return (blks == NULL || blks->prefetch == NULL) ? 0 : blks->prefetch->hits;
+}
+
 /* gets new block and fills it */
 int get_block(struct blocks *blks, struct block **blk_ret, size_t id, size_t copy_cnt)
 {
-    static size_t cleanup_count = 0;
     int error;
     struct block *blk;
     struct block *page_blk;
@@ -326,7 +705,7 @@ int get_block(struct blocks *blks, struct block **blk_ret, size_t id, size_t cop
     }
 
     if ((blk = get_free_core_block(blks)) == NULL) {
-        if (blks->core_blocks_count < MAX_CORE_BLOCKS && (++cleanup_count % 8) != 0) {
+        if (blks->core_blocks_count < blks->core_blocks_max && (++blks->cleanup_count % 8) != 0) {
             if ((error = new_core_block(blks, &blk)) != DRPM_ERR_OK)
                 return error;
         } else {
@@ -343,7 +722,7 @@ int get_block(struct blocks *blks, struct block **blk_ret, size_t id, size_t cop
                 }
             }
             if ((blk = get_free_core_block(blks)) == NULL) {
-                if (blks->core_blocks_count < MAX_CORE_BLOCKS) {
+                if (blks->core_blocks_count < blks->core_blocks_max) {
                     if ((error = new_core_block(blks, &blk)) != DRPM_ERR_OK)
                         return error;
                 } else {
@@ -380,20 +759,37 @@ int get_block(struct blocks *blks, struct block **blk_ret, size_t id, size_t cop
     return DRPM_ERR_OK;
 }
 
-/* allocates a new block */
+/* takes a new block from the core slab, allocating the slab on first use */
 int new_core_block(struct blocks *blks, struct block **new_ret)
 {
+    size_t buffers_size;
+    void *buffers;
     struct block *new;
 
-    if (blks == NULL || new_ret == NULL)
+    if (blks == NULL || new_ret == NULL || blks->core_blocks_count >= blks->core_blocks_max)
         return DRPM_ERR_PROG;
 
-    if ((new = malloc(sizeof(struct block))) == NULL ||
-        (new->data.buffer = malloc(BLOCK_SIZE)) == NULL) {
-        free(new);
-        return DRPM_ERR_MEMORY;
+    if (blks->core_slab == NULL) {
+        buffers_size = blks->core_blocks_max * BLOCK_SIZE;
+        if ((blks->core_slab = calloc(blks->core_blocks_max, sizeof(struct block))) == NULL)
+            return DRPM_ERR_MEMORY;
+        buffers = mmap(NULL, buffers_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (buffers != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+            madvise(buffers, buffers_size, MADV_HUGEPAGE);
+#endif
+            blks->core_buffers = buffers;
+            blks->core_buffers_mapped = true;
+        } else if ((blks->core_buffers = malloc(buffers_size)) == NULL) {
+            free(blks->core_slab);
+            blks->core_slab = NULL;
+            return DRPM_ERR_MEMORY;
+        }
     }
 
+    new = &blks->core_slab[blks->core_blocks_count];
+    new->data.buffer = blks->core_buffers + blks->core_blocks_count * BLOCK_SIZE;
     new->type = BLK_FREE;
     new->next = blks->core_blocks;
     blks->core_blocks = new;
@@ -430,7 +826,7 @@ int push_block(struct blocks *blks, const struct block *blk, size_t copy_cnt)
         return DRPM_ERR_PROG;
 
     if ((new = get_free_core_block(blks)) == NULL) {
-        if (blks->core_blocks_count < MAX_CORE_BLOCKS) {
+        if (blks->core_blocks_count < blks->core_blocks_max) {
             if ((error = new_core_block(blks, &new)) != DRPM_ERR_OK)
                 return error;
         } else if (blk->type == BLK_CORE) {
@@ -450,11 +846,58 @@ int push_block(struct blocks *blks, const struct block *blk, size_t copy_cnt)
     return DRPM_ERR_OK;
 }
 
-/* insert a page block in table and writes its data to temporary file */
+/* makes room for at least <count> page blocks in the page area */
+int page_area_reserve(struct blocks *blks, size_t count)
+{
+    char template[] = "/tmp/drpmpageXXXXXX";
+    size_t new_count;
+    void *map;
+
+    if (count <= blks->page_area_blocks)
+        return DRPM_ERR_OK;
+
+    if (blks->page_filedesc < 0) {
+#ifdef MFD_CLOEXEC
+        blks->page_filedesc = memfd_create("drpmpage", MFD_CLOEXEC);
+#endif
+        if (blks->page_filedesc < 0) {
+            if ((blks->page_filedesc = mkstemp(template)) < 0)
+                return DRPM_ERR_IO;
+            unlink(template);
+        }
+    }
+
+    new_count = MAX(count, MIN_PAGE_AREA_BLOCKS);
+    if (blks->page_area_blocks <= SIZE_MAX / 2)
+        new_count = MAX(new_count, 2 * blks->page_area_blocks);
+
+    /* the file stays sparse until blocks are actually written */
+    if (ftruncate(blks->page_filedesc, (off_t)new_count * BLOCK_SIZE) != 0)
+        return DRPM_ERR_IO;
+
+    /* the mapping is shared, so its contents survive remapping */
+    if (blks->page_map != NULL) {
+        munmap(blks->page_map, blks->page_area_blocks * BLOCK_SIZE);
+        blks->page_map = NULL;
+    }
+    if (new_count <= SIZE_MAX / BLOCK_SIZE) {
+        map = mmap(NULL, new_count * BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, blks->page_filedesc, 0);
+        if (map != MAP_FAILED)
+            blks->page_map = map;
+    }
+
+    blks->page_area_blocks = new_count;
+
+    return DRPM_ERR_OK;
+}
+
+/* insert a page block in table and writes its data to the page area */
 int write_page_block(struct blocks *blks, const struct block *blk, size_t copy_cnt)
 {
+    int error;
     struct block *new;
-    char template[] = "/tmp/drpmpageXXXXXX";
+    unsigned char *page;
 
     if (blks == NULL || blk == NULL || blk->type == BLK_PAGE)
         return DRPM_ERR_PROG;
@@ -471,6 +914,8 @@ int write_page_block(struct blocks *blks, const struct block *blk, size_t copy_c
             break;
 
     if (new == NULL) {
+        if ((error = page_area_reserve(blks, blks->page_blocks_count + 1)) != DRPM_ERR_OK)
+            return error;
         if ((new = malloc(sizeof(struct block))) == NULL)
             return DRPM_ERR_MEMORY;
         new->type = BLK_PAGE;
@@ -478,19 +923,20 @@ int write_page_block(struct blocks *blks, const struct block *blk, size_t copy_c
         new->next = blks->page_blocks;
         blks->page_blocks = new;
         blks->page_blocks_count++;
-        if (blks->page_filedesc < 0) {
-            if ((blks->page_filedesc = mkstemp(template)) < 0) {
-                free(new);
-                return DRPM_ERR_IO;
-            }
-            unlink(template);
-        }
     }
 
     new->id = blk->id;
 
-    if (pwrite(blks->page_filedesc, blk->data.buffer, BLOCK_SIZE, new->data.offset * BLOCK_SIZE) != BLOCK_SIZE) {
-        free(new);
+    if (blks->page_map != NULL) {
+        page = blks->page_map + new->data.offset * BLOCK_SIZE;
+        memcpy(page, blk->data.buffer, BLOCK_SIZE);
+#ifdef MADV_COLD
+        /* evicted blocks are the least likely to be needed again,
+         * so have the kernel reclaim them before other pages */
+        madvise(page, BLOCK_SIZE, MADV_COLD);
+#endif
+    } else if (pwrite(blks->page_filedesc, blk->data.buffer, BLOCK_SIZE,
+                      new->data.offset * BLOCK_SIZE) != BLOCK_SIZE) {
         return DRPM_ERR_IO;
     }
 
@@ -499,15 +945,23 @@ int write_page_block(struct blocks *blks, const struct block *blk, size_t copy_c
     return DRPM_ERR_OK;
 }
 
-/* reads page block data from temporary file into destination block */
+/* reads page block data from the page area into destination block */
 int read_page_block(struct blocks *blks, struct block *dst, const struct block *src)
 {
+    unsigned char *page;
+
     if (blks == NULL || dst == NULL || src == NULL ||
         blks->page_filedesc < 0 || dst->type == BLK_PAGE || src->type != BLK_PAGE)
         return DRPM_ERR_PROG;
 
-    if (pread(blks->page_filedesc, dst->data.buffer, BLOCK_SIZE, src->data.offset * BLOCK_SIZE) != BLOCK_SIZE)
+    if (blks->page_map != NULL) {
+        page = blks->page_map + src->data.offset * BLOCK_SIZE;
+        madvise(page, BLOCK_SIZE, MADV_WILLNEED);
+        memcpy(dst->data.buffer, page, BLOCK_SIZE);
+    } else if (pread(blks->page_filedesc, dst->data.buffer, BLOCK_SIZE,
+                     src->data.offset * BLOCK_SIZE) != BLOCK_SIZE) {
         return DRPM_ERR_IO;
+    }
 
     dst->id = src->id;
     dst->type = BLK_CORE;
@@ -518,6 +972,15 @@ int read_page_block(struct blocks *blks, struct block *dst, const struct block *
 
 /* fills CPIO header and linkto buffers based on file info at <index> */
 void fill_cpio_header(struct blocks *blks, ssize_t index)
+{
+    cpio_header_synth(blks->files, index, blks->cpio_buffer);
+
+    if (index >= 0 && S_ISLNK(blks->files[index].mode))
+        blks->linkto = blks->files[index].linkto;
+}
+
+/* writes the CPIO header (with name and padding) for file info at <index> */
+void cpio_header_synth(const struct file_info *files, ssize_t index, unsigned char *buffer)
 {
     struct cpio_header header = {0};
     struct file_info file;
@@ -526,24 +989,29 @@ void fill_cpio_header(struct blocks *blks, ssize_t index)
     if (index < 0) {
         header.nlink = 1;
         header.namesize = strlen(CPIO_TRAILER) + 1;
-        cpio_header_write(&header, (char *)blks->cpio_buffer);
-        strcpy((char *)blks->cpio_buffer + CPIO_HEADER_SIZE, CPIO_TRAILER);
-        memcpy(blks->cpio_buffer + CPIO_HEADER_SIZE + header.namesize,
+        cpio_header_write(&header, (char *)buffer);
+        strcpy((char *)buffer + CPIO_HEADER_SIZE, CPIO_TRAILER);
+        memcpy(buffer + CPIO_HEADER_SIZE + header.namesize,
                "\0\0\0", CPIO_PADDING(CPIO_HEADER_SIZE + header.namesize));
         return;
     }
 
-    file = blks->files[index];
+    file = files[index];
     name = file.name;
 
     if (name[0] == '/')
         name++;
 
-    if (S_ISREG(file.mode)) {
-        header.filesize = file.size;
-    } else if (S_ISLNK(file.mode)) {
-        header.filesize = strlen(file.linkto);
-        blks->linkto = file.linkto;
+    header.filesize = cpio_filesize(&file);
+
+    /* too large for a new ASCII header */
+    if (header.filesize > CPIO_FILESIZE_MAX) {
+        header.stripped = true;
+        header.file_index = index;
+        cpio_header_write(&header, (char *)buffer);
+        memcpy(buffer + CPIO_STRIPPED_HEADER_SIZE,
+               "\0\0\0", CPIO_PADDING(CPIO_STRIPPED_HEADER_SIZE));
+        return;
     }
 
     if (S_ISBLK(file.mode) || S_ISCHR(file.mode)) {
@@ -555,13 +1023,101 @@ void fill_cpio_header(struct blocks *blks, ssize_t index)
     header.mode = file.mode;
     header.namesize = strlen(name) + 3; // "./" prefix
 
-    cpio_header_write(&header, (char *)blks->cpio_buffer);
-    strcpy((char *)blks->cpio_buffer + CPIO_HEADER_SIZE, "./");
-    strcpy((char *)blks->cpio_buffer + CPIO_HEADER_SIZE + 2, name);
-    memcpy(blks->cpio_buffer + CPIO_HEADER_SIZE + header.namesize,
+    cpio_header_write(&header, (char *)buffer);
+    strcpy((char *)buffer + CPIO_HEADER_SIZE, "./");
+    strcpy((char *)buffer + CPIO_HEADER_SIZE + 2, name);
+    memcpy(buffer + CPIO_HEADER_SIZE + header.namesize,
            "\0\0\0", CPIO_PADDING(CPIO_HEADER_SIZE + header.namesize));
 }
 
+/* determines how many installed files may be kept open at once */
+unsigned open_files_max(unsigned requested)
+{
+    struct rlimit limit;
+
+    if (requested > 0)
+        return requested;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+        return MAX_OPEN_FILES;
+
+    if (limit.rlim_cur == RLIM_INFINITY)
+        return MAX_OPEN_FILES_AUTO;
+
+    /* leaving the other half of the descriptors to the rest of the process */
+    if (limit.rlim_cur / 2 <= MAX_OPEN_DIRS)
+        return 1;
+
+    return MIN(limit.rlim_cur / 2 - MAX_OPEN_DIRS, MAX_OPEN_FILES_AUTO);
+}
+
+/* Opens an installed file for reading, relative to a cached descriptor
+ * of its directory so that the path is not resolved again on reopening,
+ * and without updating its access time where permitted. */
+int open_installed(struct blocks *blks, const char *name)
+{
+    struct open_dir *dirs = blks->rpm_files.from_filesytem.dirs;
+    struct open_dir dir;
+    const char *base;
+    size_t dir_len;
+    unsigned short i;
+    int dirfd = AT_FDCWD;
+
+    if ((base = strrchr(name, '/')) == NULL) {
+        base = name;
+    } else {
+        dir_len = ++base - name;
+        for (i = 0; i < MAX_OPEN_DIRS && dirs[i].path != NULL; i++)
+            if (dirs[i].path_len == dir_len && memcmp(dirs[i].path, name, dir_len) == 0)
+                break;
+
+        if (i == MAX_OPEN_DIRS || dirs[i].path == NULL) {
+            dir.path_len = dir_len;
+            if ((dir.path = malloc(dir_len + 1)) == NULL)
+                return open(name, O_RDONLY);
+            memcpy(dir.path, name, dir_len);
+            dir.path[dir_len] = '\0';
+            if ((dir.filedesc = open(dir.path, O_RDONLY | O_DIRECTORY)) < 0) {
+                free(dir.path);
+                return open(name, O_RDONLY);
+            }
+            if (i == MAX_OPEN_DIRS) {
+                i--;
+                close(dirs[i].filedesc);
+                free(dirs[i].path);
+            }
+        } else {
+            dir = dirs[i];
+        }
+
+        memmove(dirs + 1, dirs, i * sizeof(struct open_dir));
+        dirs[0] = dir;
+        dirfd = dir.filedesc;
+    }
+
+    return openat_noatime(dirfd, base, &blks->rpm_files.from_filesytem.noatime_denied);
+}
+
+/* Opens <name> (relative to <dirfd>) for reading without updating its
+ * access time, unless that has already been denied (<noatime_denied>). */
+int openat_noatime(int dirfd, const char *name, bool *noatime_denied)
+{
+#ifdef O_NOATIME
+    int filedesc;
+
+    /* only permitted for the owner of the file (or a privileged process) */
+    if (!*noatime_denied) {
+        if ((filedesc = openat(dirfd, name, O_RDONLY | O_NOATIME)) >= 0 || errno != EPERM)
+            return filedesc;
+        *noatime_denied = true;
+    }
+#else
+    (void)noatime_denied;
+#endif
+
+    return openat(dirfd, name, O_RDONLY);
+}
+
 /* opens new file and appends it to list, sets <prelinked> indicator */
 int open_new_file(struct blocks *blks, bool *prelinked, size_t index)
 {
@@ -583,10 +1139,11 @@ int open_new_file(struct blocks *blks, bool *prelinked, size_t index)
 
     *prelinked = false;
 
-    if ((filedesc = open(file.name, O_RDONLY)) < 0)
+    if ((filedesc = open_installed(blks, file.name)) < 0)
         return DRPM_ERR_IO;
 
-    if (fstat(filedesc, &stats) == 0 && stats.st_size != file.size) {
+    if (!blks->rpm_files.from_filesytem.checked[index] &&
+        fstat(filedesc, &stats) == 0 && stats.st_size != (off_t)file.size) {
         if ((error = is_prelinked(prelinked, filedesc, plnk_buf, pread(filedesc, plnk_buf, 128, SEEK_SET))) != DRPM_ERR_OK) {
             close(filedesc);
             return error;
@@ -596,8 +1153,9 @@ int open_new_file(struct blocks *blks, bool *prelinked, size_t index)
             return DRPM_ERR_OK;
         }
     }
+    blks->rpm_files.from_filesytem.checked[index] = true;
 
-    if (blks->rpm_files.from_filesytem.file_count < MAX_OPEN_FILES) {
+    if (blks->rpm_files.from_filesytem.file_count < blks->rpm_files.from_filesytem.file_count_max) {
         if ((new = malloc(sizeof(struct open_file))) == NULL) {
             close(filedesc);
             return DRPM_ERR_MEMORY;
@@ -611,11 +1169,13 @@ int open_new_file(struct blocks *blks, bool *prelinked, size_t index)
         else
             files_head->prev = NULL;
         close(new->filedesc);
+        blks->rpm_files.from_filesytem.open_files[new->index] = NULL;
     }
 
     new->filedesc = filedesc;
     new->name = file.name;
     new->offset = 0;
+    new->index = index;
     new->prev = NULL;
     new->next = NULL;
 
@@ -670,244 +1230,194 @@ struct open_file *get_open_file(struct blocks *blks, size_t index)
 /***************************** fill block *****************************/
 
 /* Fills a block from old RPM in the case of a standard delta.
- * Uses stored file order to quickly locate files.
+ * Uses the old CPIO index to locate files directly, so any block can be
+ * filled at any time without generating the blocks before it.
  * CPIO entries are altered in the same way as when creating the delta. */
 int fillblock_rpm_standard(struct blocks *blks, struct block *blk, size_t id, size_t copy_cnt)
 {
     int error = DRPM_ERR_OK;
     const struct cpio_file *cpio;
-    size_t len = BLOCK_SIZE;
-    size_t off;
-    size_t read_len;
+    const struct old_cpio_entry *entry;
+    const struct file_info *file;
     unsigned char *buf_ptr;
-    ssize_t i;
-    struct cpio_header cpio_hdr;
-    char cpio_buf[CPIO_HEADER_SIZE] = {0};
-    size_t c_namesize;
-    size_t c_filesize;
-    char *name;
-    char *name_buffer = NULL;
-    char *name_buffer_tmp;
-    size_t name_buffer_len = 0;
-    struct rpm *old_rpm;
-    uint64_t left;
-    size_t rpm_id;
+    size_t len;
+    uint64_t off;
+    size_t file_off;
+    size_t read_len;
+    size_t lo;
+    size_t hi;
+    size_t mid;
 
-    if (blks == NULL || blk == NULL)
-        return DRPM_ERR_PROG;
+    (void)copy_cnt;
 
-    old_rpm = blks->rpm_files.from_rpm.old_rpm;
-    left = blks->rpm_files.from_rpm.left;
-    rpm_id = blks->rpm_files.from_rpm.rpm_id;
+    if (blks == NULL || blk == NULL || blks->cpio_files_len == 0)
+        return DRPM_ERR_PROG;
 
     buf_ptr = blk->data.buffer;
+    len = BLOCK_SIZE;
+    off = (uint64_t)id * BLOCK_SIZE;
 
-    while (true) {
-        if (left > 0) {
-            cpio = blks->cpio_files + blks->cpio_files_index;
-            if (left > cpio->content_len) {
-                off = cpio->header_len + cpio->content_len - left;
-                read_len = left - cpio->content_len;
-                if (read_len > len)
-                    read_len = len;
-                memcpy(buf_ptr, blks->cpio_buffer + off, read_len);
-                buf_ptr += read_len;
-                left -= read_len;
-                len -= read_len;
-            }
-            if (len > 0 && left > 0) {
-                read_len = MIN(len, left);
-                if (S_ISLNK(blks->files[cpio->index].mode)) {
-                    strncpy((char *)buf_ptr, blks->linkto, read_len);
-                    blks->linkto += MIN(strlen(blks->linkto), read_len);
-                } else if ((error = rpm_archive_read_chunk(old_rpm, buf_ptr, read_len)) != DRPM_ERR_OK) {
-                    break;
-                }
-                buf_ptr += read_len;
-                left -= read_len;
-                len -= read_len;
-            }
-        }
-
-        if (len > 0 && blks->cpio_files_index >= 0 &&
-            blks->cpio_files[blks->cpio_files_index].index < 0) {
-            memset(buf_ptr, 0, len);
-            len = 0;
-        }
-
-        if (len == 0) {
-            blk->type = BLK_CORE;
-            blk->id = rpm_id++;
-
-            if (blk->id == id) {
-                error = DRPM_ERR_OK;
-                break;
-            }
-
-            if (blk->id > id) {
-                error = DRPM_ERR_PROG;
-                break;
-            }
+    /* finding the last CPIO entry starting at or before the block */
+    for (lo = 0, hi = blks->cpio_files_len; hi - lo > 1; ) {
+        mid = lo + (hi - lo) / 2;
+        if (blks->cpio_files[mid].offset <= off)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    cpio = blks->cpio_files + lo;
 
-            if (blks->blocks_max[blk->id] > copy_cnt &&
-                (error = push_block(blks, blk, copy_cnt)) != DRPM_ERR_OK)
-                break;
+    if ((ssize_t)lo != blks->cpio_files_index) {
+        fill_cpio_header(blks, cpio->index);
+        blks->cpio_files_index = lo;
+    }
 
-            len = BLOCK_SIZE;
-            buf_ptr = blk->data.buffer;
+    while (len > 0) {
+        if (off < cpio->offset + cpio->header_len) {
+            file_off = off - cpio->offset;
+            read_len = MIN(len, cpio->header_len - file_off);
+            memcpy(buf_ptr, blks->cpio_buffer + file_off, read_len);
+            buf_ptr += read_len;
+            off += read_len;
+            len -= read_len;
             continue;
         }
 
-        blks->cpio_files_index++;
-        cpio = blks->cpio_files + blks->cpio_files_index;
-        i = cpio->index;
-
-        if (i < 0) {
-            fill_cpio_header(blks, i);
-            left = cpio->header_len + cpio->content_len;
-            continue;
+        /* nothing but zeroes after the trailer */
+        if (cpio->index < 0) {
+            memset(buf_ptr, 0, len);
+            break;
         }
 
-        while (true) {
-            if ((error = rpm_archive_read_chunk(old_rpm, cpio_buf, CPIO_HEADER_SIZE)) != DRPM_ERR_OK ||
-                (error = cpio_header_read(&cpio_hdr, cpio_buf)) != DRPM_ERR_OK)
-                break;
-
-            c_namesize = cpio_hdr.namesize;
-            c_filesize = cpio_hdr.filesize;
-            c_filesize += CPIO_PADDING(c_filesize);
-
-            if (c_namesize > name_buffer_len) {
-                if ((name_buffer_tmp = realloc(name_buffer, c_namesize)) == NULL) {
-                    error = DRPM_ERR_MEMORY;
+        if (off < cpio->offset + cpio->header_len + cpio->content_len) {
+            file_off = off - (cpio->offset + cpio->header_len);
+            read_len = MIN(len, cpio->content_len - file_off);
+            file = blks->files + cpio->index;
+            if (S_ISLNK(file->mode)) {
+                if (file_off > strlen(file->linkto))
+                    memset(buf_ptr, 0, read_len);
+                else
+                    strncpy((char *)buf_ptr, file->linkto + file_off, read_len);
+            } else if (S_ISREG(file->mode)) {
+                entry = blks->rpm_files.from_rpm.old_cpio + blks->cpio_files_index;
+                if (entry->header_len == 0) {
+                    error = DRPM_ERR_FORMAT;
                     break;
                 }
-                name_buffer = name_buffer_tmp;
-                name_buffer_len = c_namesize;
+                if (entry->size + CPIO_PADDING(entry->size) != cpio->content_len) {
+                    error = DRPM_ERR_MISMATCH;
+                    break;
+                }
+                if ((error = rpm_archive_seek(blks->rpm_files.from_rpm.old_rpm,
+                                              entry->offset + entry->header_len + file_off)) != DRPM_ERR_OK ||
+                    (error = rpm_archive_read_chunk(blks->rpm_files.from_rpm.old_rpm,
+                                                    buf_ptr, read_len)) != DRPM_ERR_OK)
+                    break;
+            } else {
+                memset(buf_ptr, 0, read_len);
             }
+            buf_ptr += read_len;
+            off += read_len;
+            len -= read_len;
+            continue;
+        }
 
-            if ((error = rpm_archive_read_chunk(old_rpm, name_buffer, c_namesize)) != DRPM_ERR_OK)
-                break;
+        if ((size_t)blks->cpio_files_index + 1 >= blks->cpio_files_len) {
+            error = DRPM_ERR_PROG;
+            break;
+        }
+        blks->cpio_files_index++;
+        cpio++;
+        fill_cpio_header(blks, cpio->index);
+    }
 
-            name = name_buffer;
-            name[c_namesize - 1] = '\0';
+    blk->id = id;
+    blk->type = BLK_CORE_NOPAGE;
 
-            if (strcmp(name, CPIO_TRAILER) == 0) {
-                error = DRPM_ERR_FORMAT;
-                break;
-            }
+    return error;
+}
 
-            if (strncmp(name, "./", 2) == 0)
-                name += 2;
+/* Stands in for filling a block when estimating, counting the fill. */
+int fillblock_estimate(struct blocks *blks, struct block *blk, size_t id, size_t copy_cnt)
+{
+    (void)copy_cnt;
 
-            if ((error = rpm_archive_read_chunk(old_rpm, NULL, CPIO_PADDING(CPIO_HEADER_SIZE + c_namesize))) != DRPM_ERR_OK)
-                break;
+    if (blks == NULL || blk == NULL)
+        return DRPM_ERR_PROG;
 
-            if (strcmp(name, blks->files[i].name +
-                             ((blks->files[i].name[0] == '/') ? 1 : 0)) == 0) {
-                error = DRPM_ERR_OK;
-                break;
-            }
+    if (blks->filled[id])
+        blks->refills++;
+    blks->filled[id] = true;
+    blks->fills++;
 
-            if ((error = rpm_archive_read_chunk(old_rpm, NULL, c_filesize)) != DRPM_ERR_OK)
-                break;
-        }
-        if (error != DRPM_ERR_OK)
-            break;
+    blk->id = id;
+    blk->type = BLK_CORE_NOPAGE;
 
-        fill_cpio_header(blks, cpio->index);
+    return DRPM_ERR_OK;
+}
 
-        if (!S_ISREG(blks->files[cpio->index].mode)) {
-            if ((error = rpm_archive_read_chunk(old_rpm, NULL, c_filesize)) != DRPM_ERR_OK)
-                break;
-        } else if (c_filesize != cpio->content_len) {
-            error = DRPM_ERR_MISMATCH;
-            break;
-        }
+/* Stands in for filling a block when scheduling prefetches,
+ * recording which block is filled. */
+int fillblock_schedule(struct blocks *blks, struct block *blk, size_t id, size_t copy_cnt)
+{
+    (void)copy_cnt;
 
-        left = cpio->header_len + cpio->content_len;
-    }
+    if (blks == NULL || blk == NULL)
+        return DRPM_ERR_PROG;
 
-    blks->rpm_files.from_rpm.left = left;
-    blks->rpm_files.from_rpm.rpm_id = rpm_id;
+    if (!resize32((void **)&blks->fill_order, blks->fills, sizeof(size_t)))
+        return DRPM_ERR_MEMORY;
+    blks->fill_order[blks->fills++] = id;
 
-    free(name_buffer);
+    blk->id = id;
+    blk->type = BLK_CORE_NOPAGE;
 
-    return error;
+    return DRPM_ERR_OK;
 }
 
 /* Fills a block from old RPM in the case of an rpm-only delta.
- * CPIO data is not altered, but old header is prepended. */
+ * CPIO data is not altered, but old header is prepended.
+ * Any block can be filled directly, as the old archive is in memory. */
 int fillblock_rpm_rpmonly(struct blocks *blks, struct block *blk, size_t id, size_t copy_cnt)
 {
     int error;
-    size_t read_len;
-    size_t header_read_len;
-    unsigned char *header;
+    const uint64_t off = (uint64_t)id * BLOCK_SIZE;
     size_t header_size;
-    size_t header_offset;
-    uint64_t left;
-    struct rpm *old_rpm;
-    size_t rpm_id;
+    size_t read_len;
+    size_t header_read_len = 0;
+
+    (void)copy_cnt;
 
     if (blks == NULL || blk == NULL)
         return DRPM_ERR_PROG;
 
-    header = blks->rpm_files.from_rpm.old_header;
     header_size = blks->rpm_files.from_rpm.old_header_size;
-    header_offset = blks->rpm_files.from_rpm.old_header_offset;
-    left = blks->rpm_files.from_rpm.left;
-    old_rpm = blks->rpm_files.from_rpm.old_rpm;
-    rpm_id = blks->rpm_files.from_rpm.rpm_id;
-
-    while (true) {
-        read_len = MIN(left, BLOCK_SIZE);
-
-        if (header_offset < header_size) {
-            if (header_offset + read_len > header_size) {
-                header_read_len = header_size - header_offset;
-                if ((error = rpm_archive_read_chunk(old_rpm,
-                                                    blk->data.buffer + header_read_len,
-                                                    read_len - header_read_len)) != DRPM_ERR_OK)
-                    break;
-            } else {
-                header_read_len = read_len;
-            }
-            memcpy(blk->data.buffer, header + header_offset, header_read_len);
-            header_offset += header_read_len;
-        } else {
-            if ((error = rpm_archive_read_chunk(old_rpm, blk->data.buffer, read_len)) != DRPM_ERR_OK)
-                break;
-        }
-
-        left -= read_len;
 
-        if (read_len < BLOCK_SIZE)
-            memset(blk->data.buffer + read_len, 0, BLOCK_SIZE - read_len);
+    if (off >= blks->rpm_files.from_rpm.ext_data_len)
+        return DRPM_ERR_PROG;
 
-        blk->type = BLK_CORE;
-        blk->id = rpm_id++;
+    read_len = MIN(blks->rpm_files.from_rpm.ext_data_len - off, BLOCK_SIZE);
 
-        if (blk->id == id) {
-            error = DRPM_ERR_OK;
-            break;
-        }
+    if (off < header_size) {
+        header_read_len = MIN(read_len, header_size - off);
+        memcpy(blk->data.buffer, blks->rpm_files.from_rpm.old_header + off, header_read_len);
+    }
 
-        if (blk->id > id) {
-            error = DRPM_ERR_PROG;
-            break;
-        }
+    if (read_len > header_read_len &&
+        ((error = rpm_archive_seek(blks->rpm_files.from_rpm.old_rpm,
+                                   off + header_read_len - header_size)) != DRPM_ERR_OK ||
+         (error = rpm_archive_read_chunk(blks->rpm_files.from_rpm.old_rpm,
+                                         blk->data.buffer + header_read_len,
+                                         read_len - header_read_len)) != DRPM_ERR_OK))
+        return error;
 
-        if (blks->blocks_max[blk->id] > copy_cnt &&
-            (error = push_block(blks, blk, copy_cnt)) != DRPM_ERR_OK)
-            break;
-    }
+    if (read_len < BLOCK_SIZE)
+        memset(blk->data.buffer + read_len, 0, BLOCK_SIZE - read_len);
 
-    blks->rpm_files.from_rpm.old_header_offset = header_offset;
-    blks->rpm_files.from_rpm.left = left;
-    blks->rpm_files.from_rpm.rpm_id = rpm_id;
+    blk->id = id;
+    blk->type = BLK_CORE_NOPAGE;
 
-    return error;
+    return DRPM_ERR_OK;
 }
 
 /* Fills block from filesystem data (only works for standard deltas).
@@ -929,9 +1439,15 @@ int fillblock_filesystem(struct blocks *blks, struct block *blk, size_t id, size
     if (blks == NULL || blk == NULL)
         return DRPM_ERR_PROG;
 
+    if (blks->prefetch != NULL && prefetch_take(blks->prefetch, blk->data.buffer, id)) {
+        blk->id = id;
+        blk->type = BLK_CORE_NOPAGE;
+        return DRPM_ERR_OK;
+    }
+
     buf_ptr = blk->data.buffer;
     len = BLOCK_SIZE;
-    off = id * BLOCK_SIZE;
+    off = (uint64_t)id * BLOCK_SIZE;
     i = blks->cpio_files_index >= 0 ? blks->cpio_files_index : 0;
 
     for (cpio = blks->cpio_files + i; i > 0 && cpio->offset > off; i--, cpio--);
@@ -976,15 +1492,15 @@ int fillblock_filesystem(struct blocks *blks, struct block *blk, size_t id, size
                     strncpy((char *)buf_ptr, blks->linkto + file_off, read_len);
             } else if (file_off < blks->files[cpio->index].size) {
                 read_len = MIN(len, blks->files[cpio->index].size - file_off);
-                file = get_open_file(blks, cpio->index);
+                file = get_open_file(blks, cpio - blks->cpio_files);
                 if (file == NULL) {
-                    if ((error = open_new_file(blks, &prelinked, cpio->index)) != DRPM_ERR_OK)
+                    if ((error = open_new_file(blks, &prelinked, cpio - blks->cpio_files)) != DRPM_ERR_OK)
                         break;
                     if (prelinked) {
                         blks->cpio_files_index = -1;
                         return fillblock_prelink(blks, blk, id, copy_cnt, cpio);
                     }
-                    file = get_open_file(blks, cpio->index);
+                    file = get_open_file(blks, cpio - blks->cpio_files);
                 }
                 if (file->offset != (off_t)file_off && lseek(file->filedesc, file_off, SEEK_SET) != (off_t)file_off) {
                     error = DRPM_ERR_IO;
@@ -1021,7 +1537,7 @@ int fillblock_prelink(struct blocks *blks, struct block *blk, size_t id, size_t
 {
     int error = DRPM_ERR_OK;
     struct stat stats;
-    uint64_t off = id * BLOCK_SIZE;
+    uint64_t off = (uint64_t)id * BLOCK_SIZE;
     int filedesc = -1;
     bool prelinked;
     unsigned char plnk_buf[128];
@@ -1045,12 +1561,12 @@ int fillblock_prelink(struct blocks *blks, struct block *blk, size_t id, size_t
             S_ISLNK(blks->files[cpio->index].mode))
             break;
 
-        if ((filedesc = open(blks->files[cpio->index].name, O_RDONLY)) < 0) {
+        if ((filedesc = open_installed(blks, blks->files[cpio->index].name)) < 0) {
             error = DRPM_ERR_IO;
             goto cleanup;
         }
 
-        if (fstat(filedesc, &stats) != 0 || stats.st_size == blks->files[cpio->index].size)
+        if (fstat(filedesc, &stats) != 0 || stats.st_size == (off_t)blks->files[cpio->index].size)
             break;
 
         if ((error = is_prelinked(&prelinked, filedesc, plnk_buf, pread(filedesc, plnk_buf, 128, 0))) != DRPM_ERR_OK)
@@ -1064,7 +1580,7 @@ int fillblock_prelink(struct blocks *blks, struct block *blk, size_t id, size_t
 
         do {
             id--;
-            off = id * BLOCK_SIZE;
+            off = (uint64_t)id * BLOCK_SIZE;
         } while (cpio->offset + cpio->header_len < off);
     }
 
@@ -1135,11 +1651,11 @@ int fillblock_prelink(struct blocks *blks, struct block *blk, size_t id, size_t
 
                     if (filedesc < 0) {
                         prelinked = false;
-                        if ((filedesc = open(blks->files[cpio->index].name, O_RDONLY)) < 0) {
+                        if ((filedesc = open_installed(blks, blks->files[cpio->index].name)) < 0) {
                             error = DRPM_ERR_IO;
                             goto cleanup;
                         } else if (fstat(filedesc, &stats) == 0 &&
-                                   stats.st_size != blks->files[cpio->index].size) {
+                                   stats.st_size != (off_t)blks->files[cpio->index].size) {
                             if ((error = is_prelinked(&prelinked, filedesc, plnk_buf, pread(filedesc, plnk_buf, 128, 0))) != DRPM_ERR_OK)
                                 goto cleanup;
                             if (prelinked) {
@@ -1191,7 +1707,7 @@ int fillblock_prelink(struct blocks *blks, struct block *blk, size_t id, size_t
             break;
 
         id++;
-        off = id * BLOCK_SIZE;
+        off = (uint64_t)id * BLOCK_SIZE;
     }
 
     if (id < id_orig) {
@@ -1209,3 +1725,302 @@ cleanup:
 
     return error;
 }
+
+/*************************** block prefetch ***************************/
+
+/* Starts prefetching the blocks of installed files in the order the
+ * external copies will fill them, so that cold reads overlap with
+ * reconstruction instead of stalling it. Blocks still held by the
+ * cache when they are read again are not filled, so the schedule
+ * comes from replaying the copies through the cache. */
+int prefetch_start(struct blocks *blks, size_t block_count,
+                   const uint32_t *ext_copies, size_t ext_copies_count, unsigned threads)
+{
+    int error;
+    struct prefetch *pf;
+    struct blocks *replay;
+
+    /* each thread keeps a file open, out of the same budget as the
+     * open-file cache, which is left at least one */
+    threads = MIN(threads, blks->rpm_files.from_filesytem.file_count_max - 1);
+
+    if (ext_copies_count == 0 || threads == 0)
+        return DRPM_ERR_OK;
+
+    if ((pf = calloc(1, sizeof(struct prefetch))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    pf->blks = blks;
+
+    if ((error = blocks_replay(&replay, block_count, ext_copies, ext_copies_count,
+                               fillblock_schedule)) != DRPM_ERR_OK) {
+        prefetch_free(pf);
+        return error;
+    }
+
+    pf->schedule = replay->fill_order;
+    pf->schedule_len = replay->fills;
+    replay->fill_order = NULL;
+    blocks_destroy(&replay);
+
+    if (pf->schedule_len == 0) {
+        prefetch_free(pf);
+        return DRPM_ERR_OK;
+    }
+
+    pf->slot_count = MIN(pf->schedule_len, MAX_PREFETCH_BLOCKS);
+
+    if ((pf->slots = calloc(pf->slot_count, sizeof(struct prefetch_slot))) == NULL ||
+        (pf->buffers = malloc(pf->slot_count * BLOCK_SIZE)) == NULL ||
+        (pf->workers = malloc(threads * sizeof(pthread_t))) == NULL) {
+        prefetch_free(pf);
+        return DRPM_ERR_MEMORY;
+    }
+
+    for (size_t i = 0; i < pf->slot_count; i++) {
+        pf->slots[i].state = PREFETCH_EMPTY;
+        pf->slots[i].buffer = pf->buffers + i * BLOCK_SIZE;
+    }
+
+    if (pthread_mutex_init(&pf->lock, NULL) != 0) {
+        prefetch_free(pf);
+        return DRPM_ERR_OTHER;
+    }
+    if (pthread_cond_init(&pf->filled, NULL) != 0) {
+        pthread_mutex_destroy(&pf->lock);
+        prefetch_free(pf);
+        return DRPM_ERR_OTHER;
+    }
+    if (pthread_cond_init(&pf->space, NULL) != 0) {
+        pthread_cond_destroy(&pf->filled);
+        pthread_mutex_destroy(&pf->lock);
+        prefetch_free(pf);
+        return DRPM_ERR_OTHER;
+    }
+
+    // running with fewer threads than requested is not an error
+    while (pf->worker_count < threads &&
+           pthread_create(&pf->workers[pf->worker_count], NULL, prefetch_worker, pf) == 0)
+        pf->worker_count++;
+
+    if (pf->worker_count == 0) {
+        pthread_cond_destroy(&pf->space);
+        pthread_cond_destroy(&pf->filled);
+        pthread_mutex_destroy(&pf->lock);
+        prefetch_free(pf);
+        return DRPM_ERR_OK;
+    }
+
+    blks->rpm_files.from_filesytem.file_count_max -= pf->worker_count;
+    blks->prefetch = pf;
+
+    return DRPM_ERR_OK;
+}
+
+/* stops prefetch threads and frees their resources */
+void prefetch_stop(struct blocks *blks)
+{
+    struct prefetch *pf = blks->prefetch;
+
+    if (pf == NULL)
+        return;
+
+    pthread_mutex_lock(&pf->lock);
+    pf->stop = true;
+    pthread_cond_broadcast(&pf->space);
+    pthread_mutex_unlock(&pf->lock);
+
+    for (unsigned i = 0; i < pf->worker_count; i++)
+        pthread_join(pf->workers[i], NULL);
+
+    pthread_cond_destroy(&pf->space);
+    pthread_cond_destroy(&pf->filled);
+    pthread_mutex_destroy(&pf->lock);
+    prefetch_free(pf);
+
+    blks->prefetch = NULL;
+}
+
+void prefetch_free(struct prefetch *pf)
+{
+    free(pf->schedule);
+    free(pf->slots);
+    free(pf->buffers);
+    free(pf->workers);
+    free(pf);
+}
+
+/* fills upcoming blocks until the schedule is exhausted,
+ * staying at most one window ahead of the apply cursor */
+void *prefetch_worker(void *data)
+{
+    struct prefetch *pf = data;
+    struct prefetch_slot *slot;
+    unsigned char *header;
+    int filedesc = -1;
+    ssize_t file_index = -1;
+    bool noatime_denied = false;
+    size_t id;
+    bool filled;
+
+    header = malloc(pf->blks->cpio_buffer_len);
+
+    pthread_mutex_lock(&pf->lock);
+
+    while (header != NULL) {
+        while (!pf->stop && pf->next < pf->schedule_len && pf->next >= pf->cursor + pf->slot_count)
+            pthread_cond_wait(&pf->space, &pf->lock);
+        if (pf->stop || pf->next >= pf->schedule_len)
+            break;
+
+        slot = &pf->slots[pf->next % pf->slot_count];
+        slot->state = PREFETCH_FILLING;
+        id = pf->schedule[pf->next++];
+
+        pthread_mutex_unlock(&pf->lock);
+        filled = prefetch_fill(pf->blks, &filedesc, &file_index, &noatime_denied, header, slot->buffer, id);
+        pthread_mutex_lock(&pf->lock);
+
+        slot->state = filled ? PREFETCH_READY : PREFETCH_FAILED;
+        pthread_cond_broadcast(&pf->filled);
+    }
+
+    pthread_mutex_unlock(&pf->lock);
+
+    if (!(filedesc < 0))
+        close(filedesc);
+    free(header);
+
+    return NULL;
+}
+
+/* Fills a block from installed files the same way as
+ * fillblock_filesystem(), but without touching shared state, so that
+ * it can run on any thread. Keeps the last file read open in
+ * <filedesc> and <file_index>, which counts against the budget of
+ * open files. Returns false if the block has to be
+ * filled by fillblock_filesystem() instead (e.g. the file is prelinked
+ * or cannot be read). */
+bool prefetch_fill(const struct blocks *blks, int *filedesc, ssize_t *file_index,
+                   bool *noatime_denied, unsigned char *header, unsigned char *buf_ptr, size_t id)
+{
+    const struct cpio_file *cpio;
+    const struct file_info *file;
+    struct stat stats;
+    uint64_t off = (uint64_t)id * BLOCK_SIZE;
+    size_t len = BLOCK_SIZE;
+    size_t lo = 0;
+    size_t hi = blks->cpio_files_len;
+    size_t mid;
+    size_t file_off;
+    size_t read_len;
+
+    if (hi == 0)
+        return false;
+
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (blks->cpio_files[mid].offset <= off)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    cpio = blks->cpio_files + lo;
+
+    while (len > 0) {
+        if (off < cpio->offset + cpio->header_len) {
+            cpio_header_synth(blks->files, cpio->index, header);
+            file_off = off - cpio->offset;
+            read_len = MIN(len, cpio->header_len - file_off);
+            memcpy(buf_ptr, header + file_off, read_len);
+        } else if (cpio->index < 0) {
+            memset(buf_ptr, 0, len);
+            read_len = len;
+        } else if (off >= cpio->offset + cpio->header_len + cpio->content_len) {
+            if (++cpio == blks->cpio_files + blks->cpio_files_len)
+                return false;
+            continue;
+        } else {
+            file = &blks->files[cpio->index];
+            file_off = off - (cpio->offset + cpio->header_len);
+            if (S_ISLNK(file->mode)) {
+                read_len = MIN(len, cpio->content_len - file_off);
+                if (file_off > strlen(file->linkto))
+                    memset(buf_ptr, 0, read_len);
+                else
+                    strncpy((char *)buf_ptr, file->linkto + file_off, read_len);
+            } else if (file_off < file->size) {
+                read_len = MIN(len, file->size - file_off);
+                if (*file_index != cpio->index) {
+                    if (!(*filedesc < 0))
+                        close(*filedesc);
+                    *file_index = -1;
+                    if ((*filedesc = openat_noatime(AT_FDCWD, file->name, noatime_denied)) < 0)
+                        return false;
+                    if (fstat(*filedesc, &stats) != 0 || stats.st_size != (off_t)file->size)
+                        return false;
+                    *file_index = cpio->index;
+                }
+                if (pread(*filedesc, buf_ptr, read_len, file_off) != (ssize_t)read_len)
+                    return false;
+            } else {
+                read_len = MIN(len, cpio->content_len - file_off);
+                memset(buf_ptr, 0, read_len);
+            }
+        }
+
+        buf_ptr += read_len;
+        off += read_len;
+        len -= read_len;
+    }
+
+    return true;
+}
+
+/* Takes block <id> from the prefetch window into <buffer>, waiting for
+ * it if a thread is still reading it. Returns false if the block has
+ * not been prefetched, in which case it has to be filled directly. */
+bool prefetch_take(struct prefetch *pf, unsigned char *buffer, size_t id)
+{
+    const size_t window_end = MIN(pf->schedule_len, pf->cursor + pf->slot_count);
+    struct prefetch_slot *slot;
+    size_t pos;
+    bool taken = false;
+
+    pthread_mutex_lock(&pf->lock);
+
+    for (pos = pf->cursor; pos < window_end; pos++)
+        if (pf->schedule[pos] == id)
+            break;
+
+    if (pos == window_end) {
+        pthread_mutex_unlock(&pf->lock);
+        return false;
+    }
+
+    pf->hits++;
+
+    /* slots up to <pos> are released, so none of them may be in use */
+    for (size_t i = pf->cursor; i <= pos && i < pf->next; i++)
+        while (pf->slots[i % pf->slot_count].state == PREFETCH_FILLING)
+            pthread_cond_wait(&pf->filled, &pf->lock);
+
+    if (pos < pf->next) {
+        slot = &pf->slots[pos % pf->slot_count];
+        if (slot->state == PREFETCH_READY) {
+            memcpy(buffer, slot->buffer, BLOCK_SIZE);
+            taken = true;
+        }
+    } else {
+        /* threads are falling behind, skip what they have not started */
+        pf->next = pos + 1;
+    }
+
+    pf->cursor = pos + 1;
+    pthread_cond_broadcast(&pf->space);
+
+    pthread_mutex_unlock(&pf->lock);
+
+    return taken;
+}
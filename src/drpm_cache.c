@@ -0,0 +1,698 @@
+/*
+    Copyright (C) 2026 Red Hat
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2.1 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* A size-limited LRU cache of expensive intermediate data (decompressed
+ * payloads, match indexes), keyed by MD5 digests of the content they
+ * were derived from. Entries are reference-counted, so that they can be
+ * used by several threads at once and are only freed once evicted and
+ * no longer in use.
+ * Flat entries (payloads) may also be kept as files in a directory,
+ * so that they outlive the process. Such files are read rather than
+ * mapped, as a mapped file truncated by another process would crash
+ * this one, and the directory must not be writable by other users. */
+
+#define _GNU_SOURCE
+
+#include "drpm.h"
+#include "drpm_private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <openssl/md5.h>
+
+/* only flat entries can be stored in files */
+#define CACHE_PERSISTENT(kind) ((kind) == CACHE_PAYLOAD)
+#define CACHE_FILE_SUFFIX ".payload"
+#define CACHE_FILE_NAME_LEN (MD5_DIGEST_LENGTH * 2 + sizeof(CACHE_FILE_SUFFIX) - 1)
+
+struct cache_entry {
+    int kind;
+    unsigned char key[MD5_DIGEST_LENGTH];
+    void *data;
+    size_t size;
+    void (*free_data)(void *);
+    unsigned refs;
+    bool cached; // linked in the LRU list
+    char *path; // file removed when evicted
+    struct cache_entry *prev; // more recently used
+    struct cache_entry *next; // less recently used
+};
+
+struct cache {
+    pthread_mutex_t lock;
+    unsigned refs; // references to the cache itself
+    size_t budget;
+    size_t used;
+    size_t count;
+    struct cache_entry *head; // most recently used
+    struct cache_entry *tail; // least recently used
+    unsigned long hits;
+    unsigned long misses;
+    char *dir; // where flat entries are stored, if anywhere
+};
+
+/* a file of the cache directory, when pruning it */
+struct cache_file {
+    char name[CACHE_FILE_NAME_LEN + 1];
+    time_t mtime;
+    off_t size;
+};
+
+/* used by rpm_read() if no other cache is given */
+static struct cache *process_cache = NULL;
+/* guards <process_cache> against being replaced while a reference
+ * to it is being taken */
+static pthread_mutex_t process_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct cache_entry *entry_insert(struct cache *, struct cache_entry *);
+static char *entry_path(const struct cache *, const unsigned char *);
+static void entry_evict(struct cache *, struct cache_entry *);
+static struct cache_entry *entry_load(struct cache *, int, const unsigned char *);
+static void entry_persist(struct cache *, struct cache_entry *);
+static int cache_dir_prune(const char *, size_t);
+static int cache_file_cmp(const void *, const void *);
+static void entry_free(struct cache_entry *);
+static void entry_unlink(struct cache *, struct cache_entry *);
+static void entry_push(struct cache *, struct cache_entry *);
+static void hash_free_data(void *);
+
+void entry_free(struct cache_entry *entry)
+{
+    if (entry->free_data != NULL)
+        entry->free_data(entry->data);
+    free(entry->path);
+    free(entry);
+}
+
+/* Takes <entry> out of the LRU list (with the cache locked),
+ * freeing it unless it is in use. */
+void entry_evict(struct cache *cache, struct cache_entry *entry)
+{
+    entry_unlink(cache, entry);
+    entry->cached = false;
+    cache->used -= entry->size;
+    cache->count--;
+
+    if (entry->path != NULL)
+        unlink(entry->path);
+
+    if (entry->refs == 0)
+        entry_free(entry);
+}
+
+/* Adds a new <entry> to the cache (with the cache locked), making room
+ * for it by evicting least recently used entries. Returns the entry that
+ * is now cached under its key, which is an existing one if another
+ * thread got there first (and <entry> is then freed). */
+struct cache_entry *entry_insert(struct cache *cache, struct cache_entry *entry)
+{
+    struct cache_entry *prev;
+
+    for (struct cache_entry *old = cache->head; old != NULL; old = old->next) {
+        if (old->kind == entry->kind && memcmp(old->key, entry->key, MD5_DIGEST_LENGTH) == 0) {
+            old->refs++;
+            entry_free(entry);
+            return old;
+        }
+    }
+
+    for (struct cache_entry *old = cache->tail;
+         old != NULL && entry->size > cache->budget - cache->used; old = prev) {
+        prev = old->prev;
+        entry_evict(cache, old);
+    }
+
+    if (entry->size <= cache->budget - cache->used) {
+        entry_push(cache, entry);
+        entry->cached = true;
+        cache->used += entry->size;
+        cache->count++;
+    } else if (entry->path != NULL) {
+        unlink(entry->path);
+    }
+
+    return entry;
+}
+
+char *entry_path(const struct cache *cache, const unsigned char *key)
+{
+    char *path;
+    size_t dir_len = strlen(cache->dir);
+
+    if ((path = malloc(dir_len + 1 + CACHE_FILE_NAME_LEN + 1)) == NULL)
+        return NULL;
+
+    memcpy(path, cache->dir, dir_len);
+    path[dir_len] = '/';
+    dump_hex(path + dir_len + 1, key, MD5_DIGEST_LENGTH);
+    strcat(path, CACHE_FILE_SUFFIX);
+
+    return path;
+}
+
+/* Reads the file storing the entry of type <kind> for <key>, if there is
+ * one (and it is a regular file, not a symbolic link). Its modification
+ * time is updated to keep track of its use. */
+struct cache_entry *entry_load(struct cache *cache, int kind, const unsigned char *key)
+{
+    struct cache_entry *entry;
+    struct stat stats;
+    unsigned char *data = NULL;
+    ssize_t read_len = 0;
+    int filedesc = -1;
+
+    if ((entry = calloc(1, sizeof(struct cache_entry))) == NULL ||
+        (entry->path = entry_path(cache, key)) == NULL ||
+        (filedesc = open(entry->path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW)) < 0 ||
+        fstat(filedesc, &stats) != 0 || !S_ISREG(stats.st_mode) ||
+        (data = malloc(MAX(stats.st_size, 1))) == NULL)
+        goto fail;
+
+    // a file shrinking meanwhile only gives a short read
+    for (off_t done = 0; done < stats.st_size; done += read_len)
+        if ((read_len = pread(filedesc, data + done, stats.st_size - done, done)) <= 0)
+            goto fail;
+
+    futimens(filedesc, NULL);
+    close(filedesc);
+
+    entry->kind = kind;
+    memcpy(entry->key, key, MD5_DIGEST_LENGTH);
+    entry->data = data;
+    entry->size = stats.st_size;
+    entry->free_data = free;
+    entry->refs = 1;
+
+    return entry;
+
+fail:
+    if (filedesc >= 0)
+        close(filedesc);
+    if (entry != NULL)
+        free(entry->path);
+    free(entry);
+    free(data);
+    return NULL;
+}
+
+/* Writes the data of a new <entry> to a file, so that it is found by
+ * later processes. The entry is left as it is if that fails. */
+void entry_persist(struct cache *cache, struct cache_entry *entry)
+{
+    char *path;
+    char *tmp_path = NULL;
+    const unsigned char *ptr = entry->data;
+    size_t left = entry->size;
+    ssize_t written;
+    int filedesc = -1;
+
+    if ((path = entry_path(cache, entry->key)) == NULL ||
+        (tmp_path = malloc(strlen(path) + 8)) == NULL)
+        goto fail;
+
+    sprintf(tmp_path, "%s.XXXXXX", path);
+    if ((filedesc = mkstemp(tmp_path)) < 0)
+        goto fail;
+
+    for (; left > 0; ptr += written, left -= written)
+        if ((written = write(filedesc, ptr, left)) <= 0)
+            goto fail;
+
+    if (rename(tmp_path, path) != 0)
+        goto fail;
+
+    close(filedesc);
+    free(tmp_path);
+
+    entry->path = path;
+
+    return;
+
+fail:
+    if (filedesc >= 0) {
+        close(filedesc);
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    free(path);
+}
+
+void entry_unlink(struct cache *cache, struct cache_entry *entry)
+{
+    if (entry->prev != NULL)
+        entry->prev->next = entry->next;
+    else
+        cache->head = entry->next;
+    if (entry->next != NULL)
+        entry->next->prev = entry->prev;
+    else
+        cache->tail = entry->prev;
+
+    entry->prev = entry->next = NULL;
+}
+
+void entry_push(struct cache *cache, struct cache_entry *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head != NULL)
+        cache->head->prev = entry;
+    else
+        cache->tail = entry;
+    cache->head = entry;
+}
+
+/* Creates a cache holding at most <budget> bytes of entries. */
+int cache_create(struct cache **cache, size_t budget)
+{
+    if (cache == NULL)
+        return DRPM_ERR_PROG;
+
+    if ((*cache = calloc(1, sizeof(struct cache))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    if (pthread_mutex_init(&(*cache)->lock, NULL) != 0) {
+        free(*cache);
+        *cache = NULL;
+        return DRPM_ERR_OTHER;
+    }
+
+    (*cache)->refs = 1;
+    (*cache)->budget = budget;
+
+    return DRPM_ERR_OK;
+}
+
+/* Keeps flat entries as files in <dir>, starting with what earlier
+ * processes left there (trimmed to the budget, oldest first).
+ * The directory must be owned by the caller and not be writable by
+ * anyone else, who could otherwise plant payloads in it. */
+int cache_set_dir(struct cache *cache, const char *dir)
+{
+    struct stat stats;
+    int error;
+
+    if (cache == NULL || dir == NULL)
+        return DRPM_ERR_PROG;
+
+    if (stat(dir, &stats) != 0)
+        return DRPM_ERR_IO;
+
+    if (!S_ISDIR(stats.st_mode) || stats.st_uid != geteuid() ||
+        (stats.st_mode & (S_IWGRP | S_IWOTH)) != 0)
+        return DRPM_ERR_ARGS;
+
+    if ((error = cache_dir_prune(dir, cache->budget)) != DRPM_ERR_OK)
+        return error;
+
+    free(cache->dir);
+    if ((cache->dir = strdup(dir)) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    return DRPM_ERR_OK;
+}
+
+int cache_file_cmp(const void *file1, const void *file2)
+{
+    const time_t mtime1 = ((const struct cache_file *)file1)->mtime;
+    const time_t mtime2 = ((const struct cache_file *)file2)->mtime;
+
+    return (mtime1 < mtime2) - (mtime1 > mtime2); // newest first
+}
+
+/* Removes least recently used files from the cache directory <dir>
+ * until the rest fits within <budget> bytes. */
+int cache_dir_prune(const char *dir, size_t budget)
+{
+    DIR *dirst;
+    struct dirent *dent;
+    struct stat stats;
+    struct cache_file *files = NULL;
+    struct cache_file *files_tmp;
+    size_t files_len = 0;
+    size_t files_alloc = 0;
+    uint64_t total = 0;
+    int dirfd_;
+    int error = DRPM_ERR_OK;
+
+    if ((dirst = opendir(dir)) == NULL)
+        return DRPM_ERR_IO;
+    dirfd_ = dirfd(dirst);
+
+    while ((dent = readdir(dirst)) != NULL) {
+        if (strlen(dent->d_name) != CACHE_FILE_NAME_LEN ||
+            strcmp(dent->d_name + MD5_DIGEST_LENGTH * 2, CACHE_FILE_SUFFIX) != 0 ||
+            fstatat(dirfd_, dent->d_name, &stats, AT_SYMLINK_NOFOLLOW) != 0 ||
+            !S_ISREG(stats.st_mode))
+            continue;
+        if (files_len == files_alloc) {
+            files_alloc = MAX(2 * files_alloc, 64);
+            if ((files_tmp = realloc(files, files_alloc * sizeof(struct cache_file))) == NULL) {
+                error = DRPM_ERR_MEMORY;
+                goto cleanup;
+            }
+            files = files_tmp;
+        }
+        strcpy(files[files_len].name, dent->d_name);
+        files[files_len].mtime = stats.st_mtime;
+        files[files_len].size = stats.st_size;
+        files_len++;
+    }
+
+    qsort(files, files_len, sizeof(struct cache_file), cache_file_cmp);
+
+    for (size_t i = 0; i < files_len; i++) {
+        total += files[i].size;
+        if (total > budget)
+            unlinkat(dirfd_, files[i].name, 0);
+    }
+
+cleanup:
+    free(files);
+    closedir(dirst);
+
+    return error;
+}
+
+/* Takes another reference to the cache, to be dropped with
+ * cache_destroy(). */
+void cache_hold(struct cache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    cache->refs++;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* Drops a reference to the cache (the one from cache_create() or one
+ * taken with cache_hold()). Once the last one is dropped, the cache and
+ * all entries are freed, which no entry may then be in use for.
+ * Stored files are kept for later processes. */
+int cache_destroy(struct cache **cache)
+{
+    struct cache_entry *entry;
+    struct cache_entry *next;
+    bool unused;
+
+    if (cache == NULL || *cache == NULL)
+        return DRPM_ERR_PROG;
+
+    pthread_mutex_lock(&(*cache)->lock);
+    unused = (--(*cache)->refs == 0);
+    pthread_mutex_unlock(&(*cache)->lock);
+
+    if (!unused) {
+        *cache = NULL;
+        return DRPM_ERR_OK;
+    }
+
+    for (entry = (*cache)->head; entry != NULL; entry = next) {
+        next = entry->next;
+        entry_free(entry);
+    }
+
+    pthread_mutex_destroy(&(*cache)->lock);
+    free((*cache)->dir);
+    free(*cache);
+    *cache = NULL;
+
+    return DRPM_ERR_OK;
+}
+
+/* Looks up the entry of type <kind> for <key>. On a hit, the entry is
+ * marked as most recently used and returned with a reference taken,
+ * which has to be dropped with cache_release(). Returns NULL on a miss. */
+struct cache_entry *cache_get(struct cache *cache, int kind, const unsigned char key[MD5_DIGEST_LENGTH])
+{
+    struct cache_entry *entry;
+
+    pthread_mutex_lock(&cache->lock);
+
+    for (entry = cache->head; entry != NULL; entry = entry->next)
+        if (entry->kind == kind && memcmp(entry->key, key, MD5_DIGEST_LENGTH) == 0)
+            break;
+
+    if (entry != NULL) {
+        entry_unlink(cache, entry);
+        entry_push(cache, entry);
+        entry->refs++;
+        cache->hits++;
+        pthread_mutex_unlock(&cache->lock);
+        return entry;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+    /* possibly stored by an earlier process */
+    if (cache->dir != NULL && CACHE_PERSISTENT(kind) &&
+        (entry = entry_load(cache, kind, key)) != NULL) {
+        pthread_mutex_lock(&cache->lock);
+        entry = entry_insert(cache, entry);
+        cache->hits++;
+        pthread_mutex_unlock(&cache->lock);
+        return entry;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    cache->misses++;
+    pthread_mutex_unlock(&cache->lock);
+
+    return NULL;
+}
+
+/* Stores <data> (accounted as <size> bytes and freed by <free_data>)
+ * as the entry of type <kind> for <key>, evicting least recently used
+ * entries that are not in use to stay within budget.
+ * The entry is returned in <*entry_ret> with a reference taken.
+ * If another thread has stored the same entry in the meantime, <data>
+ * is freed and that entry is returned instead. Data that does not fit
+ * is not cached, but still returned as an entry that is freed once
+ * released, so callers need not handle that case.
+ * Flat entries are also written to the cache directory, if there is one. */
+int cache_put(struct cache *cache, int kind, const unsigned char key[MD5_DIGEST_LENGTH],
+              void *data, size_t size, void (*free_data)(void *),
+              struct cache_entry **entry_ret)
+{
+    struct cache_entry *entry;
+
+    if ((entry = calloc(1, sizeof(struct cache_entry))) == NULL) {
+        if (free_data != NULL)
+            free_data(data);
+        return DRPM_ERR_MEMORY;
+    }
+
+    entry->kind = kind;
+    memcpy(entry->key, key, MD5_DIGEST_LENGTH);
+    entry->data = data;
+    entry->size = size;
+    entry->free_data = free_data;
+    entry->refs = 1;
+
+    if (cache->dir != NULL && CACHE_PERSISTENT(kind) && size <= cache->budget)
+        entry_persist(cache, entry);
+
+    pthread_mutex_lock(&cache->lock);
+    *entry_ret = entry_insert(cache, entry);
+    pthread_mutex_unlock(&cache->lock);
+
+    return DRPM_ERR_OK;
+}
+
+/* Drops a reference taken by cache_get() or cache_put(). */
+void cache_release(struct cache *cache, struct cache_entry *entry)
+{
+    bool unused;
+
+    if (entry == NULL)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    unused = (--entry->refs == 0 && !entry->cached);
+    pthread_mutex_unlock(&cache->lock);
+
+    if (unused)
+        entry_free(entry);
+}
+
+/* Drops an <entry> in use (e.g. found to be corrupt) from the cache,
+ * so that it is freed once released. */
+void cache_remove(struct cache *cache, struct cache_entry *entry)
+{
+    pthread_mutex_lock(&cache->lock);
+    if (entry->cached)
+        entry_evict(cache, entry);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void *cache_entry_data(const struct cache_entry *entry)
+{
+    return entry->data;
+}
+
+size_t cache_entry_size(const struct cache_entry *entry)
+{
+    return entry->size;
+}
+
+/* Returns the process-wide cache set up by drpm_cache_enable(), if any,
+ * with a reference taken, which has to be dropped with cache_destroy().
+ * The cache thus stays usable if it is replaced or disabled meanwhile. */
+struct cache *cache_process(void)
+{
+    struct cache *cache;
+
+    pthread_mutex_lock(&process_cache_lock);
+    if ((cache = process_cache) != NULL)
+        cache_hold(cache);
+    pthread_mutex_unlock(&process_cache_lock);
+
+    return cache;
+}
+
+int drpm_cache_enable(unsigned long mbytes, const char *dir)
+{
+    struct cache *cache;
+    struct cache *old_cache;
+    int error;
+
+    if (mbytes == 0 || mbytes > SIZE_MAX / (1024 * 1024))
+        return DRPM_ERR_ARGS;
+
+    if ((error = cache_create(&cache, (size_t)mbytes * 1024 * 1024)) != DRPM_ERR_OK)
+        return error;
+
+    if (dir != NULL && (error = cache_set_dir(cache, dir)) != DRPM_ERR_OK) {
+        cache_destroy(&cache);
+        return error;
+    }
+
+    pthread_mutex_lock(&process_cache_lock);
+    old_cache = process_cache;
+    process_cache = cache;
+    pthread_mutex_unlock(&process_cache_lock);
+
+    // freed once operations still using it are done
+    if (old_cache != NULL)
+        cache_destroy(&old_cache);
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_cache_disable(void)
+{
+    struct cache *old_cache;
+
+    pthread_mutex_lock(&process_cache_lock);
+    old_cache = process_cache;
+    process_cache = NULL;
+    pthread_mutex_unlock(&process_cache_lock);
+
+    if (old_cache != NULL)
+        cache_destroy(&old_cache);
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_cache_get_stats(unsigned long *hits, unsigned long *misses,
+                         unsigned long *count, unsigned long long *size)
+{
+    struct cache *cache;
+    size_t cache_count;
+    size_t cache_size;
+
+    if (hits == NULL || misses == NULL || count == NULL || size == NULL)
+        return DRPM_ERR_ARGS;
+
+    if ((cache = cache_process()) == NULL) {
+        *hits = *misses = *count = 0;
+        *size = 0;
+        return DRPM_ERR_OK;
+    }
+
+    cache_get_stats(cache, &cache_count, &cache_size, hits, misses);
+    cache_destroy(&cache);
+    *count = cache_count;
+    *size = cache_size;
+
+    return DRPM_ERR_OK;
+}
+
+/* Fetches the number of cached entries, their total size
+ * and the number of lookups that hit and missed. */
+void cache_get_stats(struct cache *cache, size_t *count, size_t *size,
+                     unsigned long *hits, unsigned long *misses)
+{
+    pthread_mutex_lock(&cache->lock);
+    *count = cache->count;
+    *size = cache->used;
+    *hits = cache->hits;
+    *misses = cache->misses;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void hash_free_data(void *data)
+{
+    struct hash *hsh = data;
+
+    hash_free(&hsh);
+}
+
+/* Fetches the match index of <old> (of length <old_len>), the diff input
+ * derived from the RPM with signature MD5 <sigmd5> (<rpm_only> telling
+ * which kind of input it is), building and caching it on a miss.
+ * Chained, plain and sparse indexes (with <spacing> not 0, see
+ * hash_create_sparse()) are cached separately.
+ * Up to <threads> threads are used to build it, which is reported to
+ * <prog> (if not NULL) as hash_create() does.
+ * The returned entry has to be released with cache_release(). */
+int cache_get_index(struct cache *cache, const unsigned char sigmd5[MD5_DIGEST_LENGTH], bool rpm_only,
+                    bool chained, unsigned spacing,
+                    const unsigned char *old, size_t old_len, unsigned threads,
+                    struct cache_entry **entry_ret, struct progress *prog)
+{
+    unsigned char key[MD5_DIGEST_LENGTH];
+    const unsigned char kind = (rpm_only ? DRPM_TYPE_RPMONLY : DRPM_TYPE_STANDARD) | (chained ? 0x80 : 0);
+    struct hash *hsh;
+    MD5_CTX md5;
+    int error;
+
+    if (cache == NULL || sigmd5 == NULL || old == NULL || entry_ret == NULL)
+        return DRPM_ERR_PROG;
+
+    if (MD5_Init(&md5) != 1 ||
+        MD5_Update(&md5, sigmd5, MD5_DIGEST_LENGTH) != 1 ||
+        MD5_Update(&md5, &kind, 1) != 1 ||
+        md5_update_be32(&md5, spacing) != 1 ||
+        md5_update_be64(&md5, old_len) != 1 ||
+        MD5_Final(key, &md5) != 1)
+        return DRPM_ERR_OTHER;
+
+    if ((*entry_ret = cache_get(cache, CACHE_INDEX, key)) != NULL)
+        return DRPM_ERR_OK;
+
+    if ((error = (spacing != 0) ? hash_create_sparse(&hsh, old, old_len, spacing, threads, prog)
+                                : hash_create(&hsh, old, old_len, chained, threads, prog)) != DRPM_ERR_OK)
+        return error;
+
+    return cache_put(cache, CACHE_INDEX, key, hsh, hash_size(hsh), hash_free_data, entry_ret);
+}
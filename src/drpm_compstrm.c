@@ -27,6 +27,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <openssl/md5.h>
 #include <zlib.h>
 #include <bzlib.h>
 #include <lzma.h>
@@ -37,11 +38,33 @@
 #include <zstd.h>
 #endif
 
+/* lzma_stream_encoder_mt() is part of the stable API since xz 5.2.0 */
+#if LZMA_VERSION >= 50020002
+#define HAVE_LZMA_ENCODER_MT
+#endif
+
 struct compstrm {
     unsigned char *data;
     size_t data_len;
     size_t data_pos;
     int filedesc;
+    MD5_CTX *md5; // digest of compressed data, if streaming
+    /* when comparing, compressed data is checked against the file
+     * <cmp_filedesc> from <cmp_offset> on instead of being kept */
+    int cmp_filedesc;
+    off_t cmp_offset;
+    struct progress *progress; // where bytes written are counted, if anywhere
+    int progress_phase;
+    size_t comp_size; // total size of compressed data
+    bool keep_data; // whether compressed data is kept after writing
+    uint32_t xz_preset; // preset of the xz encoder, UINT32_MAX if not xz
+    /* when sampling, slices of <sample_slice> bytes are kept every
+     * <sample_stride> bytes, the stride doubling whenever
+     * <sample_slices> slices are kept */
+    size_t sample_slice;
+    size_t sample_slices;
+    size_t sample_stride;
+    uint64_t sample_offset; // input so far
     union {
         z_stream gzip;
         bz_stream bzip2;
@@ -55,12 +78,18 @@ struct compstrm {
     } stream;
     int (*write_chunk)(struct compstrm *, size_t, const void *);
     int (*finish)(struct compstrm *);
+    void (*end)(struct compstrm *); // releases an unfinished encoder
     bool finished;
 };
 
+static void end_bzip2(struct compstrm *);
+static void end_gzip(struct compstrm *);
+static void end_lzma(struct compstrm *);
 static int finish_bzip2(struct compstrm *);
 static int finish_gzip(struct compstrm *);
 static int finish_lzma(struct compstrm *);
+static int compare_data(struct compstrm *, size_t);
+static int flush_data(struct compstrm *);
 static int init_bzip2(struct compstrm *, int);
 static int init_gzip(struct compstrm *, int);
 static int init_lzma(struct compstrm *, int);
@@ -69,8 +98,10 @@ static int writechunk(struct compstrm *, size_t, const void *);
 static int writechunk_bzip2(struct compstrm *, size_t, const void *);
 static int writechunk_gzip(struct compstrm *, size_t, const void *);
 static int writechunk_lzma(struct compstrm *, size_t, const void *);
+static int writechunk_sample(struct compstrm *, size_t, const void *);
 
 #ifdef HAVE_LZLIB_DEVEL
+static void end_lzip(struct compstrm *);
 static int finish_lzip(struct compstrm *);
 static int init_lzip(struct compstrm *, int);
 static int writechunk_lzip(struct compstrm *, size_t, const void *);
@@ -92,11 +123,43 @@ static int lzip_error(struct compstrm *strm)
 #endif
 
 #ifdef WITH_ZSTD
+static void end_zstd(struct compstrm *);
 static int finish_zstd(struct compstrm *);
 static int init_zstd(struct compstrm *, int);
 static int writechunk_zstd(struct compstrm *, size_t, const void *);
 #endif
 
+/* Functions for releasing unfinished compression for individual methods. */
+
+void end_bzip2(struct compstrm *strm)
+{
+    BZ2_bzCompressEnd(&strm->stream.bzip2);
+}
+
+void end_gzip(struct compstrm *strm)
+{
+    deflateEnd(&strm->stream.gzip);
+}
+
+void end_lzma(struct compstrm *strm)
+{
+    lzma_end(&strm->stream.lzma);
+}
+
+#ifdef HAVE_LZLIB_DEVEL
+void end_lzip(struct compstrm *strm)
+{
+    LZ_compress_close(strm->stream.lzip);
+}
+#endif
+
+#ifdef WITH_ZSTD
+void end_zstd(struct compstrm *strm)
+{
+    ZSTD_freeCCtx(strm->stream.zstd_context);
+}
+#endif
+
 /* Functions for finishing compression for individual methods. */
 
 int finish_bzip2(struct compstrm *strm)
@@ -247,33 +310,43 @@ cleanup:
 #ifdef WITH_ZSTD
 int finish_zstd(struct compstrm *strm)
 {
+    int error = DRPM_ERR_OK;
     size_t const buffOutSize = ZSTD_CStreamOutSize();
-    void* const buffOut = malloc(buffOutSize);
-    if (buffOut == NULL)
-        return DRPM_ERR_MEMORY;
+    void *buffOut;
     unsigned char *data_tmp;
 
+    if ((buffOut = malloc(buffOutSize)) == NULL) {
+        error = DRPM_ERR_MEMORY;
+        goto cleanup;
+    }
+
     size_t remaining;
     // No more new input just finish flushing compression data
     ZSTD_inBuffer input = { NULL, 0, 0 };
     do{
         ZSTD_outBuffer output = { buffOut, buffOutSize, 0 };
         remaining = ZSTD_compressStream2(strm->stream.zstd_context, &output , &input, ZSTD_e_end);
-        if (ZSTD_isError(remaining))
-            return DRPM_ERR_OTHER;
+        if (ZSTD_isError(remaining)) {
+            error = DRPM_ERR_OTHER;
+            goto cleanup;
+        }
 
         if (output.pos == 0)
             continue;
-        if ((data_tmp = realloc(strm->data, strm->data_len + output.pos)) == NULL)
-            return DRPM_ERR_MEMORY;
+        if ((data_tmp = realloc(strm->data, strm->data_len + output.pos)) == NULL) {
+            error = DRPM_ERR_MEMORY;
+            goto cleanup;
+        }
         strm->data = data_tmp;
         memcpy(strm->data + strm->data_len, buffOut, output.pos);
         strm->data_len += output.pos;
     } while(remaining != 0);
 
+cleanup:
     free(buffOut);
     ZSTD_freeCCtx(strm->stream.zstd_context);
-    return DRPM_ERR_OK;
+
+    return error;
 }
 
 #endif
@@ -284,6 +357,7 @@ int init_bzip2(struct compstrm *strm, int level)
 {
     strm->write_chunk = writechunk_bzip2;
     strm->finish = finish_bzip2;
+    strm->end = end_bzip2;
 
     strm->stream.bzip2.bzalloc = NULL;
     strm->stream.bzip2.bzfree = NULL;
@@ -310,6 +384,7 @@ int init_gzip(struct compstrm *strm, int level)
 {
     strm->write_chunk = writechunk_gzip;
     strm->finish = finish_gzip;
+    strm->end = end_gzip;
 
     strm->stream.gzip.zalloc = Z_NULL;
     strm->stream.gzip.zfree = Z_NULL;
@@ -338,6 +413,7 @@ int init_lzma(struct compstrm *strm, int level)
 
     strm->write_chunk = writechunk_lzma;
     strm->finish = finish_lzma;
+    strm->end = end_lzma;
     strm->stream.lzma = stream;
 
     if (level == DRPM_COMP_LEVEL_DEFAULT)
@@ -363,12 +439,15 @@ int init_xz(struct compstrm *strm, int level)
 
     strm->write_chunk = writechunk_lzma;
     strm->finish = finish_lzma;
+    strm->end = end_lzma;
     strm->stream.lzma = stream;
     memset(&strm->stream.lzma, 0, sizeof(lzma_stream));
 
     if (level == DRPM_COMP_LEVEL_DEFAULT)
         level = 3;
 
+    strm->xz_preset = level;
+
     switch (lzma_easy_encoder(&strm->stream.lzma, level, LZMA_CHECK_SHA256)) {
     case LZMA_OK:
         break;
@@ -388,6 +467,7 @@ int init_lzip(struct compstrm *strm, int level)
 
     strm->write_chunk = writechunk_lzip;
     strm->finish = finish_lzip;
+    strm->end = end_lzip;
 
     if ((strm->stream.lzip = LZ_compress_open(65535, 16, SIZE_MAX)) == NULL)
         return DRPM_ERR_MEMORY;
@@ -413,17 +493,74 @@ int init_zstd(struct compstrm *strm, int level)
 
     strm->write_chunk = writechunk_zstd;
     strm->finish = finish_zstd;
+    strm->end = end_zstd;
 
     return DRPM_ERR_OK;
 }
 #endif
 
+/* Checks the <len> bytes of compressed data that have not been flushed
+ * yet against the file being compared with. */
+int compare_data(struct compstrm *strm, size_t len)
+{
+    unsigned char buffer[CHUNK_SIZE];
+    const unsigned char *data = strm->data + strm->data_pos;
+    const off_t offset = strm->cmp_offset + strm->comp_size;
+    ssize_t read_len;
+
+    for (size_t done = 0; done < len; done += read_len) {
+        if ((read_len = pread(strm->cmp_filedesc, buffer, MIN(sizeof(buffer), len - done),
+                              offset + done)) < 0)
+            return DRPM_ERR_IO;
+        // the file ending early is a mismatch as well
+        if (read_len == 0 || memcmp(buffer, data + done, read_len) != 0)
+            return DRPM_ERR_MISMATCH;
+    }
+
+    return DRPM_ERR_OK;
+}
+
+/* Writes out compressed data not yet written to the file (if any).
+ * When streaming, the data is hashed and then dropped from memory. */
+int flush_data(struct compstrm *strm)
+{
+    const size_t comp_write_len = strm->data_len - strm->data_pos;
+    int error;
+
+    if (strm->cmp_filedesc >= 0 && comp_write_len > 0 &&
+        (error = compare_data(strm, comp_write_len)) != DRPM_ERR_OK)
+        return error;
+
+    if (strm->filedesc >= 0 && comp_write_len > 0) {
+        if (write(strm->filedesc, strm->data + strm->data_pos,
+                  comp_write_len) != (ssize_t)comp_write_len)
+            return DRPM_ERR_IO;
+        if (strm->md5 != NULL &&
+            MD5_Update(strm->md5, strm->data + strm->data_pos, comp_write_len) != 1)
+            return DRPM_ERR_OTHER;
+    }
+
+    strm->comp_size += comp_write_len;
+
+    if (strm->keep_data) {
+        strm->data_pos = strm->data_len;
+    } else {
+        strm->data_len = 0;
+        strm->data_pos = 0;
+    }
+
+    return DRPM_ERR_OK;
+}
+
 /* Frees memory allocated by compression stream. */
 int compstrm_destroy(struct compstrm **strm)
 {
     if (strm == NULL || *strm == NULL)
         return DRPM_ERR_PROG;
 
+    if ((*strm)->end != NULL)
+        (*strm)->end(*strm);
+
     free((*strm)->data);
     free(*strm);
     *strm = NULL;
@@ -448,12 +585,25 @@ int compstrm_init(struct compstrm **strm, int filedesc, unsigned short comp, int
     (*strm)->data_len = 0;
     (*strm)->data_pos = 0;
     (*strm)->filedesc = filedesc;
+    (*strm)->md5 = NULL;
+    (*strm)->cmp_filedesc = -1;
+    (*strm)->cmp_offset = 0;
+    (*strm)->progress = NULL;
+    (*strm)->progress_phase = -1;
+    (*strm)->comp_size = 0;
+    (*strm)->keep_data = true;
+    (*strm)->xz_preset = UINT32_MAX;
+    (*strm)->sample_slice = 0;
+    (*strm)->sample_slices = 0;
+    (*strm)->sample_stride = 0;
+    (*strm)->sample_offset = 0;
     (*strm)->finished = false;
 
     switch (comp) {
     case DRPM_COMP_NONE:
         (*strm)->write_chunk = writechunk;
         (*strm)->finish = NULL;
+        (*strm)->end = NULL;
         break;
     case DRPM_COMP_GZIP:
         if ((error = init_gzip(*strm, level)) != DRPM_ERR_OK)
@@ -496,16 +646,197 @@ cleanup_fail:
     return error;
 }
 
+/* Primes the compressor with dictionary <dict> of size <dict_len>.
+ * Only zstd supports dictionaries. Must be called before any writes. */
+int compstrm_load_dict(struct compstrm *strm, const unsigned char *dict, size_t dict_len)
+{
+    if (strm == NULL || strm->data_len > 0 || dict == NULL)
+        return DRPM_ERR_PROG;
+
+#ifdef WITH_ZSTD
+    if (strm->write_chunk == writechunk_zstd) {
+        if (ZSTD_getDictID_fromDict(dict, dict_len) == 0 ||
+            ZSTD_isError(ZSTD_CCtx_loadDictionary(strm->stream.zstd_context, dict, dict_len)))
+            return DRPM_ERR_FORMAT;
+        return DRPM_ERR_OK;
+    }
+#else
+    (void)dict_len;
+#endif
+
+    return DRPM_ERR_ARGS;
+}
+
+/* Switches an xz stream to independent blocks of <block_size> bytes,
+ * as written by the multi-threaded xz encoder, and compresses them on
+ * up to <threads> threads. The output does not depend on the number of
+ * threads. Must be called before any writes. */
+int compstrm_set_xz_blocks(struct compstrm *strm, uint64_t block_size, unsigned threads)
+{
+#ifdef HAVE_LZMA_ENCODER_MT
+    lzma_stream stream = LZMA_STREAM_INIT;
+    lzma_mt mt = {0};
+    const uint64_t memlimit = MAX(lzma_physmem() / 4, 64 << 20);
+
+    if (strm == NULL || strm->comp_size > 0 || strm->data_len > 0 || block_size == 0)
+        return DRPM_ERR_PROG;
+
+    if (strm->xz_preset == UINT32_MAX)
+        return DRPM_ERR_ARGS;
+
+    mt.block_size = block_size;
+    mt.preset = strm->xz_preset;
+    mt.check = LZMA_CHECK_SHA256;
+    mt.threads = MAX(threads, 1);
+
+    // every thread buffers a whole block, so stay within a quarter of RAM
+    while (mt.threads > 1 && lzma_stream_encoder_mt_memusage(&mt) > memlimit)
+        mt.threads--;
+
+    lzma_end(&strm->stream.lzma);
+    strm->stream.lzma = stream;
+
+    switch (lzma_stream_encoder_mt(&strm->stream.lzma, &mt)) {
+    case LZMA_OK:
+        break;
+    case LZMA_MEM_ERROR:
+        return DRPM_ERR_MEMORY;
+    default:
+        return DRPM_ERR_FORMAT;
+    }
+
+    return DRPM_ERR_OK;
+#else
+    (void)strm;
+    (void)block_size;
+    (void)threads;
+
+    return DRPM_ERR_CONFIG;
+#endif
+}
+
+/* Sets zstd frame parameters: window log <window_log> (unless 0) and
+ * content checksum <checksum>. With <workers> > 0, compresses in
+ * multi-threaded mode, whose output differs from single-threaded mode
+ * but not between different numbers of workers. Must be called before
+ * any writes. */
+int compstrm_set_zstd_params(struct compstrm *strm, unsigned short window_log,
+                             bool checksum, unsigned workers)
+{
+#ifdef WITH_ZSTD
+    if (strm == NULL || strm->comp_size > 0 || strm->data_len > 0)
+        return DRPM_ERR_PROG;
+
+    if (strm->write_chunk != writechunk_zstd)
+        return DRPM_ERR_ARGS;
+
+    if ((window_log > 0 &&
+         ZSTD_isError(ZSTD_CCtx_setParameter(strm->stream.zstd_context, ZSTD_c_windowLog, window_log))) ||
+        ZSTD_isError(ZSTD_CCtx_setParameter(strm->stream.zstd_context, ZSTD_c_checksumFlag, checksum)))
+        return DRPM_ERR_FORMAT;
+
+    // fails if libzstd was built without multi-threading support
+    if (workers > 0 &&
+        ZSTD_isError(ZSTD_CCtx_setParameter(strm->stream.zstd_context, ZSTD_c_nbWorkers, workers)))
+        return DRPM_ERR_CONFIG;
+
+    return DRPM_ERR_OK;
+#else
+    (void)strm;
+    (void)window_log;
+    (void)checksum;
+    (void)workers;
+
+    return DRPM_ERR_CONFIG;
+#endif
+}
+
+/* Makes the stream write compressed data through to its file without
+ * keeping a copy in memory, updating <md5> (unless NULL) as it goes.
+ * Must be called before any writes. */
+int compstrm_set_streaming(struct compstrm *strm, MD5_CTX *md5)
+{
+    if (strm == NULL || strm->filedesc < 0 || strm->comp_size > 0)
+        return DRPM_ERR_PROG;
+
+    strm->md5 = md5;
+    strm->keep_data = false;
+
+    return DRPM_ERR_OK;
+}
+
+/* Makes a stream without a file compare compressed data against the
+ * contents of <filedesc> from <offset> on as it is produced, instead of
+ * keeping it in memory. Writes fail with DRPM_ERR_MISMATCH as soon as
+ * the data differs. Must be called before any writes. */
+int compstrm_set_comparing(struct compstrm *strm, int filedesc, off_t offset)
+{
+    if (strm == NULL || strm->filedesc >= 0 || filedesc < 0 || offset < 0 ||
+        strm->comp_size > 0 || strm->data_len > 0)
+        return DRPM_ERR_PROG;
+
+    strm->cmp_filedesc = filedesc;
+    strm->cmp_offset = offset;
+    strm->keep_data = false;
+
+    return DRPM_ERR_OK;
+}
+
+/* Counts bytes written to the stream as processed in <phase> of <prog>,
+ * so that long writes report progress and can be canceled in between. */
+int compstrm_set_progress(struct compstrm *strm, struct progress *prog, int phase)
+{
+    if (strm == NULL)
+        return DRPM_ERR_PROG;
+
+    strm->progress = prog;
+    strm->progress_phase = phase;
+
+    return DRPM_ERR_OK;
+}
+
+/* Makes an uncompressed stream keep a sample of at most <slice_count>
+ * slices of <slice_len> bytes, evenly spaced across all that is written
+ * to it however long that turns out to be, instead of keeping it all.
+ * Must be called before any writes. */
+int compstrm_set_sampling(struct compstrm *strm, size_t slice_len, size_t slice_count)
+{
+    if (strm == NULL || strm->comp_size > 0 || strm->data_len > 0 ||
+        slice_len == 0 || slice_count < 2 || slice_count > SIZE_MAX / slice_len)
+        return DRPM_ERR_PROG;
+
+    if (strm->write_chunk != writechunk || strm->filedesc >= 0)
+        return DRPM_ERR_ARGS;
+
+    strm->write_chunk = writechunk_sample;
+    strm->sample_slice = slice_len;
+    strm->sample_slices = slice_count;
+    strm->sample_stride = slice_len;
+
+    return DRPM_ERR_OK;
+}
+
+/* Fetches the total size of data compressed by this stream so far. */
+int compstrm_get_comp_size(struct compstrm *strm, size_t *size)
+{
+    if (strm == NULL || size == NULL)
+        return DRPM_ERR_PROG;
+
+    *size = strm->comp_size;
+
+    return DRPM_ERR_OK;
+}
+
 /* Finishes up compression.
  * If neither <data> nor <data_len> are NULL, stores all data
- * compressed by this stream in <*data> (and its size in <*data_len>). */
+ * compressed by this stream in <*data> (and its size in <*data_len>).
+ * This is not possible for a streaming compression stream. */
 int compstrm_finish(struct compstrm *strm, unsigned char **data, size_t *data_len)
 {
     int error;
-    size_t comp_write_len;
     const bool copy_data = (data != NULL && data_len != NULL);
 
-    if (strm == NULL || strm->finished)
+    if (strm == NULL || strm->finished || (copy_data && !strm->keep_data))
         return DRPM_ERR_PROG;
 
     if (copy_data) {
@@ -514,13 +845,11 @@ int compstrm_finish(struct compstrm *strm, unsigned char **data, size_t *data_le
     }
 
     if (strm->finish != NULL) {
-        if ((error = strm->finish(strm)) != DRPM_ERR_OK)
+        // finishing releases the encoder, whether it succeeds or not
+        strm->end = NULL;
+        if ((error = strm->finish(strm)) != DRPM_ERR_OK ||
+            (error = flush_data(strm)) != DRPM_ERR_OK)
             return error;
-        comp_write_len = strm->data_len - strm->data_pos;
-        if (strm->filedesc >= 0 && comp_write_len > 0 &&
-            write(strm->filedesc, strm->data + strm->data_pos,
-                  comp_write_len) != (ssize_t)comp_write_len)
-                return DRPM_ERR_IO;
     }
 
     strm->finished = true;
@@ -562,8 +891,8 @@ int compstrm_write_be64(struct compstrm *strm, uint64_t number)
 /* Compresses <write_len> bytes pointed to by <buffer>. */
 int compstrm_write(struct compstrm *strm, size_t write_len, const void *buffer)
 {
+    size_t chunk_len;
     int error;
-    size_t comp_write_len;
 
     if (strm == NULL || strm->finished)
         return DRPM_ERR_PROG;
@@ -574,18 +903,20 @@ int compstrm_write(struct compstrm *strm, size_t write_len, const void *buffer)
     if (buffer == NULL)
         return DRPM_ERR_PROG;
 
-    if ((error = strm->write_chunk(strm, write_len, buffer)) != DRPM_ERR_OK)
-        return error;
-
-    comp_write_len = strm->data_len - strm->data_pos;
-
-    if (strm->filedesc >= 0 && comp_write_len > 0) {
-        if (write(strm->filedesc, strm->data + strm->data_pos,
-                  comp_write_len) != (ssize_t)comp_write_len)
-            return DRPM_ERR_IO;
+    if (strm->progress == NULL) {
+        if ((error = strm->write_chunk(strm, write_len, buffer)) != DRPM_ERR_OK)
+            return error;
+        return flush_data(strm);
     }
 
-    strm->data_pos = strm->data_len;
+    /* in pieces, so that canceling does not wait for all of it */
+    for (size_t done = 0; done < write_len; done += chunk_len) {
+        chunk_len = MIN(write_len - done, PROGRESS_INTERVAL);
+        if ((error = strm->write_chunk(strm, chunk_len, (const unsigned char *)buffer + done)) != DRPM_ERR_OK ||
+            (error = flush_data(strm)) != DRPM_ERR_OK ||
+            (error = progress_add(strm->progress, strm->progress_phase, chunk_len)) != DRPM_ERR_OK)
+            return error;
+    }
 
     return DRPM_ERR_OK;
 }
@@ -607,6 +938,40 @@ int writechunk(struct compstrm *strm, size_t in_len, const void *in_buffer)
     return DRPM_ERR_OK;
 }
 
+// no compression, keeping only a sample
+int writechunk_sample(struct compstrm *strm, size_t in_len, const void *in_buffer)
+{
+    const unsigned char *in = in_buffer;
+    size_t stride_pos;
+    size_t n;
+    int error;
+
+    while (in_len > 0) {
+        stride_pos = strm->sample_offset % strm->sample_stride;
+        if (stride_pos >= strm->sample_slice) {
+            n = MIN(in_len, strm->sample_stride - stride_pos);
+        } else if (stride_pos == 0 && strm->data_len == strm->sample_slices * strm->sample_slice) {
+            /* full, so keeping every other slice at twice the stride */
+            for (size_t i = 1; 2 * i < strm->sample_slices; i++)
+                memcpy(strm->data + i * strm->sample_slice,
+                       strm->data + 2 * i * strm->sample_slice, strm->sample_slice);
+            strm->data_len = (strm->sample_slices + 1) / 2 * strm->sample_slice;
+            strm->data_pos = MIN(strm->data_pos, strm->data_len);
+            strm->sample_stride *= 2;
+            continue;
+        } else {
+            n = MIN(in_len, strm->sample_slice - stride_pos);
+            if ((error = writechunk(strm, n, in)) != DRPM_ERR_OK)
+                return error;
+        }
+        in += n;
+        in_len -= n;
+        strm->sample_offset += n;
+    }
+
+    return DRPM_ERR_OK;
+}
+
 int writechunk_bzip2(struct compstrm *strm, size_t in_len, const void *in_buffer)
 {
     unsigned char *data_tmp;
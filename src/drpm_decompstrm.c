@@ -26,8 +26,10 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <zlib.h>
 #include <bzlib.h>
 #include <lzma.h>
@@ -37,6 +39,7 @@
 #ifdef WITH_ZSTD
 #include <zstd.h>
 #endif
+#include <stdio.h>
 #include <openssl/md5.h>
 
 /* magic bytes for determining compression type */
@@ -47,11 +50,28 @@
 #define MAGIC_LZIP(x) (((x) >> 32) == 0x4C5A4950)
 #define MAGIC_ZSTD(x) (((x) >> 32) == 0x28B52FFD)
 
+/* longest zstd frame header (ZSTD_FRAMEHEADERSIZE_MAX is not part of
+ * the stable API) */
+#define ZSTD_FRAME_HEADER_MAX 18
+
+/* compressed input read ahead per thread for decoding zstd frames in parallel */
+#define ZSTD_READ_AHEAD (8 * 1024 * 1024)
+
+/* lzma_stream_decoder_mt() is part of the stable API since xz 5.4.0 */
+#if LZMA_VERSION >= 50040002
+#define HAVE_LZMA_DECODER_MT
+#endif
+
 struct decompstrm {
     unsigned char *data;
     size_t data_len;
     size_t data_pos;
+    size_t data_alloc;
+    size_t size_hint;
     int filedesc;
+    unsigned char *in_buffer;
+    unsigned char *input;
+    unsigned threads;
     union {
         z_stream gzip;
         bz_stream bzip2;
@@ -63,13 +83,19 @@ struct decompstrm {
         ZSTD_DCtx *zstd_context;
 #endif
     } stream;
+#ifdef WITH_ZSTD
+    ZSTD_DDict *zstd_dict;
+#endif
     bool lzip_eof;
+    bool lzma_end;
     int (*read_chunk)(struct decompstrm *);
     void (*finish)(struct decompstrm *);
     size_t comp_size;
     MD5_CTX *md5;
     const unsigned char *buffer;
     size_t buffer_len;
+    struct progress *progress; // where bytes decompressed are counted, if anywhere
+    int progress_phase;
 };
 
 static void finish_bzip2(struct decompstrm *);
@@ -78,15 +104,21 @@ static void finish_lzma(struct decompstrm *);
 static int init_bzip2(struct decompstrm *);
 static int init_gzip(struct decompstrm *);
 static int init_lzma(struct decompstrm *);
+#ifdef HAVE_LZMA_DECODER_MT
+static int init_xz_mt(struct decompstrm *);
+#endif
 static int readchunk(struct decompstrm *);
 static int readchunk_bzip2(struct decompstrm *);
 static int readchunk_gzip(struct decompstrm *);
+static int readchunk_input(struct decompstrm *, const unsigned char **, size_t *);
 static int readchunk_lzma(struct decompstrm *);
+static int reserve_output(struct decompstrm *, size_t);
 
 #ifdef HAVE_LZLIB_DEVEL
 static void finish_lzip(struct decompstrm *);
 static int init_lzip(struct decompstrm *);
 static int readchunk_lzip(struct decompstrm *);
+static int readchunk_lzip_drain(struct decompstrm *);
 
 static int lzip_error(struct decompstrm *strm)
 {
@@ -108,6 +140,24 @@ static int lzip_error(struct decompstrm *strm)
 static void finish_zstd(struct decompstrm *);
 static int init_zstd(struct decompstrm *);
 static int readchunk_zstd(struct decompstrm *);
+static int readall_zstd_mt(struct decompstrm *, bool *);
+static int decode_zstd_frame(void *, size_t);
+static int decode_zstd_frames(struct decompstrm *, const unsigned char *, size_t, size_t *);
+static int decode_zstd_stream(struct decompstrm *, const unsigned char *, size_t);
+
+struct zstd_frame {
+    size_t in_offset;
+    size_t in_len;
+    size_t out_offset;
+    size_t out_len;
+};
+
+struct zstd_frames {
+    const unsigned char *in;
+    unsigned char *out;
+    struct zstd_frame *frames;
+    const ZSTD_DDict *dict;
+};
 #endif
 
 /* Functions for finishing decompression for individual methods. */
@@ -138,6 +188,7 @@ void finish_lzip(struct decompstrm *strm)
 void finish_zstd(struct decompstrm *strm)
 {
     ZSTD_freeDCtx(strm->stream.zstd_context);
+    ZSTD_freeDDict(strm->zstd_dict);
 }
 
 #endif
@@ -208,6 +259,39 @@ int init_lzma(struct decompstrm *strm)
     return DRPM_ERR_OK;
 }
 
+#ifdef HAVE_LZMA_DECODER_MT
+/* Multi-block xz streams are decoded in parallel, liblzma falls back
+ * to single-threaded decoding on its own for single-block streams. */
+int init_xz_mt(struct decompstrm *strm)
+{
+    lzma_stream stream = LZMA_STREAM_INIT;
+    lzma_mt mt = {0};
+
+    strm->read_chunk = readchunk_lzma;
+    strm->finish = finish_lzma;
+    strm->stream.lzma = stream;
+
+    mt.threads = strm->threads;
+    // beyond a quarter of RAM liblzma decodes serially instead
+    mt.memlimit_threading = MAX(lzma_physmem() / 4, 64 << 20);
+    mt.memlimit_stop = UINT64_MAX;
+
+    switch (lzma_stream_decoder_mt(&strm->stream.lzma, &mt)) {
+    case LZMA_OK:
+        break;
+    case LZMA_MEM_ERROR:
+        return DRPM_ERR_MEMORY;
+    case LZMA_UNSUPPORTED_CHECK:
+    case LZMA_OPTIONS_ERROR:
+        return init_lzma(strm);
+    default:
+        return DRPM_ERR_FORMAT;
+    }
+
+    return DRPM_ERR_OK;
+}
+#endif
+
 #ifdef HAVE_LZLIB_DEVEL
 int init_lzip(struct decompstrm *strm)
 {
@@ -233,6 +317,7 @@ int init_zstd(struct decompstrm *strm)
     if ((strm->stream.zstd_context = ZSTD_createDCtx()) == NULL)
         return DRPM_ERR_MEMORY;
 
+    strm->zstd_dict = NULL;
     strm->read_chunk = readchunk_zstd;
     strm->finish = finish_zstd;
 
@@ -250,6 +335,8 @@ int decompstrm_destroy(struct decompstrm **strm)
         (*strm)->finish(*strm);
 
     free((*strm)->data);
+    free((*strm)->in_buffer);
+    free((*strm)->input);
     free(*strm);
     *strm = NULL;
 
@@ -260,9 +347,11 @@ int decompstrm_destroy(struct decompstrm **strm)
  * The detected compression method will be stored in <*comp> (if not NULL).
  * If <md5> is not NULL, input data will be used to update the MD5 context.
  * If <filedesc> is valid, compressed data will be read from the file.
- * Otherwise, input data is read from <buffer> of size <buffer_len>. */
+ * Otherwise, input data is read from <buffer> of size <buffer_len>.
+ * With <threads> greater than 1, multi-block xz and multi-frame zstd
+ * data is decompressed in parallel. */
 int decompstrm_init(struct decompstrm **strm, int filedesc, unsigned short *comp, MD5_CTX *md5,
-                    const unsigned char *buffer, size_t buffer_len)
+                    const unsigned char *buffer, size_t buffer_len, unsigned threads)
 {
     uint64_t magic;
     int error = DRPM_ERR_OK;
@@ -285,11 +374,19 @@ int decompstrm_init(struct decompstrm **strm, int filedesc, unsigned short *comp
     (*strm)->data = NULL;
     (*strm)->data_len = 0;
     (*strm)->data_pos = 0;
+    (*strm)->data_alloc = 0;
+    (*strm)->size_hint = 0;
     (*strm)->filedesc = filedesc;
+    (*strm)->in_buffer = NULL;
+    (*strm)->input = NULL;
+    (*strm)->threads = MAX(threads, 1);
+    (*strm)->lzma_end = false;
     (*strm)->comp_size = 0;
     (*strm)->md5 = md5;
     (*strm)->buffer = buffer;
     (*strm)->buffer_len = buffer_len;
+    (*strm)->progress = NULL;
+    (*strm)->progress_phase = -1;
 
     if (MAGIC_GZIP(magic)) {
         if (comp != NULL)
@@ -304,7 +401,13 @@ int decompstrm_init(struct decompstrm **strm, int filedesc, unsigned short *comp
     } else if (MAGIC_XZ(magic)) {
         if (comp != NULL)
             *comp = DRPM_COMP_XZ;
-        if ((error = init_lzma(*strm)) != DRPM_ERR_OK)
+#ifdef HAVE_LZMA_DECODER_MT
+        if ((*strm)->threads > 1)
+            error = init_xz_mt(*strm);
+        else
+#endif
+        error = init_lzma(*strm);
+        if (error != DRPM_ERR_OK)
             goto cleanup_fail;
     } else if (MAGIC_LZMA(magic)) {
         if (comp != NULL)
@@ -341,6 +444,112 @@ cleanup_fail:
     return error;
 }
 
+/* If the stream is zstd-compressed with a dictionary, loads the dictionary
+ * from <dict_dir> (or the default directory if NULL).
+ * Dictionaries are looked up by their ID as "<dict_dir>/<ID>.dict".
+ * Must be called before any data is read from the stream. */
+int decompstrm_load_dict(struct decompstrm *strm, const char *dict_dir)
+{
+#ifdef WITH_ZSTD
+    unsigned char header[ZSTD_FRAME_HEADER_MAX];
+    const unsigned char *frame;
+    ssize_t header_len;
+    unsigned dict_id;
+    char *path;
+    unsigned char *dict = NULL;
+    size_t dict_len;
+    int error;
+
+    if (strm == NULL || strm->comp_size > 0)
+        return DRPM_ERR_PROG;
+
+    if (strm->read_chunk != readchunk_zstd)
+        return DRPM_ERR_OK;
+
+    if (strm->filedesc < 0) {
+        frame = strm->buffer;
+        header_len = MIN(strm->buffer_len, ZSTD_FRAME_HEADER_MAX);
+    } else {
+        if ((header_len = read(strm->filedesc, header, ZSTD_FRAME_HEADER_MAX)) < 0 ||
+            lseek(strm->filedesc, -header_len, SEEK_CUR) == -1)
+            return DRPM_ERR_IO;
+        frame = header;
+    }
+
+    if ((dict_id = ZSTD_getDictID_fromFrame(frame, header_len)) == 0)
+        return DRPM_ERR_OK;
+
+    if (dict_dir == NULL)
+        dict_dir = DRPM_ZSTD_DICT_DIR;
+
+    if ((path = malloc(strlen(dict_dir) + 17)) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    sprintf(path, "%s/%u.dict", dict_dir, dict_id);
+
+    if ((error = read_file(path, &dict, &dict_len)) != DRPM_ERR_OK)
+        goto cleanup;
+
+    if (ZSTD_getDictID_fromDict(dict, dict_len) != dict_id) {
+        error = DRPM_ERR_FORMAT;
+        goto cleanup;
+    }
+
+    // digested once, shared by the serial decoder and frame workers
+    if ((strm->zstd_dict = ZSTD_createDDict(dict, dict_len)) == NULL) {
+        error = DRPM_ERR_MEMORY;
+        goto cleanup;
+    }
+
+    if (ZSTD_isError(ZSTD_DCtx_refDDict(strm->stream.zstd_context, strm->zstd_dict)))
+        error = DRPM_ERR_FORMAT;
+
+cleanup:
+    free(dict);
+    free(path);
+
+    return error;
+#else
+    (void)dict_dir;
+
+    if (strm == NULL)
+        return DRPM_ERR_PROG;
+
+    return DRPM_ERR_OK;
+#endif
+}
+
+/* Hints that about <size> more bytes of decompressed data are expected,
+ * so that the output window can be allocated once up front.
+ * Failing to allocate is not an error, the window simply grows on demand. */
+int decompstrm_reserve(struct decompstrm *strm, size_t size)
+{
+    if (strm == NULL)
+        return DRPM_ERR_PROG;
+
+    if (size == 0 || UNSIGNED_SUM_OVERFLOWS(strm->data_len, size))
+        return DRPM_ERR_OK;
+
+    strm->size_hint = strm->data_len + size;
+    if (reserve_output(strm, size) != DRPM_ERR_OK)
+        strm->size_hint = 0;
+
+    return DRPM_ERR_OK;
+}
+
+/* Counts bytes decompressed by decompstrm_read_until_eof() as processed
+ * in <phase> of <prog>, so that reading can be canceled in between. */
+int decompstrm_set_progress(struct decompstrm *strm, struct progress *prog, int phase)
+{
+    if (strm == NULL)
+        return DRPM_ERR_PROG;
+
+    strm->progress = prog;
+    strm->progress_phase = phase;
+
+    return DRPM_ERR_OK;
+}
+
 /* Fetches size of *compressed* data. */
 int decompstrm_get_comp_size(struct decompstrm *strm, size_t *size)
 {
@@ -404,21 +613,35 @@ int decompstrm_read(struct decompstrm *strm, size_t read_len, void *buffer_ret)
 
     strm->data_pos += read_len;
 
+    // everything consumed, reuse the window
+    if (strm->data_pos == strm->data_len)
+        strm->data_pos = strm->data_len = 0;
+
     return DRPM_ERR_OK;
 }
 
 /* Decompresses the entire file and stores the result <*buffer_ret>
- * (and the size <*len_ret>). */
+ * (and the size <*len_ret>).
+ * If nothing has been read from the stream yet, the output window
+ * itself is handed over to the caller instead of being copied. */
 int decompstrm_read_until_eof(struct decompstrm *strm,
                               size_t *len_ret, unsigned char **buffer_ret)
 {
     int error;
     bool eof = false;
     size_t data_len_prev;
+    unsigned char *data_tmp;
 
     if (strm == NULL || (buffer_ret != NULL && len_ret == NULL))
         return DRPM_ERR_PROG;
 
+#ifdef WITH_ZSTD
+    if (strm->threads > 1 && strm->read_chunk == readchunk_zstd &&
+        strm->comp_size == 0 &&
+        (error = readall_zstd_mt(strm, &eof)) != DRPM_ERR_OK)
+        return error;
+#endif
+
     while (!eof) {
         data_len_prev = strm->data_len;
         switch ((error = strm->read_chunk(strm))) {
@@ -432,15 +655,28 @@ int decompstrm_read_until_eof(struct decompstrm *strm,
         }
         if (data_len_prev > strm->data_len)
             return DRPM_ERR_OVERFLOW;
+        if ((error = progress_add(strm->progress, strm->progress_phase,
+                                  strm->data_len - data_len_prev)) != DRPM_ERR_OK)
+            return error;
     }
 
     if (len_ret != NULL) {
         *len_ret = strm->data_len - strm->data_pos;
         if (buffer_ret != NULL) {
-            if ((*buffer_ret = malloc(*len_ret)) == NULL)
-                return DRPM_ERR_MEMORY;
-            memcpy(*buffer_ret, strm->data + strm->data_pos, *len_ret);
-            strm->data_pos = strm->data_len;
+            if (strm->data_pos == 0) {
+                if (*len_ret > 0 && *len_ret < strm->data_alloc &&
+                    (data_tmp = realloc(strm->data, *len_ret)) != NULL)
+                    strm->data = data_tmp;
+                *buffer_ret = strm->data;
+                strm->data = NULL;
+                strm->data_alloc = 0;
+                strm->data_len = 0;
+            } else {
+                if ((*buffer_ret = malloc(*len_ret)) == NULL)
+                    return DRPM_ERR_MEMORY;
+                memcpy(*buffer_ret, strm->data + strm->data_pos, *len_ret);
+                strm->data_pos = strm->data_len;
+            }
         }
     }
 
@@ -449,68 +685,125 @@ int decompstrm_read_until_eof(struct decompstrm *strm,
 
 /* Functions for decompressing chunks of data. */
 
-// no compression
-int readchunk(struct decompstrm *strm)
+/* Fetches the next batch of compressed input (up to DECOMP_READ_SIZE bytes).
+ * When reading from memory, <*in> points directly into the source buffer,
+ * otherwise data is read into the stream's input buffer.
+ * A zero <*in_len> signals end of input. */
+int readchunk_input(struct decompstrm *strm, const unsigned char **in, size_t *in_len)
 {
-    ssize_t in_len;
-    unsigned char *data_tmp;
-    unsigned char buffer[CHUNK_SIZE];
+    ssize_t bytes_read;
 
     if (strm->filedesc < 0) {
-        in_len = MIN(CHUNK_SIZE, strm->buffer_len);
-        memcpy(buffer, strm->buffer, in_len);
-        strm->buffer += in_len;
-        strm->buffer_len -= in_len;
+        *in = strm->buffer;
+        *in_len = MIN(DECOMP_READ_SIZE, strm->buffer_len);
+        strm->buffer += *in_len;
+        strm->buffer_len -= *in_len;
     } else {
-        if ((in_len = read(strm->filedesc, buffer, CHUNK_SIZE)) < 0)
+        if (strm->in_buffer == NULL &&
+            (strm->in_buffer = malloc(DECOMP_READ_SIZE)) == NULL)
+            return DRPM_ERR_MEMORY;
+        if ((bytes_read = read(strm->filedesc, strm->in_buffer, DECOMP_READ_SIZE)) < 0)
             return DRPM_ERR_IO;
+        *in = strm->in_buffer;
+        *in_len = bytes_read;
     }
 
-    if (in_len == 0)
-        return DRPM_ERR_FORMAT;
+    strm->comp_size += *in_len;
 
-    if ((data_tmp = realloc(strm->data, strm->data_len + in_len)) == NULL)
-        return DRPM_ERR_MEMORY;
+    if (*in_len > 0 && strm->md5 != NULL && MD5_Update(strm->md5, *in, *in_len) != 1)
+        return DRPM_ERR_OTHER;
 
-    strm->data = data_tmp;
-    memcpy(strm->data + strm->data_len, buffer, in_len);
-    strm->data_len += in_len;
+    return DRPM_ERR_OK;
+}
 
-    strm->comp_size = strm->data_len;
+/* Makes sure there is room for at least <min_free> more bytes of
+ * decompressed data after <strm->data_len>.
+ * Grows up to the size hint first (if any), then geometrically. */
+int reserve_output(struct decompstrm *strm, size_t min_free)
+{
+    unsigned char *data_tmp;
+    size_t new_alloc;
 
-    if (strm->md5 != NULL && MD5_Update(strm->md5, buffer, in_len) != 1)
-        return DRPM_ERR_OTHER;
+    if (strm->data_alloc - strm->data_len >= min_free)
+        return DRPM_ERR_OK;
+
+    if (UNSIGNED_SUM_OVERFLOWS(strm->data_len, min_free))
+        return DRPM_ERR_OVERFLOW;
+
+    if (strm->size_hint >= strm->data_len + min_free) {
+        new_alloc = strm->size_hint;
+    } else if (strm->size_hint > 0) {
+        // hint exhausted, most likely only the end of stream is left
+        new_alloc = strm->data_len + min_free;
+        strm->size_hint = 0;
+    } else {
+        new_alloc = strm->data_alloc * 2;
+        if (new_alloc < strm->data_alloc || new_alloc < strm->data_len + min_free)
+            new_alloc = strm->data_len + min_free;
+    }
+
+    if ((data_tmp = realloc(strm->data, new_alloc)) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    strm->data = data_tmp;
+    strm->data_alloc = new_alloc;
 
     return DRPM_ERR_OK;
 }
 
-int readchunk_bzip2(struct decompstrm *strm)
+// no compression
+int readchunk(struct decompstrm *strm)
 {
     ssize_t in_len;
-    unsigned char *data_tmp;
-    char in_buffer[CHUNK_SIZE];
-    char out_buffer[CHUNK_SIZE];
-    size_t out_len;
+    int error;
+
+    if ((error = reserve_output(strm, DECOMP_READ_SIZE)) != DRPM_ERR_OK)
+        return error;
 
     if (strm->filedesc < 0) {
-        in_len = MIN(CHUNK_SIZE, strm->buffer_len);
-        memcpy(in_buffer, strm->buffer, in_len);
+        in_len = MIN(DECOMP_READ_SIZE, strm->buffer_len);
+        memcpy(strm->data + strm->data_len, strm->buffer, in_len);
         strm->buffer += in_len;
         strm->buffer_len -= in_len;
     } else {
-        if ((in_len = read(strm->filedesc, in_buffer, CHUNK_SIZE)) < 0)
+        if ((in_len = read(strm->filedesc, strm->data + strm->data_len, DECOMP_READ_SIZE)) < 0)
             return DRPM_ERR_IO;
     }
 
     if (in_len == 0)
         return DRPM_ERR_FORMAT;
 
-    strm->stream.bzip2.next_in = in_buffer;
+    if (strm->md5 != NULL && MD5_Update(strm->md5, strm->data + strm->data_len, in_len) != 1)
+        return DRPM_ERR_OTHER;
+
+    strm->data_len += in_len;
+    strm->comp_size += in_len;
+
+    return DRPM_ERR_OK;
+}
+
+int readchunk_bzip2(struct decompstrm *strm)
+{
+    const unsigned char *in;
+    size_t in_len;
+    size_t out_avail;
+    int error;
+
+    if ((error = readchunk_input(strm, &in, &in_len)) != DRPM_ERR_OK)
+        return error;
+
+    if (in_len == 0)
+        return DRPM_ERR_FORMAT;
+
+    strm->stream.bzip2.next_in = (char *)in;
     strm->stream.bzip2.avail_in = in_len;
 
     do {
-        strm->stream.bzip2.next_out = out_buffer;
-        strm->stream.bzip2.avail_out = CHUNK_SIZE;
+        if ((error = reserve_output(strm, DECOMP_OUT_MIN)) != DRPM_ERR_OK)
+            return error;
+        out_avail = MIN(strm->data_alloc - strm->data_len, UINT_MAX);
+        strm->stream.bzip2.next_out = (char *)strm->data + strm->data_len;
+        strm->stream.bzip2.avail_out = out_avail;
         switch (BZ2_bzDecompress(&strm->stream.bzip2)) {
         case BZ_DATA_ERROR:
         case BZ_DATA_ERROR_MAGIC:
@@ -518,52 +811,34 @@ int readchunk_bzip2(struct decompstrm *strm)
         case BZ_MEM_ERROR:
             return DRPM_ERR_MEMORY;
         }
-        out_len = CHUNK_SIZE - strm->stream.bzip2.avail_out;
-        if (out_len == 0)
-            continue;
-        if ((data_tmp = realloc(strm->data, strm->data_len + out_len))
-            == NULL)
-            return DRPM_ERR_MEMORY;
-        strm->data = data_tmp;
-        memcpy(strm->data + strm->data_len, out_buffer, out_len);
-        strm->data_len += out_len;
+        strm->data_len += out_avail - strm->stream.bzip2.avail_out;
     } while (!strm->stream.bzip2.avail_out);
 
-    strm->comp_size += in_len;
-
-    if (strm->md5 != NULL && MD5_Update(strm->md5, in_buffer, in_len) != 1)
-        return DRPM_ERR_OTHER;
-
     return DRPM_ERR_OK;
 }
 
 int readchunk_gzip(struct decompstrm *strm)
 {
-    ssize_t in_len;
-    unsigned char *data_tmp;
-    unsigned char in_buffer[CHUNK_SIZE];
-    unsigned char out_buffer[CHUNK_SIZE];
-    size_t out_len;
+    const unsigned char *in;
+    size_t in_len;
+    size_t out_avail;
+    int error;
 
-    if (strm->filedesc < 0) {
-        in_len = MIN(CHUNK_SIZE, strm->buffer_len);
-        memcpy(in_buffer, strm->buffer, in_len);
-        strm->buffer += in_len;
-        strm->buffer_len -= in_len;
-    } else {
-        if ((in_len = read(strm->filedesc, in_buffer, CHUNK_SIZE)) < 0)
-            return DRPM_ERR_IO;
-    }
+    if ((error = readchunk_input(strm, &in, &in_len)) != DRPM_ERR_OK)
+        return error;
 
     if (in_len == 0)
         return DRPM_ERR_FORMAT;
 
-    strm->stream.gzip.next_in = in_buffer;
+    strm->stream.gzip.next_in = (unsigned char *)in;
     strm->stream.gzip.avail_in = in_len;
 
     do {
-        strm->stream.gzip.next_out = out_buffer;
-        strm->stream.gzip.avail_out = CHUNK_SIZE;
+        if ((error = reserve_output(strm, DECOMP_OUT_MIN)) != DRPM_ERR_OK)
+            return error;
+        out_avail = MIN(strm->data_alloc - strm->data_len, UINT_MAX);
+        strm->stream.gzip.next_out = strm->data + strm->data_len;
+        strm->stream.gzip.avail_out = out_avail;
         switch (inflate(&strm->stream.gzip, Z_SYNC_FLUSH)) {
         case Z_DATA_ERROR:
         case Z_NEED_DICT:
@@ -572,55 +847,40 @@ int readchunk_gzip(struct decompstrm *strm)
         case Z_MEM_ERROR:
             return DRPM_ERR_MEMORY;
         }
-        out_len = CHUNK_SIZE - strm->stream.gzip.avail_out;
-        if (out_len == 0)
-            continue;
-        if ((data_tmp = realloc(strm->data, strm->data_len + out_len))
-            == NULL)
-            return DRPM_ERR_MEMORY;
-        strm->data = data_tmp;
-        memcpy(strm->data + strm->data_len, out_buffer, out_len);
-        strm->data_len += out_len;
+        strm->data_len += out_avail - strm->stream.gzip.avail_out;
     } while (!strm->stream.gzip.avail_out);
 
-    strm->comp_size += in_len;
-
-    if (strm->md5 != NULL && MD5_Update(strm->md5, in_buffer, in_len) != 1)
-        return DRPM_ERR_OTHER;
-
     return DRPM_ERR_OK;
 }
 
 int readchunk_lzma(struct decompstrm *strm)
 {
-    ssize_t in_len;
-    unsigned char *data_tmp;
-    unsigned char in_buffer[CHUNK_SIZE];
-    unsigned char out_buffer[CHUNK_SIZE];
-    size_t out_len;
+    const unsigned char *in;
+    size_t in_len;
+    size_t out_avail;
+    int error;
 
-    if (strm->filedesc < 0) {
-        in_len = MIN(CHUNK_SIZE, strm->buffer_len);
-        memcpy(in_buffer, strm->buffer, in_len);
-        strm->buffer += in_len;
-        strm->buffer_len -= in_len;
-    } else {
-        if ((in_len = read(strm->filedesc, in_buffer, CHUNK_SIZE)) < 0)
-            return DRPM_ERR_IO;
-    }
+    if ((error = readchunk_input(strm, &in, &in_len)) != DRPM_ERR_OK)
+        return error;
 
-    if (in_len == 0)
+    // flush whatever the decoder still holds (the threaded one may lag behind)
+    if (in_len == 0 && strm->lzma_end)
         return DRPM_ERR_FORMAT;
 
-    strm->stream.lzma.next_in = in_buffer;
+    strm->stream.lzma.next_in = in;
     strm->stream.lzma.avail_in = in_len;
 
     do {
-        strm->stream.lzma.next_out = out_buffer;
-        strm->stream.lzma.avail_out = CHUNK_SIZE;
-        switch (lzma_code(&strm->stream.lzma, LZMA_RUN)) {
+        if ((error = reserve_output(strm, DECOMP_OUT_MIN)) != DRPM_ERR_OK)
+            return error;
+        out_avail = strm->data_alloc - strm->data_len;
+        strm->stream.lzma.next_out = strm->data + strm->data_len;
+        strm->stream.lzma.avail_out = out_avail;
+        switch (lzma_code(&strm->stream.lzma, (in_len == 0) ? LZMA_FINISH : LZMA_RUN)) {
         case LZMA_OK:
+            break;
         case LZMA_STREAM_END:
+            strm->lzma_end = true;
             break;
         case LZMA_FORMAT_ERROR:
         case LZMA_OPTIONS_ERROR:
@@ -632,99 +892,69 @@ int readchunk_lzma(struct decompstrm *strm)
         default:
             return DRPM_ERR_OTHER;
         }
-        out_len = CHUNK_SIZE - strm->stream.lzma.avail_out;
-        if (out_len == 0)
-            continue;
-        if ((data_tmp = realloc(strm->data, strm->data_len + out_len))
-            == NULL)
-            return DRPM_ERR_MEMORY;
-        strm->data = data_tmp;
-        memcpy(strm->data + strm->data_len, out_buffer, out_len);
-        strm->data_len += out_len;
-    } while (!strm->stream.lzma.avail_out);
+        strm->data_len += out_avail - strm->stream.lzma.avail_out;
+    } while (!strm->stream.lzma.avail_out || (in_len == 0 && !strm->lzma_end));
 
-    strm->comp_size += in_len;
+    return DRPM_ERR_OK;
+}
 
-    if (strm->md5 != NULL && MD5_Update(strm->md5, in_buffer, in_len) != 1)
-        return DRPM_ERR_OTHER;
+#ifdef HAVE_LZLIB_DEVEL
+/* Moves whatever the lzip decoder has ready straight into the data window. */
+int readchunk_lzip_drain(struct decompstrm *strm)
+{
+    int error;
+    int rd;
+
+    if ((error = reserve_output(strm, DECOMP_OUT_MIN)) != DRPM_ERR_OK)
+        return error;
+
+    if ((rd = LZ_decompress_read(strm->stream.lzip, strm->data + strm->data_len,
+                                 MIN(strm->data_alloc - strm->data_len, INT_MAX))) < 0) {
+        error = lzip_error(strm);
+        return error == DRPM_ERR_OK ? DRPM_ERR_OTHER : error;
+    }
+
+    strm->data_len += rd;
 
     return DRPM_ERR_OK;
 }
 
-#ifdef HAVE_LZLIB_DEVEL
 int readchunk_lzip(struct decompstrm *strm)
 {
     int error;
-    unsigned char *data_tmp;
-    ssize_t in_len;
-    unsigned char in_buffer[CHUNK_SIZE];
-    unsigned char out_buffer[CHUNK_SIZE];
-    size_t out_len;
-    ssize_t written = 0;
+    const unsigned char *in;
+    size_t in_len;
+    size_t written = 0;
     int wr;
-    int rd;
 
     if (strm->lzip_eof)
         return DRPM_ERR_FORMAT;
 
-    if (strm->filedesc < 0) {
-        in_len = MIN(CHUNK_SIZE, strm->buffer_len);
-        memcpy(in_buffer, strm->buffer, in_len);
-        strm->buffer += in_len;
-        strm->buffer_len -= in_len;
-    } else {
-        if ((in_len = read(strm->filedesc, in_buffer, CHUNK_SIZE)) < 0)
-            return DRPM_ERR_IO;
-    }
+    if ((error = readchunk_input(strm, &in, &in_len)) != DRPM_ERR_OK)
+        return error;
 
     if (in_len == 0) {
         strm->lzip_eof = true;
         LZ_decompress_finish(strm->stream.lzip);
         do {
-            if ((rd = LZ_decompress_read(strm->stream.lzip, out_buffer, CHUNK_SIZE)) < 0) {
-                error = lzip_error(strm);
-                return error == DRPM_ERR_OK ? DRPM_ERR_OTHER : error;
-            }
-            out_len = rd;
-            if (out_len == 0)
-                continue;
-            if ((data_tmp = realloc(strm->data, strm->data_len + out_len)) == NULL)
-                return DRPM_ERR_MEMORY;
-            strm->data = data_tmp;
-            memcpy(strm->data + strm->data_len, out_buffer, out_len);
-            strm->data_len += out_len;
+            if ((error = readchunk_lzip_drain(strm)) != DRPM_ERR_OK)
+                return error;
         } while (!LZ_decompress_finished(strm->stream.lzip));
     } else {
         while (written < in_len) {
             if (LZ_decompress_write_size(strm->stream.lzip) > 0) {
-                if ((wr = LZ_decompress_write(strm->stream.lzip,
-                                              in_buffer + written,
-                                              in_len - written)) < 0) {
+                if ((wr = LZ_decompress_write(strm->stream.lzip, in + written,
+                                              MIN(in_len - written, INT_MAX))) < 0) {
                     error = lzip_error(strm);
                     return error == DRPM_ERR_OK ? DRPM_ERR_OTHER : error;
                 }
                 written += wr;
             }
-            if ((rd = LZ_decompress_read(strm->stream.lzip, out_buffer, CHUNK_SIZE)) < 0) {
-                error = lzip_error(strm);
-                return error == DRPM_ERR_OK ? DRPM_ERR_OTHER : error;
-            }
-            out_len = rd;
-            if (out_len == 0)
-                continue;
-            if ((data_tmp = realloc(strm->data, strm->data_len + out_len)) == NULL)
-                return DRPM_ERR_MEMORY;
-            strm->data = data_tmp;
-            memcpy(strm->data + strm->data_len, out_buffer, out_len);
-            strm->data_len += out_len;
-        };
+            if ((error = readchunk_lzip_drain(strm)) != DRPM_ERR_OK)
+                return error;
+        }
     }
 
-    strm->comp_size += in_len;
-
-    if (strm->md5 != NULL && MD5_Update(strm->md5, in_buffer, in_len) != 1)
-        return DRPM_ERR_OTHER;
-
     return DRPM_ERR_OK;
 }
 #endif
@@ -732,50 +962,188 @@ int readchunk_lzip(struct decompstrm *strm)
 #ifdef WITH_ZSTD
 int readchunk_zstd(struct decompstrm *strm)
 {
-    ssize_t in_len;
-    unsigned char *data_tmp;
-    unsigned char in_buffer[CHUNK_SIZE];
+    const unsigned char *in;
+    size_t in_len;
+    int error;
 
-    if (strm->filedesc < 0) {
-        in_len = MIN(CHUNK_SIZE, strm->buffer_len);
-        memcpy(in_buffer, strm->buffer, in_len);
-        strm->buffer += in_len;
-        strm->buffer_len -= in_len;
-    } else {
-        if ((in_len = read(strm->filedesc, in_buffer, CHUNK_SIZE)) < 0)
-            return DRPM_ERR_IO;
-    }
+    if ((error = readchunk_input(strm, &in, &in_len)) != DRPM_ERR_OK)
+        return error;
 
     if (in_len == 0)
         return DRPM_ERR_FORMAT;
 
-    size_t const buffOutSize = ZSTD_DStreamOutSize();
-    void* const buffOut = malloc(buffOutSize);
-    if (buffOut == NULL)
-        return DRPM_ERR_MEMORY;
+    return decode_zstd_stream(strm, in, in_len);
+}
 
-    ZSTD_inBuffer input = { in_buffer, in_len, 0 };
+/* feeds <in> (of <in_len> bytes) through the serial decoder */
+int decode_zstd_stream(struct decompstrm *strm, const unsigned char *in, size_t in_len)
+{
+    size_t ret;
+    int error;
+    ZSTD_outBuffer output;
+    ZSTD_inBuffer input = { in, in_len, 0 };
 
-    while (input.pos < input.size) {
-        ZSTD_outBuffer output = { buffOut, buffOutSize, 0 };
-        size_t const ret = ZSTD_decompressStream(strm->stream.zstd_context, &output , &input);
+    do {
+        if ((error = reserve_output(strm, ZSTD_DStreamOutSize())) != DRPM_ERR_OK)
+            return error;
+        output.dst = strm->data + strm->data_len;
+        output.size = strm->data_alloc - strm->data_len;
+        output.pos = 0;
+        ret = ZSTD_decompressStream(strm->stream.zstd_context, &output, &input);
         if (ZSTD_isError(ret))
             return DRPM_ERR_OTHER;
-        if (output.pos == 0)
-            continue;
-        if ((data_tmp = realloc(strm->data, strm->data_len + output.pos)) == NULL)
-            return DRPM_ERR_MEMORY;
-        strm->data = data_tmp;
-        memcpy(strm->data + strm->data_len, buffOut, output.pos);
         strm->data_len += output.pos;
+    } while (input.pos < input.size || output.pos == output.size);
+
+    return DRPM_ERR_OK;
+}
+#endif
+
+#ifdef WITH_ZSTD
+/* Decodes one frame of a multi-frame zstd stream (run in parallel). */
+int decode_zstd_frame(void *arg, size_t index)
+{
+    const struct zstd_frames *zf = arg;
+    const struct zstd_frame *frame = &zf->frames[index];
+    ZSTD_DCtx *context;
+    size_t ret;
+
+    if ((context = ZSTD_createDCtx()) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    ret = ZSTD_decompress_usingDDict(context, zf->out + frame->out_offset, frame->out_len,
+                                     zf->in + frame->in_offset, frame->in_len, zf->dict);
+
+    ZSTD_freeDCtx(context);
+
+    return (ZSTD_isError(ret) || ret != frame->out_len) ? DRPM_ERR_FORMAT : DRPM_ERR_OK;
+}
+
+/* Decodes the complete zstd frames at the start of <in> (of <in_len>
+ * bytes) in parallel, directly into the output window, stopping at the
+ * first frame that is incomplete or has no known content size.
+ * The input used up is returned in <*used>. */
+int decode_zstd_frames(struct decompstrm *strm, const unsigned char *in, size_t in_len, size_t *used)
+{
+    struct zstd_frame *frames = NULL;
+    struct zstd_frames zf;
+    size_t frame_count = 0;
+    size_t out_len = 0;
+    size_t frame_len;
+    size_t off;
+    unsigned long long content_len;
+    int error = DRPM_ERR_OK;
+
+    for (off = 0; off < in_len; off += frame_len) {
+        frame_len = ZSTD_findFrameCompressedSize(in + off, in_len - off);
+        content_len = ZSTD_getFrameContentSize(in + off, in_len - off);
+        if (ZSTD_isError(frame_len) ||
+            content_len == ZSTD_CONTENTSIZE_UNKNOWN ||
+            content_len == ZSTD_CONTENTSIZE_ERROR ||
+            content_len > SIZE_MAX - out_len)
+            break;
+        if (!resize16((void **)&frames, frame_count, sizeof(struct zstd_frame))) {
+            error = DRPM_ERR_MEMORY;
+            goto cleanup;
+        }
+        frames[frame_count].in_offset = off;
+        frames[frame_count].in_len = frame_len;
+        frames[frame_count].out_offset = out_len;
+        frames[frame_count].out_len = content_len;
+        frame_count++;
+        out_len += content_len;
     }
 
-    strm->comp_size += in_len;
+    *used = off;
 
-    if (strm->md5 != NULL && MD5_Update(strm->md5, in_buffer, in_len) != 1)
-        return DRPM_ERR_OTHER;
+    if (frame_count == 0)
+        goto cleanup;
 
-    free(buffOut);
-    return DRPM_ERR_OK;
+    if ((error = reserve_output(strm, out_len)) != DRPM_ERR_OK)
+        goto cleanup;
+
+    zf.in = in;
+    zf.out = strm->data + strm->data_len;
+    zf.frames = frames;
+    zf.dict = strm->zstd_dict;
+
+    if ((error = parallel_run(strm->threads, frame_count, decode_zstd_frame, &zf)) != DRPM_ERR_OK)
+        goto cleanup;
+
+    if (strm->md5 != NULL && MD5_Update(strm->md5, in, off) != 1) {
+        error = DRPM_ERR_OTHER;
+        goto cleanup;
+    }
+
+    strm->data_len += out_len;
+    strm->comp_size += off;
+
+cleanup:
+    free(frames);
+
+    return error;
+}
+
+/* Reads the remaining input a window of ZSTD_READ_AHEAD bytes per thread
+ * at a time and decodes the complete frames in each window in parallel,
+ * setting <*done> once all of the input has been decoded this way.
+ * From the first frame that cannot be split off (no known content size,
+ * or too large for the window) on, the serial decoder takes over. */
+int readall_zstd_mt(struct decompstrm *strm, bool *done)
+{
+    size_t in_alloc;
+    size_t in_len = 0;
+    size_t used;
+    size_t data_len_prev;
+    ssize_t bytes_read = 1;
+    int error;
+
+    *done = false;
+
+    if (strm->filedesc < 0) {
+        // already in memory, the serial decoder picks up where this stops
+        if ((error = decode_zstd_frames(strm, strm->buffer, strm->buffer_len, &used)) != DRPM_ERR_OK)
+            return error;
+        strm->buffer += used;
+        strm->buffer_len -= used;
+        *done = (strm->buffer_len == 0);
+        return DRPM_ERR_OK;
+    }
+
+    in_alloc = MIN((uint64_t)strm->threads * ZSTD_READ_AHEAD, SIZE_MAX / 2);
+    if ((strm->input = malloc(in_alloc)) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    do {
+        while (in_len < in_alloc &&
+               (bytes_read = read(strm->filedesc, strm->input + in_len, in_alloc - in_len)) > 0)
+            in_len += bytes_read;
+        if (bytes_read < 0)
+            return DRPM_ERR_IO;
+
+        data_len_prev = strm->data_len;
+        if ((error = decode_zstd_frames(strm, strm->input, in_len, &used)) != DRPM_ERR_OK ||
+            (error = progress_add(strm->progress, strm->progress_phase,
+                                  strm->data_len - data_len_prev)) != DRPM_ERR_OK)
+            return error;
+        in_len -= used;
+        memmove(strm->input, strm->input + used, in_len);
+    } while (used > 0 && bytes_read > 0);
+
+    if (in_len == 0 && bytes_read == 0) {
+        *done = true;
+    } else {
+        // the rest of the window goes first, the file is read on from there
+        strm->comp_size += in_len;
+        if (strm->md5 != NULL && MD5_Update(strm->md5, strm->input, in_len) != 1)
+            error = DRPM_ERR_OTHER;
+        else
+            error = decode_zstd_stream(strm, strm->input, in_len);
+    }
+
+    free(strm->input);
+    strm->input = NULL;
+
+    return error;
 }
 #endif
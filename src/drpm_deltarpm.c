@@ -24,6 +24,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 
 #define DELTARPM_COMP_UN 0
 #define DELTARPM_COMP_GZ 1
@@ -36,6 +37,18 @@
 
 #define DELTARPM_COMP_BZ DELTARPM_COMP_BZ_20
 
+/* target compression parameters describing a multi-block xz payload:
+ * magic followed by the uncompressed size of a block (64-bit BE) */
+#define XZ_BLOCKS_MAGIC "XZBK"
+#define XZ_BLOCKS_PARAM_LEN 12
+
+/* target compression parameters describing a zstd payload:
+ * magic, flags (ZSTD_PARAM_*) and window log (0 for the level's default) */
+#define ZSTD_PARAMS_MAGIC "ZSTF"
+#define ZSTD_PARAMS_LEN 6
+#define ZSTD_PARAM_WORKERS 0x01
+#define ZSTD_PARAM_CHECKSUM 0x02
+
 #define DELTARPM_MKCOMP(comp, level) ((comp) | ((level) << 8))
 #define DELTARPM_COMPALGO(comp) ((comp) & 255)
 #define DELTARPM_COMPLEVEL(comp) (((comp) >> 8) & 255)
@@ -107,6 +120,85 @@ bool deltarpm_encode_comp(uint32_t *deltarpm_comp, unsigned short comp, unsigned
     return true;
 }
 
+/* Records in the target compression parameters that the target payload
+ * is made of independent xz blocks of <block_size> uncompressed bytes.
+ * Version 4 only, as deltarpm refuses unknown compression parameters. */
+int deltarpm_set_xz_blocks(struct deltarpm *delta, uint64_t block_size)
+{
+    unsigned char *param;
+
+    if (delta->tgt_comp != DRPM_COMP_XZ || delta->version < 4 || block_size == 0)
+        return DRPM_ERR_PROG;
+
+    if ((param = malloc(XZ_BLOCKS_PARAM_LEN)) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    memcpy(param, XZ_BLOCKS_MAGIC, 4);
+    create_be64(block_size, param + 4);
+
+    free(delta->tgt_comp_param);
+    delta->tgt_comp_param = param;
+    delta->tgt_comp_param_len = XZ_BLOCKS_PARAM_LEN;
+
+    return DRPM_ERR_OK;
+}
+
+/* Fetches the xz block size recorded by deltarpm_set_xz_blocks().
+ * Returns false if the target payload was not recorded as such. */
+bool deltarpm_get_xz_blocks(const struct deltarpm *delta, uint64_t *block_size)
+{
+    if (delta->tgt_comp != DRPM_COMP_XZ ||
+        delta->tgt_comp_param_len != XZ_BLOCKS_PARAM_LEN ||
+        memcmp(delta->tgt_comp_param, XZ_BLOCKS_MAGIC, 4) != 0 ||
+        (*block_size = parse_be64(delta->tgt_comp_param + 4)) == 0)
+        return false;
+
+    return true;
+}
+
+/* Records the frame parameters of a zstd target payload in the target
+ * compression parameters, along with whether it was compressed by
+ * worker threads (which changes the output, unlike their number).
+ * Version 4 only, as deltarpm refuses unknown compression parameters. */
+int deltarpm_set_zstd_params(struct deltarpm *delta, unsigned short window_log,
+                             bool checksum, bool workers)
+{
+    unsigned char *param;
+
+    if (delta->tgt_comp != DRPM_COMP_ZSTD || delta->version < 4 || window_log > UINT8_MAX)
+        return DRPM_ERR_PROG;
+
+    if ((param = malloc(ZSTD_PARAMS_LEN)) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    memcpy(param, ZSTD_PARAMS_MAGIC, 4);
+    param[4] = (workers ? ZSTD_PARAM_WORKERS : 0) | (checksum ? ZSTD_PARAM_CHECKSUM : 0);
+    param[5] = window_log;
+
+    free(delta->tgt_comp_param);
+    delta->tgt_comp_param = param;
+    delta->tgt_comp_param_len = ZSTD_PARAMS_LEN;
+
+    return DRPM_ERR_OK;
+}
+
+/* Fetches the zstd parameters recorded by deltarpm_set_zstd_params().
+ * Returns false if none were recorded. */
+bool deltarpm_get_zstd_params(const struct deltarpm *delta, unsigned short *window_log,
+                              bool *checksum, bool *workers)
+{
+    if (delta->tgt_comp != DRPM_COMP_ZSTD ||
+        delta->tgt_comp_param_len != ZSTD_PARAMS_LEN ||
+        memcmp(delta->tgt_comp_param, ZSTD_PARAMS_MAGIC, 4) != 0)
+        return false;
+
+    *workers = (delta->tgt_comp_param[4] & ZSTD_PARAM_WORKERS) != 0;
+    *checksum = (delta->tgt_comp_param[4] & ZSTD_PARAM_CHECKSUM) != 0;
+    *window_log = delta->tgt_comp_param[5];
+
+    return true;
+}
+
 void free_deltarpm(struct deltarpm *delta)
 {
     struct deltarpm delta_init = {0};
@@ -127,6 +219,7 @@ void free_deltarpm(struct deltarpm *delta)
     free(delta->tgt_leadsig);
     free(delta->int_copies);
     free(delta->ext_copies);
+    free(delta->self_copies);
     free(delta->add_data);
 
     if (delta->int_data_as_ptrs)
@@ -49,15 +49,22 @@
 
 #define BUFFER_SIZE 4096
 
+/* hash_search() finds no shorter matches */
+#define SEARCH_LEN_MIN 32
+
 struct diff_copy {
     size_t old_off;
     size_t old_len;
     size_t new_off;
     size_t new_len;
+    size_t self_dist; // new data taken from this far back in new (if not 0)
 };
 
+static int find_self_copies(struct diff_copy **, size_t *, const unsigned char *, size_t,
+                            size_t, uint32_t *);
 static int create_diff_copies(const struct diff_copy *, size_t,
-                              uint32_t **, uint32_t *, uint32_t **, uint32_t *);
+                              uint32_t **, uint32_t *, uint32_t **, uint32_t *,
+                              uint32_t **, uint32_t *);
 static int create_int_data_array(const struct diff_copy *, const unsigned char *,
                                  const uint32_t *, uint32_t,
                                  const unsigned char ***, uint64_t *);
@@ -73,26 +80,41 @@ static int create_int_data_array(const struct diff_copy *, const unsigned char *
  * External copies will be stored in <*ext_copies_ret> and the number
  * of external copies shall be in <*ext_copies_count_ret>.
  * Internal copies will be stored in <*int_copies_ret> and the number
- * of internal copies shall be in <*int_copies_count_ret>. */
+ * of internal copies shall be in <*int_copies_count_ret>.
+ * Matches are searched for with the given <effort> level, in <index>
+ * if given (e.g. kept warm by drpmd), otherwise an index of <old>
+ * is built for the call (by up to <threads> threads), sparse if
+ * <index_spacing> is not 0.
+ * The <seeds_count> <seeds> (ordered by new offset) are taken as matches
+ * without searching, which only happens in between them.
+ * If <self_window> is not 0, data in <new> repeated from up to that far
+ * back is taken from there instead of internal data. Such internal copies
+ * are stored in <*self_copies_ret> (count in <*self_copies_count_ret>,
+ * the longest distance in <*self_window_ret>) and have NULL internal data.
+ * Progress through <new> is reported to <prog> (may be NULL). */
 int make_diff(const unsigned char *old, size_t old_len,
               const unsigned char *new, size_t new_len,
               const unsigned char ***int_data_array_ret, uint64_t *int_data_len_ret,
               uint32_t **ext_copies_ret, uint32_t *ext_copies_count_ret,
               uint32_t **int_copies_ret, uint32_t *int_copies_count_ret,
               unsigned char **add_block_ret, uint32_t *add_block_len_ret,
-              unsigned short add_block_comp, int add_block_comp_level)
+              unsigned short add_block_comp, int add_block_comp_level,
+              unsigned short effort, unsigned index_spacing, unsigned threads,
+              struct hash *index, const struct diff_seed *seeds, size_t seeds_count,
+              size_t self_window, uint32_t **self_copies_ret, uint32_t *self_copies_count_ret,
+              uint32_t *self_window_ret, struct progress *prog)
 {
     int error;
 
     const bool addblk = (add_block_ret != NULL && add_block_len_ret != NULL);
     size_t add_block_len;
-    struct compstrm *stream;
+    struct compstrm *stream = NULL;
 
     struct diff_copy *diff_copies = NULL;
     size_t diff_copies_len = 0;
 
     //struct sfxsrt *suffix;
-    struct hash *hashtab;
+    struct hash *hashtab = index;
 
     size_t old_pos = 0;
     size_t new_pos = 0;
@@ -101,6 +123,8 @@ int make_diff(const unsigned char *old, size_t old_len,
 
     size_t len = 0;
     size_t len_forward;
+    size_t search_len;
+    size_t seed = 0;
     size_t len_back;
     size_t len_overlap;
     size_t len_split;
@@ -118,25 +142,61 @@ int make_diff(const unsigned char *old, size_t old_len,
     if (old == NULL || new == NULL ||
         int_data_array_ret == NULL || int_data_len_ret == NULL ||
         ext_copies_ret == NULL || ext_copies_count_ret == NULL ||
-        int_copies_ret == NULL || int_copies_count_ret == NULL)
+        int_copies_ret == NULL || int_copies_count_ret == NULL ||
+        (self_window > 0 && (self_copies_ret == NULL || self_copies_count_ret == NULL ||
+                             self_window_ret == NULL)))
         return DRPM_ERR_PROG;
 
     if (addblk)
         *add_block_ret = NULL;
 
+    /* building the index is still part of reading the input,
+     * as when it comes from a cache */
     //if ((error = sfxsrt_create(&suffix, old, old_len)) != DRPM_ERR_OK)
-    if ((error = hash_create(&hashtab, old, old_len)) != DRPM_ERR_OK)
+    if (index == NULL &&
+        (error = (index_spacing != 0) ? hash_create_sparse(&hashtab, old, old_len, index_spacing, threads, prog)
+                                      : hash_create(&hashtab, old, old_len, hash_effort_chained(effort),
+                                                    threads, prog)) != DRPM_ERR_OK)
+        return error;
+
+    if ((error = progress_report(prog, DRPM_PHASE_DIFF, 0, 0, new_len)) != DRPM_ERR_OK)
         goto cleanup_fail;
 
     if (addblk && (error = compstrm_init(&stream, -1, add_block_comp, add_block_comp_level)) != DRPM_ERR_OK)
         goto cleanup_fail;
 
     while (new_pos_prev < new_len) {
-        /* find new match */
-        //new_pos = sfxsrt_search(suffix, old, old_len, new, new_len,
-        new_pos = hash_search(hashtab, old, old_len, new, new_len,
-                              addblk ? old_pos_prev - new_pos_prev : old_len,
-                              new_pos + len, &old_pos, &len);
+        if ((error = progress_report(prog, DRPM_PHASE_DIFF, new_pos_prev,
+                                     new_pos_prev, new_len)) != DRPM_ERR_OK)
+            goto cleanup_fail;
+
+        /* seeds in line with the last match are left to its extension and the search */
+        while (seed < seeds_count &&
+               (seeds[seed].new_off < new_pos + len ||
+                (seeds[seed].old_off + new_pos_prev == old_pos_prev + seeds[seed].new_off)))
+            seed++;
+
+        /* find new match (up to the next seed) */
+        search_len = (seed < seeds_count) ? seeds[seed].new_off : new_len;
+        if (search_len >= new_pos + len + SEARCH_LEN_MIN) {
+            //new_pos = sfxsrt_search(suffix, old, old_len, new, search_len,
+            new_pos = hash_search(hashtab, old, old_len, new, search_len,
+                                  addblk ? old_pos_prev - new_pos_prev : old_len,
+                                  old_pos_prev - new_pos_prev, new_pos + len, effort,
+                                  &old_pos, &len);
+        } else {
+            new_pos = search_len;
+            old_pos = 0;
+            len = 0;
+        }
+
+        /* nothing found before the seed, so the seed is the new match */
+        if (len == 0 && seed < seeds_count) {
+            new_pos = seeds[seed].new_off;
+            old_pos = seeds[seed].old_off;
+            len = seeds[seed].len;
+            seed++;
+        }
 
         /* extend last match forwards */
         max_len = MIN(old_len - old_pos_prev, new_pos - new_pos_prev);
@@ -228,6 +288,7 @@ int make_diff(const unsigned char *old, size_t old_len,
         diff_copies[diff_copies_len].new_len = (new_pos - len_back) - (new_pos_prev + len_forward);
         diff_copies[diff_copies_len].old_off = old_pos_prev;
         diff_copies[diff_copies_len].old_len = len_forward;
+        diff_copies[diff_copies_len].self_dist = 0;
         diff_copies_len++;
 
         if (addblk) {
@@ -247,16 +308,32 @@ int make_diff(const unsigned char *old, size_t old_len,
         new_pos_prev = new_pos - len_back;
     }
 
+    if ((error = progress_report(prog, DRPM_PHASE_DIFF, new_len, new_len, new_len)) != DRPM_ERR_OK)
+        goto cleanup_fail;
+
+    /* taking repeats in new data from earlier output */
+    if (self_window > 0 &&
+        (error = find_self_copies(&diff_copies, &diff_copies_len, new, new_len,
+                                  self_window, self_window_ret)) != DRPM_ERR_OK)
+        goto cleanup_fail;
+
     /* use diff_copies to create outputs */
     if ((error = create_diff_copies(diff_copies, diff_copies_len, ext_copies_ret, ext_copies_count_ret,
-                                    int_copies_ret, int_copies_count_ret)) != DRPM_ERR_OK ||
+                                    int_copies_ret, int_copies_count_ret,
+                                    (self_window > 0) ? self_copies_ret : NULL,
+                                    self_copies_count_ret)) != DRPM_ERR_OK ||
         (error = create_int_data_array(diff_copies, new, *int_copies_ret, *int_copies_count_ret,
                                        int_data_array_ret, int_data_len_ret)) != DRPM_ERR_OK ||
         (addblk && (error = compstrm_finish(stream, add_block_ret, &add_block_len)) != DRPM_ERR_OK))
         goto cleanup_fail;
 
-    if (addblk)
+    if (addblk) {
+        if (add_block_len > UINT32_MAX) {
+            error = DRPM_ERR_OVERFLOW;
+            goto cleanup_fail;
+        }
         *add_block_len_ret = add_block_len;
+    }
 
     goto cleanup;
 
@@ -267,7 +344,8 @@ cleanup_fail:
 cleanup:
     free(diff_copies);
     //sfxsrt_free(&suffix);
-    hash_free(&hashtab);
+    if (index == NULL)
+        hash_free(&hashtab);
 
     if (addblk) {
         if (error == DRPM_ERR_OK)
@@ -279,10 +357,91 @@ cleanup:
     return error;
 }
 
-/* Creates internal and external copies from diff data. */
+/* Splits the new data of <*diff_copies> (<*diff_copies_len> of them)
+ * where it repeats earlier data of <new> (from up to <window> bytes back),
+ * which is then copied from there. The longest distance back taken is
+ * stored in <*window_ret>. Repeats are kept to single internal copies,
+ * i.e. to at most INT32_MAX bytes each. */
+int find_self_copies(struct diff_copy **diff_copies, size_t *diff_copies_len,
+                     const unsigned char *new, size_t new_len,
+                     size_t window, uint32_t *window_ret)
+{
+    int error;
+
+    struct self_hash *shash;
+    struct diff_copy *copies = NULL;
+    size_t copies_len = 0;
+    struct diff_copy piece;
+
+    size_t end;
+    size_t pos;
+    size_t src;
+    size_t len;
+
+    *window_ret = 0;
+
+    if ((error = self_hash_create(&shash, new, new_len, window)) != DRPM_ERR_OK)
+        return error;
+
+    for (size_t i = 0; i < *diff_copies_len; i++) {
+        piece = (*diff_copies)[i];
+        end = piece.new_off + piece.new_len;
+
+        while (true) {
+            pos = self_hash_search(shash, piece.new_off, end, &src, &len);
+            piece.new_len = pos - piece.new_off;
+            len = MIN(len, INT32_MAX); // the rest is found again as a repeat
+
+            // first piece also keeps the old data preceding the new data
+            if (piece.old_len > 0 || piece.new_len > 0) {
+                if (!resize32((void **)&copies, copies_len, sizeof(struct diff_copy))) {
+                    error = DRPM_ERR_MEMORY;
+                    goto cleanup;
+                }
+                copies[copies_len++] = piece;
+            }
+
+            if (pos == end)
+                break;
+
+            if (!resize32((void **)&copies, copies_len, sizeof(struct diff_copy))) {
+                error = DRPM_ERR_MEMORY;
+                goto cleanup;
+            }
+            copies[copies_len].old_off = 0;
+            copies[copies_len].old_len = 0;
+            copies[copies_len].new_off = pos;
+            copies[copies_len].new_len = len;
+            copies[copies_len].self_dist = pos - src;
+            copies_len++;
+
+            *window_ret = MAX(*window_ret, pos - src);
+
+            piece.old_off = 0;
+            piece.old_len = 0;
+            piece.new_off = pos + len;
+        }
+    }
+
+    free(*diff_copies);
+    *diff_copies = copies;
+    *diff_copies_len = copies_len;
+    copies = NULL;
+
+cleanup:
+    free(copies);
+    self_hash_free(&shash);
+
+    return error;
+}
+
+/* Creates internal and external copies from diff data.
+ * Internal copies taken from earlier output are also listed
+ * in <*self_copies_ret> if not NULL. */
 int create_diff_copies(const struct diff_copy *diff_copies, size_t diff_copies_len,
                        uint32_t **ext_copies_ret, uint32_t *ext_copies_count_ret,
-                       uint32_t **int_copies_ret, uint32_t *int_copies_count_ret)
+                       uint32_t **int_copies_ret, uint32_t *int_copies_count_ret,
+                       uint32_t **self_copies_ret, uint32_t *self_copies_count_ret)
 {
     int error;
 
@@ -290,6 +449,9 @@ int create_diff_copies(const struct diff_copy *diff_copies, size_t diff_copies_l
     uint32_t int_copies_count = 0;
     uint32_t *ext_copies = NULL;
     uint32_t ext_copies_count = 0;
+    uint32_t *self_copies = NULL;
+    uint32_t self_copies_count = 0;
+    uint32_t next_self_copy = 0;
 
     size_t new_len;
     size_t old_len;
@@ -349,6 +511,18 @@ int create_diff_copies(const struct diff_copy *diff_copies, size_t diff_copies_l
                 int_copies[int_copies_count * 2] = ext_copies_count - last_ext_copies_count;
                 last_ext_copies_count = ext_copies_count;
 
+                /* stored as internal copies skipped since the previous one and distance */
+                if (diff_copies[i].self_dist > 0 && self_copies_ret != NULL) {
+                    if (!resize16((void **)&self_copies, self_copies_count * 2, 4)) {
+                        error = DRPM_ERR_MEMORY;
+                        goto cleanup_fail;
+                    }
+                    self_copies[self_copies_count * 2] = int_copies_count - next_self_copy;
+                    self_copies[self_copies_count * 2 + 1] = diff_copies[i].self_dist;
+                    self_copies_count++;
+                    next_self_copy = int_copies_count + 1;
+                }
+
                 if (new_len >= (uint32_t)INT32_MIN) {
                     int_copies[int_copies_count++ * 2 + 1] = INT32_MAX;
                     new_len -= INT32_MAX;
@@ -375,17 +549,23 @@ int create_diff_copies(const struct diff_copy *diff_copies, size_t diff_copies_l
     *ext_copies_count_ret = ext_copies_count;
     *int_copies_ret = int_copies;
     *int_copies_count_ret = int_copies_count;
+    if (self_copies_ret != NULL) {
+        *self_copies_ret = self_copies;
+        *self_copies_count_ret = self_copies_count;
+    }
 
     return DRPM_ERR_OK;
 
 cleanup_fail:
     free(int_copies);
     free(ext_copies);
+    free(self_copies);
 
     return error;
 }
 
-/* Constructs internal data from diff data and internal copies. */
+/* Constructs internal data from diff data and internal copies.
+ * Internal copies taken from earlier output get no internal data. */
 int create_int_data_array(const struct diff_copy *diff_copies, //size_t diff_copies_len,
                           const unsigned char *new,
                           const uint32_t *int_copies, uint32_t int_copies_count,
@@ -409,10 +589,14 @@ int create_int_data_array(const struct diff_copy *diff_copies, //size_t diff_cop
                 j++;
             }
         }
-        int_data_array[i] = new + offset;
+        if (todo > 0 && diff_copies[j - 1].self_dist > 0) {
+            int_data_array[i] = NULL;
+        } else {
+            int_data_array[i] = new + offset;
+            int_data_len += todo;
+        }
         offset += todo;
         left -= todo;
-        int_data_len += todo;
     }
 
     *int_data_array_ret = int_data_array;
@@ -47,6 +47,9 @@
 
 #define MAGIC_RPML 0x52504D4C
 
+/* smaller files are left to the match search */
+#define SEED_MIN_LEN 512
+
 #ifndef RPMFILE_UNPATCHED
 #define RPMFILE_UNPATCHED (1 << 10)
 #endif
@@ -66,6 +69,13 @@ struct files_seq {
     ssize_t last_seq;
 };
 
+/* content of a regular file in a CPIO archive held in memory */
+struct cpio_content {
+    const char *digest; // from the RPM header
+    size_t offset;
+    size_t size;
+};
+
 /* RPM patches */
 
 struct patch_file {
@@ -86,7 +96,12 @@ struct rpm_patches {
     struct patch_info patchrpm;
 };
 
+static int cpio_contents(const unsigned char *, size_t, size_t,
+                         const struct file_info *, size_t,
+                         struct cpio_content **, size_t *);
+static int cpio_content_cmp(const void *, const void *);
 static int cpio_extend(unsigned char **, size_t *, const void *, size_t);
+static size_t file_info_find(const struct file_info *, size_t, const char *, size_t);
 static bool is_unpatched(const struct rpm_patches *, const char *, const char *);
 static int rpml_get_uint16(int, uint16_t *);
 static int rpml_get_uint32(int, uint32_t *);
@@ -192,10 +207,32 @@ int cpio_extend(unsigned char **cpio, size_t *cpio_len,
     return DRPM_ERR_OK;
 }
 
-/* Reads CPIO header entry. */
+/* Reads the next CPIO header entry from the archive of <rpm_file>
+ * into <buffer>. Stripped headers are shorter, so only the rest of
+ * a new ASCII header is read once the magic has been seen. */
+int cpio_header_fetch(struct rpm *rpm_file, struct cpio_header *cpio_hdr,
+                      char buffer[CPIO_HEADER_SIZE + 1])
+{
+    int error;
+
+    if ((error = rpm_archive_read_chunk(rpm_file, buffer, CPIO_STRIPPED_HEADER_SIZE)) != DRPM_ERR_OK)
+        return error;
+
+    if (strncmp(buffer, CPIO_STRIPPED_MAGIC, 6) != 0 &&
+        (error = rpm_archive_read_chunk(rpm_file, buffer + CPIO_STRIPPED_HEADER_SIZE,
+                                        CPIO_HEADER_SIZE - CPIO_STRIPPED_HEADER_SIZE)) != DRPM_ERR_OK)
+        return error;
+
+    return cpio_header_read(cpio_hdr, buffer);
+}
+
+/* Reads CPIO header entry.
+ * For a stripped header, only the file index is set. */
 int cpio_header_read(struct cpio_header *cpio_hdr,
                      const char buffer[CPIO_HEADER_SIZE + 1])
 {
+    const struct cpio_header cpio_hdr_init = {0};
+    ssize_t file_index_ret;
     ssize_t ino_ret;
     ssize_t mode_ret;
     ssize_t uid_ret;
@@ -209,6 +246,15 @@ int cpio_header_read(struct cpio_header *cpio_hdr,
     ssize_t rdevminor_ret;
     ssize_t namesize_ret;
 
+    if (strncmp(buffer, CPIO_STRIPPED_MAGIC, 6) == 0) {
+        if ((file_index_ret = parse_hexnum(buffer + 6, 8)) < 0)
+            return DRPM_ERR_FORMAT;
+        *cpio_hdr = cpio_hdr_init;
+        cpio_hdr->stripped = true;
+        cpio_hdr->file_index = file_index_ret;
+        return DRPM_ERR_OK;
+    }
+
     if (strncmp(buffer, CPIO_MAGIC, 6) != 0 ||
         (ino_ret = parse_hexnum((buffer += 6), 8)) < 0 ||
         (mode_ret = parse_hexnum((buffer += 8), 8)) < 0 ||
@@ -236,22 +282,40 @@ int cpio_header_read(struct cpio_header *cpio_hdr,
     cpio_hdr->rdevmajor = rdevmajor_ret;
     cpio_hdr->rdevminor = rdevminor_ret;
     cpio_hdr->namesize = namesize_ret;
+    cpio_hdr->stripped = false;
+    cpio_hdr->file_index = 0;
 
     return DRPM_ERR_OK;
 }
 
-/* Writes CPIO header entry. */
+/* Writes CPIO header entry (CPIO_HEADER_LEN(cpio_hdr) bytes). */
 void cpio_header_write(const struct cpio_header *cpio_hdr,
                        char buffer[CPIO_HEADER_SIZE + 1])
 {
+    if (cpio_hdr->stripped) {
+        sprintf(buffer, CPIO_STRIPPED_MAGIC "%08x", cpio_hdr->file_index);
+        return;
+    }
+
     sprintf(buffer, CPIO_MAGIC
             "%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x",
             cpio_hdr->ino, cpio_hdr->mode, cpio_hdr->uid, cpio_hdr->gid,
-            cpio_hdr->nlink, cpio_hdr->mtime, cpio_hdr->filesize,
+            cpio_hdr->nlink, cpio_hdr->mtime, (uint32_t)cpio_hdr->filesize,
             cpio_hdr->devmajor, cpio_hdr->devminor, cpio_hdr->rdevmajor,
             cpio_hdr->rdevminor, cpio_hdr->namesize, 0);
 }
 
+/* Returns the length of the content of <file> in a CPIO archive
+ * (the target's name for symlinks). */
+uint64_t cpio_filesize(const struct file_info *file)
+{
+    if (S_ISREG(file->mode))
+        return file->size;
+    if (S_ISLNK(file->mode))
+        return strlen(file->linkto);
+    return 0;
+}
+
 /* For standard DeltaRPMs, the old RPM's CPIO archive is parsed based
  * on file metadata found in the RPM header. An altered CPIO archive
  * is created: e.g. some files may be skipped, a symlink's file content
@@ -292,8 +356,9 @@ int parse_cpio_from_rpm_filedata(struct rpm *rpm_file,
     size_t cpio_len_prev = 0;
     uint64_t offset;
 
-    size_t c_filesize;
+    uint64_t c_filesize;
     size_t c_namesize;
+    size_t c_header_len;
     char *name;
     size_t name_len;
     char *name_buffer = NULL;
@@ -344,14 +409,26 @@ int parse_cpio_from_rpm_filedata(struct rpm *rpm_file,
 
         /* reading CPIO header and pathname */
 
-        if ((error = rpm_archive_read_chunk(rpm_file, cpio_buffer, CPIO_HEADER_SIZE)) != DRPM_ERR_OK)
+        if ((error = cpio_header_fetch(rpm_file, &cpio_hdr, cpio_buffer)) != DRPM_ERR_OK)
             goto cleanup_fail;
 
-        if ((error = cpio_header_read(&cpio_hdr, cpio_buffer)) != DRPM_ERR_OK)
-            goto cleanup_fail;
+        c_header_len = CPIO_HEADER_LEN(&cpio_hdr);
 
-        c_filesize = cpio_hdr.filesize;
-        c_namesize = cpio_hdr.namesize;
+        /* large-file payloads only name the file's index in the RPM header */
+        if (cpio_hdr.stripped) {
+            if ((files_index = cpio_hdr.file_index) >= file_count) {
+                error = DRPM_ERR_FORMAT;
+                goto cleanup_fail;
+            }
+            c_filesize = cpio_filesize(&files[files_index]);
+            c_namesize = 0;
+            name = files[files_index].name;
+            if (name[0] == '/')
+                name++;
+        } else {
+            c_filesize = cpio_hdr.filesize;
+            c_namesize = cpio_hdr.namesize;
+        }
 
         if (c_namesize > name_buffer_len) {
             if ((name_buffer_tmp = realloc(name_buffer, c_namesize)) == NULL) {
@@ -362,26 +439,33 @@ int parse_cpio_from_rpm_filedata(struct rpm *rpm_file,
             name_buffer_len = c_namesize;
         }
 
-        if ((error = rpm_archive_read_chunk(rpm_file, name_buffer, c_namesize)) != DRPM_ERR_OK)
-            goto cleanup_fail;
+        if (!cpio_hdr.stripped) {
+            if (c_namesize == 0) {
+                error = DRPM_ERR_FORMAT;
+                goto cleanup_fail;
+            }
 
-        name = name_buffer;
-        name[c_namesize - 1] = '\0';
+            if ((error = rpm_archive_read_chunk(rpm_file, name_buffer, c_namesize)) != DRPM_ERR_OK)
+                goto cleanup_fail;
 
-        /* end of archive? */
-        if (strcmp(name, CPIO_TRAILER) == 0)
-            break;
+            name = name_buffer;
+            name[c_namesize - 1] = '\0';
+
+            /* end of archive? */
+            if (strcmp(name, CPIO_TRAILER) == 0)
+                break;
 
-        if (strncmp(name, "./", 2) == 0)
-            name += 2;
+            if (strncmp(name, "./", 2) == 0)
+                name += 2;
+        }
 
         name_len = strlen(name) + 1;
 
-        padding_bytes = CPIO_PADDING(CPIO_HEADER_SIZE + c_namesize);
+        padding_bytes = CPIO_PADDING(c_header_len + c_namesize);
         if ((error = rpm_archive_read_chunk(rpm_file, NULL, padding_bytes)) != DRPM_ERR_OK)
             goto cleanup_fail;
 
-        const size_t cpio_hdrname_len = CPIO_HEADER_SIZE + c_namesize + padding_bytes;
+        const size_t cpio_hdrname_len = c_header_len + c_namesize + padding_bytes;
         size_t cpio_pos_before_hdrname = cpio_pos;
 
         cpio_pos += cpio_hdrname_len;
@@ -393,7 +477,7 @@ int parse_cpio_from_rpm_filedata(struct rpm *rpm_file,
          * - bad verify flags
          * - colored file in non-multilib dir */
 
-        for (files_index = 0; files_index < file_count; files_index++) {
+        for (files_index = cpio_hdr.stripped ? files_index : 0; files_index < file_count; files_index++) {
             if (strcmp(name, files[files_index].name +
                              ((files[files_index].name[0] == '/') ? 1 : 0)) == 0)
                 break;
@@ -414,6 +498,9 @@ int parse_cpio_from_rpm_filedata(struct rpm *rpm_file,
                         (file.color & (RPMFC_ELF32 | RPMFC_ELF64)) != 0 &&
                         !IN_MULTILIB_DIR(name));
                 cpio_hdr.filesize = file.size;
+                /* too large for a new ASCII header */
+                if ((cpio_hdr.stripped = (file.size > CPIO_FILESIZE_MAX)))
+                    cpio_hdr.file_index = files_index;
             } else if (S_ISLNK(file.mode)) {
                 cpio_hdr.filesize = strlen(file.linkto);
             } else if (S_ISBLK(file.mode) || S_ISCHR(file.mode)) {
@@ -476,16 +563,24 @@ int parse_cpio_from_rpm_filedata(struct rpm *rpm_file,
 
             cpio_header_write(&cpio_hdr, cpio_buffer);
 
-            if ((error = cpio_extend(&cpio, &cpio_len, cpio_buffer, CPIO_HEADER_SIZE)) != DRPM_ERR_OK ||
-                (error = cpio_extend(&cpio, &cpio_len, "./", 2)) != DRPM_ERR_OK ||
-                (error = cpio_extend(&cpio, &cpio_len, name, name_len)) != DRPM_ERR_OK ||
-                (error = cpio_extend(&cpio, &cpio_len, "\0\0\0",
-                                     CPIO_PADDING(CPIO_HEADER_SIZE + cpio_hdr.namesize))) != DRPM_ERR_OK)
+            if (cpio_hdr.stripped) {
+                if ((error = cpio_extend(&cpio, &cpio_len, cpio_buffer, CPIO_STRIPPED_HEADER_SIZE)) != DRPM_ERR_OK ||
+                    (error = cpio_extend(&cpio, &cpio_len, "\0\0\0",
+                                         CPIO_PADDING(CPIO_STRIPPED_HEADER_SIZE))) != DRPM_ERR_OK)
+                    goto cleanup_fail;
+            } else if ((error = cpio_extend(&cpio, &cpio_len, cpio_buffer, CPIO_HEADER_SIZE)) != DRPM_ERR_OK ||
+                       (error = cpio_extend(&cpio, &cpio_len, "./", 2)) != DRPM_ERR_OK ||
+                       (error = cpio_extend(&cpio, &cpio_len, name, name_len)) != DRPM_ERR_OK ||
+                       (error = cpio_extend(&cpio, &cpio_len, "\0\0\0",
+                                            CPIO_PADDING(CPIO_HEADER_SIZE + cpio_hdr.namesize))) != DRPM_ERR_OK) {
                 goto cleanup_fail;
+            }
 
             if (MD5_Update(&seq_md5, name, name_len) != 1 ||
                 md5_update_be32(&seq_md5, cpio_hdr.mode) != 1 ||
-                md5_update_be32(&seq_md5, cpio_hdr.filesize) != 1 ||
+                (cpio_hdr.filesize > CPIO_FILESIZE_MAX ?
+                 md5_update_be64(&seq_md5, cpio_hdr.filesize) :
+                 md5_update_be32(&seq_md5, cpio_hdr.filesize)) != 1 ||
                 md5_update_be32(&seq_md5, makedev(cpio_hdr.rdevmajor,
                                                   cpio_hdr.rdevminor)) != 1) {
                 error = DRPM_ERR_OTHER;
@@ -620,6 +715,197 @@ cleanup:
 
 /* RPM patches */
 
+/* Looks up <name> (without leading slash) in <files>, starting at
+ * <hint>, as archives mostly follow the order of the RPM header.
+ * Returns <count> if not found. */
+size_t file_info_find(const struct file_info *files, size_t count,
+                      const char *name, size_t hint)
+{
+    for (size_t i = 0; i < count; i++) {
+        const size_t index = (hint + i) % count;
+        if (strcmp(name, files[index].name + ((files[index].name[0] == '/') ? 1 : 0)) == 0)
+            return index;
+    }
+
+    return count;
+}
+
+/* Sorts by digest first and size second. */
+int cpio_content_cmp(const void *a, const void *b)
+{
+    const struct cpio_content *content_a = a;
+    const struct cpio_content *content_b = b;
+    int cmp;
+
+    if ((cmp = strcmp(content_a->digest, content_b->digest)) != 0)
+        return cmp;
+
+    return (content_a->size > content_b->size) - (content_a->size < content_b->size);
+}
+
+/* Lists the regular files of at least SEED_MIN_LEN bytes in the CPIO
+ * archive starting at offset <pos> of <cpio>, along with their digests
+ * from <files>. Parsing stops quietly at anything unexpected, since
+ * the list is only used to speed up the diff. */
+int cpio_contents(const unsigned char *cpio, size_t cpio_len, size_t pos,
+                  const struct file_info *files, size_t file_count,
+                  struct cpio_content **contents_ret, size_t *count_ret)
+{
+    struct cpio_content *contents = NULL;
+    size_t count = 0;
+    struct cpio_header cpio_hdr;
+    char cpio_buffer[CPIO_HEADER_SIZE + 1];
+    size_t header_len;
+    size_t files_index = 0;
+    uint64_t filesize;
+    const char *name;
+
+    cpio_buffer[CPIO_HEADER_SIZE] = '\0';
+
+    while (pos + CPIO_HEADER_SIZE <= cpio_len) {
+        memcpy(cpio_buffer, cpio + pos, CPIO_HEADER_SIZE);
+        if (cpio_header_read(&cpio_hdr, cpio_buffer) != DRPM_ERR_OK)
+            break;
+
+        if (cpio_hdr.stripped) {
+            if ((files_index = cpio_hdr.file_index) >= file_count)
+                break;
+            filesize = cpio_filesize(&files[files_index]);
+            header_len = CPIO_STRIPPED_HEADER_SIZE;
+        } else {
+            header_len = CPIO_HEADER_SIZE + cpio_hdr.namesize;
+            if (cpio_hdr.namesize == 0 || header_len > cpio_len - pos)
+                break;
+            name = (const char *)cpio + pos + CPIO_HEADER_SIZE;
+            if (name[cpio_hdr.namesize - 1] != '\0' || strcmp(name, CPIO_TRAILER) == 0)
+                break;
+            if (strncmp(name, "./", 2) == 0)
+                name += 2;
+            files_index = file_info_find(files, file_count, name,
+                                         (files_index + 1 < file_count) ? files_index + 1 : 0);
+            filesize = cpio_hdr.filesize;
+        }
+
+        pos += header_len + CPIO_PADDING(header_len);
+        if (pos > cpio_len || filesize > cpio_len - pos)
+            break;
+
+        if (files_index < file_count && S_ISREG(files[files_index].mode) &&
+            filesize >= SEED_MIN_LEN && filesize == files[files_index].size &&
+            files[files_index].md5[0] != '\0') {
+            if (!resize32((void **)&contents, count, sizeof(struct cpio_content))) {
+                free(contents);
+                return DRPM_ERR_MEMORY;
+            }
+            contents[count].digest = files[files_index].md5;
+            contents[count].offset = pos;
+            contents[count].size = filesize;
+            count++;
+        }
+
+        pos += filesize + CPIO_PADDING(filesize);
+    }
+
+    *contents_ret = contents;
+    *count_ret = count;
+
+    return DRPM_ERR_OK;
+}
+
+/* Pairs files of the new RPM with files of the old RPM that have the
+ * same digest in the RPM headers (i.e. unchanged, renamed or moved
+ * files), so that make_diff() can copy them without searching.
+ * The CPIO archives start at offsets <old_start> and <new_start> of
+ * <old_cpio> and <new_cpio>, respectively (after the RPM headers
+ * of rpm-only DeltaRPMs). The found seeds are ordered by their offset
+ * in <new_cpio> and their contents are verified to match. */
+int diff_seeds_find(struct rpm *old_rpm, const unsigned char *old_cpio, size_t old_cpio_len, size_t old_start,
+                    struct rpm *new_rpm, const unsigned char *new_cpio, size_t new_cpio_len, size_t new_start,
+                    struct diff_seed **seeds_ret, size_t *seeds_count_ret)
+{
+    int error;
+
+    struct file_info *old_files = NULL;
+    size_t old_file_count = 0;
+    struct file_info *new_files = NULL;
+    size_t new_file_count = 0;
+    unsigned short old_digest_algo;
+    unsigned short new_digest_algo;
+
+    struct cpio_content *old_contents = NULL;
+    size_t old_contents_count = 0;
+    struct cpio_content *new_contents = NULL;
+    size_t new_contents_count = 0;
+    const struct cpio_content *old_content;
+
+    struct diff_seed *seeds = NULL;
+    size_t seeds_count = 0;
+
+    if (old_rpm == NULL || old_cpio == NULL || new_rpm == NULL || new_cpio == NULL ||
+        seeds_ret == NULL || seeds_count_ret == NULL)
+        return DRPM_ERR_PROG;
+
+    *seeds_ret = NULL;
+    *seeds_count_ret = 0;
+
+    /* digests of different algorithms cannot be compared,
+     * and seeding is not worth failing over */
+    if (rpm_get_digest_algo(old_rpm, &old_digest_algo) != DRPM_ERR_OK ||
+        rpm_get_digest_algo(new_rpm, &new_digest_algo) != DRPM_ERR_OK ||
+        old_digest_algo != new_digest_algo)
+        return DRPM_ERR_OK;
+
+    if ((error = rpm_get_file_info(old_rpm, &old_files, &old_file_count, NULL)) != DRPM_ERR_OK ||
+        (error = rpm_get_file_info(new_rpm, &new_files, &new_file_count, NULL)) != DRPM_ERR_OK ||
+        (error = cpio_contents(old_cpio, old_cpio_len, old_start, old_files, old_file_count,
+                               &old_contents, &old_contents_count)) != DRPM_ERR_OK ||
+        (error = cpio_contents(new_cpio, new_cpio_len, new_start, new_files, new_file_count,
+                               &new_contents, &new_contents_count)) != DRPM_ERR_OK)
+        goto cleanup;
+
+    if (old_contents_count > 0)
+        qsort(old_contents, old_contents_count, sizeof(struct cpio_content), cpio_content_cmp);
+
+    for (size_t i = 0; i < new_contents_count && old_contents_count > 0; i++) {
+        if ((old_content = bsearch(&new_contents[i], old_contents, old_contents_count,
+                                   sizeof(struct cpio_content), cpio_content_cmp)) == NULL ||
+            memcmp(old_cpio + old_content->offset, new_cpio + new_contents[i].offset,
+                   new_contents[i].size) != 0)
+            continue;
+        if (!resize32((void **)&seeds, seeds_count, sizeof(struct diff_seed))) {
+            error = DRPM_ERR_MEMORY;
+            goto cleanup;
+        }
+        seeds[seeds_count].old_off = old_content->offset;
+        seeds[seeds_count].new_off = new_contents[i].offset;
+        seeds[seeds_count].len = new_contents[i].size;
+        seeds_count++;
+    }
+
+    *seeds_ret = seeds;
+    *seeds_count_ret = seeds_count;
+    seeds = NULL;
+
+cleanup:
+    for (size_t i = 0; i < old_file_count; i++) {
+        free(old_files[i].name);
+        free(old_files[i].md5);
+        free(old_files[i].linkto);
+    }
+    free(old_files);
+    for (size_t i = 0; i < new_file_count; i++) {
+        free(new_files[i].name);
+        free(new_files[i].md5);
+        free(new_files[i].linkto);
+    }
+    free(new_files);
+    free(old_contents);
+    free(new_contents);
+    free(seeds);
+
+    return error;
+}
+
 int rpml_get_uint16(int filedesc, uint16_t *ret)
 {
     unsigned char buf[2];
@@ -906,7 +1192,7 @@ int patches_read(const char *oldrpmprint, const char *oldpatchrpm, struct rpm_pa
 
     switch (magic) {
     case MAGIC_RPM:
-        if ((error = rpm_read(&rpmst, oldrpmprint, RPM_ARCHIVE_DONT_READ, NULL, NULL, NULL)) != DRPM_ERR_OK ||
+        if ((error = rpm_read(&rpmst, oldrpmprint, RPM_ARCHIVE_DONT_READ, 1, NULL, NULL, NULL, NULL, NULL)) != DRPM_ERR_OK ||
             (error = rpm_get_nevr(rpmst, &rpmprint->nevr)) != DRPM_ERR_OK ||
             (error = rpm_get_file_info(rpmst, &files, &file_count, NULL)) != DRPM_ERR_OK)
             goto cleanup_fail;
@@ -1037,8 +1323,8 @@ int fill_nodiff_deltarpm(struct deltarpm *delta, const char *rpm_filename,
     }
     delta->sequence_len = MD5_DIGEST_LENGTH;
 
-    if ((error = rpm_read(&solo_rpm, rpm_filename, RPM_ARCHIVE_READ_UNCOMP,
-                          NULL, delta->sequence, delta->tgt_md5)) != DRPM_ERR_OK ||
+    if ((error = rpm_read(&solo_rpm, rpm_filename, RPM_ARCHIVE_READ_UNCOMP, 1,
+                          NULL, delta->sequence, delta->tgt_md5, NULL, delta->progress)) != DRPM_ERR_OK ||
         (error = rpm_fetch_lead_and_signature(solo_rpm, &delta->tgt_leadsig, &delta->tgt_leadsig_len)) != DRPM_ERR_OK ||
         (error = rpm_get_nevr(solo_rpm, &nevr)) != DRPM_ERR_OK)
         goto cleanup;
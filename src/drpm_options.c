@@ -50,6 +50,7 @@ int drpm_make_options_destroy(struct drpm_make_options **opts)
     free((*opts)->seqfile);
     free((*opts)->oldrpmprint);
     free((*opts)->oldpatchrpm);
+    free((*opts)->dict);
     free(*opts);
     *opts = NULL;
 
@@ -64,6 +65,7 @@ int drpm_make_options_defaults(struct drpm_make_options *opts)
     free(opts->seqfile);
     free(opts->oldrpmprint);
     free(opts->oldpatchrpm);
+    free(opts->dict);
 
     opts->rpm_only = false;
     opts->version = 3;
@@ -77,6 +79,16 @@ int drpm_make_options_defaults(struct drpm_make_options *opts)
     opts->oldrpmprint = NULL;
     opts->oldpatchrpm = NULL;
     opts->mbytes = 0;
+    opts->threads = 1;
+    opts->dict = NULL;
+    opts->comp_auto = false;
+    opts->comp_slack = 0;
+    opts->stats = NULL;
+    opts->progress = NULL;
+    opts->progress_data = NULL;
+    opts->cache = NULL;
+    opts->effort = DRPM_EFFORT_DEFAULT;
+    opts->index_spacing = 0;
 
     return DRPM_ERR_OK;
 }
@@ -95,13 +107,24 @@ int drpm_make_options_copy(struct drpm_make_options *opts_dst, const struct drpm
     opts_dst->addblk_comp = opts_src->addblk_comp;
     opts_dst->addblk_comp_level = opts_src->addblk_comp_level;
     opts_dst->mbytes = opts_src->mbytes;
+    opts_dst->threads = opts_src->threads;
+    opts_dst->comp_auto = opts_src->comp_auto;
+    opts_dst->comp_slack = opts_src->comp_slack;
+    opts_dst->stats = opts_src->stats;
+    opts_dst->progress = opts_src->progress;
+    opts_dst->progress_data = opts_src->progress_data;
+    opts_dst->cache = opts_src->cache;
+    opts_dst->effort = opts_src->effort;
+    opts_dst->index_spacing = opts_src->index_spacing;
 
     free(opts_dst->seqfile);
     free(opts_dst->oldrpmprint);
     free(opts_dst->oldpatchrpm);
+    free(opts_dst->dict);
     opts_dst->seqfile = NULL;
     opts_dst->oldrpmprint = NULL;
     opts_dst->oldpatchrpm = NULL;
+    opts_dst->dict = NULL;
 
     if (opts_src->seqfile != NULL) {
         if ((opts_dst->seqfile = malloc(strlen(opts_src->seqfile) + 1)) == NULL)
@@ -121,6 +144,12 @@ int drpm_make_options_copy(struct drpm_make_options *opts_dst, const struct drpm
         strcpy(opts_dst->oldpatchrpm, opts_src->oldpatchrpm);
     }
 
+    if (opts_src->dict != NULL) {
+        if ((opts_dst->dict = malloc(strlen(opts_src->dict) + 1)) == NULL)
+            return DRPM_ERR_MEMORY;
+        strcpy(opts_dst->dict, opts_src->dict);
+    }
+
     return DRPM_ERR_OK;
 }
 
@@ -145,7 +174,7 @@ int drpm_make_options_set_type(struct drpm_make_options *opts, unsigned short ty
 
 int drpm_make_options_set_version(struct drpm_make_options *opts, unsigned short version)
 {
-    if (opts == NULL || version < 1 || version > 3)
+    if (opts == NULL || version < 1 || version > DELTARPM_VERSION_MAX)
         return DRPM_ERR_ARGS;
 
     opts->version = version;
@@ -170,6 +199,7 @@ int drpm_make_options_set_delta_comp(struct drpm_make_options *opts, unsigned sh
     case DRPM_COMP_ZSTD:
 #endif
         opts->comp_from_rpm = false;
+        opts->comp_auto = false;
         opts->comp = comp;
         opts->comp_level = level;
         break;
@@ -186,6 +216,19 @@ int drpm_make_options_get_delta_comp_from_rpm(struct drpm_make_options *opts)
         return DRPM_ERR_ARGS;
 
     opts->comp_from_rpm = true;
+    opts->comp_auto = false;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_make_options_set_delta_comp_auto(struct drpm_make_options *opts, unsigned short slack)
+{
+    if (opts == NULL || slack > 100)
+        return DRPM_ERR_ARGS;
+
+    opts->comp_from_rpm = false;
+    opts->comp_auto = true;
+    opts->comp_slack = slack;
 
     return DRPM_ERR_OK;
 }
@@ -273,6 +316,79 @@ int drpm_make_options_add_patches(struct drpm_make_options *opts, const char *ol
     return DRPM_ERR_OK;
 }
 
+int drpm_make_options_set_threads(struct drpm_make_options *opts, unsigned threads)
+{
+    if (opts == NULL || threads > THREADS_MAX)
+        return DRPM_ERR_ARGS;
+
+    opts->threads = threads;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_make_options_set_effort(struct drpm_make_options *opts, unsigned short effort)
+{
+    if (opts == NULL || effort < DRPM_EFFORT_MIN || effort > DRPM_EFFORT_MAX)
+        return DRPM_ERR_ARGS;
+
+    opts->effort = effort;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_make_options_set_sparse_index(struct drpm_make_options *opts, unsigned spacing)
+{
+    if (opts == NULL ||
+        (spacing != 0 && (spacing < SPARSE_INDEX_MIN || spacing > SPARSE_INDEX_MAX ||
+                          (spacing & (spacing - 1)) != 0)))
+        return DRPM_ERR_ARGS;
+
+    opts->index_spacing = spacing;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_make_options_set_delta_dict(struct drpm_make_options *opts, const char *dictfile)
+{
+    char *tmp;
+
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    if (dictfile == NULL) {
+        free(opts->dict);
+        opts->dict = NULL;
+    } else {
+        if ((tmp = realloc(opts->dict, strlen(dictfile) + 1)) == NULL)
+            return DRPM_ERR_MEMORY;
+        opts->dict = tmp;
+        strcpy(opts->dict, dictfile);
+    }
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_make_options_set_stats(struct drpm_make_options *opts, struct drpm_make_stats *stats)
+{
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    opts->stats = stats;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_make_options_set_progress(struct drpm_make_options *opts, drpm_progress_cb callback, void *data)
+{
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    opts->progress = callback;
+    opts->progress_data = data;
+
+    return DRPM_ERR_OK;
+}
+
 // TODO: not yet used
 int drpm_make_options_set_memlimit(struct drpm_make_options *opts, unsigned mbytes)
 {
@@ -283,3 +399,212 @@ int drpm_make_options_set_memlimit(struct drpm_make_options *opts, unsigned mbyt
 
     return DRPM_ERR_OK;
 }
+
+int drpm_make_stats_init(struct drpm_make_stats **stats)
+{
+    const struct drpm_make_stats init = {0};
+
+    if (stats == NULL)
+        return DRPM_ERR_ARGS;
+
+    if ((*stats = malloc(sizeof(struct drpm_make_stats))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    **stats = init;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_make_stats_destroy(struct drpm_make_stats **stats)
+{
+    if (stats == NULL)
+        return DRPM_ERR_ARGS;
+
+    free(*stats);
+    *stats = NULL;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_make_stats_get_delta_comp(const struct drpm_make_stats *stats, unsigned short *comp, unsigned short *level)
+{
+    if (stats == NULL || comp == NULL || level == NULL)
+        return DRPM_ERR_ARGS;
+
+    *comp = stats->comp;
+    *level = stats->comp_level;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_make_stats_get_comp_trials(const struct drpm_make_stats *stats, unsigned *count, unsigned long *sample_len)
+{
+    if (stats == NULL || count == NULL || sample_len == NULL)
+        return DRPM_ERR_ARGS;
+
+    *count = stats->trial_count;
+    *sample_len = stats->sample_len;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_make_stats_get_comp_trial(const struct drpm_make_stats *stats, unsigned index,
+                                   unsigned short *comp, unsigned short *level,
+                                   unsigned long *comp_len, unsigned long *usecs)
+{
+    if (stats == NULL || index >= stats->trial_count ||
+        comp == NULL || level == NULL || comp_len == NULL || usecs == NULL)
+        return DRPM_ERR_ARGS;
+
+    *comp = stats->trials[index].comp;
+    *level = stats->trials[index].comp_level;
+    *comp_len = stats->trials[index].comp_len;
+    *usecs = stats->trials[index].usecs;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_options_init(struct drpm_apply_options **opts)
+{
+    const struct drpm_apply_options init = {0};
+
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    if ((*opts = malloc(sizeof(struct drpm_apply_options))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    **opts = init;
+
+    drpm_apply_options_defaults(*opts);
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_options_destroy(struct drpm_apply_options **opts)
+{
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    free((*opts)->dict_dir);
+    free(*opts);
+    *opts = NULL;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_options_defaults(struct drpm_apply_options *opts)
+{
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    free(opts->dict_dir);
+
+    opts->threads = 1;
+    opts->dict_dir = NULL;
+    opts->open_files = 0;
+    opts->io_threads = IO_THREADS_DEFAULT;
+    opts->verify_files = false;
+    opts->bad_file = NULL;
+    opts->progress = NULL;
+    opts->progress_data = NULL;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_options_copy(struct drpm_apply_options *opts_dst, const struct drpm_apply_options *opts_src)
+{
+    if (opts_dst == NULL || opts_src == NULL)
+        return DRPM_ERR_ARGS;
+
+    opts_dst->threads = opts_src->threads;
+    opts_dst->open_files = opts_src->open_files;
+    opts_dst->io_threads = opts_src->io_threads;
+    opts_dst->verify_files = opts_src->verify_files;
+    opts_dst->bad_file = opts_src->bad_file;
+    opts_dst->progress = opts_src->progress;
+    opts_dst->progress_data = opts_src->progress_data;
+
+    free(opts_dst->dict_dir);
+    opts_dst->dict_dir = NULL;
+
+    if (opts_src->dict_dir != NULL) {
+        if ((opts_dst->dict_dir = malloc(strlen(opts_src->dict_dir) + 1)) == NULL)
+            return DRPM_ERR_MEMORY;
+        strcpy(opts_dst->dict_dir, opts_src->dict_dir);
+    }
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_options_set_threads(struct drpm_apply_options *opts, unsigned threads)
+{
+    if (opts == NULL || threads > THREADS_MAX)
+        return DRPM_ERR_ARGS;
+
+    opts->threads = threads;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_options_set_dict_dir(struct drpm_apply_options *opts, const char *dir)
+{
+    char *tmp;
+
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    if (dir == NULL) {
+        free(opts->dict_dir);
+        opts->dict_dir = NULL;
+    } else {
+        if ((tmp = realloc(opts->dict_dir, strlen(dir) + 1)) == NULL)
+            return DRPM_ERR_MEMORY;
+        opts->dict_dir = tmp;
+        strcpy(opts->dict_dir, dir);
+    }
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_options_set_open_files(struct drpm_apply_options *opts, unsigned count)
+{
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    opts->open_files = count;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_options_set_io_threads(struct drpm_apply_options *opts, unsigned threads)
+{
+    if (opts == NULL || threads > THREADS_MAX)
+        return DRPM_ERR_ARGS;
+
+    opts->io_threads = threads;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_options_verify_files(struct drpm_apply_options *opts, char **bad_file)
+{
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    opts->verify_files = true;
+    opts->bad_file = bad_file;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_options_set_progress(struct drpm_apply_options *opts, drpm_progress_cb callback, void *data)
+{
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    opts->progress = callback;
+    opts->progress_data = data;
+
+    return DRPM_ERR_OK;
+}
@@ -31,9 +31,23 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <openssl/md5.h>
+#include <openssl/sha.h>
 
 #define CHUNK_SIZE 1024
 
+/* automatic delta compression selection trial-compresses
+ * up to this many slices of this size taken from across the delta body */
+#define COMP_SAMPLE_SLICES 16
+#define COMP_SAMPLE_SLICE_SIZE (64 * 1024)
+#define COMP_TRIALS_MAX 8
+
+/* compressed input is read in batches of this size */
+#ifndef DECOMP_READ_SIZE
+#define DECOMP_READ_SIZE (128 * 1024)
+#endif
+/* minimum free space in the output window before each decoder call */
+#define DECOMP_OUT_MIN (64 * 1024)
+
 #define CREAT_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH)
 
 #define DIGESTALGO_MD5 0
@@ -47,6 +61,26 @@
 #define RPM_ARCHIVE_READ_UNCOMP 1
 #define RPM_ARCHIVE_READ_DECOMP 2
 
+/* progress is reported at phase changes and then at most
+ * once per this many bytes, which also bounds cancellation latency */
+#define PROGRESS_INTERVAL (4 * 1024 * 1024)
+
+/* kinds of cache entries */
+#define SPARSE_INDEX_MIN 32
+#define SPARSE_INDEX_MAX (1 << 20)
+
+#define CACHE_PAYLOAD 0
+#define CACHE_INDEX 1
+
+#define THREADS_MAX 64
+#define IO_THREADS_DEFAULT 2
+
+/* version 4 deltas may copy from earlier output, which drpm_make()
+ * searches this far back, while anything beyond the maximum is rejected */
+#define DELTARPM_VERSION_MAX 4
+#define SELF_WINDOW (32 << 20)
+#define SELF_WINDOW_MAX (1 << 30)
+
 #define MIN(x,y) (((x) < (y)) ? (x) : (y))
 #define MAX(x,y) (((x) > (y)) ? (x) : (y))
 
@@ -64,6 +98,13 @@
 #define CPIO_HEADER_SIZE 110 /* new ASCII format (6B + 8B * 13) */
 #define CPIO_PADDING(offset) PADDING((offset), 4)
 
+/* rpm's large-file payloads use stripped headers (6B + 8B file index),
+ * taking everything else from the RPM header */
+#define CPIO_STRIPPED_MAGIC "07070X"
+#define CPIO_STRIPPED_HEADER_SIZE 14
+#define CPIO_FILESIZE_MAX UINT32_MAX
+#define CPIO_HEADER_LEN(hdr) ((hdr)->stripped ? CPIO_STRIPPED_HEADER_SIZE : CPIO_HEADER_SIZE)
+
 struct drpm {
     char *filename;
     uint32_t version;
@@ -72,7 +113,7 @@ struct drpm {
     char *sequence;
     char *src_nevr;
     char *tgt_nevr;
-    uint32_t tgt_size;
+    uint64_t tgt_size;
     char tgt_md5[MD5_DIGEST_LENGTH * 2 + 1];
     uint32_t tgt_comp;
     char *tgt_comp_param;
@@ -84,10 +125,13 @@ struct drpm {
     uint32_t *ext_copies;
     uint64_t ext_data_len;
     uint64_t int_data_len;
+    uint32_t self_window;
+    uint32_t *self_copies;
 
     uint32_t offadj_elems_size;
     uint32_t int_copies_size;
     uint32_t ext_copies_size;
+    uint32_t self_copies_size;
 };
 
 struct drpm_make_options {
@@ -103,15 +147,68 @@ struct drpm_make_options {
     char *oldrpmprint;
     char *oldpatchrpm;
     unsigned mbytes;
+    unsigned threads;
+    char *dict;
+    bool comp_auto;
+    unsigned short comp_slack;
+    struct drpm_make_stats *stats;
+    drpm_progress_cb progress;
+    void *progress_data;
+    struct cache *cache; // warm payloads and indexes (drpmd)
+    unsigned short effort;
+    unsigned index_spacing; // sparse index if not 0
 };
 
+struct drpm_make_stats {
+    unsigned short comp;
+    unsigned short comp_level;
+    size_t sample_len;
+    struct {
+        unsigned short comp;
+        unsigned short comp_level;
+        size_t comp_len;
+        unsigned long usecs;
+    } trials[COMP_TRIALS_MAX];
+    unsigned trial_count;
+};
+
+struct drpm_apply_options {
+    unsigned threads;
+    char *dict_dir;
+    unsigned open_files;
+    unsigned io_threads;
+    bool verify_files;
+    char **bad_file; // where to report the file failing verification
+    drpm_progress_cb progress;
+    void *progress_data;
+};
+
+struct drpm_apply_estimate {
+    uint64_t memory;
+    uint64_t msecs;
+    uint64_t blocks; // peak core blocks (bytes)
+    uint64_t ext_read;
+    uint64_t ext_reread;
+    uint64_t decomp;
+    uint64_t recomp;
+    unsigned short recomp_comp;
+};
+
+struct check_file;
 struct cpio_file;
 struct cpio_header;
 struct deltarpm;
+struct diff_seed;
 struct file_info;
+struct file_verifier;
+struct out_window;
+struct progress;
 
 //drpm_block.c
 struct blocks;
+//drpm_cache.c
+struct cache;
+struct cache_entry;
 //drpm_compstrm.c
 struct compstrm;
 //drpm_decompstrm.c
@@ -122,30 +219,69 @@ struct rpm_patches;
 struct rpm;
 //drpm_search.c
 struct hash;
+struct self_hash;
 struct sfxsrt;
 //drpm_write.c
 struct compstrm_wrapper;
 
 //drpm_apply.c
+int apply_estimate(struct drpm_apply_estimate *, const struct deltarpm *, bool, unsigned short, unsigned);
+int check_files(const struct check_file *, size_t, unsigned short, int, bool);
 int expand_sequence(struct cpio_file **, size_t *, const unsigned char *, uint32_t,
                     const struct file_info *, size_t, unsigned short, int);
+int file_verifier_destroy(struct file_verifier **);
+int file_verifier_feed(struct file_verifier *, const unsigned char *, size_t);
+int file_verifier_finish(struct file_verifier *, char **);
+int file_verifier_start(struct file_verifier **, const struct file_info *, size_t, unsigned short);
 int is_prelinked(bool *, int, const unsigned char *, ssize_t);
+int out_window_create(struct out_window **, size_t);
+void out_window_destroy(struct out_window **);
+int out_window_fetch(const struct out_window *, size_t, unsigned char *, size_t);
+void out_window_push(struct out_window *, const unsigned char *, size_t);
 int prelink_open(const char *, int *);
 
 //drpm_block.c
 size_t block_id(uint64_t offset);
 size_t block_size();
-int blocks_create(struct blocks **, uint64_t, const struct file_info *,
+int blocks_create(struct blocks **, uint64_t, const struct file_info *, size_t,
                   const struct cpio_file *, size_t, const uint32_t *, size_t,
-                  struct rpm *, bool);
+                  struct rpm *, bool, unsigned, unsigned);
 int blocks_destroy(struct blocks **);
+int blocks_estimate(uint64_t, const uint32_t *, size_t, size_t *, size_t *, size_t *, size_t *);
 int blocks_next(struct blocks *, unsigned char *, size_t *, uint64_t, size_t,
                 size_t, size_t);
+size_t blocks_prefetched(const struct blocks *);
+
+//drpm_cache.c
+int cache_create(struct cache **, size_t);
+int cache_destroy(struct cache **);
+void *cache_entry_data(const struct cache_entry *);
+size_t cache_entry_size(const struct cache_entry *);
+struct cache_entry *cache_get(struct cache *, int, const unsigned char *);
+int cache_get_index(struct cache *, const unsigned char *, bool, bool, unsigned,
+                    const unsigned char *, size_t, unsigned, struct cache_entry **,
+                    struct progress *);
+void cache_get_stats(struct cache *, size_t *, size_t *, unsigned long *, unsigned long *);
+void cache_hold(struct cache *);
+int cache_put(struct cache *, int, const unsigned char *, void *, size_t,
+              void (*)(void *), struct cache_entry **);
+struct cache *cache_process(void);
+void cache_release(struct cache *, struct cache_entry *);
+void cache_remove(struct cache *, struct cache_entry *);
+int cache_set_dir(struct cache *, const char *);
 
 //drpm_compstrm.c
 int compstrm_destroy(struct compstrm **);
 int compstrm_finish(struct compstrm *, unsigned char **, size_t *);
+int compstrm_get_comp_size(struct compstrm *, size_t *);
 int compstrm_init(struct compstrm **, int, unsigned short, int);
+int compstrm_load_dict(struct compstrm *, const unsigned char *, size_t);
+int compstrm_set_comparing(struct compstrm *, int, off_t);
+int compstrm_set_progress(struct compstrm *, struct progress *, int);
+int compstrm_set_sampling(struct compstrm *, size_t, size_t);
+int compstrm_set_streaming(struct compstrm *, MD5_CTX *);
+int compstrm_set_xz_blocks(struct compstrm *, uint64_t, unsigned);
+int compstrm_set_zstd_params(struct compstrm *, unsigned short, bool, unsigned);
 int compstrm_write(struct compstrm *, size_t, const void *);
 int compstrm_write_be32(struct compstrm *, uint32_t);
 int compstrm_write_be64(struct compstrm *, uint64_t);
@@ -153,26 +289,40 @@ int compstrm_write_be64(struct compstrm *, uint64_t);
 //drpm_decompstrm.c
 int decompstrm_destroy(struct decompstrm **);
 int decompstrm_get_comp_size(struct decompstrm *, size_t *);
-int decompstrm_init(struct decompstrm **, int, unsigned short *, MD5_CTX *, const unsigned char *, size_t);
+int decompstrm_init(struct decompstrm **, int, unsigned short *, MD5_CTX *, const unsigned char *, size_t, unsigned);
+int decompstrm_load_dict(struct decompstrm *, const char *);
 int decompstrm_read(struct decompstrm *, size_t, void *);
 int decompstrm_read_be32(struct decompstrm *, uint32_t *);
 int decompstrm_read_be64(struct decompstrm *, uint64_t *);
 int decompstrm_read_until_eof(struct decompstrm *, size_t *, unsigned char **);
+int decompstrm_reserve(struct decompstrm *, size_t);
+int decompstrm_set_progress(struct decompstrm *, struct progress *, int);
 
 //drpm_deltarpm.c
 bool deltarpm_decode_comp(uint32_t, unsigned short *, unsigned short *);
 bool deltarpm_encode_comp(uint32_t *, unsigned short, unsigned short);
+bool deltarpm_get_xz_blocks(const struct deltarpm *, uint64_t *);
+bool deltarpm_get_zstd_params(const struct deltarpm *, unsigned short *, bool *, bool *);
+int deltarpm_set_xz_blocks(struct deltarpm *, uint64_t);
+int deltarpm_set_zstd_params(struct deltarpm *, unsigned short, bool, bool);
 void free_deltarpm(struct deltarpm *);
 
 //drpm_diff.c
 int make_diff(const unsigned char *, size_t, const unsigned char *, size_t,
               const unsigned char ***, uint64_t *, uint32_t **, uint32_t *,
               uint32_t **, uint32_t *, unsigned char **, uint32_t *,
-              unsigned short, int);
+              unsigned short, int, unsigned short, unsigned, unsigned,
+              struct hash *, const struct diff_seed *, size_t, size_t,
+              uint32_t **, uint32_t *, uint32_t *, struct progress *);
 
 //drpm_make.c
+int cpio_header_fetch(struct rpm *, struct cpio_header *, char *);
 int cpio_header_read(struct cpio_header *, const char *);
 void cpio_header_write(const struct cpio_header *, char *);
+uint64_t cpio_filesize(const struct file_info *);
+int diff_seeds_find(struct rpm *, const unsigned char *, size_t, size_t,
+                    struct rpm *, const unsigned char *, size_t, size_t,
+                    struct diff_seed **, size_t *);
 int fill_nodiff_deltarpm(struct deltarpm *, const char *, bool);
 int parse_cpio_from_rpm_filedata(struct rpm *, unsigned char **, size_t *,
                                  unsigned char **, uint32_t *,
@@ -188,10 +338,13 @@ void drpm_free(struct drpm *);
 int read_be32(int, uint32_t *);
 int read_be64(int, uint64_t *);
 int read_deltarpm(struct deltarpm *, const char *);
+int read_deltarpm_body(struct deltarpm *, const char *, unsigned char **, size_t *);
+int read_file(const char *, unsigned char **, size_t *);
 
 //drpm_rpm.c
 int rpm_archive_read_chunk(struct rpm *, void *, size_t);
 int rpm_archive_rewind(struct rpm *);
+int rpm_archive_seek(struct rpm *, uint64_t);
 int rpm_destroy(struct rpm **);
 int rpm_fetch_archive(struct rpm *, unsigned char **, size_t *);
 int rpm_fetch_header(struct rpm *, unsigned char **, uint32_t *);
@@ -203,10 +356,15 @@ int rpm_get_digest_algo(struct rpm *, unsigned short *);
 int rpm_get_file_info(struct rpm *, struct file_info **, size_t *, bool *);
 int rpm_get_nevr(struct rpm *, char **);
 int rpm_get_payload_format(struct rpm *, unsigned short *);
+int rpm_get_xz_block_size(struct rpm *, uint64_t *);
+int rpm_get_zstd_params(struct rpm *, unsigned short *, bool *, bool *);
 bool rpm_is_sourcerpm(struct rpm *);
+int rpm_leadsig_get_size(unsigned char *, size_t, uint64_t *);
 int rpm_patch_payload_format(struct rpm *, const char *);
-int rpm_read(struct rpm **, const char *, int, unsigned short *,
-             unsigned char *, unsigned char *);
+int rpm_payload_reproducible(struct rpm *, const char *, unsigned short, unsigned short, bool *);
+uint64_t rpm_probe_xz_blocks(int, off_t);
+int rpm_read(struct rpm **, const char *, int, unsigned, unsigned short *,
+             unsigned char *, unsigned char *, struct cache *, struct progress *);
 int rpm_read_header(struct rpm **, const char *, const char *);
 int rpm_replace_lead_and_signature(struct rpm *, unsigned char *, size_t);
 int rpm_signature_empty(struct rpm *);
@@ -214,15 +372,24 @@ int rpm_signature_get_md5(struct rpm *, unsigned char *, bool *);
 int rpm_signature_reload(struct rpm *);
 int rpm_signature_set_md5(struct rpm *, unsigned char *);
 int rpm_signature_set_size(struct rpm *, uint32_t);
-uint32_t rpm_size_full(struct rpm *);
+uint64_t rpm_size_archive(struct rpm *);
+uint64_t rpm_size_full(struct rpm *);
 uint32_t rpm_size_header(struct rpm *);
 int rpm_write(struct rpm *, const char *, bool, unsigned char *, bool);
 
 //drpm_search.c
-int hash_create(struct hash **, const unsigned char *, size_t);
+int hash_create(struct hash **, const unsigned char *, size_t, bool, unsigned, struct progress *);
+int hash_create_sparse(struct hash **, const unsigned char *, size_t, unsigned, unsigned,
+                       struct progress *);
+bool hash_effort_chained(unsigned short);
 void hash_free(struct hash **);
+size_t hash_size(const struct hash *);
 size_t hash_search(struct hash *, const unsigned char *, size_t,
-                   const unsigned char *, size_t, size_t, size_t, size_t *, size_t *);
+                   const unsigned char *, size_t, size_t, size_t, size_t,
+                   unsigned short, size_t *, size_t *);
+int self_hash_create(struct self_hash **, const unsigned char *, size_t, size_t);
+void self_hash_free(struct self_hash **);
+size_t self_hash_search(struct self_hash *, size_t, size_t, size_t *, size_t *);
 int sfxsrt_create(struct sfxsrt **, const unsigned char *, size_t);
 void sfxsrt_free(struct sfxsrt **);
 size_t sfxsrt_search(struct sfxsrt *, const unsigned char *, size_t,
@@ -233,6 +400,7 @@ void create_be32(uint32_t, unsigned char *);
 void create_be64(uint64_t, unsigned char *);
 void dump_hex(char *, const unsigned char *, size_t);
 int md5_update_be32(MD5_CTX *, uint32_t);
+int md5_update_be64(MD5_CTX *, uint64_t);
 uint16_t parse_be16(const unsigned char *);
 uint32_t parse_be32(const unsigned char *);
 uint64_t parse_be64(const unsigned char *);
@@ -240,14 +408,21 @@ ssize_t parse_hex(unsigned char *, const char *);
 ssize_t parse_hexnum(const char *, size_t);
 bool parse_md5(unsigned char *, const char *);
 bool parse_sha256(unsigned char *, const char *);
+int parallel_run(unsigned, size_t, int (*)(void *, size_t), void *);
+int progress_add(struct progress *, int, uint64_t);
+void progress_init(struct progress *, drpm_progress_cb, void *);
+int progress_report(struct progress *, int, uint64_t, uint64_t, uint64_t);
 bool resize16(void **, size_t, size_t);
 bool resize32(void **, size_t, size_t);
+unsigned threads_resolve(unsigned);
 
 //drpm_write.c
 int compstrm_wrapper_destroy(struct compstrm_wrapper **);
 int compstrm_wrapper_finish(struct compstrm_wrapper *, unsigned char **, size_t *);
 int compstrm_wrapper_init(struct compstrm_wrapper **, size_t,
                           int, unsigned short, int);
+int compstrm_wrapper_set_xz_blocks(struct compstrm_wrapper *, uint64_t, unsigned);
+int compstrm_wrapper_set_zstd_params(struct compstrm_wrapper *, unsigned short, bool, unsigned);
 int compstrm_wrapper_write(struct compstrm_wrapper *, const unsigned char *, size_t);
 int write_be32(int, uint32_t);
 int write_be64(int, uint64_t);
@@ -255,6 +430,13 @@ int write_comp(struct compstrm *, size_t *, int, const void *, size_t);
 int write_deltarpm(struct deltarpm *);
 int write_seqfile(struct deltarpm *, const char *);
 
+/* an installed file to be checked against its digest */
+struct check_file {
+    const char *name;
+    unsigned char digest[MAX(MD5_DIGEST_LENGTH, SHA256_DIGEST_LENGTH)];
+    size_t filesize;
+};
+
 struct cpio_file {
     ssize_t index;
     size_t header_len;
@@ -262,6 +444,13 @@ struct cpio_file {
     size_t offset;
 };
 
+/* old content known to be identical to new content (from file digests) */
+struct diff_seed {
+    size_t old_off;
+    size_t new_off;
+    size_t len;
+};
+
 struct cpio_header {
     uint16_t ino;
     uint16_t mode;
@@ -269,19 +458,28 @@ struct cpio_header {
     uint16_t gid;
     uint16_t nlink;
     uint32_t mtime;
-    uint32_t filesize;
+    uint64_t filesize;
     uint8_t devmajor;
     uint8_t devminor;
     uint8_t rdevmajor;
     uint8_t rdevminor;
     uint16_t namesize;
+    bool stripped;
+    uint32_t file_index; // into the RPM header (stripped headers only)
 };
 
 struct deltarpm {
     const char *filename;
+    const char *dict_file; // zstd dictionary to compress body with
+    const char *dict_dir; // where to look for zstd dictionaries
+    bool copies_only; // reading add and internal data lengths only
     unsigned short type;
     unsigned short comp;
     unsigned short comp_level;
+    bool comp_auto; // pick comp and comp_level by trial compression
+    unsigned short comp_slack; // allowed size overhead of auto pick (percent)
+    struct drpm_make_stats *stats; // where to report what was picked
+    struct progress *progress; // where writing the body is reported, if anywhere
     union {
         struct rpm *tgt_rpm;
         char *tgt_nevr;
@@ -291,7 +489,7 @@ struct deltarpm {
     uint32_t sequence_len;
     unsigned char *sequence;
     unsigned char tgt_md5[MD5_DIGEST_LENGTH];
-    uint32_t tgt_size;
+    uint64_t tgt_size;
     unsigned short tgt_comp;
     unsigned short tgt_comp_level;
     uint32_t tgt_comp_param_len;
@@ -307,8 +505,15 @@ struct deltarpm {
     uint32_t *int_copies;
     uint32_t *ext_copies;
     uint64_t ext_data_len;
+    /* internal copies taken from earlier output instead of internal data
+     * (version 4), as pairs of the number of internal copies since
+     * the previous one and the distance back into the output */
+    uint32_t self_window; // longest distance
+    uint32_t self_copies_count;
+    uint32_t *self_copies;
     uint32_t add_data_len;
     unsigned char *add_data;
+    unsigned short add_comp; // only determined if copies_only
     uint64_t int_data_len;
     bool int_data_as_ptrs;
     union {
@@ -322,11 +527,21 @@ struct file_info {
     uint32_t flags;
     char *md5;
     uint16_t rdev;
-    uint32_t size;
+    uint64_t size;
     uint16_t mode;
     uint32_t verify;
     char *linkto;
     uint32_t color;
 };
 
+/* caller's progress callback and what was last reported to it */
+struct progress {
+    drpm_progress_cb callback;
+    void *data;
+    int phase;
+    uint64_t bytes;
+    uint64_t done;
+    uint64_t counted; // bytes counted with progress_add() in this phase
+};
+
 #endif
@@ -28,13 +28,16 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <openssl/md5.h>
 
 #define MAGIC_DRPM 0x6472706D
 
 #define MAGIC_DLT(x) (((x) >> 8) == 0x444C54)
-#define MAGIC_DLT3(x) ((x) == 0x444C5433)
+#define DLT_VERSION(x) ((int)((x) % 256) - '0')
 
+static int readdelta_add_comp(struct deltarpm *, const unsigned char *, size_t);
+static int readdelta_head(int *, struct deltarpm *, const char *);
 static int readdelta_rest(int, struct deltarpm *);
 static int readdelta_rpmonly(int, struct deltarpm *);
 static int readdelta_standard(int, struct deltarpm *);
@@ -77,6 +80,59 @@ int read_be64(int filedesc, uint64_t *buffer_ret)
     return DRPM_ERR_OK;
 }
 
+/* Reads the whole of file <filename> into <*buffer_ret>. */
+int read_file(const char *filename, unsigned char **buffer_ret, size_t *len_ret)
+{
+    int filedesc;
+    struct stat stats;
+    ssize_t bytes_read;
+    int error = DRPM_ERR_OK;
+
+    if ((filedesc = open(filename, O_RDONLY)) < 0)
+        return DRPM_ERR_IO;
+
+    if (fstat(filedesc, &stats) != 0) {
+        error = DRPM_ERR_IO;
+        goto cleanup;
+    }
+
+    if ((uint64_t)stats.st_size >= SIZE_MAX) {
+        error = DRPM_ERR_OVERFLOW;
+        goto cleanup;
+    }
+
+    if ((*buffer_ret = malloc(stats.st_size + 1)) == NULL) {
+        error = DRPM_ERR_MEMORY;
+        goto cleanup;
+    }
+
+    if ((bytes_read = read(filedesc, *buffer_ret, stats.st_size)) != stats.st_size) {
+        error = (bytes_read < 0) ? DRPM_ERR_IO : DRPM_ERR_FORMAT;
+        free(*buffer_ret);
+        *buffer_ret = NULL;
+        goto cleanup;
+    }
+
+    *len_ret = stats.st_size;
+
+cleanup:
+    close(filedesc);
+
+    return error;
+}
+
+/* Determines how the add block starting with <data> is compressed. */
+int readdelta_add_comp(struct deltarpm *delta, const unsigned char *data, size_t data_len)
+{
+    struct decompstrm *stream;
+    int error;
+
+    if ((error = decompstrm_init(&stream, -1, &delta->add_comp, NULL, data, data_len, 1)) != DRPM_ERR_OK)
+        return error == DRPM_ERR_PROG ? DRPM_ERR_FORMAT : error;
+
+    return decompstrm_destroy(&stream);
+}
+
 /* Reads the rest of the DeltaRPM, i.e. the compressed part
  * that has the same format for standard and rpm-only deltas. */
 int readdelta_rest(int filedesc, struct deltarpm *delta)
@@ -88,27 +144,38 @@ int readdelta_rest(int filedesc, struct deltarpm *delta)
     uint32_t offadj_elems_size;
     uint32_t int_copies_size;
     uint32_t ext_copies_size;
+    uint32_t self_copies_size;
+    uint32_t self_copy;
     uint32_t ext_data_32;
+    uint32_t tgt_size_32;
+    uint64_t tgt_size;
     uint32_t add_data_len;
+    unsigned char add_magic[8];
     uint32_t int_data_32;
     uint64_t off;
+    uint64_t next_self;
     int error = DRPM_ERR_OK;
 
     /* initializing decompression and determining compression method */
-    if ((error = decompstrm_init(&stream, filedesc, &delta->comp, NULL, NULL, 0)) != DRPM_ERR_OK)
+    if ((error = decompstrm_init(&stream, filedesc, &delta->comp, NULL, NULL, 0, 1)) != DRPM_ERR_OK)
         return error;
 
-    /* reading delta version (1-3) */
+    /* loading the dictionary the body was compressed with (if any) */
+    if ((error = decompstrm_load_dict(stream, delta->dict_dir)) != DRPM_ERR_OK)
+        goto cleanup;
+
+    /* reading delta version (1-4) */
 
     if ((error = decompstrm_read_be32(stream, &version)) != DRPM_ERR_OK)
         goto cleanup;
 
-    if (!MAGIC_DLT(version)) {
+    if (!MAGIC_DLT(version) || DLT_VERSION(version) < 1 ||
+        DLT_VERSION(version) > DELTARPM_VERSION_MAX) {
         error = DRPM_ERR_FORMAT;
         goto cleanup;
     }
 
-    delta->version = version % 256 - '0';
+    delta->version = DLT_VERSION(version);
 
     if (delta->version < 3 && delta->type == DRPM_TYPE_RPMONLY) {
         // rpm-only deltas only supported since version 3
@@ -159,10 +226,12 @@ int readdelta_rest(int filedesc, struct deltarpm *delta)
 
     if (delta->version >= 2) {
         /* reading size of the target RPM and the target compression */
-        if ((error = decompstrm_read_be32(stream, &delta->tgt_size)) != DRPM_ERR_OK ||
+        if ((error = decompstrm_read_be32(stream, &tgt_size_32)) != DRPM_ERR_OK ||
             (error = decompstrm_read_be32(stream, &deltarpm_comp)) != DRPM_ERR_OK)
             goto cleanup;
 
+        delta->tgt_size = tgt_size_32;
+
         if (!deltarpm_decode_comp(deltarpm_comp, &delta->tgt_comp, &delta->tgt_comp_level)) {
             error = DRPM_ERR_FORMAT;
             goto cleanup;
@@ -183,7 +252,7 @@ int readdelta_rest(int filedesc, struct deltarpm *delta)
                 goto cleanup;
         }
 
-        if (delta->version == 3) {
+        if (delta->version >= 3) {
             /* reading size of target header included in the diff
              * and the offset adjustment elements for the CPIO archive */
             if ((error = decompstrm_read_be32(stream, &delta->tgt_header_len)) != DRPM_ERR_OK ||
@@ -233,6 +302,12 @@ int readdelta_rest(int filedesc, struct deltarpm *delta)
     if ((error = decompstrm_read(stream, delta->tgt_leadsig_len, delta->tgt_leadsig)) != DRPM_ERR_OK)
         goto cleanup;
 
+    /* target RPMs of 4 GiB or more have their size saturated,
+     * but the target signature still records it */
+    if (delta->tgt_size == UINT32_MAX &&
+        rpm_leadsig_get_size(delta->tgt_leadsig, delta->tgt_leadsig_len, &tgt_size) == DRPM_ERR_OK)
+        delta->tgt_size = tgt_size;
+
     /* reading payload format offset and internal and external copies */
 
     if ((error = decompstrm_read_be32(stream, &delta->payload_fmt_off)) != DRPM_ERR_OK ||
@@ -272,8 +347,41 @@ int readdelta_rest(int filedesc, struct deltarpm *delta)
                 goto cleanup;
     }
 
+    /* reading internal copies taken from earlier output */
+    if (delta->version >= 4) {
+        if ((error = decompstrm_read_be32(stream, &delta->self_window)) != DRPM_ERR_OK ||
+            (error = decompstrm_read_be32(stream, &delta->self_copies_count)) != DRPM_ERR_OK)
+            goto cleanup;
+
+        if (delta->self_window > SELF_WINDOW_MAX ||
+            delta->self_copies_count > delta->int_copies_count) {
+            error = DRPM_ERR_FORMAT;
+            goto cleanup;
+        }
+
+        self_copies_size = delta->self_copies_count * 2;
+
+        if (self_copies_size > 0) {
+            if ((delta->self_copies = malloc(self_copies_size * 4)) == NULL) {
+                error = DRPM_ERR_MEMORY;
+                goto cleanup;
+            }
+            for (uint32_t i = 0; i < self_copies_size; i += 2)
+                if ((error = decompstrm_read_be32(stream, delta->self_copies + i)) != DRPM_ERR_OK)
+                    goto cleanup;
+            for (uint32_t j = 1; j < self_copies_size; j += 2) {
+                if ((error = decompstrm_read_be32(stream, delta->self_copies + j)) != DRPM_ERR_OK)
+                    goto cleanup;
+                if (delta->self_copies[j] == 0 || delta->self_copies[j] > delta->self_window) {
+                    error = DRPM_ERR_FORMAT;
+                    goto cleanup;
+                }
+            }
+        }
+    }
+
     /* reading length of external data */
-    if (delta->version == 3) {
+    if (delta->version >= 3) {
         if ((error = decompstrm_read_be64(stream, &delta->ext_data_len)) != DRPM_ERR_OK)
             goto cleanup;
     } else {
@@ -293,18 +401,30 @@ int readdelta_rest(int filedesc, struct deltarpm *delta)
             error = DRPM_ERR_FORMAT;
             goto cleanup;
         }
-        if ((delta->add_data = malloc(add_data_len)) == NULL) {
-            error = DRPM_ERR_MEMORY;
-            goto cleanup;
+        if (delta->copies_only) {
+            /* only finding out how the add block is compressed */
+            if (add_data_len < sizeof(add_magic)) {
+                error = DRPM_ERR_FORMAT;
+                goto cleanup;
+            }
+            if ((error = decompstrm_read(stream, sizeof(add_magic), add_magic)) != DRPM_ERR_OK ||
+                (error = decompstrm_read(stream, add_data_len - sizeof(add_magic), NULL)) != DRPM_ERR_OK ||
+                (error = readdelta_add_comp(delta, add_magic, sizeof(add_magic))) != DRPM_ERR_OK)
+                goto cleanup;
+        } else {
+            if ((delta->add_data = malloc(add_data_len)) == NULL) {
+                error = DRPM_ERR_MEMORY;
+                goto cleanup;
+            }
+            if ((error = decompstrm_read(stream, add_data_len, delta->add_data)) != DRPM_ERR_OK)
+                goto cleanup;
         }
-        if ((error = decompstrm_read(stream, add_data_len, delta->add_data)) != DRPM_ERR_OK)
-            goto cleanup;
         delta->add_data_len = add_data_len;
     }
 
     /* reading internal data */
 
-    if (delta->version == 3) {
+    if (delta->version >= 3) {
         if ((error = decompstrm_read_be64(stream, &delta->int_data_len)) != DRPM_ERR_OK)
             goto cleanup;
     } else {
@@ -318,7 +438,8 @@ int readdelta_rest(int filedesc, struct deltarpm *delta)
         goto cleanup;
     }
 
-    if (delta->int_data_len > 0) {
+    // internal data is not needed when only the copies are
+    if (delta->int_data_len > 0 && !delta->copies_only) {
         if ((delta->int_data.bytes = malloc(delta->int_data_len)) == NULL) {
             error = DRPM_ERR_MEMORY;
             goto cleanup;
@@ -329,16 +450,31 @@ int readdelta_rest(int filedesc, struct deltarpm *delta)
 
     delta->int_data_as_ptrs = false;
 
-    /* checking internal copies against internal data length */
+    /* checking internal copies against internal data length
+     * (except for those taken from earlier output) */
     off = 0;
-    for (uint32_t i = 1; i < int_copies_size; i += 2) {
-        off += delta->int_copies[i];
+    self_copy = 0;
+    next_self = (delta->self_copies_count > 0) ? delta->self_copies[0] : UINT64_MAX;
+    for (uint32_t i = 0; i < delta->int_copies_count; i++) {
+        if (i == next_self) {
+            self_copy++;
+            next_self = (self_copy < delta->self_copies_count) ?
+                        next_self + 1 + delta->self_copies[self_copy * 2] : UINT64_MAX;
+            continue;
+        }
+        off += delta->int_copies[i * 2 + 1];
         if (off > delta->int_data_len) {
             error = DRPM_ERR_FORMAT;
             goto cleanup;
         }
     }
 
+    if (self_copy < delta->self_copies_count) {
+        // self copy past the last internal copy
+        error = DRPM_ERR_FORMAT;
+        goto cleanup;
+    }
+
     /* checking external copies against external data length */
     off = 0;
     for (uint32_t i = 0; i < ext_copies_size; i += 2) {
@@ -371,7 +507,8 @@ int readdelta_rpmonly(int filedesc, struct deltarpm *delta)
     if ((error = read_be32(filedesc, &version)) != DRPM_ERR_OK)
         return error;
 
-    if (!MAGIC_DLT3(version))
+    if (!MAGIC_DLT(version) || DLT_VERSION(version) < 3 ||
+        DLT_VERSION(version) > DELTARPM_VERSION_MAX)
         return DRPM_ERR_FORMAT;
 
     if ((error = read_be32(filedesc, &tgt_nevr_len)) != DRPM_ERR_OK)
@@ -404,6 +541,9 @@ int readdelta_rpmonly(int filedesc, struct deltarpm *delta)
     if ((uint32_t)bytes_read != delta->add_data_len)
         return DRPM_ERR_FORMAT;
 
+    if (delta->copies_only && delta->add_data_len > 0)
+        return readdelta_add_comp(delta, delta->add_data, delta->add_data_len);
+
     return DRPM_ERR_OK;
 }
 
@@ -414,7 +554,7 @@ int readdelta_standard(int filedesc, struct deltarpm *delta)
     int error;
 
     /* reading RPM lead, signature and header */
-    if ((error = rpm_read(&rpmst, delta->filename, RPM_ARCHIVE_DONT_READ, NULL, NULL, NULL)) != DRPM_ERR_OK)
+    if ((error = rpm_read(&rpmst, delta->filename, RPM_ARCHIVE_DONT_READ, 1, NULL, NULL, NULL, NULL, NULL)) != DRPM_ERR_OK)
         return error;
 
     /* reading target compression from header (used for older delta versions) */
@@ -429,42 +569,47 @@ int readdelta_standard(int filedesc, struct deltarpm *delta)
     return DRPM_ERR_OK;
 }
 
-/* Reads DeltaRPM from file. */
-int read_deltarpm(struct deltarpm *delta, const char *filename)
+/* Opens DeltaRPM file <filename> and reads the part specific to
+ * its type, leaving <*filedesc> positioned at the compressed body. */
+int readdelta_head(int *filedesc, struct deltarpm *delta, const char *filename)
 {
-    int filedesc;
     uint32_t magic;
-    int error = DRPM_ERR_OK;
-
-    if (filename == NULL || delta == NULL)
-        return DRPM_ERR_PROG;
+    int error;
 
-    if ((filedesc = open(filename, O_RDONLY)) == -1)
+    if ((*filedesc = open(filename, O_RDONLY)) == -1)
         return DRPM_ERR_IO;
 
     delta->filename = filename;
 
     /* determining type of delta by magic bytes and calling relevant subroutine */
 
-    if ((error = read_be32(filedesc, &magic)) != DRPM_ERR_OK)
-        goto cleanup_fail;
+    if ((error = read_be32(*filedesc, &magic)) != DRPM_ERR_OK)
+        return error;
 
     switch (magic) {
     case MAGIC_DRPM:
         delta->type = DRPM_TYPE_RPMONLY;
-        if ((error = readdelta_rpmonly(filedesc, delta)) != DRPM_ERR_OK)
-            goto cleanup_fail;
-        break;
+        return readdelta_rpmonly(*filedesc, delta);
     case MAGIC_RPM:
         delta->type = DRPM_TYPE_STANDARD;
-        if ((error = readdelta_standard(filedesc, delta)) != DRPM_ERR_OK)
-            goto cleanup_fail;
-        break;
-    default:
-        error = DRPM_ERR_FORMAT;
-        goto cleanup_fail;
+        return readdelta_standard(*filedesc, delta);
     }
 
+    return DRPM_ERR_FORMAT;
+}
+
+/* Reads DeltaRPM from file. */
+int read_deltarpm(struct deltarpm *delta, const char *filename)
+{
+    int filedesc = -1;
+    int error = DRPM_ERR_OK;
+
+    if (filename == NULL || delta == NULL)
+        return DRPM_ERR_PROG;
+
+    if ((error = readdelta_head(&filedesc, delta, filename)) != DRPM_ERR_OK)
+        goto cleanup_fail;
+
     /* the rest of the delta is the same for both types */
     if ((error = readdelta_rest(filedesc, delta)) != DRPM_ERR_OK)
         goto cleanup_fail;
@@ -475,7 +620,35 @@ cleanup_fail:
     free_deltarpm(delta);
 
 cleanup:
-    close(filedesc);
+    if (filedesc >= 0)
+        close(filedesc);
+
+    return error;
+}
+
+/* Reads the decompressed body of DeltaRPM <filename> into <*body>
+ * without parsing it (e.g. for training compression dictionaries).
+ * <delta> is filled in with whatever precedes the body. */
+int read_deltarpm_body(struct deltarpm *delta, const char *filename,
+                       unsigned char **body, size_t *body_len)
+{
+    struct decompstrm *stream = NULL;
+    int filedesc = -1;
+    int error = DRPM_ERR_OK;
+
+    if (filename == NULL || delta == NULL || body == NULL || body_len == NULL)
+        return DRPM_ERR_PROG;
+
+    if ((error = readdelta_head(&filedesc, delta, filename)) != DRPM_ERR_OK ||
+        (error = decompstrm_init(&stream, filedesc, &delta->comp, NULL, NULL, 0, 1)) != DRPM_ERR_OK ||
+        (error = decompstrm_load_dict(stream, delta->dict_dir)) != DRPM_ERR_OK ||
+        (error = decompstrm_read_until_eof(stream, body_len, body)) != DRPM_ERR_OK)
+        free_deltarpm(delta);
+
+    if (stream != NULL)
+        decompstrm_destroy(&stream);
+    if (filedesc >= 0)
+        close(filedesc);
 
     return error;
 }
@@ -500,10 +673,12 @@ int deltarpm_to_drpm(const struct deltarpm *src, struct drpm *dst)
     dst->payload_fmt_off = src->payload_fmt_off;
     dst->ext_data_len = src->ext_data_len;
     dst->int_data_len = src->int_data_len;
+    dst->self_window = src->self_window;
 
     dst->offadj_elems_size = src->offadj_elems_count * 2;
     dst->int_copies_size = src->int_copies_count * 2;
     dst->ext_copies_size = src->ext_copies_count * 2;
+    dst->self_copies_size = src->self_copies_count * 2;
 
     if ((dst->filename = malloc(strlen(src->filename) + 1)) == NULL ||
         (dst->sequence = malloc(src->sequence_len * 2 + 1)) == NULL ||
@@ -516,7 +691,9 @@ int deltarpm_to_drpm(const struct deltarpm *src, struct drpm *dst)
         (dst->int_copies_size > 0 &&
          (dst->int_copies = malloc(dst->int_copies_size * 4)) == NULL) ||
         (dst->ext_copies_size > 0 &&
-         (dst->ext_copies = malloc(dst->ext_copies_size * 4)) == NULL)) {
+         (dst->ext_copies = malloc(dst->ext_copies_size * 4)) == NULL) ||
+        (dst->self_copies_size > 0 &&
+         (dst->self_copies = malloc(dst->self_copies_size * 4)) == NULL)) {
         error = DRPM_ERR_MEMORY;
         goto cleanup_fail;
     }
@@ -536,6 +713,8 @@ int deltarpm_to_drpm(const struct deltarpm *src, struct drpm *dst)
         memcpy(dst->int_copies, src->int_copies, dst->int_copies_size * 4);
     if (dst->ext_copies_size > 0)
         memcpy(dst->ext_copies, src->ext_copies, dst->ext_copies_size * 4);
+    if (dst->self_copies_size > 0)
+        memcpy(dst->self_copies, src->self_copies, dst->self_copies_size * 4);
 
     if (src->type == DRPM_TYPE_STANDARD) {
         if ((error = rpm_get_nevr(src->head.tgt_rpm, &dst->tgt_nevr)) != DRPM_ERR_OK)
@@ -569,6 +748,7 @@ void drpm_free(struct drpm *delta)
     free(delta->offadj_elems);
     free(delta->int_copies);
     free(delta->ext_copies);
+    free(delta->self_copies);
 
     *delta = delta_init;
 }
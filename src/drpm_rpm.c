@@ -25,13 +25,13 @@
 #include <string.h>
 #include <limits.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <lzma.h>
 #include <rpm/rpmlib.h>
 #include <rpm/rpmts.h>
 #include <rpm/rpmdb.h>
 #include <openssl/md5.h>
 
-#define BUFFER_SIZE 4096
-
 /* RFC 4880 - Section 9.4. Hash Algorithms */
 #define RFC4880_HASH_ALGO_MD5 1
 #define RFC4880_HASH_ALGO_SHA256 8
@@ -40,23 +40,51 @@
 
 #define RPMLEAD_SIZE 96
 
+/* archive input compressed between comparisons with the original payload */
+#define REPRODUCIBLE_CHUNK_SIZE (256 * 1024)
+
 struct rpm {
     unsigned char lead[RPMLEAD_SIZE];
     Header signature;
     Header header;
     unsigned char *archive;
+    /* cache entry the archive is borrowed from (instead of being
+     * owned), with a reference held on it and on its cache */
+    struct cache *archive_cache;
+    struct cache_entry *archive_entry;
     size_t archive_size;
     size_t archive_offset;
     size_t archive_comp_size;
+    uint64_t xz_block_size;
+    unsigned short zstd_window_log;
+    bool zstd_checksum;
 };
 
+/* A decompressed payload is kept in a cache as the archive followed
+ * by a trailer telling what was learned about its compression, so that
+ * the buffer it was decompressed into can be handed over as it is.
+ * Being flat, it can be stored in a file (whose contents are checked
+ * against the digest before use). The trailer is big-endian:
+ * archive MD5 (16 bytes), compressed archive size (8), xz block size (8),
+ * compression method (4), zstd window log (4), zstd checksum flag (1)
+ * and the magic (4). */
+#define CACHED_PAYLOAD_MAGIC "drpP"
+#define CACHED_PAYLOAD_TRAILER_SIZE (MD5_DIGEST_LENGTH + 8 + 8 + 4 + 4 + 1 + 4)
+
+static uint64_t rpm_archive_size_hint(struct rpm *);
 static void rpm_init(struct rpm *);
 static void rpm_free(struct rpm *);
 static int rpm_export_header(struct rpm *, unsigned char **, size_t *);
 static int rpm_export_signature(struct rpm *, unsigned char **, size_t *);
 static void rpm_header_unload_region(struct rpm *, rpmTagVal);
-static int rpm_read_archive(struct rpm *, const char *, off_t, bool,
-                            unsigned short *, MD5_CTX *, MD5_CTX *);
+static void rpm_probe_zstd_frame(struct rpm *, int, off_t);
+static int rpm_read_archive(struct rpm *, const char *, off_t, bool, unsigned,
+                            unsigned short *, MD5_CTX *, MD5_CTX *,
+                            struct cache *, const unsigned char *, struct progress *);
+static void rpm_archive_borrow(struct rpm *, struct cache *, struct cache_entry *);
+static int rpm_archive_from_cache(struct rpm *, int, struct cache *, struct cache_entry *,
+                                  unsigned short *, MD5_CTX *);
+static int rpm_archive_to_cache(struct rpm *, struct cache *, const unsigned char *, unsigned short);
 
 void rpm_init(struct rpm *rpmst)
 {
@@ -67,9 +95,14 @@ void rpm_init(struct rpm *rpmst)
     rpmst->signature = NULL;
     rpmst->header = NULL;
     rpmst->archive = NULL;
+    rpmst->archive_cache = NULL;
+    rpmst->archive_entry = NULL;
     rpmst->archive_size = 0;
     rpmst->archive_offset = 0;
     rpmst->archive_comp_size = 0;
+    rpmst->xz_block_size = 0;
+    rpmst->zstd_window_log = 0;
+    rpmst->zstd_checksum = false;
 }
 
 void rpm_free(struct rpm *rpmst)
@@ -79,7 +112,12 @@ void rpm_free(struct rpm *rpmst)
 
     headerFree(rpmst->signature);
     headerFree(rpmst->header);
-    free(rpmst->archive);
+    if (rpmst->archive_entry != NULL) {
+        cache_release(rpmst->archive_cache, rpmst->archive_entry);
+        cache_destroy(&rpmst->archive_cache);
+    } else {
+        free(rpmst->archive);
+    }
 
     rpm_init(rpmst);
 }
@@ -174,16 +212,257 @@ void rpm_header_unload_region(struct rpm *rpmst, rpmTagVal rpmtag)
     rpmtdFree(td);
 }
 
+/* Returns the uncompressed payload size as recorded in the header
+ * (or signature), or 0 if it is not known. */
+uint64_t rpm_archive_size_hint(struct rpm *rpmst)
+{
+    uint64_t size;
+
+    if ((size = headerGetNumber(rpmst->header, RPMTAG_LONGARCHIVESIZE)) == 0 &&
+        (size = headerGetNumber(rpmst->header, RPMTAG_ARCHIVESIZE)) == 0 &&
+        (size = headerGetNumber(rpmst->signature, RPMSIGTAG_LONGARCHIVESIZE)) == 0)
+        size = headerGetNumber(rpmst->signature, RPMSIGTAG_PAYLOADSIZE);
+
+    return size;
+}
+
+/* Works out whether the xz payload at <offset> (up to the end of the
+ * file) is made of equally sized blocks carrying their sizes in the block
+ * headers, which is what the multi-threaded xz encoder writes. If so,
+ * returns the uncompressed size of a block. Anything else gives 0, as
+ * the payload can then only be recompressed as a whole. */
+uint64_t rpm_probe_xz_blocks(int filedesc, off_t offset)
+{
+    struct stat stats;
+    unsigned char buffer[LZMA_BLOCK_HEADER_SIZE_MAX];
+    unsigned char *index_buf = NULL;
+    lzma_stream_flags header_flags;
+    lzma_stream_flags footer_flags;
+    lzma_index *index = NULL;
+    lzma_index_iter iter;
+    uint64_t memlimit = UINT64_MAX;
+    size_t index_pos = 0;
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_block block = {0};
+    uint64_t block_size = 0;
+    uint64_t prev_size = 0;
+    uint64_t stream_size;
+    uint64_t ret = 0;
+
+    if (fstat(filedesc, &stats) != 0 || stats.st_size < offset ||
+        (stream_size = stats.st_size - offset) < 2 * LZMA_STREAM_HEADER_SIZE + 1)
+        return 0;
+
+    /* stream header, footer and index */
+    if (pread(filedesc, buffer, LZMA_STREAM_HEADER_SIZE, offset) != LZMA_STREAM_HEADER_SIZE ||
+        lzma_stream_header_decode(&header_flags, buffer) != LZMA_OK ||
+        pread(filedesc, buffer, LZMA_STREAM_HEADER_SIZE,
+              stats.st_size - LZMA_STREAM_HEADER_SIZE) != LZMA_STREAM_HEADER_SIZE ||
+        lzma_stream_footer_decode(&footer_flags, buffer) != LZMA_OK ||
+        lzma_stream_flags_compare(&header_flags, &footer_flags) != LZMA_OK ||
+        footer_flags.check != LZMA_CHECK_SHA256 ||
+        footer_flags.backward_size > stream_size - 2 * LZMA_STREAM_HEADER_SIZE ||
+        (index_buf = malloc(footer_flags.backward_size)) == NULL ||
+        pread(filedesc, index_buf, footer_flags.backward_size,
+              stats.st_size - LZMA_STREAM_HEADER_SIZE - footer_flags.backward_size)
+              != (ssize_t)footer_flags.backward_size ||
+        lzma_index_buffer_decode(&index, &memlimit, NULL, index_buf, &index_pos,
+                                 footer_flags.backward_size) != LZMA_OK ||
+        lzma_index_stream_size(index) != stream_size)
+        goto cleanup;
+
+    /* all blocks but the last one must be of the same size */
+    lzma_index_iter_init(&iter, index);
+    while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK)) {
+        if (block_size == 0)
+            block_size = iter.block.uncompressed_size;
+        else if (prev_size != block_size)
+            goto cleanup;
+        prev_size = iter.block.uncompressed_size;
+        if (prev_size == 0 || prev_size > block_size)
+            goto cleanup;
+    }
+    if (block_size == 0)
+        goto cleanup;
+
+    /* the first block header must record both sizes */
+    if (pread(filedesc, buffer, 1, offset + LZMA_STREAM_HEADER_SIZE) != 1 || buffer[0] == 0)
+        goto cleanup;
+    block.version = 1;
+    block.check = footer_flags.check;
+    block.filters = filters;
+    block.header_size = lzma_block_header_size_decode(buffer[0]);
+    if (pread(filedesc, buffer + 1, block.header_size - 1,
+              offset + LZMA_STREAM_HEADER_SIZE + 1) != (ssize_t)block.header_size - 1 ||
+        lzma_block_header_decode(&block, NULL, buffer) != LZMA_OK)
+        goto cleanup;
+    for (size_t i = 0; filters[i].id != LZMA_VLI_UNKNOWN; i++)
+        free(filters[i].options);
+
+    if (filters[0].id == LZMA_FILTER_LZMA2 && filters[1].id == LZMA_VLI_UNKNOWN &&
+        block.compressed_size != LZMA_VLI_UNKNOWN &&
+        block.uncompressed_size != LZMA_VLI_UNKNOWN)
+        ret = block_size;
+
+cleanup:
+    lzma_index_end(index, NULL);
+    free(index_buf);
+
+    return ret;
+}
+
+/* Reads the window size and checksum flag from the header of the zstd
+ * frame at <offset>. A window that is not a power of two (or a frame
+ * without a window descriptor) leaves the window log at 0. */
+void rpm_probe_zstd_frame(struct rpm *rpmst, int filedesc, off_t offset)
+{
+    unsigned char frame_header[6];
+
+    if (pread(filedesc, frame_header, sizeof(frame_header), offset) != sizeof(frame_header) ||
+        parse_be32(frame_header) != 0x28B52FFD)
+        return;
+
+    rpmst->zstd_checksum = (frame_header[4] & 0x04) != 0;
+
+    /* no window descriptor in single-segment frames */
+    if ((frame_header[4] & 0x20) == 0 && (frame_header[5] & 0x07) == 0)
+        rpmst->zstd_window_log = 10 + (frame_header[5] >> 3);
+}
+
+/* Makes the archive of <rpmst> that of the cached payload <entry>,
+ * taking over the reference held on it. */
+void rpm_archive_borrow(struct rpm *rpmst, struct cache *cache, struct cache_entry *entry)
+{
+    cache_hold(cache);
+    rpmst->archive_cache = cache;
+    rpmst->archive_entry = entry;
+    rpmst->archive = cache_entry_data(entry);
+    rpmst->archive_size = cache_entry_size(entry) - CACHED_PAYLOAD_TRAILER_SIZE;
+}
+
+/* Fills in the archive of <rpmst> from the cached decompressed payload
+ * <entry> of <cache>, borrowing it (with the reference held on it) on
+ * success. Returns DRPM_ERR_FORMAT if it is not a valid one
+ * (e.g. a truncated or stale file left by another process), which
+ * includes an archive not matching the digest it was stored with.
+ * The compressed archive still has to be read from <filedesc> if its
+ * MD5 is needed, but that is much cheaper than decompressing it. */
+int rpm_archive_from_cache(struct rpm *rpmst, int filedesc, struct cache *cache,
+                           struct cache_entry *entry, unsigned short *comp_ret, MD5_CTX *md5)
+{
+    const unsigned char *payload = cache_entry_data(entry);
+    const size_t size = cache_entry_size(entry);
+    const unsigned char *trailer;
+    unsigned char *buffer;
+    ssize_t bytes_read;
+    unsigned char archive_md5[MD5_DIGEST_LENGTH];
+    int error = DRPM_ERR_OK;
+
+    if (size < CACHED_PAYLOAD_TRAILER_SIZE)
+        return DRPM_ERR_FORMAT;
+
+    trailer = payload + size - CACHED_PAYLOAD_TRAILER_SIZE;
+
+    if (memcmp(trailer + CACHED_PAYLOAD_TRAILER_SIZE - 4, CACHED_PAYLOAD_MAGIC, 4) != 0)
+        return DRPM_ERR_FORMAT;
+
+    if (MD5(payload, size - CACHED_PAYLOAD_TRAILER_SIZE, archive_md5) == NULL)
+        return DRPM_ERR_OTHER;
+    if (memcmp(archive_md5, trailer, MD5_DIGEST_LENGTH) != 0)
+        return DRPM_ERR_FORMAT;
+
+    if (md5 != NULL) {
+        if ((buffer = malloc(DECOMP_READ_SIZE)) == NULL)
+            return DRPM_ERR_MEMORY;
+
+        while ((bytes_read = read(filedesc, buffer, DECOMP_READ_SIZE)) > 0) {
+            if (MD5_Update(md5, buffer, bytes_read) != 1) {
+                error = DRPM_ERR_OTHER;
+                break;
+            }
+        }
+        if (bytes_read < 0)
+            error = DRPM_ERR_IO;
+
+        free(buffer);
+
+        if (error != DRPM_ERR_OK)
+            return error;
+    }
+
+    trailer += MD5_DIGEST_LENGTH;
+    rpmst->archive_comp_size = parse_be64(trailer);
+    rpmst->xz_block_size = parse_be64(trailer + 8);
+    rpmst->zstd_window_log = parse_be32(trailer + 20);
+    rpmst->zstd_checksum = (trailer[24] != 0);
+
+    if (comp_ret != NULL)
+        *comp_ret = parse_be32(trailer + 16);
+
+    rpm_archive_borrow(rpmst, cache, entry);
+
+    return DRPM_ERR_OK;
+}
+
+/* Hands the freshly decompressed archive of <rpmst> over to <cache>,
+ * borrowing it back from there. */
+int rpm_archive_to_cache(struct rpm *rpmst, struct cache *cache, const unsigned char *key, unsigned short comp)
+{
+    unsigned char *payload;
+    size_t payload_len;
+    unsigned char *trailer;
+    struct cache_entry *entry;
+    int error;
+
+    if (rpmst->archive_size > SIZE_MAX - CACHED_PAYLOAD_TRAILER_SIZE)
+        return DRPM_ERR_OK;
+
+    payload_len = rpmst->archive_size + CACHED_PAYLOAD_TRAILER_SIZE;
+
+    if ((payload = realloc(rpmst->archive, payload_len)) == NULL)
+        return DRPM_ERR_MEMORY;
+    rpmst->archive = payload;
+
+    trailer = payload + rpmst->archive_size;
+    if (MD5(payload, rpmst->archive_size, trailer) == NULL)
+        return DRPM_ERR_OTHER;
+    trailer += MD5_DIGEST_LENGTH;
+    create_be64(rpmst->archive_comp_size, trailer);
+    create_be64(rpmst->xz_block_size, trailer + 8);
+    create_be32(comp, trailer + 16);
+    create_be32(rpmst->zstd_window_log, trailer + 20);
+    trailer[24] = rpmst->zstd_checksum ? 1 : 0;
+    memcpy(trailer + 25, CACHED_PAYLOAD_MAGIC, 4);
+
+    /* the buffer is the cache's from now on (freed even on failure) */
+    rpmst->archive = NULL;
+    rpmst->archive_size = 0;
+
+    if ((error = cache_put(cache, CACHE_PAYLOAD, key, payload,
+                           payload_len, free, &entry)) != DRPM_ERR_OK)
+        return error;
+
+    rpm_archive_borrow(rpmst, cache, entry);
+
+    return DRPM_ERR_OK;
+}
+
 int rpm_read_archive(struct rpm *rpmst, const char *filename,
-                     off_t offset, bool decompress, unsigned short *comp_ret,
-                     MD5_CTX *seq_md5, MD5_CTX *full_md5)
+                     off_t offset, bool decompress, unsigned threads, unsigned short *comp_ret,
+                     MD5_CTX *seq_md5, MD5_CTX *full_md5,
+                     struct cache *cache, const unsigned char *cache_key,
+                     struct progress *prog)
 {
     struct decompstrm *stream = NULL;
     int filedesc;
     unsigned char *archive_tmp;
-    unsigned char buffer[BUFFER_SIZE];
+    size_t archive_alloc = 0;
+    struct stat stats;
+    uint64_t size_hint;
     ssize_t bytes_read;
     MD5_CTX *md5;
+    unsigned short comp;
+    struct cache_entry *entry;
     int error = DRPM_ERR_OK;
 
     if ((filedesc = open(filename, O_RDONLY)) < 0)
@@ -198,26 +477,76 @@ int rpm_read_archive(struct rpm *rpmst, const char *filename,
         // hack: never updating both MD5s when decompressing
         md5 = (seq_md5 == NULL) ? full_md5 : seq_md5;
 
-        if ((error = decompstrm_init(&stream, filedesc, comp_ret, md5, NULL, 0)) != DRPM_ERR_OK ||
-            (error = decompstrm_read_until_eof(stream, &rpmst->archive_size, &rpmst->archive)) != DRPM_ERR_OK ||
+        /* payloads of popular RPMs are only decompressed once */
+        if (cache != NULL && (entry = cache_get(cache, CACHE_PAYLOAD, cache_key)) != NULL) {
+            if ((error = rpm_archive_from_cache(rpmst, filedesc, cache, entry,
+                                                comp_ret, md5)) == DRPM_ERR_OK)
+                goto cleanup;
+            if (error == DRPM_ERR_FORMAT)
+                cache_remove(cache, entry); // not usable, decompressing again
+            cache_release(cache, entry);
+            if (error != DRPM_ERR_FORMAT)
+                goto cleanup;
+            error = DRPM_ERR_OK;
+        }
+
+        if ((error = decompstrm_init(&stream, filedesc, &comp, md5, NULL, 0, threads)) != DRPM_ERR_OK ||
+            (error = decompstrm_set_progress(stream, prog, DRPM_PHASE_READ)) != DRPM_ERR_OK)
+            goto cleanup;
+
+        if ((size_hint = rpm_archive_size_hint(rpmst)) > 0 && size_hint <= SIZE_MAX &&
+            (error = decompstrm_reserve(stream, size_hint)) != DRPM_ERR_OK)
+            goto cleanup;
+
+        if ((error = decompstrm_read_until_eof(stream, &rpmst->archive_size, &rpmst->archive)) != DRPM_ERR_OK ||
             (error = decompstrm_get_comp_size(stream, &rpmst->archive_comp_size)) != DRPM_ERR_OK ||
             (error = decompstrm_destroy(&stream)) != DRPM_ERR_OK)
             goto cleanup;
+
+        if (comp_ret != NULL)
+            *comp_ret = comp;
+
+        // cached payloads may later be needed as target, so always probing them
+        if ((comp_ret != NULL || cache != NULL) && comp == DRPM_COMP_XZ)
+            rpmst->xz_block_size = rpm_probe_xz_blocks(filedesc, offset);
+        else if ((comp_ret != NULL || cache != NULL) && comp == DRPM_COMP_ZSTD)
+            rpm_probe_zstd_frame(rpmst, filedesc, offset);
+
+        if (cache != NULL && (error = rpm_archive_to_cache(rpmst, cache, cache_key, comp)) != DRPM_ERR_OK)
+            goto cleanup;
     } else {
-        while ((bytes_read = read(filedesc, buffer, BUFFER_SIZE)) > 0) {
-            if ((archive_tmp = realloc(rpmst->archive,
-                 rpmst->archive_size + bytes_read)) == NULL) {
-                error = DRPM_ERR_MEMORY;
-                goto cleanup;
-            }
-            if ((seq_md5 != NULL && MD5_Update(seq_md5, buffer, bytes_read) != 1) ||
-                (full_md5 != NULL && MD5_Update(full_md5, buffer, bytes_read) != 1)) {
+        // read straight into the archive buffer, sized from the file if possible
+        if (fstat(filedesc, &stats) == 0 && stats.st_size >= offset &&
+            (uint64_t)(stats.st_size - offset) < SIZE_MAX)
+            archive_alloc = stats.st_size - offset + 1; // room to see EOF
+        else
+            archive_alloc = DECOMP_READ_SIZE;
+        if ((rpmst->archive = malloc(archive_alloc)) == NULL) {
+            error = DRPM_ERR_MEMORY;
+            goto cleanup;
+        }
+        while ((bytes_read = read(filedesc, rpmst->archive + rpmst->archive_size,
+                                  archive_alloc - rpmst->archive_size)) > 0) {
+            if ((seq_md5 != NULL && MD5_Update(seq_md5, rpmst->archive + rpmst->archive_size, bytes_read) != 1) ||
+                (full_md5 != NULL && MD5_Update(full_md5, rpmst->archive + rpmst->archive_size, bytes_read) != 1)) {
                 error = DRPM_ERR_OTHER;
                 goto cleanup;
             }
-            rpmst->archive = archive_tmp;
-            memcpy(rpmst->archive + rpmst->archive_size, buffer, bytes_read);
             rpmst->archive_size += bytes_read;
+            if ((error = progress_add(prog, DRPM_PHASE_READ, bytes_read)) != DRPM_ERR_OK)
+                goto cleanup;
+            if (rpmst->archive_size == archive_alloc) {
+                if (archive_alloc > SIZE_MAX / 2) {
+                    error = DRPM_ERR_OVERFLOW;
+                    goto cleanup;
+                }
+                archive_alloc *= 2;
+                if ((archive_tmp = realloc(rpmst->archive, archive_alloc)) == NULL) {
+                    error = DRPM_ERR_MEMORY;
+                    goto cleanup;
+                }
+                rpmst->archive = archive_tmp;
+            }
         }
         if (bytes_read < 0) {
             error = DRPM_ERR_IO;
@@ -239,13 +568,20 @@ cleanup:
  * The archive may be decompressed, read "as is", or not read at all.
  * If read, the compression method used in the archive is stored in
  * <*archive_comp>.
+ * Up to <threads> threads may be used to decompress the archive.
  * Two MD5 checksums may be created. An MD5 digest of the header
  * and archive will be written to <seq_md5_digest>, while
- * <full_md5_digest> shall be made up of the while file. */
+ * <full_md5_digest> shall be made up of the while file.
+ * If <cache> is not NULL, decompressed archives are looked up in and
+ * added to it, keyed by the MD5 digest in the signature. Otherwise the
+ * process-wide cache is used, if enabled.
+ * Reading the archive is counted towards the reading phase of <prog>
+ * (if not NULL), which may cancel it. */
 int rpm_read(struct rpm **rpmst, const char *filename,
-             int archive_mode, unsigned short *archive_comp,
+             int archive_mode, unsigned threads, unsigned short *archive_comp,
              unsigned char seq_md5_digest[MD5_DIGEST_LENGTH],
-             unsigned char full_md5_digest[MD5_DIGEST_LENGTH])
+             unsigned char full_md5_digest[MD5_DIGEST_LENGTH],
+             struct cache *cache, struct progress *prog)
 {
     FD_t file;
     const unsigned char magic_rpm[4] = {0xED, 0xAB, 0xEE, 0xDB};
@@ -258,6 +594,9 @@ int rpm_read(struct rpm **rpmst, const char *filename,
     size_t signature_len;
     unsigned char *header = NULL;
     size_t header_len;
+    unsigned char sigmd5[MD5_DIGEST_LENGTH];
+    bool has_sigmd5 = false;
+    struct cache *process_cache = NULL;
     int error = DRPM_ERR_OK;
 
     if (rpmst == NULL || filename == NULL)
@@ -326,10 +665,16 @@ int rpm_read(struct rpm **rpmst, const char *filename,
             error = DRPM_ERR_IO;
             goto cleanup_fail;
         }
+        if (cache == NULL)
+            cache = process_cache = cache_process();
+        if (cache != NULL && decomp_archive &&
+            (error = rpm_signature_get_md5(*rpmst, sigmd5, &has_sigmd5)) != DRPM_ERR_OK)
+            goto cleanup_fail;
         if ((error = rpm_read_archive(*rpmst, filename, file_pos,
-                                      decomp_archive, archive_comp,
+                                      decomp_archive, threads, archive_comp,
                                       (seq_md5_digest != NULL) ? &seq_md5 : NULL,
-                                      (full_md5_digest != NULL) ? &full_md5 : NULL)) != DRPM_ERR_OK)
+                                      (full_md5_digest != NULL) ? &full_md5 : NULL,
+                                      has_sigmd5 ? cache : NULL, sigmd5, prog)) != DRPM_ERR_OK)
             goto cleanup_fail;
     }
 
@@ -345,6 +690,8 @@ cleanup_fail:
     rpm_free(*rpmst);
 
 cleanup:
+    if (process_cache != NULL)
+        cache_destroy(&process_cache);
     free(signature);
     free(header);
     Fclose(file);
@@ -382,6 +729,20 @@ int rpm_archive_read_chunk(struct rpm *rpmst, void *buffer, size_t count)
     return DRPM_ERR_OK;
 }
 
+/* Positions the archive offset at <offset> bytes into the archive. */
+int rpm_archive_seek(struct rpm *rpmst, uint64_t offset)
+{
+    if (rpmst == NULL)
+        return DRPM_ERR_PROG;
+
+    if (offset > rpmst->archive_size)
+        return DRPM_ERR_FORMAT;
+
+    rpmst->archive_offset = offset;
+
+    return DRPM_ERR_OK;
+}
+
 /* Positions the archive offset at the beginning of the archive. */
 int rpm_archive_rewind(struct rpm *rpmst)
 {
@@ -395,18 +756,28 @@ int rpm_archive_rewind(struct rpm *rpmst)
 
 /* Returns the on-disk size of the RPM file. This will be without
  * the archive if it wasn't read. */
-uint32_t rpm_size_full(struct rpm *rpmst)
+uint64_t rpm_size_full(struct rpm *rpmst)
 {
     if (rpmst == NULL)
         return 0;
 
     unsigned sig_size = headerSizeof(rpmst->signature, HEADER_MAGIC_YES);
 
-    return RPMLEAD_SIZE + sig_size + RPMSIG_PADDING(sig_size) +
+    return (uint64_t)RPMLEAD_SIZE + sig_size + RPMSIG_PADDING(sig_size) +
            headerSizeof(rpmst->header, HEADER_MAGIC_YES) +
            rpmst->archive_comp_size;
 }
 
+/* Returns the uncompressed size of the archive as recorded
+ * in the header, or 0 if it is not known. */
+uint64_t rpm_size_archive(struct rpm *rpmst)
+{
+    if (rpmst == NULL)
+        return 0;
+
+    return rpm_archive_size_hint(rpmst);
+}
+
 /* Returns the size of the RPM header. */
 uint32_t rpm_size_header(struct rpm *rpmst)
 {
@@ -567,6 +938,34 @@ int rpm_replace_lead_and_signature(struct rpm *rpmst, unsigned char *leadsig, si
     return DRPM_ERR_OK;
 }
 
+/* Determines the size of the RPM file with lead and signature <leadsig>
+ * from the size of the header and payload recorded in the signature. */
+int rpm_leadsig_get_size(unsigned char *leadsig, size_t leadsig_len, uint64_t *size)
+{
+    const size_t skip = RPMLEAD_SIZE + sizeof(rpm_header_magic);
+    Header signature;
+    uint64_t sig_size;
+
+    if (leadsig == NULL || size == NULL || leadsig_len < RPM_LEADSIG_MIN_LEN)
+        return DRPM_ERR_PROG;
+
+    if (memcmp(leadsig + RPMLEAD_SIZE, rpm_header_magic, 4) != 0 ||
+        (signature = headerImport(leadsig + skip, 0, HEADERIMPORT_COPY)) == NULL)
+        return DRPM_ERR_FORMAT;
+
+    if ((sig_size = headerGetNumber(signature, RPMSIGTAG_LONGSIZE)) == 0)
+        sig_size = headerGetNumber(signature, RPMSIGTAG_SIZE);
+
+    headerFree(signature);
+
+    if (sig_size == 0)
+        return DRPM_ERR_FORMAT;
+
+    *size = leadsig_len + sig_size;
+
+    return DRPM_ERR_OK;
+}
+
 /* Checks if this is a source RPM. */
 bool rpm_is_sourcerpm(struct rpm *rpmst)
 {
@@ -619,6 +1018,7 @@ int rpm_get_comp(struct rpm *rpmst, unsigned short *comp)
 int rpm_get_comp_level(struct rpm *rpmst, unsigned short *level)
 {
     const char *payload_flags;
+    size_t len;
 
     if (rpmst == NULL || level == NULL)
         return DRPM_ERR_PROG;
@@ -627,8 +1027,14 @@ int rpm_get_comp_level(struct rpm *rpmst, unsigned short *level)
         return DRPM_ERR_FORMAT;
 
     /* payload_flags first contains compression level as a string (zero terminated),
-     * here we check that its max length is 2 (max compression level is 99) */
-    if (strlen(payload_flags) > 2)
+     * here we check that its max length is 2 (max compression level is 99);
+     * a thread count may follow for xz (e.g. "6T0"), which does not affect output */
+    len = strspn(payload_flags, "0123456789");
+    if (len > 2)
+        return DRPM_ERR_FORMAT;
+    if (payload_flags[len] == 'T')
+        len += 1 + strspn(payload_flags + len + 1, "0123456789");
+    if (payload_flags[len] != '\0')
         return DRPM_ERR_FORMAT;
 
     *level = atoi(payload_flags);
@@ -636,6 +1042,88 @@ int rpm_get_comp_level(struct rpm *rpmst, unsigned short *level)
     return DRPM_ERR_OK;
 }
 
+/* Fetches the uncompressed size of the blocks of a multi-block xz payload,
+ * or 0 if the payload is not made of such blocks (or was not read). */
+int rpm_get_xz_block_size(struct rpm *rpmst, uint64_t *block_size)
+{
+    if (rpmst == NULL || block_size == NULL)
+        return DRPM_ERR_PROG;
+
+    *block_size = rpmst->xz_block_size;
+
+    return DRPM_ERR_OK;
+}
+
+/* Fetches the window log (0 if unknown) and checksum flag of a zstd
+ * payload, and whether rpm compressed it in threaded mode ("19T8"). */
+int rpm_get_zstd_params(struct rpm *rpmst, unsigned short *window_log,
+                        bool *checksum, bool *threaded)
+{
+    const char *payload_flags;
+
+    if (rpmst == NULL || window_log == NULL || checksum == NULL || threaded == NULL)
+        return DRPM_ERR_PROG;
+
+    if ((payload_flags = headerGetString(rpmst->header, RPMTAG_PAYLOADFLAGS)) == NULL)
+        return DRPM_ERR_FORMAT;
+
+    *window_log = rpmst->zstd_window_log;
+    *checksum = rpmst->zstd_checksum;
+    *threaded = (strchr(payload_flags, 'T') != NULL);
+
+    return DRPM_ERR_OK;
+}
+
+/* Checks whether compressing the archive anew with <comp> at <level>
+ * and default parameters (as done when applying a delta that records
+ * none) gives back the payload of <filename> byte for byte. */
+int rpm_payload_reproducible(struct rpm *rpmst, const char *filename,
+                             unsigned short comp, unsigned short level, bool *reproducible)
+{
+    int error = DRPM_ERR_OK;
+    struct compstrm *stream = NULL;
+    size_t payload_len;
+    size_t write_len;
+    int filedesc = -1;
+
+    if (rpmst == NULL || filename == NULL || reproducible == NULL)
+        return DRPM_ERR_PROG;
+
+    *reproducible = false;
+
+    if ((filedesc = open(filename, O_RDONLY)) < 0)
+        return DRPM_ERR_IO;
+
+    /* compared as it is compressed, so that a payload that differs
+     * is usually given up on early on */
+    if ((error = compstrm_init(&stream, -1, comp, level)) != DRPM_ERR_OK ||
+        (error = compstrm_set_comparing(stream, filedesc,
+                                        rpm_size_full(rpmst) - rpmst->archive_comp_size)) != DRPM_ERR_OK)
+        goto cleanup;
+
+    for (size_t done = 0; done < rpmst->archive_size; done += write_len) {
+        write_len = MIN(REPRODUCIBLE_CHUNK_SIZE, rpmst->archive_size - done);
+        if ((error = compstrm_write(stream, write_len, rpmst->archive + done)) != DRPM_ERR_OK)
+            goto cleanup;
+    }
+
+    if ((error = compstrm_finish(stream, NULL, NULL)) != DRPM_ERR_OK ||
+        (error = compstrm_get_comp_size(stream, &payload_len)) != DRPM_ERR_OK)
+        goto cleanup;
+
+    *reproducible = (payload_len == rpmst->archive_comp_size);
+
+cleanup:
+    if (error == DRPM_ERR_MISMATCH)
+        error = DRPM_ERR_OK;
+
+    close(filedesc);
+    if (stream != NULL)
+        compstrm_destroy(&stream);
+
+    return error;
+}
+
 /* Determines the digest algorithm used for file checksums in the header. */
 int rpm_get_digest_algo(struct rpm *rpmst, unsigned short *digestalgo)
 {
@@ -738,11 +1226,13 @@ int rpm_get_file_info(struct rpm *rpmst, struct file_info **files_ret,
     rpmtd fileverify;
     rpmtd filelinktos;
     rpmtd filecolors;
+    bool long_sizes;
     const char *name;
     uint32_t *flags;
     const char *md5;
     uint16_t *rdev;
     uint32_t *size;
+    uint64_t *long_size;
     uint16_t *mode;
     uint32_t *verify;
     const char *linkto;
@@ -761,11 +1251,16 @@ int rpm_get_file_info(struct rpm *rpmst, struct file_info **files_ret,
     filelinktos = rpmtdNew();
     filecolors = rpmtdNew();
 
+    /* packages with files of 4 GiB or more only have 64-bit sizes */
+    long_sizes = !headerIsEntry(rpmst->header, RPMTAG_FILESIZES) &&
+                 headerIsEntry(rpmst->header, RPMTAG_LONGFILESIZES);
+
     if (headerGet(rpmst->header, RPMTAG_FILENAMES, filenames, HEADERGET_EXT) != 1 ||
         headerGet(rpmst->header, RPMTAG_FILEFLAGS, fileflags, HEADERGET_MINMEM) != 1 ||
         headerGet(rpmst->header, RPMTAG_FILEMD5S, filemd5s, HEADERGET_MINMEM) != 1 ||
         headerGet(rpmst->header, RPMTAG_FILERDEVS, filerdevs, HEADERGET_MINMEM) != 1 ||
-        headerGet(rpmst->header, RPMTAG_FILESIZES, filesizes, HEADERGET_MINMEM) != 1 ||
+        headerGet(rpmst->header, long_sizes ? RPMTAG_LONGFILESIZES : RPMTAG_FILESIZES,
+                  filesizes, HEADERGET_MINMEM) != 1 ||
         headerGet(rpmst->header, RPMTAG_FILEMODES, filemodes, HEADERGET_MINMEM) != 1 ||
         headerGet(rpmst->header, RPMTAG_FILEVERIFYFLAGS, fileverify, HEADERGET_MINMEM) != 1 ||
         headerGet(rpmst->header, RPMTAG_FILELINKTOS, filelinktos, HEADERGET_MINMEM) != 1) {
@@ -801,7 +1296,8 @@ int rpm_get_file_info(struct rpm *rpmst, struct file_info **files_ret,
         if ((name = rpmtdNextString(filenames)) == NULL ||
             (flags = rpmtdNextUint32(fileflags)) == NULL ||
             (md5 = rpmtdNextString(filemd5s)) == NULL ||
-            (size = rpmtdNextUint32(filesizes)) == NULL ||
+            (long_sizes ? (long_size = rpmtdNextUint64(filesizes)) == NULL :
+                          (size = rpmtdNextUint32(filesizes)) == NULL) ||
             (verify = rpmtdNextUint32(fileverify)) == NULL ||
             (linkto = rpmtdNextString(filelinktos)) == NULL ||
             (colors && (color = rpmtdNextUint32(filecolors)) == NULL) ||
@@ -824,7 +1320,7 @@ int rpm_get_file_info(struct rpm *rpmst, struct file_info **files_ret,
         files[i].flags = *flags;
         strcpy(files[i].md5, md5);
         files[i].rdev = *rdev;
-        files[i].size = *size;
+        files[i].size = long_sizes ? *long_size : *size;
         files[i].mode = *mode;
         files[i].verify = *verify;
         strcpy(files[i].linkto, linkto);
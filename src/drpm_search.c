@@ -50,8 +50,19 @@
 
 #define MIN_MISMATCHES 32
 
+/* how much shorter a match may be and still win by being nearer */
+#define LOCALITY_SLACK 8
+
 static size_t match_len(const unsigned char *, size_t, const unsigned char *, size_t);
+static bool match_better(size_t, size_t, size_t, size_t, size_t);
 static uint32_t buzhash(const unsigned char *);
+static uint32_t buzhash_roll(uint32_t, unsigned char, unsigned char);
+static int hash_keys_job(void *, size_t);
+static int hash_anchors_job(void *, size_t);
+static size_t chain_search(const struct hash *, uint32_t, size_t, unsigned short,
+                           const unsigned char *, size_t, const unsigned char *, size_t,
+                           size_t, size_t, size_t *);
+static void self_hash_index(struct self_hash *, size_t);
 static int bucketsort(long long *, long long *, size_t, size_t);
 static void suffix_split(long long *, long long *, size_t, size_t, size_t);
 static size_t suffix_search(const long long *, const unsigned char *, size_t,
@@ -70,14 +81,102 @@ size_t match_len(const unsigned char *old, size_t old_len,
     return i;
 }
 
+/* Tells whether a match of <len> bytes at old offset <pos> is better
+ * than the best one so far (of <best_len> bytes at <best_pos>).
+ * Matches of (nearly) the same length are told apart by how near they
+ * are to <near>, where the last copy left off, so that applying reads
+ * the old data in fewer, more local runs. */
+bool match_better(size_t pos, size_t len, size_t best_pos, size_t best_len, size_t near)
+{
+    size_t dist;
+    size_t best_dist;
+
+    if (len > best_len + LOCALITY_SLACK || best_len == 0)
+        return true;
+    if (len + LOCALITY_SLACK < best_len)
+        return false;
+
+    dist = (pos > near) ? pos - near : near - pos;
+    best_dist = (best_pos > near) ? best_pos - near : near - best_pos;
+
+    return dist < best_dist || (dist == best_dist && len > best_len);
+}
+
 /********************************* hash *********************************/
 
 #define HSIZESHIFT 4
 #define HSIZE (1 << HSIZESHIFT)
 
+/* blocks whose keys are computed at once, and by each job */
+#define HASH_KEYS_CHUNK (1 << 20)
+#define HASH_KEYS_JOB (1 << 16)
+/* windows searched for anchors at once, and by each job */
+#define HASH_ANCHORS_CHUNK (1 << 26)
+#define HASH_ANCHORS_JOB (1 << 20)
+/* how many blocks ahead table slots are prefetched when inserting */
+#define HASH_PREFETCH 16
+
+#ifdef __GNUC__
+#define PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define PREFETCH(addr) ((void)(addr))
+#endif
+
 struct hash {
     size_t *hash_table;
     size_t ht_len;
+    size_t *chain; // next block with the same key (by block), if chained
+    size_t chain_len;
+    uint32_t anchor_mask; // windows indexed only where hash & mask == 0, if sparse
+};
+
+struct hash_keys {
+    const unsigned char *old;
+    size_t first; // first block of chunk
+    size_t count; // blocks in chunk
+    size_t ht_len;
+    uint32_t *keys;
+};
+
+/* anchors found by one job of hash_create_sparse() */
+struct hash_anchor_list {
+    size_t *offsets;
+    uint32_t *keys;
+    size_t count;
+};
+
+struct hash_anchors {
+    const unsigned char *old;
+    size_t first; // first window of chunk
+    size_t count; // windows in chunk
+    size_t ht_len;
+    uint32_t mask;
+    struct hash_anchor_list *lists; // by job
+};
+
+/* how thoroughly hash_search() looks for matches at each effort level */
+struct hash_effort {
+    unsigned short stride;      // probing every <stride>-th position only
+    bool lookahead;             // also probing the block 3 blocks ahead
+    unsigned short candidates;  // blocks tried per probe (0 = no chains)
+    size_t lazy;                // positions searched for a longer match
+    bool local;                 // near ties go to the match nearest the last copy
+};
+
+/* Strides are coprime with HSIZE, so that a long enough match is probed
+ * at one of the block boundaries it spans in old.
+ * Up to the default, matches are chosen exactly as by deltarpm. */
+static const struct hash_effort hash_efforts[DRPM_EFFORT_MAX + 1] = {
+    {1, true, 0, HSIZE, false},             // (unused)
+    {5, false, 0, HSIZE, false},
+    {3, false, 0, HSIZE, false},
+    {1, false, 0, HSIZE, false},
+    {1, true, 0, HSIZE, false},             // DRPM_EFFORT_DEFAULT, as deltarpm
+    {1, true, 4, HSIZE, true},
+    {1, true, 8, 2 * HSIZE, true},
+    {1, true, 16, 4 * HSIZE, true},
+    {1, true, 32, 8 * HSIZE, true},
+    {1, true, 128, 16 * HSIZE, true}
 };
 
 /* 256 random numbers generated by a quantum source */
@@ -150,12 +249,61 @@ uint32_t buzhash(const unsigned char *buf)
     return x;
 }
 
-int hash_create(struct hash **hsh, const unsigned char *old, size_t old_len)
+/* Turns the buzhash of a window into that of the window one byte further,
+ * dropping byte <out> and adding byte <in>. */
+uint32_t buzhash_roll(uint32_t hash, unsigned char out, unsigned char in)
 {
-    size_t *hash_table;
+    const uint32_t x = noise[out] ^ (0x83D31DF4 ^ 0x07A63BE9);
+
+    hash = (hash << 1) ^ (hash & (1u << 31) ? 1 : 0) ^ noise[in];
+#if HSIZE % 32 != 0
+    hash ^= (x << (HSIZE % 32)) ^ (x >> (32 - (HSIZE % 32)));
+#else
+    hash ^= x;
+#endif
+
+    return hash;
+}
+
+/* Tells whether searching at <effort> needs a chained index. */
+bool hash_effort_chained(unsigned short effort)
+{
+    return hash_efforts[MIN(effort, DRPM_EFFORT_MAX)].candidates > 0;
+}
+
+/* Computes the keys of a range of blocks (one job of hash_create()). */
+int hash_keys_job(void *arg, size_t index)
+{
+    struct hash_keys *hkeys = arg;
+    const size_t start = index * HASH_KEYS_JOB;
+    const size_t end = MIN(start + HASH_KEYS_JOB, hkeys->count);
+
+    for (size_t i = start; i < end; i++)
+        hkeys->keys[i] = buzhash(hkeys->old + ((hkeys->first + i) << HSIZESHIFT)) % hkeys->ht_len;
+
+    return DRPM_ERR_OK;
+}
+
+/* Indexes the blocks of <old>. Normally only one block is kept per key
+ * (first come, first served, with one slot of overflow). A <chained>
+ * index keeps all blocks with the same key in a chain instead, in order
+ * of offset, skipping repeats of identical blocks.
+ * Keys are computed by up to <threads> threads, a chunk of blocks at
+ * a time, and then inserted by the calling thread in the same order as
+ * if computed serially, so the index does not depend on <threads>.
+ * Each chunk is counted towards the reading phase of <prog> (if not NULL),
+ * which may cancel building the index. */
+int hash_create(struct hash **hsh, const unsigned char *old, size_t old_len,
+                bool chained, unsigned threads, struct progress *prog)
+{
+    size_t *hash_table = NULL;
+    size_t *chain = NULL;
+    uint32_t *keys = NULL;
+    struct hash_keys hkeys;
     size_t ht_len;
     size_t key;
-    const unsigned char * const old_ptr = old;
+    size_t off;
+    size_t head;
     size_t primes[] = {
         65537, 98317, 147481, 221227, 331841, 497771, 746659, 1120001,
         1680013, 2520031, 3780053, 5670089, 8505137, 12757739, 19136609,
@@ -165,6 +313,9 @@ int hash_create(struct hash **hsh, const unsigned char *old, size_t old_len)
     };
     size_t i;
     const size_t i_limit = sizeof(primes)/sizeof(*primes) - 1;
+    const size_t blocks = old_len >> HSIZESHIFT;
+    const size_t chunks = (blocks + HASH_KEYS_CHUNK - 1) / HASH_KEYS_CHUNK;
+    int error;
 
     if ((*hsh = malloc(sizeof(struct hash))) == NULL)
         return DRPM_ERR_MEMORY;
@@ -176,43 +327,284 @@ int hash_create(struct hash **hsh, const unsigned char *old, size_t old_len)
     }
     ht_len = primes[i];
 
-    if ((hash_table = calloc(ht_len, sizeof(size_t))) == NULL) {
-        free(*hsh);
-        return DRPM_ERR_MEMORY;
+    if ((hash_table = calloc(ht_len, sizeof(size_t))) == NULL ||
+        (chained && (chain = calloc(MAX(blocks, 1), sizeof(size_t))) == NULL) ||
+        (keys = malloc(MAX(MIN(blocks, HASH_KEYS_CHUNK), 1) * sizeof(uint32_t))) == NULL) {
+        error = DRPM_ERR_MEMORY;
+        goto cleanup_fail;
     }
 
-    for (size_t off = 0; old_len >= HSIZE; off += HSIZE, old += HSIZE, old_len -= HSIZE) {
-        key = buzhash(old) % ht_len;
-        if (hash_table[key]) {
-            if (hash_table[(key == ht_len - 1) ? 0 : key + 1])
-                continue;
-            if (memcmp(old, old_ptr + hash_table[key], HSIZE) == 0)
-                continue;
-            key = (key == ht_len - 1) ? 0 : key + 1;
+    hkeys.old = old;
+    hkeys.ht_len = ht_len;
+    hkeys.keys = keys;
+
+    for (size_t c = 0; c < chunks; c++) {
+        // chained indexes are built backwards, so that chains end up in order of offset
+        hkeys.first = (chained ? chunks - 1 - c : c) * HASH_KEYS_CHUNK;
+        hkeys.count = MIN(HASH_KEYS_CHUNK, blocks - hkeys.first);
+
+        if ((error = parallel_run(threads, (hkeys.count + HASH_KEYS_JOB - 1) / HASH_KEYS_JOB,
+                                  hash_keys_job, &hkeys)) != DRPM_ERR_OK)
+            goto cleanup_fail;
+
+        if (chained) {
+            for (i = hkeys.count; i > 0; i--) {
+                if (i > HASH_PREFETCH)
+                    PREFETCH(hash_table + keys[i - 1 - HASH_PREFETCH]);
+                off = (hkeys.first + i - 1) << HSIZESHIFT;
+                head = hash_table[key = keys[i - 1]];
+                if (head != 0 && memcmp(old + off, old + head - 1, HSIZE) == 0)
+                    chain[off >> HSIZESHIFT] = chain[(head - 1) >> HSIZESHIFT];
+                else
+                    chain[off >> HSIZESHIFT] = head;
+                hash_table[key] = off + 1;
+            }
+        } else {
+            for (i = 0; i < hkeys.count; i++) {
+                if (i + HASH_PREFETCH < hkeys.count)
+                    PREFETCH(hash_table + keys[i + HASH_PREFETCH]);
+                off = (hkeys.first + i) << HSIZESHIFT;
+                key = keys[i];
+                if (hash_table[key]) {
+                    if (hash_table[(key == ht_len - 1) ? 0 : key + 1])
+                        continue;
+                    if (memcmp(old + off, old + hash_table[key], HSIZE) == 0)
+                        continue;
+                    key = (key == ht_len - 1) ? 0 : key + 1;
+                }
+                hash_table[key] = off + 1;
+            }
         }
-        hash_table[key] = off + 1;
+
+        if ((error = progress_add(prog, DRPM_PHASE_READ, hkeys.count << HSIZESHIFT)) != DRPM_ERR_OK)
+            goto cleanup_fail;
     }
 
+    free(keys);
+
     (*hsh)->hash_table = hash_table;
     (*hsh)->ht_len = ht_len;
+    (*hsh)->chain = chain;
+    (*hsh)->chain_len = chained ? blocks : 0;
+    (*hsh)->anchor_mask = 0;
 
     return DRPM_ERR_OK;
+
+cleanup_fail:
+    free(keys);
+    free(chain);
+    free(hash_table);
+    free(*hsh);
+
+    return error;
+}
+
+/* Finds the anchors in a range of windows (one job of hash_create_sparse()).
+ * Repeats of the previous anchor's window are left out, as they would not
+ * be indexed anyway, so that runs of identical bytes add a single anchor. */
+int hash_anchors_job(void *arg, size_t index)
+{
+    struct hash_anchors *hanchors = arg;
+    struct hash_anchor_list *list = &hanchors->lists[index];
+    const unsigned char *old = hanchors->old;
+    const size_t start = hanchors->first + index * HASH_ANCHORS_JOB;
+    const size_t end = hanchors->first + MIN((index + 1) * HASH_ANCHORS_JOB, hanchors->count);
+    size_t prev = SIZE_MAX;
+    uint32_t hash = buzhash(old + start);
+
+    for (size_t off = start; off < end; off++) {
+        if (off > start)
+            hash = buzhash_roll(hash, old[off - 1], old[off + HSIZE - 1]);
+        if ((hash & hanchors->mask) != 0 ||
+            (prev != SIZE_MAX && memcmp(old + off, old + prev, HSIZE) == 0))
+            continue;
+        if (!resize32((void **)&list->offsets, list->count, sizeof(size_t)) ||
+            !resize32((void **)&list->keys, list->count, sizeof(uint32_t)))
+            return DRPM_ERR_MEMORY;
+        list->offsets[list->count] = off;
+        list->keys[list->count++] = hash % hanchors->ht_len;
+        prev = off;
+    }
+
+    return DRPM_ERR_OK;
+}
+
+/* Indexes only content-defined anchors of <old>, i.e. windows (at any
+ * offset) whose hash has the bits of <spacing> - 1 clear, which makes one
+ * anchor every <spacing> bytes on average. As the same content makes the
+ * same anchors in new, hash_search() only needs to probe there, and the
+ * index needs only about 16 / <spacing> of the memory of a full one.
+ * Anchors are found by up to <threads> threads and inserted in order,
+ * so the index does not depend on <threads>. Progress is reported to
+ * <prog> as by hash_create(). */
+int hash_create_sparse(struct hash **hsh, const unsigned char *old, size_t old_len,
+                       unsigned spacing, unsigned threads, struct progress *prog)
+{
+    size_t *hash_table = NULL;
+    struct hash_anchors hanchors = {0};
+    struct hash_anchor_list *list;
+    size_t ht_len;
+    size_t key;
+    size_t off;
+    size_t primes[] = {
+        65537, 98317, 147481, 221227, 331841, 497771, 746659, 1120001,
+        1680013, 2520031, 3780053, 5670089, 8505137, 12757739, 19136609,
+        28704913, 43057369, 64586087, 96879131, 145318741, 217978121,
+        326967209, 490450837, 735676303, 1103514463, 1655271719,
+        0xFFFFFFFF
+    };
+    size_t i;
+    const size_t i_limit = sizeof(primes)/sizeof(*primes) - 1;
+    const size_t windows = (old_len >= HSIZE) ? old_len - HSIZE + 1 : 0;
+    const size_t chunks = (windows + HASH_ANCHORS_CHUNK - 1) / HASH_ANCHORS_CHUNK;
+    size_t jobs;
+    int error = DRPM_ERR_OK;
+
+    if (spacing == 0 || (spacing & (spacing - 1)) != 0)
+        return DRPM_ERR_PROG;
+
+    if ((*hsh = malloc(sizeof(struct hash))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    ht_len = 4 * (old_len / spacing + 1);
+    for (i = 0; i < i_limit; i++) {
+        if (ht_len < primes[i])
+            break;
+    }
+    ht_len = primes[i];
+
+    if ((hash_table = calloc(ht_len, sizeof(size_t))) == NULL ||
+        (hanchors.lists = calloc(HASH_ANCHORS_CHUNK / HASH_ANCHORS_JOB,
+                                 sizeof(struct hash_anchor_list))) == NULL) {
+        error = DRPM_ERR_MEMORY;
+        goto cleanup;
+    }
+
+    hanchors.old = old;
+    hanchors.ht_len = ht_len;
+    hanchors.mask = spacing - 1;
+
+    for (size_t c = 0; c < chunks; c++) {
+        hanchors.first = c * HASH_ANCHORS_CHUNK;
+        hanchors.count = MIN(HASH_ANCHORS_CHUNK, windows - hanchors.first);
+        jobs = (hanchors.count + HASH_ANCHORS_JOB - 1) / HASH_ANCHORS_JOB;
+
+        for (size_t j = 0; j < jobs; j++)
+            hanchors.lists[j].count = 0;
+
+        if ((error = parallel_run(threads, jobs, hash_anchors_job, &hanchors)) != DRPM_ERR_OK)
+            goto cleanup;
+
+        for (size_t j = 0; j < jobs; j++) {
+            list = &hanchors.lists[j];
+            for (i = 0; i < list->count; i++) {
+                if (i + HASH_PREFETCH < list->count)
+                    PREFETCH(hash_table + list->keys[i + HASH_PREFETCH]);
+                off = list->offsets[i];
+                key = list->keys[i];
+                if (hash_table[key]) {
+                    if (memcmp(old + off, old + hash_table[key] - 1, HSIZE) == 0)
+                        continue;
+                    key = (key == ht_len - 1) ? 0 : key + 1;
+                    if (hash_table[key])
+                        continue;
+                }
+                hash_table[key] = off + 1;
+            }
+        }
+
+        if ((error = progress_add(prog, DRPM_PHASE_READ, hanchors.count)) != DRPM_ERR_OK)
+            goto cleanup;
+    }
+
+    (*hsh)->hash_table = hash_table;
+    (*hsh)->ht_len = ht_len;
+    (*hsh)->chain = NULL;
+    (*hsh)->chain_len = 0;
+    (*hsh)->anchor_mask = spacing - 1;
+    hash_table = NULL;
+
+cleanup:
+    if (hanchors.lists != NULL) {
+        for (size_t j = 0; j < HASH_ANCHORS_CHUNK / HASH_ANCHORS_JOB; j++) {
+            free(hanchors.lists[j].offsets);
+            free(hanchors.lists[j].keys);
+        }
+        free(hanchors.lists);
+    }
+    if (error != DRPM_ERR_OK) {
+        free(hash_table);
+        free(*hsh);
+    }
+
+    return error;
 }
 
 void hash_free(struct hash **hsh)
 {
     free((*hsh)->hash_table);
+    free((*hsh)->chain);
     free(*hsh);
 }
 
+/* Returns the memory taken by the hash table. */
+size_t hash_size(const struct hash *hsh)
+{
+    return sizeof(struct hash) + (hsh->ht_len + hsh->chain_len) * sizeof(size_t);
+}
+
+/* Finds the longest match for <new> + <scan> among (at most <candidates>)
+ * blocks in the chain of <hashval>, with the block matching <back> bytes
+ * into the match. Returns its length (0 if none) and offset in <*pos_ret>.
+ * (Near) ties go to the offset nearest to <near>. */
+size_t chain_search(const struct hash *hsh, uint32_t hashval, size_t back,
+                    unsigned short candidates,
+                    const unsigned char *old, size_t old_len,
+                    const unsigned char *new, size_t new_len,
+                    size_t scan, size_t near, size_t *pos_ret)
+{
+    size_t best_len = 0;
+    size_t best_pos = 0;
+    size_t len;
+    size_t pos;
+
+    for (size_t off = hsh->hash_table[hashval % hsh->ht_len];
+         off != 0 && candidates > 0;
+         off = hsh->chain[(off - 1) >> HSIZESHIFT], candidates--) {
+        pos = off - 1;
+        if (pos < back || memcmp(old + pos, new + scan + back, HSIZE) != 0)
+            continue;
+        pos -= back;
+        len = match_len(old + pos, old_len - pos, new + scan, new_len - scan);
+        if (match_better(pos, len, best_pos, best_len, near)) {
+            best_len = len;
+            best_pos = *pos_ret = pos;
+        }
+    }
+
+    return best_len;
+}
+
+/* Looks for the next match of <new> (from <scan>) in <old> worth a new
+ * copy, i.e. differing enough from continuing at <last_offset>.
+ * Above the default effort, of matches of (nearly) the same length, the one
+ * nearest to the old data in line with the last copy (at <near_offset>
+ * from new) is taken.
+ * The <effort> level trades speed for finding longer matches: low levels
+ * probe sparsely, high levels try several candidates per probe (if the
+ * index is chained) and wait longer for a longer match before taking one. */
 size_t hash_search(struct hash *hsh,
                    const unsigned char *old, size_t old_len,
                    const unsigned char *new, size_t new_len,
-                   size_t last_offset, size_t scan,
-                   size_t *pos_ret, size_t *len_ret)
+                   size_t last_offset, size_t near_offset, size_t scan,
+                   unsigned short effort, size_t *pos_ret, size_t *len_ret)
 {
     size_t *hash_table = hsh->hash_table;
     size_t ht_len = hsh->ht_len;
+    const struct hash_effort *eff = &hash_efforts[MIN(effort, DRPM_EFFORT_MAX)];
+    const bool chained = eff->candidates > 0 && hsh->chain != NULL;
+    const bool local = eff->local;
+    const uint32_t anchor_mask = hsh->anchor_mask;
 
     size_t last_scan = 0;
     size_t last_pos = 0;
@@ -228,11 +620,11 @@ size_t hash_search(struct hash *hsh,
     size_t len = 0;
     size_t pos2;
     size_t len2;
+    size_t near;
 
     uint32_t key;
     uint32_t key2;
     uint32_t prekey = (scan <= new_len - HSIZE) ? buzhash(new + scan) : 0;
-    uint32_t xprekey;
 
     hash_table = hsh->hash_table;
     ht_len = hsh->ht_len;
@@ -250,20 +642,35 @@ size_t hash_search(struct hash *hsh,
             break;
         }
 
+        // sparse indexes only have the anchors, at any offset
+        if (anchor_mask != 0 ? (prekey & anchor_mask) != 0 : (eff->stride > 1 && scan % eff->stride != 0))
+            goto scannext;
+
+        near = scan + near_offset;
+
+        if (chained) {
+            if ((len = chain_search(hsh, prekey, 0, eff->candidates, old, old_len,
+                                    new, new_len, scan, near, &pos)) == 0)
+                goto scannext;
+            if (eff->lookahead && scan + HSIZE * 4 <= new_len &&
+                (len2 = chain_search(hsh, buzhash(new + scan + 3 * HSIZE), 3 * HSIZE, eff->candidates,
+                                     old, old_len, new, new_len, scan, near, &pos2)) > 0 &&
+                match_better(pos2, len2, pos, len, near)) {
+                pos = pos2;
+                len = len2;
+            }
+            goto gotmatch;
+        }
+
         key = prekey % ht_len;
         pos = hash_table[key];
 
         if (pos == 0) {
 scannext:
-            if (last_len >= 32 && scan - last_scan >= HSIZE)
+            // no use waiting past the end of the best match
+            if (last_len >= 32 && (scan - last_scan >= eff->lazy || scan - last_scan >= last_len))
                 goto gotit;
-            prekey = (prekey << 1) ^ (prekey & (1u << 31) ? 1 : 0) ^ noise[new[scan + HSIZE]];
-            xprekey = noise[new[scan]] ^ (0x83D31DF4 ^ 0x07A63BE9);
-#if HSIZE % 32 != 0
-            prekey ^= (xprekey << (HSIZE % 32)) ^ (xprekey >> (32 - (HSIZE % 32)));
-#else
-            prekey ^= xprekey;
-#endif
+            prekey = buzhash_roll(prekey, new[scan], new[scan + HSIZE]);
             scan++;
             continue;
         }
@@ -277,7 +684,7 @@ scannext:
                 goto scannext;
         }
         len = match_len(old + pos + HSIZE, old_len - pos - HSIZE, new + scan + HSIZE, new_len - scan - HSIZE) + HSIZE;
-        if (scan + HSIZE * 4 <= new_len) {
+        if (eff->lookahead && anchor_mask == 0 && scan + HSIZE * 4 <= new_len) {
             key2 = buzhash(new + scan + 3 * HSIZE) % ht_len;
             pos2 = hash_table[key2];
             if (pos2) {
@@ -290,13 +697,22 @@ scannext:
                 pos2 -= 1 + 3 * HSIZE;
                 if (pos2 != pos) {
                     len2 = match_len(old + pos2, old_len - pos2, new + scan, new_len - scan);
-                    if (len2 > len) {
+                    if (local ? match_better(pos2, len2, pos, len, near) : len2 > len) {
                         pos = pos2;
                         len = len2;
                     }
                 }
             }
         }
+gotmatch:
+        // the old data in line with the last copy may do just as well
+        if (local && pos != near && near < old_len) {
+            len2 = match_len(old + near, old_len - near, new + scan, new_len - scan);
+            if (match_better(near, len2, pos, len, near)) {
+                pos = near;
+                len = len2;
+            }
+        }
         if (len > last_len) {
             last_len = len;
             last_pos = pos;
@@ -365,6 +781,108 @@ gotit:
     return scan;
 }
 
+/**************************** self matches ****************************/
+
+/* shorter repeats are left to the body compression */
+#define SELF_MATCH_MIN 256
+
+struct self_hash {
+    const unsigned char *new;
+    size_t new_len;
+    size_t window;
+    size_t *hash_table; // offset + 1 of the latest block per key
+    size_t ht_len;
+    size_t indexed; // blocks indexed so far
+};
+
+/* Prepares an index of <new> for finding repeats within it, at most
+ * <window> bytes back. Blocks are only indexed once the search has
+ * passed them, i.e. once they would already have been reconstructed. */
+int self_hash_create(struct self_hash **sh, const unsigned char *new, size_t new_len,
+                     size_t window)
+{
+    if (sh == NULL || new == NULL || window == 0)
+        return DRPM_ERR_PROG;
+
+    if ((*sh = malloc(sizeof(struct self_hash))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    (*sh)->new = new;
+    (*sh)->new_len = new_len;
+    (*sh)->window = window;
+    (*sh)->ht_len = 2 * (MIN(new_len, window) >> HSIZESHIFT) + 1;
+    (*sh)->indexed = 0;
+
+    if (((*sh)->hash_table = calloc((*sh)->ht_len, sizeof(size_t))) == NULL) {
+        free(*sh);
+        return DRPM_ERR_MEMORY;
+    }
+
+    return DRPM_ERR_OK;
+}
+
+void self_hash_free(struct self_hash **sh)
+{
+    free((*sh)->hash_table);
+    free(*sh);
+}
+
+/* Indexes the blocks ending by <end>. Later blocks replace earlier ones
+ * with the same key, as those are the likelier to be within the window. */
+void self_hash_index(struct self_hash *sh, size_t end)
+{
+    size_t off;
+
+    while (((sh->indexed + 1) << HSIZESHIFT) <= end) {
+        off = sh->indexed++ << HSIZESHIFT;
+        sh->hash_table[buzhash(sh->new + off) % sh->ht_len] = off + 1;
+    }
+}
+
+/* Looks for the first repeat of earlier data in <new> between <scan>
+ * and <end> of at least SELF_MATCH_MIN bytes. Returns where it starts
+ * (<end> if none found), with its source in <*src_ret> and its length
+ * in <*len_ret>. The source may overlap the repeat itself. */
+size_t self_hash_search(struct self_hash *sh, size_t scan, size_t end,
+                        size_t *src_ret, size_t *len_ret)
+{
+    const unsigned char *new = sh->new;
+    uint32_t hashval;
+    size_t off;
+    size_t src;
+    size_t len;
+    size_t back;
+
+    if (scan >= end || end - scan < SELF_MATCH_MIN || end > sh->new_len)
+        return end;
+
+    hashval = buzhash(new + scan);
+
+    for (size_t pos = scan; ; pos++) {
+        self_hash_index(sh, pos);
+
+        off = sh->hash_table[hashval % sh->ht_len];
+        if (off != 0 && (src = off - 1) < pos && pos - src <= sh->window &&
+            memcmp(new + src, new + pos, HSIZE) == 0) {
+            len = match_len(new + src, end - src, new + pos, end - pos);
+            for (back = 0; pos - back > scan && src - back > 0 &&
+                           new[src - back - 1] == new[pos - back - 1]; back++)
+                ;
+            if (len + back >= SELF_MATCH_MIN) {
+                *src_ret = src - back;
+                *len_ret = len + back;
+                return pos - back;
+            }
+        }
+
+        if (pos + HSIZE >= end)
+            break;
+        hashval = buzhash_roll(hashval, new[pos], new[pos + HSIZE]);
+    }
+
+    return end;
+}
+
 /**************************** suffix sort ****************************/
 
 struct sfxsrt {
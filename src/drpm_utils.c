@@ -27,10 +27,22 @@
 #include <string.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <openssl/md5.h>
 #include <openssl/sha.h>
 
+struct parallel {
+    pthread_mutex_t lock;
+    size_t next;
+    size_t count;
+    int error;
+    int (*job)(void *, size_t);
+    void *arg;
+};
+
+static void *parallel_worker(void *);
 static bool resize(void **, size_t, size_t, size_t);
 
 /* Reads 16-byte integer in network byte order buffer. */
@@ -92,6 +104,15 @@ int md5_update_be32(MD5_CTX *md5, uint32_t number)
     return MD5_Update(md5, be32, 4);
 }
 
+int md5_update_be64(MD5_CTX *md5, uint64_t number)
+{
+    unsigned char be64[8];
+
+    create_be64(number, be64);
+
+    return MD5_Update(md5, be64, 8);
+}
+
 /* Represents array of bytes pointed to by <source> of size <count>
  * as human-readable ASCII hexadecimals and stores this string in
  * <dest> (should be at least of size <count> * 2 + 1). */
@@ -178,3 +199,135 @@ bool resize32(void **buffer, size_t members_count, size_t member_size)
 {
     return resize(buffer, members_count, member_size, 32);
 }
+
+/* Translates a requested thread count into an actual one
+ * (0 meaning one thread per online CPU). */
+unsigned threads_resolve(unsigned threads)
+{
+    long cpus;
+
+    if (threads > 0)
+        return threads;
+
+    if ((cpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        return 1;
+
+    return MIN(cpus, THREADS_MAX);
+}
+
+void *parallel_worker(void *data)
+{
+    struct parallel *par = data;
+    size_t index;
+    int error;
+
+    for (;;) {
+        pthread_mutex_lock(&par->lock);
+        if (par->error != DRPM_ERR_OK || par->next >= par->count) {
+            pthread_mutex_unlock(&par->lock);
+            break;
+        }
+        index = par->next++;
+        pthread_mutex_unlock(&par->lock);
+
+        if ((error = par->job(par->arg, index)) != DRPM_ERR_OK) {
+            pthread_mutex_lock(&par->lock);
+            if (par->error == DRPM_ERR_OK)
+                par->error = error;
+            pthread_mutex_unlock(&par->lock);
+        }
+    }
+
+    return NULL;
+}
+
+/* Calls <job>(<arg>, i) for every i in [0, <count>), spreading the calls
+ * across up to <threads> threads (the calling thread included).
+ * Jobs are handed out in ascending order, but may finish in any order.
+ * Returns the first error reported by a job. */
+int parallel_run(unsigned threads, size_t count, int (*job)(void *, size_t), void *arg)
+{
+    struct parallel par = {.next = 0, .count = count, .error = DRPM_ERR_OK, .job = job, .arg = arg};
+    pthread_t *workers;
+    unsigned started = 0;
+    int error;
+
+    threads = MIN(threads, count);
+
+    if (threads <= 1 || (workers = malloc((threads - 1) * sizeof(pthread_t))) == NULL) {
+        for (size_t i = 0; i < count; i++)
+            if ((error = job(arg, i)) != DRPM_ERR_OK)
+                return error;
+        return DRPM_ERR_OK;
+    }
+
+    if (pthread_mutex_init(&par.lock, NULL) != 0) {
+        free(workers);
+        return DRPM_ERR_OTHER;
+    }
+
+    // running with fewer threads than requested is not an error
+    while (started < threads - 1 &&
+           pthread_create(&workers[started], NULL, parallel_worker, &par) == 0)
+        started++;
+
+    parallel_worker(&par);
+
+    for (unsigned i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    pthread_mutex_destroy(&par.lock);
+    free(workers);
+
+    return par.error;
+}
+
+void progress_init(struct progress *prog, drpm_progress_cb callback, void *data)
+{
+    prog->callback = callback;
+    prog->data = data;
+    prog->phase = -1;
+    prog->bytes = 0;
+    prog->done = 0;
+    prog->counted = 0;
+}
+
+/* Reports progress to the caller's callback (if any) when <phase> has
+ * just started, when another PROGRESS_INTERVAL bytes have been processed
+ * or when all <total> units of work are done.
+ * Returns DRPM_ERR_CANCELED if the caller asked to stop. */
+int progress_report(struct progress *prog, int phase, uint64_t bytes, uint64_t done, uint64_t total)
+{
+    if (prog == NULL || prog->callback == NULL)
+        return DRPM_ERR_OK;
+
+    if (phase == prog->phase && bytes - prog->bytes < PROGRESS_INTERVAL &&
+        (done == prog->done || done < total))
+        return DRPM_ERR_OK;
+
+    if (phase != prog->phase)
+        prog->counted = bytes;
+
+    prog->phase = phase;
+    prog->bytes = bytes;
+    prog->done = done;
+
+    return (prog->callback(prog->data, phase, bytes, done, total) == 0) ?
+           DRPM_ERR_OK : DRPM_ERR_CANCELED;
+}
+
+/* Counts another <bytes> processed in <phase>, for work that is not
+ * split into units (such as reading or writing), and reports the bytes
+ * counted in the phase so far as progress_report() does.
+ * Returns DRPM_ERR_CANCELED if the caller asked to stop. */
+int progress_add(struct progress *prog, int phase, uint64_t bytes)
+{
+    if (prog == NULL || prog->callback == NULL)
+        return DRPM_ERR_OK;
+
+    if (phase != prog->phase)
+        prog->counted = 0;
+    prog->counted += bytes;
+
+    return progress_report(prog, phase, prog->counted, 0, 0);
+}
@@ -25,9 +25,28 @@
 #include <stdint.h>
 #include <string.h>
 #include <fcntl.h>
+#include <time.h>
 #include <openssl/md5.h>
 #include <rpm/rpmlib.h>
 
+/* Candidates tried by automatic compression selection,
+ * roughly from the cheapest to the most expensive. */
+static const struct {
+    unsigned short comp;
+    unsigned short level;
+} comp_candidates[] = {
+#ifdef WITH_ZSTD
+    {DRPM_COMP_ZSTD, 3},
+#endif
+    {DRPM_COMP_GZIP, 6},
+#ifdef WITH_ZSTD
+    {DRPM_COMP_ZSTD, 9},
+#endif
+    {DRPM_COMP_BZIP2, 9},
+    {DRPM_COMP_XZ, 6},
+    {DRPM_COMP_XZ, 9}
+};
+
 /* Wrapper for struct compstrm. Used to prepend uncompressed header. */
 struct compstrm_wrapper {
     struct compstrm *strm; // compression stream
@@ -37,6 +56,10 @@ struct compstrm_wrapper {
     unsigned char *uncomp_data; // uncompressed data
 };
 
+static int comp_select(struct deltarpm *);
+static int comp_trial(unsigned short, unsigned short, const unsigned char *, size_t, size_t *, unsigned long *);
+static int write_body(struct compstrm *, const struct deltarpm *);
+
 /* Writes 32-byte integer in network byte order to file. */
 int write_be32(int filedesc, uint32_t number)
 {
@@ -63,27 +86,16 @@ int write_be64(int filedesc, uint64_t number)
     return DRPM_ERR_OK;
 }
 
-/* Writes out the DeltaRPM. */
-int write_deltarpm(struct deltarpm *delta)
+/* Writes the (to be compressed) DeltaRPM body to <stream>. */
+int write_body(struct compstrm *stream, const struct deltarpm *delta)
 {
     int error = DRPM_ERR_OK;
-    int filedesc = -1;
-    struct compstrm *stream = NULL;
-    uint32_t tgt_nevr_len;
     uint32_t src_nevr_len;
     char version[5];
     uint32_t tgt_comp;
     uint32_t int_copies_size;
     uint32_t ext_copies_size;
-    unsigned char *header = NULL;
-    uint32_t header_size;
-    MD5_CTX md5;
-    unsigned char md5_digest[MD5_DIGEST_LENGTH] = {0};
-    unsigned char *strm_data = NULL;
-    size_t strm_data_len;
-
-    if (delta->type != DRPM_TYPE_STANDARD && delta->type != DRPM_TYPE_RPMONLY)
-        return DRPM_ERR_PROG;
+    uint32_t self_copies_size;
 
     version[0] = 'D';
     version[1] = 'L';
@@ -93,31 +105,29 @@ int write_deltarpm(struct deltarpm *delta)
 
     src_nevr_len = strlen(delta->src_nevr) + 1;
 
-    if ((error = compstrm_init(&stream, -1, delta->comp, (int)delta->comp_level)) != DRPM_ERR_OK ||
-        (error = compstrm_write(stream, 4, version)) != DRPM_ERR_OK ||
+    if ((error = compstrm_write(stream, 4, version)) != DRPM_ERR_OK ||
         (error = compstrm_write_be32(stream, src_nevr_len)) != DRPM_ERR_OK ||
         (error = compstrm_write(stream, src_nevr_len, delta->src_nevr)) != DRPM_ERR_OK ||
         (error = compstrm_write_be32(stream, delta->sequence_len)) != DRPM_ERR_OK ||
         (error = compstrm_write(stream, delta->sequence_len, delta->sequence)) != DRPM_ERR_OK ||
         (error = compstrm_write(stream, MD5_DIGEST_LENGTH, delta->tgt_md5)) != DRPM_ERR_OK)
-        goto cleanup;
+        return error;
 
     if (delta->version >= 2) {
-        if (!deltarpm_encode_comp(&tgt_comp, delta->tgt_comp, delta->tgt_comp_level)) {
-            error = DRPM_ERR_PROG;
-            goto cleanup;
-        }
+        if (!deltarpm_encode_comp(&tgt_comp, delta->tgt_comp, delta->tgt_comp_level))
+            return DRPM_ERR_PROG;
 
-        if ((error = compstrm_write_be32(stream, delta->tgt_size)) != DRPM_ERR_OK ||
+        // saturated for target RPMs of 4 GiB or more (see read_deltarpm())
+        if ((error = compstrm_write_be32(stream, MIN(delta->tgt_size, UINT32_MAX))) != DRPM_ERR_OK ||
             (error = compstrm_write_be32(stream, tgt_comp)) != DRPM_ERR_OK ||
             (error = compstrm_write_be32(stream, delta->tgt_comp_param_len)) != DRPM_ERR_OK ||
             (error = compstrm_write(stream, delta->tgt_comp_param_len, delta->tgt_comp_param)) != DRPM_ERR_OK)
-            goto cleanup;
+            return error;
 
         if (delta->version >= 3) {
             if ((error = compstrm_write_be32(stream, delta->tgt_header_len)) != DRPM_ERR_OK ||
                 (error = compstrm_write_be32(stream, delta->offadj_elems_count)) != DRPM_ERR_OK)
-                goto cleanup;
+                return error;
 
             /* offadj_elems and later int_copies and ext_copies are all pairs of numbers,
              * so in order to get the actual size we mupliply their count by 2.
@@ -126,13 +136,13 @@ int write_deltarpm(struct deltarpm *delta)
             uint32_t offadj_elems_size = delta->offadj_elems_count * 2;
             for (uint32_t i = 0; i < offadj_elems_size; i += 2) {
                 if ((error = compstrm_write_be32(stream, delta->offadj_elems[i])) != DRPM_ERR_OK)
-                    goto cleanup;
+                    return error;
             }
             for (uint32_t j = 1; j < offadj_elems_size; j += 2) {
                 if ((error = compstrm_write_be32(stream, (int32_t)delta->offadj_elems[j] < 0 ?
                                                          TWOS_COMPLEMENT(delta->offadj_elems[j]) | INT32_MIN :
                                                          delta->offadj_elems[j])) != DRPM_ERR_OK)
-                    goto cleanup;
+                    return error;
             }
         }
     }
@@ -142,95 +152,262 @@ int write_deltarpm(struct deltarpm *delta)
         (error = compstrm_write_be32(stream, delta->payload_fmt_off)) != DRPM_ERR_OK ||
         (error = compstrm_write_be32(stream, delta->int_copies_count)) != DRPM_ERR_OK ||
         (error = compstrm_write_be32(stream, delta->ext_copies_count)) != DRPM_ERR_OK)
-        goto cleanup;
+        return error;
 
     int_copies_size = delta->int_copies_count * 2;
     ext_copies_size = delta->ext_copies_count * 2;
 
     for (uint32_t i = 0; i < int_copies_size; i += 2) {
         if ((error = compstrm_write_be32(stream, delta->int_copies[i])) != DRPM_ERR_OK)
-            goto cleanup;
+            return error;
     }
     for (uint32_t j = 1; j < int_copies_size; j += 2) {
         if ((error = compstrm_write_be32(stream, delta->int_copies[j])) != DRPM_ERR_OK)
-            goto cleanup;
+            return error;
     }
 
     for (uint32_t i = 0; i < ext_copies_size; i += 2) {
         if ((error = compstrm_write_be32(stream, (int32_t)delta->ext_copies[i] < 0 ?
                                                  TWOS_COMPLEMENT(delta->ext_copies[i]) | INT32_MIN :
                                                  delta->ext_copies[i])) != DRPM_ERR_OK)
-            goto cleanup;
+            return error;
     }
     for (uint32_t j = 1; j < ext_copies_size; j += 2) {
         if ((error = compstrm_write_be32(stream, delta->ext_copies[j])) != DRPM_ERR_OK)
-            goto cleanup;
+            return error;
+    }
+
+    if (delta->version >= 4) {
+        if ((error = compstrm_write_be32(stream, delta->self_window)) != DRPM_ERR_OK ||
+            (error = compstrm_write_be32(stream, delta->self_copies_count)) != DRPM_ERR_OK)
+            return error;
+
+        self_copies_size = delta->self_copies_count * 2;
+
+        for (uint32_t i = 0; i < self_copies_size; i += 2) {
+            if ((error = compstrm_write_be32(stream, delta->self_copies[i])) != DRPM_ERR_OK)
+                return error;
+        }
+        for (uint32_t j = 1; j < self_copies_size; j += 2) {
+            if ((error = compstrm_write_be32(stream, delta->self_copies[j])) != DRPM_ERR_OK)
+                return error;
+        }
     }
 
     if (delta->version >= 3) {
         if ((error = compstrm_write_be64(stream, delta->ext_data_len)) != DRPM_ERR_OK)
-            goto cleanup;
+            return error;
     } else {
         if ((error = compstrm_write_be32(stream, (uint32_t)delta->ext_data_len)) != DRPM_ERR_OK)
-            goto cleanup;
+            return error;
     }
 
     if (delta->type == DRPM_TYPE_STANDARD) {
         if ((error = compstrm_write_be32(stream, delta->add_data_len)) != DRPM_ERR_OK ||
             (error = compstrm_write(stream, delta->add_data_len, delta->add_data)) != DRPM_ERR_OK)
-            goto cleanup;
+            return error;
     } else {
         if ((error = compstrm_write_be32(stream, 0)) != DRPM_ERR_OK)
-            goto cleanup;
+            return error;
     }
 
     if (delta->version >= 3) {
         if ((error = compstrm_write_be64(stream, delta->int_data_len)) != DRPM_ERR_OK)
-            goto cleanup;
+            return error;
     } else {
         if ((error = compstrm_write_be32(stream, (uint32_t)delta->int_data_len)) != DRPM_ERR_OK)
-            goto cleanup;
+            return error;
     }
 
     if (delta->int_data_as_ptrs) {
+        // internal copies taken from earlier output have no internal data
         for (uint32_t i = 0; i < delta->int_copies_count; i++) {
-            if ((error = compstrm_write(stream, delta->int_copies[i * 2 + 1],
-                                                delta->int_data.ptrs[i])) != DRPM_ERR_OK)
-                goto cleanup;
+            if (delta->int_data.ptrs[i] != NULL &&
+                (error = compstrm_write(stream, delta->int_copies[i * 2 + 1],
+                                        delta->int_data.ptrs[i])) != DRPM_ERR_OK)
+                return error;
         }
     } else {
         if ((error = compstrm_write(stream, delta->int_data_len, delta->int_data.bytes)) != DRPM_ERR_OK)
+            return error;
+    }
+
+    return DRPM_ERR_OK;
+}
+
+/* Compresses <sample> with <comp> at <level>, measuring the size
+ * of the output and the time it took. */
+int comp_trial(unsigned short comp, unsigned short level,
+               const unsigned char *sample, size_t sample_len,
+               size_t *comp_len, unsigned long *usecs)
+{
+    struct compstrm *stream;
+    unsigned char *comp_data = NULL;
+    struct timespec start;
+    struct timespec end;
+    int error;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &start) != 0)
+        return DRPM_ERR_OTHER;
+
+    if ((error = compstrm_init(&stream, -1, comp, level)) != DRPM_ERR_OK)
+        return error;
+
+    if ((error = compstrm_write(stream, sample_len, sample)) == DRPM_ERR_OK &&
+        (error = compstrm_finish(stream, &comp_data, comp_len)) == DRPM_ERR_OK &&
+        clock_gettime(CLOCK_MONOTONIC, &end) != 0)
+        error = DRPM_ERR_OTHER;
+
+    compstrm_destroy(&stream);
+    free(comp_data);
+
+    if (error == DRPM_ERR_OK)
+        *usecs = (end.tv_sec - start.tv_sec) * 1000000UL +
+                 (end.tv_nsec - start.tv_nsec) / 1000;
+
+    return error;
+}
+
+/* Picks the compression for the DeltaRPM by trial-compressing a sample
+ * of its body with each of the candidate methods. The sample is taken
+ * while writing out the body uncompressed, so only the sample is held
+ * in memory. The fastest candidate whose output is at most
+ * <delta->comp_slack> percent bigger than the smallest one wins. */
+int comp_select(struct deltarpm *delta)
+{
+    const size_t candidate_count = sizeof(comp_candidates) / sizeof(comp_candidates[0]);
+    struct compstrm *stream = NULL;
+    unsigned char *sample = NULL;
+    size_t sample_len;
+    size_t comp_lens[sizeof(comp_candidates) / sizeof(comp_candidates[0])];
+    unsigned long usecs[sizeof(comp_candidates) / sizeof(comp_candidates[0])];
+    size_t best_len = SIZE_MAX;
+    size_t pick = candidate_count;
+    int error;
+
+    /* evenly spaced slices of the body, as the compressible bulk
+     * (internal data) is spread over the whole of it */
+    if ((error = compstrm_init(&stream, -1, DRPM_COMP_NONE, 0)) != DRPM_ERR_OK)
+        return error;
+    if ((error = compstrm_set_sampling(stream, COMP_SAMPLE_SLICE_SIZE, COMP_SAMPLE_SLICES)) != DRPM_ERR_OK ||
+        (error = write_body(stream, delta)) != DRPM_ERR_OK ||
+        (error = compstrm_finish(stream, &sample, &sample_len)) != DRPM_ERR_OK)
+        goto cleanup;
+
+    for (size_t i = 0; i < candidate_count; i++) {
+        if ((error = comp_trial(comp_candidates[i].comp, comp_candidates[i].level,
+                                sample, sample_len, &comp_lens[i], &usecs[i])) != DRPM_ERR_OK)
             goto cleanup;
+        best_len = MIN(best_len, comp_lens[i]);
+    }
+
+    for (size_t i = 0; i < candidate_count; i++) {
+        if ((comp_lens[i] - best_len) * 100 <= best_len * delta->comp_slack &&
+            (pick == candidate_count || usecs[i] < usecs[pick]))
+            pick = i;
     }
 
-    if ((error = compstrm_finish(stream, &strm_data, &strm_data_len)) != DRPM_ERR_OK)
+    delta->comp = comp_candidates[pick].comp;
+    delta->comp_level = comp_candidates[pick].level;
+
+    if (delta->stats != NULL) {
+        delta->stats->sample_len = sample_len;
+        delta->stats->trial_count = (unsigned)candidate_count;
+        for (size_t i = 0; i < candidate_count; i++) {
+            delta->stats->trials[i].comp = comp_candidates[i].comp;
+            delta->stats->trials[i].comp_level = comp_candidates[i].level;
+            delta->stats->trials[i].comp_len = comp_lens[i];
+            delta->stats->trials[i].usecs = usecs[i];
+        }
+    }
+
+cleanup:
+    compstrm_destroy(&stream);
+    free(sample);
+
+    return error;
+}
+
+/* Writes out the DeltaRPM.
+ * The body is compressed straight into the file. For standard deltas,
+ * a signature of the same size is written in front of it first and
+ * patched once the size and MD5 of header and body are known. */
+int write_deltarpm(struct deltarpm *delta)
+{
+    int error = DRPM_ERR_OK;
+    int filedesc = -1;
+    struct compstrm *stream = NULL;
+    uint32_t tgt_nevr_len;
+    char version[5];
+    unsigned char *header = NULL;
+    uint32_t header_size;
+    unsigned char *lead_sig = NULL;
+    uint32_t lead_sig_len;
+    uint32_t lead_sig_reserved = 0;
+    MD5_CTX md5;
+    unsigned char md5_digest[MD5_DIGEST_LENGTH] = {0};
+    size_t strm_data_len;
+    unsigned char *dict = NULL;
+    size_t dict_len;
+    bool file_written = false;
+
+    if (delta->type != DRPM_TYPE_STANDARD && delta->type != DRPM_TYPE_RPMONLY)
+        return DRPM_ERR_PROG;
+
+    version[0] = 'D';
+    version[1] = 'L';
+    version[2] = 'T';
+    version[3] = '0' + delta->version;
+    version[4] = '\0';
+
+    if (delta->comp_auto && (error = comp_select(delta)) != DRPM_ERR_OK)
+        goto cleanup;
+
+    if (delta->dict_file != NULL &&
+        (error = read_file(delta->dict_file, &dict, &dict_len)) != DRPM_ERR_OK)
         goto cleanup;
 
     switch (delta->type) {
     case DRPM_TYPE_STANDARD:
-        if ((error = rpm_fetch_header(delta->head.tgt_rpm, &header, &header_size)) != DRPM_ERR_OK)
-            return error;
-
-        if (MD5_Init(&md5) != 1 ||
-            MD5_Update(&md5, header, header_size) != 1 ||
-            MD5_Update(&md5, strm_data, strm_data_len) != 1 ||
-            MD5_Final(md5_digest, &md5) != 1)
-            return DRPM_ERR_OTHER;
-
-        if ((error = rpm_signature_empty(delta->head.tgt_rpm)) != DRPM_ERR_OK ||
-            (error = rpm_signature_set_size(delta->head.tgt_rpm, header_size + strm_data_len)) != DRPM_ERR_OK ||
+        /* placeholder signature, the size and MD5 tags have fixed widths
+         * so the real one will take up exactly as much space */
+        if ((error = rpm_fetch_header(delta->head.tgt_rpm, &header, &header_size)) != DRPM_ERR_OK ||
+            (error = rpm_signature_empty(delta->head.tgt_rpm)) != DRPM_ERR_OK ||
+            (error = rpm_signature_set_size(delta->head.tgt_rpm, 0)) != DRPM_ERR_OK ||
             (error = rpm_signature_set_md5(delta->head.tgt_rpm, md5_digest)) != DRPM_ERR_OK ||
             (error = rpm_signature_reload(delta->head.tgt_rpm)) != DRPM_ERR_OK ||
-            (error = rpm_write(delta->head.tgt_rpm, delta->filename, false, NULL, false)) != DRPM_ERR_OK)
-            return error;
+            (error = rpm_fetch_lead_and_signature(delta->head.tgt_rpm, &lead_sig, &lead_sig_reserved)) != DRPM_ERR_OK)
+            goto cleanup;
 
-        if ((filedesc = open(delta->filename, O_WRONLY | O_APPEND)) < 0)
-            return DRPM_ERR_IO;
+        file_written = true;
+        if ((error = rpm_write(delta->head.tgt_rpm, delta->filename, false, NULL, false)) != DRPM_ERR_OK)
+            goto cleanup;
+
+        free(lead_sig);
+        lead_sig = NULL;
+
+        if ((filedesc = open(delta->filename, O_WRONLY)) < 0) {
+            error = DRPM_ERR_IO;
+            goto cleanup;
+        }
+        if (lseek(filedesc, 0, SEEK_END) != (off_t)lead_sig_reserved + header_size) {
+            error = DRPM_ERR_IO;
+            goto cleanup;
+        }
+
+        if (MD5_Init(&md5) != 1 ||
+            MD5_Update(&md5, header, header_size) != 1) {
+            error = DRPM_ERR_OTHER;
+            goto cleanup;
+        }
         break;
 
     case DRPM_TYPE_RPMONLY:
-        if ((filedesc = creat(delta->filename, CREAT_MODE)) < 0)
-            return DRPM_ERR_IO;
+        if ((filedesc = creat(delta->filename, CREAT_MODE)) < 0) {
+            error = DRPM_ERR_IO;
+            goto cleanup;
+        }
+        file_written = true;
 
         if (write(filedesc, "drpm", 4) != 4 ||
             write(filedesc, version, 4) != 4) {
@@ -255,18 +432,71 @@ int write_deltarpm(struct deltarpm *delta)
         break;
     }
 
-    if (write(filedesc, strm_data, strm_data_len) != (ssize_t)strm_data_len)
-        error = DRPM_ERR_IO;
+    if ((error = compstrm_init(&stream, filedesc, delta->comp, (int)delta->comp_level)) != DRPM_ERR_OK ||
+        (error = compstrm_set_streaming(stream, delta->type == DRPM_TYPE_STANDARD ? &md5 : NULL)) != DRPM_ERR_OK ||
+        (dict != NULL && (error = compstrm_load_dict(stream, dict, dict_len)) != DRPM_ERR_OK) ||
+        (error = compstrm_set_progress(stream, delta->progress, DRPM_PHASE_WRITE)) != DRPM_ERR_OK)
+        goto cleanup;
+
+    if ((error = write_body(stream, delta)) != DRPM_ERR_OK)
+        goto cleanup;
+
+    if (delta->stats != NULL) {
+        delta->stats->comp = delta->comp;
+        delta->stats->comp_level = delta->comp_level;
+    }
+
+    if ((error = compstrm_finish(stream, NULL, NULL)) != DRPM_ERR_OK ||
+        (error = compstrm_get_comp_size(stream, &strm_data_len)) != DRPM_ERR_OK)
+        goto cleanup;
+
+    if (delta->type == DRPM_TYPE_STANDARD) {
+        if (strm_data_len > UINT32_MAX - header_size) {
+            error = DRPM_ERR_OVERFLOW;
+            goto cleanup;
+        }
+
+        if (MD5_Final(md5_digest, &md5) != 1) {
+            error = DRPM_ERR_OTHER;
+            goto cleanup;
+        }
+
+        if ((error = rpm_signature_empty(delta->head.tgt_rpm)) != DRPM_ERR_OK ||
+            (error = rpm_signature_set_size(delta->head.tgt_rpm, header_size + strm_data_len)) != DRPM_ERR_OK ||
+            (error = rpm_signature_set_md5(delta->head.tgt_rpm, md5_digest)) != DRPM_ERR_OK ||
+            (error = rpm_signature_reload(delta->head.tgt_rpm)) != DRPM_ERR_OK ||
+            (error = rpm_fetch_lead_and_signature(delta->head.tgt_rpm, &lead_sig, &lead_sig_len)) != DRPM_ERR_OK)
+            goto cleanup;
+
+        if (lead_sig_len != lead_sig_reserved) {
+            error = DRPM_ERR_PROG;
+            goto cleanup;
+        }
+
+        if (pwrite(filedesc, lead_sig, lead_sig_len, 0) != (ssize_t)lead_sig_len) {
+            error = DRPM_ERR_IO;
+            goto cleanup;
+        }
+    }
 
 cleanup:
-    if (error == DRPM_ERR_OK)
-        error = compstrm_destroy(&stream);
-    else
-        compstrm_destroy(&stream);
+    if (stream != NULL) {
+        if (error == DRPM_ERR_OK)
+            error = compstrm_destroy(&stream);
+        else
+            compstrm_destroy(&stream);
+    }
+
+    if (filedesc >= 0 && close(filedesc) != 0 && error == DRPM_ERR_OK)
+        error = DRPM_ERR_IO;
+
+    /* not leaving a delta with a placeholder signature or a truncated body behind */
+    if (error != DRPM_ERR_OK && file_written)
+        unlink(delta->filename);
 
     free(header);
-    free(strm_data);
-    close(filedesc);
+    free(lead_sig);
+    free(dict);
 
     return error;
 }
@@ -327,6 +557,23 @@ int compstrm_wrapper_init(struct compstrm_wrapper **csw, size_t uncomp_len,
     return DRPM_ERR_OK;
 }
 
+int compstrm_wrapper_set_xz_blocks(struct compstrm_wrapper *csw, uint64_t block_size, unsigned threads)
+{
+    if (csw == NULL)
+        return DRPM_ERR_PROG;
+
+    return compstrm_set_xz_blocks(csw->strm, block_size, threads);
+}
+
+int compstrm_wrapper_set_zstd_params(struct compstrm_wrapper *csw, unsigned short window_log,
+                                     bool checksum, unsigned workers)
+{
+    if (csw == NULL)
+        return DRPM_ERR_PROG;
+
+    return compstrm_set_zstd_params(csw->strm, window_log, checksum, workers);
+}
+
 int compstrm_wrapper_destroy(struct compstrm_wrapper **csw)
 {
     if (csw == NULL || *csw == NULL)
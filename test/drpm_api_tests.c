@@ -23,14 +23,30 @@
 #endif
 
 #include "../src/drpm.h"
+#include "../src/drpm_private.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
 #include <sys/stat.h>
 #include <openssl/md5.h>
+#ifdef DRPMD_PROGRAM
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#endif
+#include <lzma.h>
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
 
 #include <stdarg.h>
 #include <stddef.h>
@@ -46,6 +62,17 @@
 #define DELTARPM_RPMONLY_NOADDBLK "rpmonly-noaddblk.drpm"
 #define DELTARPM_STANDARD_LZIP "standard-lzip.drpm"
 #define DELTARPM_STANDARD_ZSTD "standard-zstd.drpm"
+#define DELTARPM_STANDARD_AUTO "standard-auto.drpm"
+#define DELTARPM_STANDARD_CACHED "standard-cached.drpm"
+#define DELTARPM_STANDARD_FAST "standard-fast.drpm"
+#define DELTARPM_STANDARD_THREADS "standard-threads.drpm"
+#define DELTARPM_STANDARD_SPARSE "standard-sparse.drpm"
+#define DELTARPM_STANDARD_BEST "standard-best.drpm"
+#define DELTARPM_STANDARD_SELF "standard-self.drpm"
+#define DELTARPM_STANDARD_DICT "standard-dict.drpm"
+#define DELTARPM_RPMONLY_SEEDED "rpmonly-seeded.drpm"
+#define DELTARPM_DRPMD "drpmd.drpm"
+#define DELTARPM_STANDARD_CANCEL "standard-cancel.drpm"
 
 #define OLDRPM_1 "drpm-old.rpm"
 #define NEWRPM_1 "drpm-new.rpm"
@@ -56,9 +83,63 @@
 #define RPMOUT_RPMONLY_NOADDBLK "rpmonly-noaddblk.rpm"
 #define RPMOUT_STANDARD_LZIP "standard-lzip.rpm"
 #define RPMOUT_STANDARD_ZSTD "standard-zstd.rpm"
+#define RPMOUT_STANDARD_THREADS "standard-threads.rpm"
+#define RPMOUT_STANDARD_VERIFY "standard-verify.rpm"
+#define RPMOUT_STANDARD_CANCEL "standard-cancel.rpm"
+#define RPMOUT_STANDARD_CACHED "standard-cached.rpm"
+#define RPMOUT_STANDARD_FAST "standard-fast.rpm"
+#define RPMOUT_STANDARD_BEST "standard-best.rpm"
+#define RPMOUT_STANDARD_SPARSE "standard-sparse.rpm"
+#define RPMOUT_STANDARD_SELF "standard-self.rpm"
+#define RPMOUT_STANDARD_DICT "standard-dict.rpm"
+#define RPMOUT_RPMONLY_SEEDED "rpmonly-seeded.rpm"
+#define RPMOUT_DRPMD "drpmd.rpm"
+
+#define PAYLOAD_CACHE_DIR "payload-cache-XXXXXX"
+
+#define DICT_SIZE (8 * 1024)
+#define DICT_SAMPLE_SIZE 1024
 
 #define SEQFILE "seqfile.txt"
 
+/* synthetic payloads for compression parameter round trips */
+#define PAYLOAD_BLOCK_SIZE (64 * 1024)
+#define PAYLOAD_SIZE (3 * PAYLOAD_BLOCK_SIZE + 1000)
+#define PAYLOAD_OFFSET 96
+#define XZ_PAYLOAD_FILE "payload.xz"
+
+/* sparse installed file of more than 4 GiB with a marker past 4 GiB */
+#define LARGE_FILE "large-file.bin"
+#define LARGE_FILE_SIZE (((uint64_t)1 << 32) + 3 * 4096 + 3)
+#define LARGE_MARKER "drpm"
+#define LARGE_MARKER_OFFSET (((uint64_t)1 << 32) + 4096)
+
+/* synthetic CPIO archive for the file verifier, with a file larger
+ * than the verifier's buffer after the corrupt one */
+#define VERIFY_FILE_SIZE 4096
+#define VERIFY_LARGE_FILE_SIZE (3 * 1024 * 1024)
+
+/* input long enough to be canceled while reading or writing it */
+#define CANCEL_DATA_SIZE (4 * PROGRESS_INTERVAL)
+#define CANCEL_DATA_FILE "cancel-data.gz"
+
+/* installed files checked through io_uring: one spanning several reads,
+ * one shorter than expected and a directory, whose reads fail */
+#define URING_GOOD_FILE "uring-good.bin"
+#define URING_GOOD_FILE_SIZE (150 * 1024 + 7)
+#define URING_SHORT_FILE "uring-short.bin"
+#define URING_DIR "uring-dir"
+
+/* installed files read alternately a block at a time, with only one
+ * kept open */
+#define REOPEN_FILE_A "reopen-a.bin"
+#define REOPEN_FILE_B "reopen-b.bin"
+#define REOPEN_BLOCKS 8
+
+/* installed file read twice over its first half when prefetching */
+#define PREFETCH_FILE "prefetch-file.bin"
+#define PREFETCH_HALF_BLOCKS 300
+
 // garbage collector for drpm_read tests
 struct read_deltas {
     unsigned short index;
@@ -83,6 +164,28 @@ static off_t filesize(const char *path)
     return stats.st_size;
 }
 
+static bool same_contents(const char *path1, const char *path2)
+{
+    FILE *file1 = fopen(path1, "rb");
+    FILE *file2 = fopen(path2, "rb");
+    int c1 = 0;
+    int c2 = 0;
+
+    if (file1 != NULL && file2 != NULL) {
+        do {
+            c1 = getc(file1);
+            c2 = getc(file2);
+        } while (c1 == c2 && c1 != EOF);
+    }
+
+    if (file1 != NULL)
+        fclose(file1);
+    if (file2 != NULL)
+        fclose(file2);
+
+    return file1 != NULL && file2 != NULL && c1 == c2;
+}
+
 /***************************** drpm_make ******************************/
 
 static int make_setup(void **state)
@@ -167,6 +270,207 @@ static void make_rpmonly_noaddblk(void **state)
     assert_int_equal(DRPM_ERR_OK, drpm_make(OLDRPM_2, NEWRPM_2, DELTARPM_RPMONLY_NOADDBLK, opts));
 }
 
+// testing automatic compression selection (not in makedeltarpm)
+static void make_standard_auto(void **state)
+{
+    drpm_make_options *opts = *state;
+    drpm_make_stats *stats;
+    unsigned short comp;
+    unsigned short level;
+    unsigned short trial_comp;
+    unsigned short trial_level;
+    unsigned trial_count;
+    unsigned long sample_len;
+    unsigned long comp_len;
+    unsigned long best_len = ULONG_MAX;
+    unsigned long picked_len = 0;
+    unsigned long usecs;
+
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_defaults(opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_make_stats_init(&stats));
+
+    assert_int_equal(DRPM_ERR_ARGS, drpm_make_options_set_delta_comp_auto(opts, 101));
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_set_delta_comp_auto(opts, 3));
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_set_stats(opts, stats));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_make(OLDRPM_1, NEWRPM_1, DELTARPM_STANDARD_AUTO, opts));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_make_stats_get_delta_comp(stats, &comp, &level));
+    assert_int_equal(DRPM_ERR_OK, drpm_make_stats_get_comp_trials(stats, &trial_count, &sample_len));
+    assert_true(trial_count > 0);
+    assert_true(sample_len > 0);
+
+    for (unsigned i = 0; i < trial_count; i++) {
+        assert_int_equal(DRPM_ERR_OK, drpm_make_stats_get_comp_trial(stats, i, &trial_comp, &trial_level,
+                                                                     &comp_len, &usecs));
+        if (comp_len < best_len)
+            best_len = comp_len;
+        if (trial_comp == comp && trial_level == level)
+            picked_len = comp_len;
+    }
+    assert_int_equal(DRPM_ERR_ARGS, drpm_make_stats_get_comp_trial(stats, trial_count, &trial_comp, &trial_level,
+                                                                   &comp_len, &usecs));
+
+    // the pick must be one of the candidates and within 3 % of the best
+    assert_true(picked_len > 0);
+    assert_true((picked_len - best_len) * 100 <= best_len * 3);
+
+    assert_int_equal(DRPM_ERR_OK, drpm_make_stats_destroy(&stats));
+}
+
+// making the same DeltaRPM from warm payloads and index (as drpmd does)
+static void make_standard_cached(void **state)
+{
+    drpm_make_options *opts = *state;
+    struct cache *cache = NULL;
+    size_t count;
+    size_t size;
+    unsigned long hits;
+    unsigned long misses;
+
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_defaults(opts));
+    assert_int_equal(DRPM_ERR_OK, cache_create(&cache, SIZE_MAX));
+    opts->cache = cache;
+
+    assert_int_equal(DRPM_ERR_OK, drpm_make(OLDRPM_1, NEWRPM_1, DELTARPM_STANDARD_CACHED, opts));
+    cache_get_stats(cache, &count, &size, &hits, &misses);
+    assert_int_equal(3, count); // both payloads and the old index
+    assert_int_equal(0, hits);
+
+    assert_int_equal(DRPM_ERR_OK, drpm_make(OLDRPM_1, NEWRPM_1, DELTARPM_STANDARD_CACHED, opts));
+    cache_get_stats(cache, &count, &size, &hits, &misses);
+    assert_int_equal(3, hits);
+
+    assert_true(same_contents(DELTARPM_STANDARD, DELTARPM_STANDARD_CACHED));
+
+    opts->cache = NULL;
+    assert_int_equal(DRPM_ERR_OK, cache_destroy(&cache));
+}
+
+// the index of the old payload is built in parallel, but must not change the DeltaRPM
+static void make_standard_threads(void **state)
+{
+    drpm_make_options *opts = *state;
+
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_defaults(opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_set_threads(opts, 4));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_make(OLDRPM_1, NEWRPM_1, DELTARPM_STANDARD_THREADS, opts));
+    assert_true(same_contents(DELTARPM_STANDARD, DELTARPM_STANDARD_THREADS));
+}
+
+// lowest and highest diff effort must both make usable DeltaRPMs
+static void make_standard_effort(void **state)
+{
+    drpm_make_options *opts = *state;
+
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_defaults(opts));
+
+    assert_int_equal(DRPM_ERR_ARGS, drpm_make_options_set_effort(opts, DRPM_EFFORT_MIN - 1));
+    assert_int_equal(DRPM_ERR_ARGS, drpm_make_options_set_effort(opts, DRPM_EFFORT_MAX + 1));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_set_effort(opts, DRPM_EFFORT_MIN));
+    assert_int_equal(DRPM_ERR_OK, drpm_make(OLDRPM_1, NEWRPM_1, DELTARPM_STANDARD_FAST, opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_set_effort(opts, DRPM_EFFORT_MAX));
+    assert_int_equal(DRPM_ERR_OK, drpm_make(OLDRPM_1, NEWRPM_1, DELTARPM_STANDARD_BEST, opts));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply(OLDRPM_1, DELTARPM_STANDARD_FAST, RPMOUT_STANDARD_FAST));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply(OLDRPM_1, DELTARPM_STANDARD_BEST, RPMOUT_STANDARD_BEST));
+    assert_true(same_contents(RPMOUT_STANDARD_FAST, RPMOUT_STANDARD_BEST));
+}
+
+// a sparse index may make a larger DeltaRPM, but it must still reconstruct the new RPM
+static void make_standard_sparse(void **state)
+{
+    drpm_make_options *opts = *state;
+
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_defaults(opts));
+
+    assert_int_equal(DRPM_ERR_ARGS, drpm_make_options_set_sparse_index(opts, 16));
+    assert_int_equal(DRPM_ERR_ARGS, drpm_make_options_set_sparse_index(opts, 96));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_set_sparse_index(opts, 64));
+    assert_int_equal(DRPM_ERR_OK, drpm_make(OLDRPM_1, NEWRPM_1, DELTARPM_STANDARD_SPARSE, opts));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply(OLDRPM_1, DELTARPM_STANDARD_SPARSE, RPMOUT_STANDARD_SPARSE));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply(OLDRPM_1, DELTARPM_STANDARD, RPMOUT_STANDARD));
+    assert_true(same_contents(RPMOUT_STANDARD, RPMOUT_STANDARD_SPARSE));
+}
+
+// above the default effort, files unchanged between the RPMs are copied without searching
+static void make_rpmonly_seeded(void **state)
+{
+    drpm_make_options *opts = *state;
+    struct rpm *old_rpm = NULL;
+    struct rpm *new_rpm = NULL;
+    unsigned char *old_cpio = NULL;
+    unsigned char *new_cpio = NULL;
+    size_t old_cpio_len;
+    size_t new_cpio_len;
+    struct diff_seed *seeds = NULL;
+    size_t seeds_count;
+
+    // COPYING is the same in both
+    assert_int_equal(DRPM_ERR_OK, rpm_read(&old_rpm, OLDRPM_2, RPM_ARCHIVE_READ_DECOMP, 1, NULL, NULL, NULL, NULL, NULL));
+    assert_int_equal(DRPM_ERR_OK, rpm_read(&new_rpm, NEWRPM_2, RPM_ARCHIVE_READ_DECOMP, 1, NULL, NULL, NULL, NULL, NULL));
+    assert_int_equal(DRPM_ERR_OK, rpm_fetch_archive(old_rpm, &old_cpio, &old_cpio_len));
+    assert_int_equal(DRPM_ERR_OK, rpm_fetch_archive(new_rpm, &new_cpio, &new_cpio_len));
+    assert_int_equal(DRPM_ERR_OK, diff_seeds_find(old_rpm, old_cpio, old_cpio_len, 0,
+                                                  new_rpm, new_cpio, new_cpio_len, 0,
+                                                  &seeds, &seeds_count));
+    assert_true(seeds_count > 0);
+    for (size_t i = 0; i < seeds_count; i++)
+        assert_memory_equal(old_cpio + seeds[i].old_off, new_cpio + seeds[i].new_off, seeds[i].len);
+    free(seeds);
+    free(old_cpio);
+    free(new_cpio);
+    assert_int_equal(DRPM_ERR_OK, rpm_destroy(&old_rpm));
+    assert_int_equal(DRPM_ERR_OK, rpm_destroy(&new_rpm));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_defaults(opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_set_type(opts, DRPM_TYPE_RPMONLY));
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_set_effort(opts, DRPM_EFFORT_DEFAULT + 1));
+    assert_int_equal(DRPM_ERR_OK, drpm_make(OLDRPM_2, NEWRPM_2, DELTARPM_RPMONLY_SEEDED, opts));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply(OLDRPM_2, DELTARPM_RPMONLY_SEEDED, RPMOUT_RPMONLY_SEEDED));
+    assert_true(same_contents(NEWRPM_2, RPMOUT_RPMONLY_SEEDED));
+}
+
+// version 4 (not in makedeltarpm) may take internal copies from earlier output
+static void make_standard_self(void **state)
+{
+    drpm_make_options *opts = *state;
+    drpm *delta = NULL;
+    unsigned version;
+    unsigned long self_window;
+    unsigned long *self_copies = NULL;
+    unsigned long self_copies_size;
+
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_defaults(opts));
+
+    assert_int_equal(DRPM_ERR_ARGS, drpm_make_options_set_version(opts, 5));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_set_version(opts, 4));
+    assert_int_equal(DRPM_ERR_OK, drpm_make(OLDRPM_1, NEWRPM_1, DELTARPM_STANDARD_SELF, opts));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_read(&delta, DELTARPM_STANDARD_SELF));
+    assert_int_equal(DRPM_ERR_OK, drpm_get_uint(delta, DRPM_TAG_VERSION, &version));
+    assert_int_equal(DRPM_ERR_OK, drpm_get_ulong(delta, DRPM_TAG_SELFWINDOW, &self_window));
+    assert_int_equal(DRPM_ERR_OK, drpm_get_ulong_array(delta, DRPM_TAG_SELFCOPIES, &self_copies, &self_copies_size));
+    assert_int_equal(4, version);
+    // documentation added to drpm.h in NEWRPM_1 repeats itself
+    assert_true(self_copies_size >= 2);
+    assert_int_equal(0, self_copies_size % 2);
+    for (unsigned long i = 1; i < self_copies_size; i += 2)
+        assert_in_range(self_copies[i], 1, self_window);
+    free(self_copies);
+    assert_int_equal(DRPM_ERR_OK, drpm_destroy(&delta));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply(OLDRPM_1, DELTARPM_STANDARD_SELF, RPMOUT_STANDARD_SELF));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply(OLDRPM_1, DELTARPM_STANDARD, RPMOUT_STANDARD));
+    assert_true(same_contents(RPMOUT_STANDARD, RPMOUT_STANDARD_SELF));
+}
+
 #ifdef HAVE_LZLIB_DEVEL
 // testing lzip support (not in makedeltarpm)
 static void make_standard_lzip(void **state)
@@ -950,6 +1254,52 @@ static void check_sequence(void **state)
     assert_int_equal(DRPM_ERR_OK, drpm_check_sequence(OLDRPM_1, (const char *)*state, DRPM_CHECK_NONE));
 }
 
+#ifdef WITH_IO_URING
+// falls back to checking one by one if io_uring is not available at run time
+static void check_files_batch(void **state)
+{
+    unsigned char *content;
+    int filedesc;
+    struct check_file files[3] = {{0}};
+
+    (void)state;
+
+    assert_non_null(content = malloc(URING_GOOD_FILE_SIZE));
+    for (size_t i = 0; i < URING_GOOD_FILE_SIZE; i++)
+        content[i] = i * 13 + i / 509;
+
+    assert_true((filedesc = open(URING_GOOD_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0);
+    assert_int_equal(URING_GOOD_FILE_SIZE, write(filedesc, content, URING_GOOD_FILE_SIZE));
+    assert_int_equal(0, close(filedesc));
+    assert_true((filedesc = open(URING_SHORT_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0);
+    assert_int_equal(URING_GOOD_FILE_SIZE / 2, write(filedesc, content, URING_GOOD_FILE_SIZE / 2));
+    assert_int_equal(0, close(filedesc));
+    assert_int_equal(0, mkdir(URING_DIR, 0755));
+
+    files[0].name = URING_GOOD_FILE;
+    files[0].filesize = URING_GOOD_FILE_SIZE;
+    MD5(content, URING_GOOD_FILE_SIZE, files[0].digest);
+    files[1] = files[0];
+    files[2] = files[0];
+
+    assert_int_equal(DRPM_ERR_OK, check_files(files, 3, DIGESTALGO_MD5, DRPM_CHECK_FULL, true));
+
+    // the short read ends the file early, so its digest cannot match
+    files[1].name = URING_SHORT_FILE;
+    assert_int_equal(DRPM_ERR_MISMATCH, check_files(files, 3, DIGESTALGO_MD5, DRPM_CHECK_FULL, true));
+
+    // the first failure in sequence order is the one reported
+    files[1].name = URING_DIR;
+    files[2].name = URING_SHORT_FILE;
+    assert_int_equal(DRPM_ERR_IO, check_files(files, 3, DIGESTALGO_MD5, DRPM_CHECK_FULL, true));
+
+    assert_int_equal(0, unlink(URING_GOOD_FILE));
+    assert_int_equal(0, unlink(URING_SHORT_FILE));
+    assert_int_equal(0, rmdir(URING_DIR));
+    free(content);
+}
+#endif
+
 /***************************** drpm_apply *****************************/
 
 static void apply_standard(void **state)
@@ -964,6 +1314,380 @@ static void apply_rpmonly_noaddblk(void **state)
     assert_int_equal(DRPM_ERR_OK, drpm_apply(OLDRPM_2, DELTARPM_RPMONLY_NOADDBLK, RPMOUT_RPMONLY_NOADDBLK));
 }
 
+static void apply_standard_threads(void **state)
+{
+    drpm_apply_options *opts = NULL;
+
+    (void)state;
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_init(&opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_set_threads(opts, 0));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_with_options(OLDRPM_1, DELTARPM_STANDARD, RPMOUT_STANDARD_THREADS, opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_destroy(&opts));
+}
+
+static void apply_standard_verify(void **state)
+{
+    drpm_apply_options *opts = NULL;
+    char *bad_file = NULL;
+
+    (void)state;
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_init(&opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_verify_files(opts, &bad_file));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_with_options(OLDRPM_1, DELTARPM_STANDARD, RPMOUT_STANDARD_VERIFY, opts));
+    assert_null(bad_file);
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_destroy(&opts));
+}
+
+struct progress_seen {
+    unsigned phases; // bit per phase reported
+    unsigned long long done;
+    unsigned long long total;
+    int cancel_phase;
+    unsigned long long cancel_bytes; // not canceling before this many bytes
+};
+
+static int progress_record(void *data, int phase, unsigned long long bytes,
+                           unsigned long long done, unsigned long long total)
+{
+    struct progress_seen *seen = data;
+
+    (void)bytes;
+
+    seen->phases |= 1U << phase;
+    if (phase == DRPM_PHASE_APPLY) {
+        seen->done = done;
+        seen->total = total;
+    }
+
+    return phase == seen->cancel_phase && bytes >= seen->cancel_bytes;
+}
+
+// appends a new ASCII CPIO entry for <name> to <out>
+static size_t cpio_entry_write(unsigned char *out, const char *name, uint16_t mode,
+                               const unsigned char *content, size_t size)
+{
+    struct cpio_header header = {0};
+    size_t len = CPIO_HEADER_SIZE;
+
+    header.mode = mode;
+    header.nlink = 1;
+    header.filesize = size;
+    header.namesize = strlen(name) + 1;
+
+    cpio_header_write(&header, (char *)out);
+    memcpy(out + len, name, header.namesize);
+    len += header.namesize;
+    memset(out + len, 0, CPIO_PADDING(len));
+    len += CPIO_PADDING(len);
+    memcpy(out + len, content, size);
+    len += size;
+    memset(out + len, 0, CPIO_PADDING(size));
+    len += CPIO_PADDING(size);
+
+    return len;
+}
+
+static void verify_corrupt_file(void **state)
+{
+    unsigned char *content;
+    unsigned char *archive;
+    size_t archive_len = 0;
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    char digests[3][2 * MD5_DIGEST_LENGTH + 1];
+    struct file_info files[3] = {{0}};
+    const char *names[3] = {"/usr/share/good", "/usr/share/bad", "/usr/share/large"};
+    const size_t sizes[3] = {VERIFY_FILE_SIZE, VERIFY_FILE_SIZE, VERIFY_LARGE_FILE_SIZE};
+    struct file_verifier *verifier = NULL;
+    char *bad_file = NULL;
+    char name[32];
+
+    (void)state;
+
+    assert_non_null(content = malloc(VERIFY_LARGE_FILE_SIZE + 1));
+    assert_non_null(archive = malloc(VERIFY_LARGE_FILE_SIZE + 3 * VERIFY_FILE_SIZE));
+    for (size_t i = 0; i < VERIFY_LARGE_FILE_SIZE + 1; i++)
+        content[i] = i * 7 + i / 251;
+
+    /* the digest of the second file is that of different content */
+    for (size_t i = 0; i < 3; i++) {
+        MD5(content + (i == 1), sizes[i], digest);
+        dump_hex(digests[i], digest, MD5_DIGEST_LENGTH);
+        files[i].name = (char *)names[i];
+        files[i].md5 = digests[i];
+        files[i].linkto = "";
+        files[i].mode = S_IFREG | 0644;
+        files[i].size = sizes[i];
+        snprintf(name, sizeof(name), ".%s", names[i]);
+        archive_len += cpio_entry_write(archive + archive_len, name, files[i].mode,
+                                        content, sizes[i]);
+    }
+    archive_len += cpio_entry_write(archive + archive_len, CPIO_TRAILER, 0, content, 0);
+
+    assert_int_equal(DRPM_ERR_OK, file_verifier_start(&verifier, files, 3, DIGESTALGO_MD5));
+    /* the large file does not fit in the buffer, so feeding stops early */
+    assert_int_equal(DRPM_ERR_MISMATCH, file_verifier_feed(verifier, archive, archive_len));
+    assert_int_equal(DRPM_ERR_MISMATCH, file_verifier_finish(verifier, &bad_file));
+    assert_non_null(bad_file);
+    assert_string_equal(names[1], bad_file);
+    assert_int_equal(DRPM_ERR_OK, file_verifier_destroy(&verifier));
+
+    free(bad_file);
+    free(archive);
+    free(content);
+}
+
+static void apply_standard_progress(void **state)
+{
+    drpm_apply_options *opts = NULL;
+    struct progress_seen seen = {0, 0, 0, -1};
+
+    (void)state;
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_init(&opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_set_progress(opts, progress_record, &seen));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_with_options(OLDRPM_1, DELTARPM_STANDARD, RPMOUT_STANDARD_CANCEL, opts));
+    assert_int_equal((1U << DRPM_PHASE_READ) | (1U << DRPM_PHASE_APPLY) | (1U << DRPM_PHASE_WRITE), seen.phases);
+    assert_true(seen.total > 0);
+    assert_int_equal(seen.total, seen.done);
+
+    // canceling removes the partially written RPM
+    seen.phases = 0;
+    seen.cancel_phase = DRPM_PHASE_APPLY;
+    assert_int_equal(DRPM_ERR_CANCELED, drpm_apply_with_options(OLDRPM_1, DELTARPM_STANDARD, RPMOUT_STANDARD_CANCEL, opts));
+    assert_int_equal(0, seen.phases & (1U << DRPM_PHASE_WRITE));
+    assert_int_not_equal(0, access(RPMOUT_STANDARD_CANCEL, F_OK));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_destroy(&opts));
+}
+
+static void make_standard_progress(void **state)
+{
+    drpm_make_options *opts = *state;
+    struct progress_seen seen = {0, 0, 0, DRPM_PHASE_READ, 0};
+
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_defaults(opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_set_progress(opts, progress_record, &seen));
+
+    // canceling while reading or writing leaves no DeltaRPM behind
+    assert_int_equal(DRPM_ERR_CANCELED, drpm_make(OLDRPM_1, NEWRPM_1, DELTARPM_STANDARD_CANCEL, opts));
+    assert_int_equal(0, seen.phases & ~(1U << DRPM_PHASE_READ));
+    assert_int_not_equal(0, access(DELTARPM_STANDARD_CANCEL, F_OK));
+
+    seen.phases = 0;
+    seen.cancel_phase = DRPM_PHASE_WRITE;
+    assert_int_equal(DRPM_ERR_CANCELED, drpm_make(OLDRPM_1, NEWRPM_1, DELTARPM_STANDARD_CANCEL, opts));
+    assert_int_equal((1U << DRPM_PHASE_READ) | (1U << DRPM_PHASE_DIFF) | (1U << DRPM_PHASE_WRITE), seen.phases);
+    assert_int_not_equal(0, access(DELTARPM_STANDARD_CANCEL, F_OK));
+}
+
+static void progress_cancel_midway(void **state)
+{
+    struct progress_seen seen = {0, 0, 0, DRPM_PHASE_WRITE, 1};
+    struct progress prog;
+    struct compstrm *cstrm;
+    struct decompstrm *dstrm;
+    struct hash *hsh = NULL;
+    unsigned char *data;
+    int filedesc;
+
+    (void)state;
+
+    assert_non_null(data = malloc(CANCEL_DATA_SIZE));
+    for (size_t i = 0; i < CANCEL_DATA_SIZE; i++)
+        data[i] = i * 7 + i / 1021;
+
+    assert_true((filedesc = open(CANCEL_DATA_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644)) >= 0);
+    assert_int_equal(DRPM_ERR_OK, compstrm_init(&cstrm, filedesc, DRPM_COMP_GZIP, 1));
+    assert_int_equal(DRPM_ERR_OK, compstrm_write(cstrm, CANCEL_DATA_SIZE, data));
+    assert_int_equal(DRPM_ERR_OK, compstrm_finish(cstrm, NULL, NULL));
+    assert_int_equal(DRPM_ERR_OK, compstrm_destroy(&cstrm));
+
+    // compressing a single large buffer stops midway
+    progress_init(&prog, progress_record, &seen);
+    assert_int_equal(DRPM_ERR_OK, progress_report(&prog, DRPM_PHASE_WRITE, 0, 0, 0));
+    assert_int_equal(DRPM_ERR_OK, compstrm_init(&cstrm, -1, DRPM_COMP_GZIP, 1));
+    assert_int_equal(DRPM_ERR_OK, compstrm_set_progress(cstrm, &prog, DRPM_PHASE_WRITE));
+    assert_int_equal(DRPM_ERR_CANCELED, compstrm_write(cstrm, CANCEL_DATA_SIZE, data));
+    assert_int_equal(DRPM_ERR_OK, compstrm_destroy(&cstrm));
+
+    // so does decompressing all of a file
+    seen.cancel_phase = DRPM_PHASE_READ;
+    progress_init(&prog, progress_record, &seen);
+    assert_int_equal(DRPM_ERR_OK, progress_report(&prog, DRPM_PHASE_READ, 0, 0, 0));
+    assert_int_equal(0, lseek(filedesc, 0, SEEK_SET));
+    assert_int_equal(DRPM_ERR_OK, decompstrm_init(&dstrm, filedesc, NULL, NULL, NULL, 0, 1));
+    assert_int_equal(DRPM_ERR_OK, decompstrm_set_progress(dstrm, &prog, DRPM_PHASE_READ));
+    assert_int_equal(DRPM_ERR_CANCELED, decompstrm_read_until_eof(dstrm, NULL, NULL));
+    assert_int_equal(DRPM_ERR_OK, decompstrm_destroy(&dstrm));
+    assert_int_equal(0, close(filedesc));
+
+    // ... and building the match index
+    progress_init(&prog, progress_record, &seen);
+    assert_int_equal(DRPM_ERR_OK, progress_report(&prog, DRPM_PHASE_READ, 0, 0, 0));
+    assert_int_equal(DRPM_ERR_CANCELED, hash_create(&hsh, data, CANCEL_DATA_SIZE, false, 1, &prog));
+    progress_init(&prog, progress_record, &seen);
+    assert_int_equal(DRPM_ERR_OK, progress_report(&prog, DRPM_PHASE_READ, 0, 0, 0));
+    assert_int_equal(DRPM_ERR_CANCELED, hash_create_sparse(&hsh, data, CANCEL_DATA_SIZE,
+                                                           SPARSE_INDEX_MIN, 1, &prog));
+
+    assert_int_equal(0, unlink(CANCEL_DATA_FILE));
+    free(data);
+}
+
+/* Flips the last byte of every file in <dir> (if <remove> is false)
+ * or removes them all together with <dir>. */
+static void cache_dir_files(const char *dir, bool remove)
+{
+    DIR *dirp;
+    struct dirent *dent;
+    char path[PATH_MAX];
+    unsigned char byte;
+    int filedesc;
+    off_t end;
+
+    assert_non_null(dirp = opendir(dir));
+    while ((dent = readdir(dirp)) != NULL) {
+        if (strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, dent->d_name);
+        if (remove) {
+            assert_int_equal(0, unlink(path));
+            continue;
+        }
+        assert_true((filedesc = open(path, O_RDWR)) >= 0);
+        assert_true((end = lseek(filedesc, 0, SEEK_END)) > 0);
+        assert_int_equal(1, pread(filedesc, &byte, 1, end - 1));
+        byte ^= 0xFF;
+        assert_int_equal(1, pwrite(filedesc, &byte, 1, end - 1));
+        assert_int_equal(0, close(filedesc));
+    }
+    closedir(dirp);
+
+    if (remove)
+        assert_int_equal(0, rmdir(dir));
+}
+
+static void apply_standard_cached(void **state)
+{
+    char cache_dir[] = PAYLOAD_CACHE_DIR;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long count;
+    unsigned long long size;
+
+    (void)state;
+
+    assert_non_null(mkdtemp(cache_dir));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_cache_enable(64, cache_dir));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply(OLDRPM_1, DELTARPM_STANDARD, RPMOUT_STANDARD_CACHED));
+    assert_int_equal(DRPM_ERR_OK, drpm_cache_get_stats(&hits, &misses, &count, &size));
+    assert_int_equal(0, hits);
+    assert_true(misses > 0);
+    assert_true(count > 0 && size > 0);
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply(OLDRPM_1, DELTARPM_STANDARD, RPMOUT_STANDARD_CACHED));
+    assert_int_equal(DRPM_ERR_OK, drpm_cache_get_stats(&hits, &misses, &count, &size));
+    assert_true(hits > 0);
+    assert_true(same_contents(RPMOUT_STANDARD, RPMOUT_STANDARD_CACHED));
+
+    // payloads stored by an earlier process are picked up
+    assert_int_equal(DRPM_ERR_OK, drpm_cache_disable());
+    assert_int_equal(DRPM_ERR_OK, drpm_cache_enable(64, cache_dir));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply(OLDRPM_1, DELTARPM_STANDARD, RPMOUT_STANDARD_CACHED));
+    assert_int_equal(DRPM_ERR_OK, drpm_cache_get_stats(&hits, &misses, &count, &size));
+    assert_true(hits > 0);
+    assert_int_equal(0, misses);
+    assert_true(same_contents(RPMOUT_STANDARD, RPMOUT_STANDARD_CACHED));
+
+    // ... unless they no longer match their digest
+    assert_int_equal(DRPM_ERR_OK, drpm_cache_disable());
+    cache_dir_files(cache_dir, false);
+    assert_int_equal(DRPM_ERR_OK, drpm_cache_enable(64, cache_dir));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply(OLDRPM_1, DELTARPM_STANDARD, RPMOUT_STANDARD_CACHED));
+    assert_true(same_contents(RPMOUT_STANDARD, RPMOUT_STANDARD_CACHED));
+    assert_int_equal(DRPM_ERR_OK, drpm_cache_disable());
+
+    // a directory others may write to is refused
+    assert_int_equal(0, chmod(cache_dir, 0777));
+    assert_int_equal(DRPM_ERR_ARGS, drpm_cache_enable(64, cache_dir));
+    assert_int_equal(0, chmod(cache_dir, 0700));
+
+    cache_dir_files(cache_dir, true);
+}
+
+static void cache_disable_in_use(void **state)
+{
+    const unsigned char key[MD5_DIGEST_LENGTH] = {0};
+    struct cache *cache;
+    struct cache_entry *entry;
+    unsigned char *data;
+
+    (void)state;
+
+    assert_null(cache_process());
+
+    // a cache still used when disabled is freed once no longer used
+    assert_int_equal(DRPM_ERR_OK, drpm_cache_enable(1, NULL));
+    assert_non_null(cache = cache_process());
+    assert_int_equal(DRPM_ERR_OK, drpm_cache_disable());
+    assert_null(cache_process());
+
+    assert_non_null(data = malloc(16));
+    memset(data, 0x5A, 16);
+    assert_int_equal(DRPM_ERR_OK, cache_put(cache, CACHE_PAYLOAD, key, data, 16, free, &entry));
+    cache_release(cache, entry);
+    assert_non_null(entry = cache_get(cache, CACHE_PAYLOAD, key));
+    assert_int_equal(16, cache_entry_size(entry));
+    cache_release(cache, entry);
+    assert_int_equal(DRPM_ERR_OK, cache_destroy(&cache));
+    assert_null(cache);
+}
+
+static void apply_standard_estimate(void **state)
+{
+    drpm_apply_estimate *estimate = NULL;
+    drpm *delta = NULL;
+    unsigned tgt_comp;
+    unsigned long long blocks;
+    unsigned long long ext_read;
+    unsigned long long value;
+
+    (void)state;
+
+    assert_int_equal(DRPM_ERR_ARGS, drpm_estimate_apply(&estimate, OLDRPM_1, NULL, NULL));
+    assert_int_equal(DRPM_ERR_ARGS, drpm_estimate_apply(&estimate, NULL, DELTARPM_RPMONLY_NOADDBLK, NULL));
+    assert_int_equal(DRPM_ERR_MISMATCH, drpm_estimate_apply(&estimate, OLDRPM_2, DELTARPM_STANDARD, NULL));
+    assert_null(estimate);
+
+    assert_int_equal(DRPM_ERR_OK, drpm_estimate_apply(&estimate, OLDRPM_1, DELTARPM_STANDARD, NULL));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_estimate_get(estimate, DRPM_ESTIMATE_BLOCKS, &blocks));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_estimate_get(estimate, DRPM_ESTIMATE_EXTREAD, &ext_read));
+    assert_true(blocks > 0);
+    assert_true(ext_read >= blocks);
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_estimate_get(estimate, DRPM_ESTIMATE_EXTREREAD, &value));
+    assert_true(value <= ext_read - blocks);
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_estimate_get(estimate, DRPM_ESTIMATE_MEMORY, &value));
+    assert_true(value > blocks);
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_estimate_get(estimate, DRPM_ESTIMATE_DECOMP, &value));
+    assert_true(value > 0);
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_estimate_get(estimate, DRPM_ESTIMATE_RECOMP, &value));
+    assert_true(value > 0);
+
+    assert_int_equal(DRPM_ERR_OK, drpm_read(&delta, DELTARPM_STANDARD));
+    assert_int_equal(DRPM_ERR_OK, drpm_get_uint(delta, DRPM_TAG_TGTCOMP, &tgt_comp));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_estimate_get(estimate, DRPM_ESTIMATE_RECOMPCOMP, &value));
+    assert_int_equal(tgt_comp, value);
+    assert_int_equal(DRPM_ERR_OK, drpm_destroy(&delta));
+
+    assert_int_equal(DRPM_ERR_ARGS, drpm_apply_estimate_get(estimate, -1, &value));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_estimate_destroy(&estimate));
+    assert_null(estimate);
+}
+
 #ifdef HAVE_LZLIB_DEVEL
 static void apply_standard_lzip(void **state)
 {
@@ -978,7 +1702,815 @@ static void apply_standard_zstd(void **state)
     (void)state;
     assert_int_equal(DRPM_ERR_OK, drpm_apply(OLDRPM_2, DELTARPM_STANDARD_ZSTD, RPMOUT_STANDARD_ZSTD));
 }
+
+static void write_dict(const char *path, const unsigned char *dict, size_t dict_len)
+{
+    FILE *file;
+
+    assert_non_null(file = fopen(path, "wb"));
+    assert_int_equal(dict_len, fwrite(dict, 1, dict_len, file));
+    assert_int_equal(0, fclose(file));
+}
+
+// dictionary trained on the bodies of the DeltaRPMs made so far
+static void apply_standard_dict(void **state)
+{
+    const char *corpus[] = {DELTARPM_NODIFF, DELTARPM_IDENTITY, DELTARPM_RPMONLY,
+                            DELTARPM_STANDARD, DELTARPM_RPMONLY_NOADDBLK, DELTARPM_STANDARD_ZSTD};
+    const unsigned corpus_len = sizeof(corpus) / sizeof(*corpus);
+    unsigned char *samples = NULL;
+    size_t samples_len = 0;
+    size_t *sample_sizes = NULL;
+    unsigned sample_count = 0;
+    unsigned char dict[DICT_SIZE];
+    size_t dict_len;
+    unsigned dict_id;
+    char dict_dir[] = "dict-XXXXXX";
+    char dict_path[sizeof(dict_dir) + 16];
+    drpm_make_options *make_opts = NULL;
+    drpm_apply_options *apply_opts = NULL;
+
+    (void)state;
+
+    // the bodies are cut into samples, as training needs several of them
+    for (unsigned i = 0; i < corpus_len; i++) {
+        struct deltarpm delta = {0};
+        unsigned char *body;
+        size_t body_len;
+
+        assert_int_equal(DRPM_ERR_OK, read_deltarpm_body(&delta, corpus[i], &body, &body_len));
+        free_deltarpm(&delta);
+
+        assert_non_null(samples = realloc(samples, samples_len + body_len));
+        assert_non_null(sample_sizes = realloc(sample_sizes, (sample_count + body_len / DICT_SAMPLE_SIZE + 1) * sizeof(size_t)));
+        memcpy(samples + samples_len, body, body_len);
+        samples_len += body_len;
+        for (size_t off = 0; off < body_len; off += DICT_SAMPLE_SIZE)
+            sample_sizes[sample_count++] = MIN(DICT_SAMPLE_SIZE, body_len - off);
+        free(body);
+    }
+
+    dict_len = ZDICT_trainFromBuffer(dict, DICT_SIZE, samples, sample_sizes, sample_count);
+    free(samples);
+    free(sample_sizes);
+    assert_false(ZDICT_isError(dict_len));
+    assert_int_not_equal(0, dict_id = ZDICT_getDictID(dict, dict_len));
+
+    assert_non_null(mkdtemp(dict_dir));
+    sprintf(dict_path, "%s/%u.dict", dict_dir, dict_id);
+    write_dict(dict_path, dict, dict_len);
+
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_init(&make_opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_set_delta_comp(make_opts, DRPM_COMP_ZSTD, DRPM_COMP_LEVEL_DEFAULT));
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_set_delta_dict(make_opts, dict_path));
+    assert_int_equal(DRPM_ERR_OK, drpm_make(OLDRPM_1, NEWRPM_1, DELTARPM_STANDARD_DICT, make_opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_make_options_destroy(&make_opts));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_init(&apply_opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_set_dict_dir(apply_opts, dict_dir));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_with_options(OLDRPM_1, DELTARPM_STANDARD_DICT, RPMOUT_STANDARD_DICT, apply_opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply(OLDRPM_1, DELTARPM_STANDARD, RPMOUT_STANDARD));
+    assert_true(same_contents(RPMOUT_STANDARD, RPMOUT_STANDARD_DICT));
+
+    // a dictionary with another ID under the expected name
+    dict[4] ^= 1;
+    write_dict(dict_path, dict, dict_len);
+    assert_int_equal(DRPM_ERR_FORMAT, drpm_apply_with_options(OLDRPM_1, DELTARPM_STANDARD_DICT, RPMOUT_STANDARD_DICT, apply_opts));
+
+    // no dictionary at all
+    assert_int_equal(0, unlink(dict_path));
+    assert_int_equal(DRPM_ERR_IO, drpm_apply_with_options(OLDRPM_1, DELTARPM_STANDARD_DICT, RPMOUT_STANDARD_DICT, apply_opts));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_destroy(&apply_opts));
+    assert_int_equal(0, rmdir(dict_dir));
+}
+#endif
+
+#ifdef DRPMD_PROGRAM
+/******************************* drpmd ********************************/
+
+static pid_t drpmd_start(const char *socket_path)
+{
+    pid_t pid;
+
+    assert_true((pid = fork()) >= 0);
+    if (pid == 0) {
+        execl(DRPMD_PROGRAM, "drpmd", "-s", socket_path, "-j", "2", (char *)NULL);
+        _exit(127);
+    }
+
+    return pid;
+}
+
+// retrying while the daemon starts up
+static int drpmd_connect(const char *socket_path)
+{
+    struct sockaddr_un addr = {0};
+    const struct timespec delay = {0, 50 * 1000 * 1000};
+    int sock;
+
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    for (unsigned tries = 0; tries < 100; tries++) {
+        assert_true((sock = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0);
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            return sock;
+        close(sock);
+        nanosleep(&delay, NULL);
+    }
+
+    fail();
+    return -1;
+}
+
+// sends a request and reads the whole reply
+static char *drpmd_request(const char *socket_path, const char *request, size_t *reply_len)
+{
+    const int sock = drpmd_connect(socket_path);
+    char *reply = NULL;
+    ssize_t read_len;
+
+    *reply_len = 0;
+    assert_int_equal(strlen(request), write(sock, request, strlen(request)));
+    do {
+        assert_non_null(reply = realloc(reply, *reply_len + BUFSIZ + 1));
+        assert_true((read_len = read(sock, reply + *reply_len, BUFSIZ)) >= 0);
+        *reply_len += read_len;
+    } while (read_len > 0);
+    reply[*reply_len] = '\0';
+    assert_int_equal(0, close(sock));
+
+    return reply;
+}
+
+// returns where the data of an "OK <LENGTH>" reply starts
+static size_t drpmd_reply_ok(const char *reply, size_t reply_len)
+{
+    unsigned long long len;
+    int offset = 0;
+
+    assert_int_equal(1, sscanf(reply, "OK %llu\n%n", &len, &offset));
+    assert_true(offset > 0);
+    assert_int_equal(reply_len, offset + len);
+
+    return offset;
+}
+
+static void drpmd_protocol(void **state)
+{
+    char dir[] = "drpmd-XXXXXX";
+    char socket_path[sizeof(dir) + 8];
+    struct stat stats;
+    char *reply;
+    size_t reply_len;
+    size_t offset;
+    FILE *file;
+    pid_t pid;
+    int status;
+    int code;
+
+    (void)state;
+
+    assert_non_null(mkdtemp(dir));
+    sprintf(socket_path, "%s/socket", dir);
+    pid = drpmd_start(socket_path);
+
+    reply = drpmd_request(socket_path, "STATS\n", &reply_len);
+    offset = drpmd_reply_ok(reply, reply_len);
+    assert_memory_equal("cached=", reply + offset, 7);
+    free(reply);
+
+    /* only the daemon's user may connect */
+    assert_int_equal(0, lstat(socket_path, &stats));
+    assert_true(S_ISSOCK(stats.st_mode));
+    assert_int_equal(0600, stats.st_mode & 0777);
+
+    reply = drpmd_request(socket_path, "MAKE\tdelta\n", &reply_len);
+    assert_int_equal(1, sscanf(reply, "ERR %d", &code));
+    assert_int_equal(DRPM_ERR_ARGS, code);
+    free(reply);
+
+    /* the DeltaRPM sent back reconstructs the new RPM */
+    reply = drpmd_request(socket_path, "MAKE\tstandard\t" OLDRPM_1 "\t" NEWRPM_1 "\n", &reply_len);
+    offset = drpmd_reply_ok(reply, reply_len);
+    assert_non_null(file = fopen(DELTARPM_DRPMD, "wb"));
+    assert_int_equal(reply_len - offset, fwrite(reply + offset, 1, reply_len - offset, file));
+    assert_int_equal(0, fclose(file));
+    free(reply);
+    assert_int_equal(DRPM_ERR_OK, drpm_apply(OLDRPM_1, DELTARPM_DRPMD, RPMOUT_DRPMD));
+    assert_true(same_contents(RPMOUT_STANDARD, RPMOUT_DRPMD));
+
+    assert_int_equal(0, kill(pid, SIGTERM));
+    assert_int_equal(pid, waitpid(pid, &status, 0));
+    assert_true(WIFEXITED(status));
+    assert_int_equal(EXIT_SUCCESS, WEXITSTATUS(status));
+    assert_int_not_equal(0, lstat(socket_path, &stats));
+    assert_int_equal(0, rmdir(dir));
+}
+
+// the daemon only replaces a socket at its path
+static void drpmd_socket_path(void **state)
+{
+    char dir[] = "drpmd-XXXXXX";
+    char socket_path[sizeof(dir) + 8];
+    struct stat stats;
+    FILE *file;
+    pid_t pid;
+    int status;
+
+    (void)state;
+
+    assert_non_null(mkdtemp(dir));
+    sprintf(socket_path, "%s/socket", dir);
+    assert_non_null(file = fopen(socket_path, "w"));
+    assert_int_equal(0, fclose(file));
+
+    pid = drpmd_start(socket_path);
+    assert_int_equal(pid, waitpid(pid, &status, 0));
+    assert_true(WIFEXITED(status));
+    assert_int_equal(EXIT_FAILURE, WEXITSTATUS(status));
+    assert_int_equal(0, lstat(socket_path, &stats));
+    assert_true(S_ISREG(stats.st_mode));
+
+    assert_int_equal(0, unlink(socket_path));
+    assert_int_equal(0, rmdir(dir));
+}
+#endif
+
+/**************************** match search ****************************/
+
+#define REPEAT_SIZE 1024
+#define FILLER_SIZE 4096
+
+// old: filler, repeat, filler, repeat; new: repeat, then other data
+static void locality_data_create(unsigned char **old_ret, size_t *old_len_ret,
+                                 unsigned char **new_ret, size_t *new_len_ret)
+{
+    const size_t old_len = 2 * (FILLER_SIZE + REPEAT_SIZE);
+    const size_t new_len = 2 * REPEAT_SIZE;
+    unsigned char *old;
+    unsigned char *new;
+    uint32_t state = 1;
+
+    assert_non_null(old = malloc(old_len));
+    assert_non_null(new = malloc(new_len));
+    for (size_t i = 0; i < old_len; i++) {
+        state = state * 1103515245 + 12345;
+        old[i] = state >> 16;
+    }
+    memcpy(old + 2 * FILLER_SIZE + REPEAT_SIZE, old + FILLER_SIZE, REPEAT_SIZE);
+    memcpy(new, old + FILLER_SIZE, REPEAT_SIZE);
+    for (size_t i = REPEAT_SIZE; i < new_len; i++)
+        new[i] = ~old[i - REPEAT_SIZE];
+
+    *old_ret = old;
+    *old_len_ret = old_len;
+    *new_ret = new;
+    *new_len_ret = new_len;
+}
+
+// of equal matches, only levels above the default take the one nearest to the last copy
+static void hash_search_locality(void **state)
+{
+    const size_t repeats[2] = {FILLER_SIZE, 2 * FILLER_SIZE + REPEAT_SIZE};
+    unsigned char *old;
+    unsigned char *new;
+    size_t old_len;
+    size_t new_len;
+    struct hash *hsh = NULL;
+    size_t pos;
+    size_t len;
+    size_t default_pos = 0;
+
+    (void)state;
+
+    locality_data_create(&old, &old_len, &new, &new_len);
+
+    for (unsigned short effort = DRPM_EFFORT_DEFAULT; effort <= DRPM_EFFORT_DEFAULT + 1; effort++) {
+        assert_int_equal(DRPM_ERR_OK, hash_create(&hsh, old, old_len, hash_effort_chained(effort), 1, NULL));
+        for (size_t i = 0; i < 2; i++) {
+            assert_int_equal(0, hash_search(hsh, old, old_len, new, new_len, old_len, repeats[i], 0,
+                                            effort, &pos, &len));
+            assert_int_equal(REPEAT_SIZE, len);
+            if (effort > DRPM_EFFORT_DEFAULT)
+                assert_int_equal(repeats[i], pos);
+            else if (i == 0)
+                default_pos = pos;
+            else
+                assert_int_equal(default_pos, pos);
+        }
+        hash_free(&hsh);
+    }
+
+    free(old);
+    free(new);
+}
+
+/*********************** compression parameters ***********************/
+
+// compressible, but not trivially so
+static unsigned char *payload_create(void)
+{
+    unsigned char *payload;
+    uint32_t state = 1;
+
+    assert_non_null(payload = malloc(PAYLOAD_SIZE));
+    for (size_t i = 0; i < PAYLOAD_SIZE; i++) {
+        state = state * 1103515245 + 12345;
+        payload[i] = "drpm deltarpm payload\n"[(state >> 16) % 22];
+    }
+
+    return payload;
+}
+
+// writes <stream> at PAYLOAD_OFFSET, as an RPM payload would be
+static int payload_file_write(const unsigned char *stream, size_t stream_len)
+{
+    const unsigned char lead[PAYLOAD_OFFSET] = {0};
+    int filedesc;
+
+    assert_true((filedesc = open(XZ_PAYLOAD_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644)) >= 0);
+    assert_int_equal(PAYLOAD_OFFSET, write(filedesc, lead, PAYLOAD_OFFSET));
+    assert_int_equal(stream_len, write(filedesc, stream, stream_len));
+
+    return filedesc;
+}
+
+static void xz_blocks_round_trip(void **state)
+{
+#if LZMA_VERSION >= 50020002
+    unsigned char *payload = payload_create();
+    const size_t stream_size = lzma_stream_buffer_bound(PAYLOAD_SIZE);
+    unsigned char *stream;
+    size_t stream_len = 0;
+    lzma_stream lzma = LZMA_STREAM_INIT;
+    lzma_mt mt = {0};
+    int filedesc;
+    uint64_t block_size;
+    struct compstrm *strm = NULL;
+    unsigned char *recomp;
+    size_t recomp_len;
+    struct deltarpm delta = {0};
+    const int levels[] = {DRPM_COMP_LEVEL_DEFAULT, 1, 6};
+    uint32_t preset;
+
+    (void)state;
+
+    assert_non_null(stream = malloc(stream_size));
+
+    /* single-threaded xz writes one block without sizes in its header */
+    assert_int_equal(LZMA_OK, lzma_easy_encoder(&lzma, 3, LZMA_CHECK_SHA256));
+    lzma.next_in = payload;
+    lzma.avail_in = PAYLOAD_SIZE;
+    lzma.next_out = stream;
+    lzma.avail_out = stream_size;
+    assert_int_equal(LZMA_STREAM_END, lzma_code(&lzma, LZMA_FINISH));
+    stream_len = lzma.total_out;
+    lzma_end(&lzma);
+
+    filedesc = payload_file_write(stream, stream_len);
+    assert_int_equal(0, rpm_probe_xz_blocks(filedesc, PAYLOAD_OFFSET));
+    assert_int_equal(0, close(filedesc));
+
+    /* the block size is only recorded in version 4 */
+    delta.tgt_comp = DRPM_COMP_XZ;
+    delta.version = 3;
+    assert_int_equal(DRPM_ERR_PROG, deltarpm_set_xz_blocks(&delta, PAYLOAD_BLOCK_SIZE));
+    delta.version = 4;
+    assert_int_equal(DRPM_ERR_OK, deltarpm_set_xz_blocks(&delta, PAYLOAD_BLOCK_SIZE));
+    block_size = 0;
+    assert_true(deltarpm_get_xz_blocks(&delta, &block_size));
+    assert_int_equal(PAYLOAD_BLOCK_SIZE, block_size);
+    free_deltarpm(&delta);
+
+    /* only xz streams can be switched to blocks */
+    assert_int_equal(DRPM_ERR_OK, compstrm_init(&strm, -1, DRPM_COMP_NONE, DRPM_COMP_LEVEL_DEFAULT));
+    assert_int_equal(DRPM_ERR_ARGS, compstrm_set_xz_blocks(strm, block_size, 1));
+    assert_int_equal(DRPM_ERR_OK, compstrm_destroy(&strm));
+
+    /* level 0 (the default, preset 3) records blocks like any other */
+    for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+        preset = levels[l] == DRPM_COMP_LEVEL_DEFAULT ? 3 : levels[l];
+
+        /* multi-threaded xz, as used by rpm for threaded payloads ("w3T.xzdio") */
+        lzma = (lzma_stream)LZMA_STREAM_INIT;
+        mt.block_size = PAYLOAD_BLOCK_SIZE;
+        mt.preset = preset;
+        mt.check = LZMA_CHECK_SHA256;
+        mt.threads = 2;
+        assert_int_equal(LZMA_OK, lzma_stream_encoder_mt(&lzma, &mt));
+        lzma.next_in = payload;
+        lzma.avail_in = PAYLOAD_SIZE;
+        lzma.next_out = stream;
+        lzma.avail_out = stream_size;
+        assert_int_equal(LZMA_STREAM_END, lzma_code(&lzma, LZMA_FINISH));
+        stream_len = lzma.total_out;
+        lzma_end(&lzma);
+
+        filedesc = payload_file_write(stream, stream_len);
+        assert_int_equal(PAYLOAD_BLOCK_SIZE, block_size = rpm_probe_xz_blocks(filedesc, PAYLOAD_OFFSET));
+        assert_int_equal(0, close(filedesc));
+        assert_int_equal(0, unlink(XZ_PAYLOAD_FILE));
+
+        /* recompression gives back the same stream, whatever the thread count */
+        for (unsigned threads = 1; threads <= 4; threads *= 2) {
+            assert_int_equal(DRPM_ERR_OK, compstrm_init(&strm, -1, DRPM_COMP_XZ, levels[l]));
+            assert_int_equal(DRPM_ERR_OK, compstrm_set_xz_blocks(strm, block_size, threads));
+            assert_int_equal(DRPM_ERR_OK, compstrm_write(strm, PAYLOAD_SIZE, payload));
+            assert_int_equal(DRPM_ERR_OK, compstrm_finish(strm, &recomp, &recomp_len));
+            assert_int_equal(DRPM_ERR_OK, compstrm_destroy(&strm));
+            assert_int_equal(stream_len, recomp_len);
+            assert_memory_equal(stream, recomp, stream_len);
+            free(recomp);
+        }
+    }
+
+    free(stream);
+    free(payload);
+#else
+    (void)state;
+    skip(); // lzma_stream_encoder_mt() needs xz 5.2.0
+#endif
+}
+
+static void comp_sampling(void **state)
+{
+    unsigned char input[7];
+    struct compstrm *strm = NULL;
+    unsigned char *sample;
+    size_t sample_len;
+
+    (void)state;
+
+    /* only uncompressed streams sample */
+    assert_int_equal(DRPM_ERR_OK, compstrm_init(&strm, -1, DRPM_COMP_NONE, DRPM_COMP_LEVEL_DEFAULT));
+    assert_int_equal(DRPM_ERR_PROG, compstrm_set_sampling(strm, 16, 1));
+    assert_int_equal(DRPM_ERR_OK, compstrm_set_sampling(strm, 16, 4));
+
+    /* each byte tells which 16-byte slice of the input it comes from */
+    for (size_t off = 0; off < 1000; off += sizeof(input)) {
+        for (size_t i = 0; i < sizeof(input); i++)
+            input[i] = (off + i) / 16;
+        assert_int_equal(DRPM_ERR_OK, compstrm_write(strm, MIN(sizeof(input), 1000 - off), input));
+    }
+    assert_int_equal(DRPM_ERR_OK, compstrm_finish(strm, &sample, &sample_len));
+    assert_int_equal(DRPM_ERR_OK, compstrm_destroy(&strm));
+
+    /* the stride has doubled to 256 bytes, spreading 4 slices over the input */
+    assert_int_equal(4 * 16, sample_len);
+    for (size_t i = 0; i < sample_len; i++)
+        assert_int_equal(i / 16 * 16, sample[i]);
+
+    free(sample);
+}
+
+static void zstd_params_round_trip(void **state)
+{
+#ifdef WITH_ZSTD
+    unsigned char *payload = payload_create();
+    unsigned char *out;
+    unsigned char *frames[2];
+    size_t frame_lens[2];
+    struct compstrm *strm = NULL;
+    struct deltarpm delta = {0};
+    unsigned short window_log;
+    bool checksum;
+    bool workers;
+    int error;
+
+    (void)state;
+
+    /* the parameters are only recorded in version 4 */
+    delta.tgt_comp = DRPM_COMP_ZSTD;
+    delta.version = 3;
+    assert_int_equal(DRPM_ERR_PROG, deltarpm_set_zstd_params(&delta, 20, true, true));
+    assert_false(deltarpm_get_zstd_params(&delta, &window_log, &checksum, &workers));
+    delta.version = 4;
+    assert_int_equal(DRPM_ERR_OK, deltarpm_set_zstd_params(&delta, 20, true, true));
+    assert_true(deltarpm_get_zstd_params(&delta, &window_log, &checksum, &workers));
+    assert_int_equal(20, window_log);
+    assert_true(checksum);
+    assert_true(workers);
+    free_deltarpm(&delta);
+
+    /* the frame header carries them, and the payload survives */
+    assert_int_equal(DRPM_ERR_OK, compstrm_init(&strm, -1, DRPM_COMP_ZSTD, 3));
+    assert_int_equal(DRPM_ERR_OK, compstrm_set_zstd_params(strm, 20, true, 0));
+    assert_int_equal(DRPM_ERR_OK, compstrm_write(strm, PAYLOAD_SIZE, payload));
+    assert_int_equal(DRPM_ERR_OK, compstrm_finish(strm, &frames[0], &frame_lens[0]));
+    assert_int_equal(DRPM_ERR_OK, compstrm_destroy(&strm));
+    assert_true(frame_lens[0] > 6);
+    assert_int_equal(0x28B52FFD, parse_be32(frames[0]));
+    assert_true((frames[0][4] & 0x04) != 0); // content checksum
+    assert_true((frames[0][4] & 0x20) == 0); // window descriptor present
+    assert_int_equal(20, 10 + (frames[0][5] >> 3));
+    assert_non_null(out = malloc(PAYLOAD_SIZE));
+    assert_int_equal(PAYLOAD_SIZE, ZSTD_decompress(out, PAYLOAD_SIZE, frames[0], frame_lens[0]));
+    assert_memory_equal(payload, out, PAYLOAD_SIZE);
+    free(out);
+    free(frames[0]);
+
+    /* multi-threaded output does not depend on the number of workers */
+    for (unsigned i = 0; i < 2; i++) {
+        assert_int_equal(DRPM_ERR_OK, compstrm_init(&strm, -1, DRPM_COMP_ZSTD, 3));
+        if ((error = compstrm_set_zstd_params(strm, 0, false, i + 1)) == DRPM_ERR_CONFIG) {
+            // libzstd built without multi-threading
+            assert_int_equal(DRPM_ERR_OK, compstrm_destroy(&strm));
+            if (i > 0)
+                free(frames[0]);
+            free(payload);
+            skip();
+        }
+        assert_int_equal(DRPM_ERR_OK, error);
+        assert_int_equal(DRPM_ERR_OK, compstrm_write(strm, PAYLOAD_SIZE, payload));
+        assert_int_equal(DRPM_ERR_OK, compstrm_finish(strm, &frames[i], &frame_lens[i]));
+        assert_int_equal(DRPM_ERR_OK, compstrm_destroy(&strm));
+    }
+    assert_int_equal(frame_lens[0], frame_lens[1]);
+    assert_memory_equal(frames[0], frames[1], frame_lens[0]);
+    free(frames[0]);
+    free(frames[1]);
+
+    free(payload);
+#else
+    (void)state;
+    skip();
 #endif
+}
+
+/*************************** large payloads ***************************/
+
+static void blocks_large_file(void **state)
+{
+    char path[PATH_MAX];
+    char stripped[CPIO_HEADER_SIZE + 1];
+    int filedesc;
+    struct file_info file = {0};
+    const struct cpio_header header = {.stripped = true, .file_index = 0};
+    const size_t trailer_len = CPIO_HEADER_SIZE + sizeof(CPIO_TRAILER) + CPIO_PADDING(CPIO_HEADER_SIZE + sizeof(CPIO_TRAILER));
+    struct cpio_file cpio_files[2];
+    struct blocks *blks = NULL;
+    unsigned char *buffer;
+    size_t buffer_len;
+    unsigned char out[CPIO_HEADER_SIZE + 32];
+    size_t out_len;
+    uint64_t off = 0;
+    uint32_t copy_len;
+
+    (void)state;
+
+    assert_non_null(getcwd(path, sizeof(path) - sizeof("/" LARGE_FILE)));
+    strcat(path, "/" LARGE_FILE);
+    assert_true((filedesc = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0);
+    assert_int_equal(0, ftruncate(filedesc, LARGE_FILE_SIZE));
+    assert_int_equal(4, pwrite(filedesc, LARGE_MARKER, 4, LARGE_MARKER_OFFSET));
+    assert_int_equal(0, close(filedesc));
+
+    file.name = path;
+    file.md5 = "";
+    file.linkto = "";
+    file.mode = S_IFREG | 0644;
+    file.size = LARGE_FILE_SIZE;
+
+    /* the file takes a stripped header, as in rpm's large-file payloads */
+    cpio_files[0].index = 0;
+    cpio_files[0].header_len = CPIO_STRIPPED_HEADER_SIZE + CPIO_PADDING(CPIO_STRIPPED_HEADER_SIZE);
+    cpio_files[0].content_len = LARGE_FILE_SIZE + CPIO_PADDING(LARGE_FILE_SIZE);
+    cpio_files[0].offset = 0;
+    cpio_files[1].index = -1;
+    cpio_files[1].header_len = trailer_len;
+    cpio_files[1].content_len = 0;
+    cpio_files[1].offset = cpio_files[0].header_len + cpio_files[0].content_len;
+
+    /* header, marker (jumping over 4 GiB in steps) and trailer */
+    const uint32_t ext_copies[] = {
+        0, cpio_files[0].header_len,
+        INT32_MAX, 0,
+        INT32_MAX, 0,
+        LARGE_MARKER_OFFSET - 2 * (uint64_t)INT32_MAX, 4,
+        cpio_files[1].offset - (cpio_files[0].header_len + LARGE_MARKER_OFFSET + 4), trailer_len
+    };
+    const size_t ext_copies_count = sizeof(ext_copies) / (2 * sizeof(uint32_t));
+    const uint64_t ext_data_len = cpio_files[1].offset + trailer_len;
+
+    assert_non_null(buffer = malloc(block_size()));
+    assert_int_equal(DRPM_ERR_OK, blocks_create(&blks, ext_data_len, &file, 1, cpio_files, 2,
+                                                ext_copies, ext_copies_count, NULL, false, 0, 1));
+
+    for (size_t i = 0; i < ext_copies_count; i++) {
+        off += (int32_t)ext_copies[2 * i];
+        copy_len = ext_copies[2 * i + 1];
+        out_len = 0;
+        while (copy_len > 0) {
+            assert_int_equal(DRPM_ERR_OK, blocks_next(blks, buffer, &buffer_len, off, copy_len, i, block_id(off)));
+            memcpy(out + out_len, buffer, buffer_len);
+            out_len += buffer_len;
+            off += buffer_len;
+            copy_len -= buffer_len;
+        }
+        switch (i) {
+        case 0:
+            cpio_header_write(&header, stripped);
+            assert_memory_equal(stripped, out, CPIO_STRIPPED_HEADER_SIZE);
+            break;
+        case 3:
+            assert_memory_equal(LARGE_MARKER, out, 4);
+            break;
+        case 4:
+            assert_memory_equal(CPIO_MAGIC, out, 6);
+            assert_memory_equal(CPIO_TRAILER, out + CPIO_HEADER_SIZE, sizeof(CPIO_TRAILER));
+            break;
+        }
+    }
+
+    assert_int_equal(ext_data_len, off);
+    assert_int_equal(DRPM_ERR_OK, blocks_destroy(&blks));
+    free(buffer);
+    assert_int_equal(0, unlink(path));
+}
+
+/*************************** block prefetch ***************************/
+
+static void blocks_prefetch_reuse(void **state)
+{
+    char path[PATH_MAX];
+    const size_t half = PREFETCH_HALF_BLOCKS * block_size();
+    const size_t file_size = 2 * half;
+    unsigned char *content;
+    int filedesc;
+    struct file_info file = {0};
+    const size_t trailer_len = CPIO_HEADER_SIZE + sizeof(CPIO_TRAILER) + CPIO_PADDING(CPIO_HEADER_SIZE + sizeof(CPIO_TRAILER));
+    struct cpio_file cpio_files[2];
+    size_t namesize;
+    struct blocks *blks = NULL;
+    unsigned char *buffer;
+    size_t buffer_len;
+    uint64_t off = 0;
+    uint64_t content_off;
+    uint32_t copy_len;
+
+    (void)state;
+
+    assert_non_null(content = malloc(file_size));
+    for (size_t i = 0; i < file_size; i++)
+        content[i] = (i * 31 + i / 4096) & 0xFF;
+
+    assert_non_null(getcwd(path, sizeof(path) - sizeof("/" PREFETCH_FILE)));
+    strcat(path, "/" PREFETCH_FILE);
+    assert_true((filedesc = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0);
+    assert_int_equal(file_size, write(filedesc, content, file_size));
+    assert_int_equal(0, close(filedesc));
+
+    file.name = path;
+    file.md5 = "";
+    file.linkto = "";
+    file.mode = S_IFREG | 0644;
+    file.size = file_size;
+
+    /* a new ASCII header, "./" and the name without its leading '/' */
+    namesize = strlen(path) + 2;
+    cpio_files[0].index = 0;
+    cpio_files[0].header_len = CPIO_HEADER_SIZE + namesize + CPIO_PADDING(CPIO_HEADER_SIZE + namesize);
+    cpio_files[0].content_len = file_size;
+    cpio_files[0].offset = 0;
+    cpio_files[1].index = -1;
+    cpio_files[1].header_len = trailer_len;
+    cpio_files[1].content_len = 0;
+    cpio_files[1].offset = cpio_files[0].header_len + cpio_files[0].content_len;
+
+    const uint64_t ext_data_len = cpio_files[1].offset + trailer_len;
+    /* the first half, the same blocks again (still in core) and the rest */
+    const uint32_t ext_copies[] = {
+        0, half,
+        (uint32_t)-(int32_t)half, half,
+        0, ext_data_len - half
+    };
+    const size_t ext_copies_count = sizeof(ext_copies) / (2 * sizeof(uint32_t));
+
+    assert_non_null(buffer = malloc(block_size()));
+    assert_int_equal(DRPM_ERR_OK, blocks_create(&blks, ext_data_len, &file, 1, cpio_files, 2,
+                                                ext_copies, ext_copies_count, NULL, false, 0, 2));
+
+    for (size_t i = 0; i < ext_copies_count; i++) {
+        off += (int32_t)ext_copies[2 * i];
+        copy_len = ext_copies[2 * i + 1];
+        while (copy_len > 0) {
+            assert_int_equal(DRPM_ERR_OK, blocks_next(blks, buffer, &buffer_len, off, copy_len, i, block_id(off)));
+            for (size_t j = 0; j < buffer_len; j++) {
+                content_off = off + j - cpio_files[0].header_len;
+                if (off + j >= cpio_files[0].header_len && content_off < file_size)
+                    assert_int_equal(content[content_off], buffer[j]);
+            }
+            off += buffer_len;
+            copy_len -= buffer_len;
+        }
+    }
+
+    /* every block filled was foreseen, re-reads of core blocks included */
+    assert_int_equal(ext_data_len, off);
+    assert_int_equal((ext_data_len + block_size() - 1) / block_size(), blocks_prefetched(blks));
+    assert_int_equal(DRPM_ERR_OK, blocks_destroy(&blks));
+    free(buffer);
+    free(content);
+    assert_int_equal(0, unlink(path));
+}
+
+/***************************** open files *****************************/
+
+static void blocks_reopen_files(void **state)
+{
+    char paths[2][PATH_MAX];
+    const char *names[2] = {REOPEN_FILE_A, REOPEN_FILE_B};
+    const size_t sizes[2] = {REOPEN_BLOCKS * block_size() + 100, REOPEN_BLOCKS * block_size() + 200};
+    unsigned char *contents[2];
+    int filedesc;
+    struct file_info files[2] = {{0}};
+    const size_t trailer_len = CPIO_HEADER_SIZE + sizeof(CPIO_TRAILER) + CPIO_PADDING(CPIO_HEADER_SIZE + sizeof(CPIO_TRAILER));
+    struct cpio_file cpio_files[3];
+    size_t namesize;
+    struct blocks *blks = NULL;
+    unsigned char *buffer;
+    size_t buffer_len;
+    uint32_t ext_copies[4 * REOPEN_BLOCKS];
+    const size_t ext_copies_count = 2 * REOPEN_BLOCKS;
+    uint64_t off = 0;
+    uint64_t prev_end = 0;
+    uint64_t file_off;
+    uint32_t copy_len;
+
+    (void)state;
+
+    for (size_t f = 0; f < 2; f++) {
+        assert_non_null(contents[f] = malloc(sizes[f]));
+        for (size_t i = 0; i < sizes[f]; i++)
+            contents[f][i] = (i * (f + 3) + i / 4096) & 0xFF;
+
+        assert_non_null(getcwd(paths[f], sizeof(paths[f]) - strlen(names[f]) - 1));
+        strcat(paths[f], "/");
+        strcat(paths[f], names[f]);
+        assert_true((filedesc = open(paths[f], O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0);
+        assert_int_equal(sizes[f], write(filedesc, contents[f], sizes[f]));
+        assert_int_equal(0, close(filedesc));
+
+        files[f].name = paths[f];
+        files[f].md5 = "";
+        files[f].linkto = "";
+        files[f].mode = S_IFREG | 0644;
+        files[f].size = sizes[f];
+
+        /* a new ASCII header, "./" and the name without its leading '/' */
+        namesize = strlen(paths[f]) + 2;
+        cpio_files[f].index = f;
+        cpio_files[f].header_len = CPIO_HEADER_SIZE + namesize + CPIO_PADDING(CPIO_HEADER_SIZE + namesize);
+        cpio_files[f].content_len = sizes[f];
+        cpio_files[f].offset = (f == 0) ? 0 : cpio_files[f - 1].offset + cpio_files[f - 1].header_len +
+                                              cpio_files[f - 1].content_len;
+    }
+    cpio_files[2].index = -1;
+    cpio_files[2].header_len = trailer_len;
+    cpio_files[2].content_len = 0;
+    cpio_files[2].offset = cpio_files[1].offset + cpio_files[1].header_len + cpio_files[1].content_len;
+
+    const uint64_t ext_data_len = cpio_files[2].offset + trailer_len;
+
+    /* a block's worth from each file in turn, so that with only one
+     * file kept open, every block of file contents is read after a reopen */
+    for (size_t i = 0; i < ext_copies_count; i++) {
+        const struct cpio_file *cpio = &cpio_files[i % 2];
+        off = cpio->offset + cpio->header_len + (i / 2) * block_size();
+        ext_copies[2 * i] = (uint32_t)(int32_t)(off - prev_end);
+        ext_copies[2 * i + 1] = block_size();
+        prev_end = off + block_size();
+    }
+
+    assert_non_null(buffer = malloc(block_size()));
+    assert_int_equal(DRPM_ERR_OK, blocks_create(&blks, ext_data_len, files, 2, cpio_files, 3,
+                                                ext_copies, ext_copies_count, NULL, false, 1, 0));
+
+    off = 0;
+    for (size_t i = 0; i < ext_copies_count; i++) {
+        const struct cpio_file *cpio = &cpio_files[i % 2];
+        off += (int32_t)ext_copies[2 * i];
+        copy_len = ext_copies[2 * i + 1];
+        while (copy_len > 0) {
+            assert_int_equal(DRPM_ERR_OK, blocks_next(blks, buffer, &buffer_len, off, copy_len, i, block_id(off)));
+            for (size_t j = 0; j < buffer_len; j++) {
+                file_off = off + j - (cpio->offset + cpio->header_len);
+                assert_int_equal(contents[i % 2][file_off], buffer[j]);
+            }
+            off += buffer_len;
+            copy_len -= buffer_len;
+        }
+    }
+
+    assert_int_equal(DRPM_ERR_OK, blocks_destroy(&blks));
+    free(buffer);
+    for (size_t f = 0; f < 2; f++) {
+        assert_int_equal(0, unlink(paths[f]));
+        free(contents[f]);
+    }
+}
 
 /***************************** run tests ******************************/
 
@@ -991,6 +2523,14 @@ int main()
         cmocka_unit_test(make_rpmonly),
         cmocka_unit_test(make_standard),
         cmocka_unit_test(make_rpmonly_noaddblk),
+        cmocka_unit_test(make_standard_auto),
+        cmocka_unit_test(make_standard_cached),
+        cmocka_unit_test(make_standard_threads),
+        cmocka_unit_test(make_standard_effort),
+        cmocka_unit_test(make_standard_sparse),
+        cmocka_unit_test(make_rpmonly_seeded),
+        cmocka_unit_test(make_standard_self),
+        cmocka_unit_test(make_standard_progress),
 #ifdef HAVE_LZLIB_DEVEL
         cmocka_unit_test(make_standard_lzip)
 #endif
@@ -1012,11 +2552,25 @@ int main()
 #endif
     };
     const struct CMUnitTest check_tests[] = {
-        cmocka_unit_test(check_sequence)
+        cmocka_unit_test(check_sequence),
+#ifdef WITH_IO_URING
+        cmocka_unit_test(check_files_batch)
+#endif
     };
     const struct CMUnitTest apply_tests[] = {
         cmocka_unit_test(apply_standard),
         cmocka_unit_test(apply_rpmonly_noaddblk),
+        cmocka_unit_test(apply_standard_threads),
+        cmocka_unit_test(apply_standard_verify),
+        cmocka_unit_test(verify_corrupt_file),
+        cmocka_unit_test(apply_standard_progress),
+        cmocka_unit_test(progress_cancel_midway),
+        cmocka_unit_test(apply_standard_cached),
+        cmocka_unit_test(cache_disable_in_use),
+        cmocka_unit_test(apply_standard_estimate),
+#ifdef WITH_ZSTD
+        cmocka_unit_test(apply_standard_dict),
+#endif
 #ifdef HAVE_LZLIB_DEVEL
         cmocka_unit_test(apply_standard_lzip)
 #endif
@@ -1024,6 +2578,29 @@ int main()
         cmocka_unit_test(apply_standard_zstd)
 #endif
     };
+#ifdef DRPMD_PROGRAM
+    const struct CMUnitTest drpmd_tests[] = {
+        cmocka_unit_test(drpmd_protocol),
+        cmocka_unit_test(drpmd_socket_path)
+    };
+#endif
+    const struct CMUnitTest search_tests[] = {
+        cmocka_unit_test(hash_search_locality)
+    };
+    const struct CMUnitTest comp_param_tests[] = {
+        cmocka_unit_test(xz_blocks_round_trip),
+        cmocka_unit_test(comp_sampling),
+        cmocka_unit_test(zstd_params_round_trip)
+    };
+    const struct CMUnitTest large_tests[] = {
+        cmocka_unit_test(blocks_large_file)
+    };
+    const struct CMUnitTest prefetch_tests[] = {
+        cmocka_unit_test(blocks_prefetch_reuse)
+    };
+    const struct CMUnitTest open_file_tests[] = {
+        cmocka_unit_test(blocks_reopen_files)
+    };
 
     failed = cmocka_run_group_tests_name("drpm_make()", make_tests, make_setup, make_teardown);
     if (failed)
@@ -1041,5 +2618,31 @@ int main()
     if (failed)
         return failed;
 
+#ifdef DRPMD_PROGRAM
+    failed = cmocka_run_group_tests_name("drpmd", drpmd_tests, NULL, NULL);
+    if (failed)
+        return failed;
+#endif
+
+    failed = cmocka_run_group_tests_name("match search", search_tests, NULL, NULL);
+    if (failed)
+        return failed;
+
+    failed = cmocka_run_group_tests_name("compression parameters", comp_param_tests, NULL, NULL);
+    if (failed)
+        return failed;
+
+    failed = cmocka_run_group_tests_name("large payloads", large_tests, NULL, NULL);
+    if (failed)
+        return failed;
+
+    failed = cmocka_run_group_tests_name("block prefetch", prefetch_tests, NULL, NULL);
+    if (failed)
+        return failed;
+
+    failed = cmocka_run_group_tests_name("open files", open_file_tests, NULL, NULL);
+    if (failed)
+        return failed;
+
     return 0;
 }
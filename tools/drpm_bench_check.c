@@ -0,0 +1,148 @@
+/*
+    Copyright (C) 2026 Red Hat
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2.1 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Compares fully checking installed files one by one against checking
+ * them in batches through io_uring, as done by drpm_check_sequence() and
+ * drpm_apply() when applying from the filesystem. Size-only checks are
+ * not batched and so are not measured.
+ * File names are read from standard input, one per line
+ * (e.g. "find /usr -type f | drpm-bench-check"). */
+
+#include "drpm.h"
+#include "drpm_private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/sha.h>
+
+#define RUNS_DEFAULT 5
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-r RUNS] < FILE-LIST\n"
+            "Benchmarks synchronous and io_uring checks of installed files.\n\n"
+            "  -r RUNS  number of timed runs per method (default: %u)\n",
+            prog, RUNS_DEFAULT);
+}
+
+/* computes the digest that the check is expected to find */
+static bool digest_file(const char *name, struct check_file *check)
+{
+    unsigned char buf[BUFSIZ];
+    SHA256_CTX sha256;
+    size_t len;
+    FILE *file;
+
+    if ((file = fopen(name, "rb")) == NULL)
+        return false;
+
+    SHA256_Init(&sha256);
+    check->filesize = 0;
+    while ((len = fread(buf, 1, sizeof(buf), file)) > 0) {
+        SHA256_Update(&sha256, buf, len);
+        check->filesize += len;
+    }
+    SHA256_Final(check->digest, &sha256);
+
+    fclose(file);
+
+    return check->filesize > 0;
+}
+
+static double elapsed_ms(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e3 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned runs = RUNS_DEFAULT;
+    struct check_file *checks = NULL;
+    struct check_file *checks_tmp;
+    size_t checks_len = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t line_len;
+    struct timespec start;
+    struct timespec end;
+    double best[2];
+    int error;
+    int opt;
+    int ret = EXIT_FAILURE;
+
+    while ((opt = getopt(argc, argv, "r:h")) != -1) {
+        switch (opt) {
+        case 'r':
+            runs = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc || runs == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    while ((line_len = getline(&line, &line_size, stdin)) > 0) {
+        if (line[line_len - 1] == '\n')
+            line[--line_len] = '\0';
+        if ((checks_tmp = realloc(checks, (checks_len + 1) * sizeof(struct check_file))) == NULL)
+            goto cleanup;
+        checks = checks_tmp;
+        if (!digest_file(line, &checks[checks_len]))
+            continue;
+        if ((checks[checks_len].name = strdup(line)) == NULL)
+            goto cleanup;
+        checks_len++;
+    }
+
+    printf("%zu files\n", checks_len);
+
+    for (unsigned short batch = 0; batch < 2; batch++) {
+        best[batch] = 0;
+        for (unsigned r = 0; r < runs; r++) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            error = check_files(checks, checks_len, DIGESTALGO_SHA256, DRPM_CHECK_FULL, batch);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            if (error != DRPM_ERR_OK) {
+                fprintf(stderr, "check failed: %s\n", drpm_strerror(error));
+                goto cleanup;
+            }
+            if (r == 0 || elapsed_ms(&start, &end) < best[batch])
+                best[batch] = elapsed_ms(&start, &end);
+        }
+    }
+    printf("full  sync %10.2f ms  io_uring %10.2f ms  (%.2fx)\n",
+           best[0], best[1], best[0] / best[1]);
+
+    ret = EXIT_SUCCESS;
+
+cleanup:
+    for (size_t i = 0; i < checks_len; i++)
+        free((char *)checks[i].name);
+    free(checks);
+    free(line);
+
+    return ret;
+}
@@ -0,0 +1,139 @@
+/*
+    Copyright (C) 2026 Red Hat
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2.1 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Compares the diff effort levels of drpm_make() by making the same
+ * DeltaRPM at each level, reporting the time taken and the size of
+ * the result. Payloads are only decompressed once (in the first run)
+ * by using the payload cache. */
+
+#include "drpm.h"
+#include "drpm_private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define RUNS_DEFAULT 3
+#define CACHE_MBYTES 4096
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-r RUNS] [-R] OLD-RPM NEW-RPM\n"
+            "Benchmarks the diff effort levels of DeltaRPM creation.\n\n"
+            "  -r RUNS  number of timed runs per level (default: %u)\n"
+            "  -R       make rpm-only DeltaRPMs\n",
+            prog, RUNS_DEFAULT);
+}
+
+static double elapsed_ms(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e3 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned runs = RUNS_DEFAULT;
+    bool rpm_only = false;
+    drpm_make_options *opts = NULL;
+    char delta_name[] = "/tmp/drpm-bench-effort.XXXXXX";
+    struct timespec start;
+    struct timespec end;
+    struct stat stats;
+    double best;
+    off_t sizes[DRPM_EFFORT_MAX + 1] = {0};
+    int filedesc;
+    int error;
+    int opt;
+    int ret = EXIT_FAILURE;
+
+    while ((opt = getopt(argc, argv, "r:Rh")) != -1) {
+        switch (opt) {
+        case 'r':
+            runs = strtoul(optarg, NULL, 10);
+            break;
+        case 'R':
+            rpm_only = true;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (optind + 2 != argc || runs == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if ((filedesc = mkstemp(delta_name)) < 0) {
+        perror(delta_name);
+        return EXIT_FAILURE;
+    }
+    close(filedesc);
+
+    if ((error = drpm_cache_enable(CACHE_MBYTES, NULL)) != DRPM_ERR_OK ||
+        (error = drpm_make_options_init(&opts)) != DRPM_ERR_OK ||
+        (rpm_only && (error = drpm_make_options_set_type(opts, DRPM_TYPE_RPMONLY)) != DRPM_ERR_OK))
+        goto fail;
+
+    // warming up the payload cache
+    if ((error = drpm_make(argv[optind], argv[optind + 1], delta_name, opts)) != DRPM_ERR_OK)
+        goto fail;
+
+    for (unsigned short effort = DRPM_EFFORT_MIN; effort <= DRPM_EFFORT_MAX; effort++) {
+        if ((error = drpm_make_options_set_effort(opts, effort)) != DRPM_ERR_OK)
+            goto fail;
+        best = 0;
+        for (unsigned r = 0; r < runs; r++) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            error = drpm_make(argv[optind], argv[optind + 1], delta_name, opts);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            if (error != DRPM_ERR_OK)
+                goto fail;
+            if (r == 0 || elapsed_ms(&start, &end) < best)
+                best = elapsed_ms(&start, &end);
+        }
+        if (stat(delta_name, &stats) != 0) {
+            perror(delta_name);
+            goto cleanup;
+        }
+        sizes[effort] = stats.st_size;
+        printf("effort %u  %10.2f ms  %12lld bytes\n", effort, best, (long long)stats.st_size);
+    }
+
+    for (unsigned short effort = DRPM_EFFORT_MIN; effort <= DRPM_EFFORT_MAX; effort++)
+        printf("effort %u  %+7.2f %% size vs. default\n", effort,
+               100.0 * (sizes[effort] - sizes[DRPM_EFFORT_DEFAULT]) / sizes[DRPM_EFFORT_DEFAULT]);
+
+    ret = EXIT_SUCCESS;
+    goto cleanup;
+
+fail:
+    fprintf(stderr, "drpm error: %s\n", drpm_strerror(error));
+
+cleanup:
+    if (opts != NULL)
+        drpm_make_options_destroy(&opts);
+    drpm_cache_disable();
+    unlink(delta_name);
+
+    return ret;
+}
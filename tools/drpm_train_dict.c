@@ -0,0 +1,142 @@
+/*
+    Copyright (C) 2026 Red Hat
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2.1 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Trains a zstd dictionary on the bodies of a corpus of DeltaRPMs.
+ * The dictionary is written as "<dir>/<ID>.dict", which is where
+ * drpm_apply_with_options() looks for it, and can be passed to
+ * drpm_make_options_set_delta_dict() when making new DeltaRPMs. */
+
+#include "drpm.h"
+#include "drpm_private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zdict.h>
+
+#define DICT_SIZE_DEFAULT (112 * 1024)
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-d DIR] [-s SIZE] DELTARPM...\n"
+            "Trains a zstd dictionary for compressing DeltaRPMs.\n\n"
+            "  -d DIR   write <DIR>/<ID>.dict (default: current directory)\n"
+            "  -s SIZE  maximum dictionary size in bytes (default: %u)\n",
+            prog, DICT_SIZE_DEFAULT);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *dir = ".";
+    size_t dict_cap = DICT_SIZE_DEFAULT;
+    unsigned char *samples = NULL;
+    unsigned char *samples_tmp;
+    size_t samples_len = 0;
+    size_t *sample_sizes = NULL;
+    unsigned sample_count = 0;
+    unsigned char *dict = NULL;
+    size_t dict_len;
+    char *path = NULL;
+    FILE *file;
+    int opt;
+    int ret = EXIT_FAILURE;
+
+    while ((opt = getopt(argc, argv, "d:s:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            dir = optarg;
+            break;
+        case 's':
+            dict_cap = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (optind >= argc || dict_cap == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if ((sample_sizes = malloc((argc - optind) * sizeof(size_t))) == NULL)
+        goto cleanup;
+
+    for (int i = optind; i < argc; i++) {
+        struct deltarpm delta = {0};
+        unsigned char *body = NULL;
+        size_t body_len;
+        int error;
+
+        if ((error = read_deltarpm_body(&delta, argv[i], &body, &body_len)) != DRPM_ERR_OK) {
+            fprintf(stderr, "%s: %s\n", argv[i], drpm_strerror(error));
+            goto cleanup;
+        }
+        free_deltarpm(&delta);
+
+        if ((samples_tmp = realloc(samples, samples_len + body_len + 1)) == NULL) {
+            free(body);
+            goto cleanup;
+        }
+        samples = samples_tmp;
+        memcpy(samples + samples_len, body, body_len);
+        samples_len += body_len;
+        sample_sizes[sample_count++] = body_len;
+        free(body);
+    }
+
+    if ((dict = malloc(dict_cap)) == NULL)
+        goto cleanup;
+
+    dict_len = ZDICT_trainFromBuffer(dict, dict_cap, samples, sample_sizes, sample_count);
+    if (ZDICT_isError(dict_len)) {
+        fprintf(stderr, "training failed: %s\n", ZDICT_getErrorName(dict_len));
+        goto cleanup;
+    }
+
+    if ((path = malloc(strlen(dir) + 17)) == NULL)
+        goto cleanup;
+    sprintf(path, "%s/%u.dict", dir, ZDICT_getDictID(dict, dict_len));
+
+    if ((file = fopen(path, "wb")) == NULL) {
+        perror(path);
+        goto cleanup;
+    }
+    if (fwrite(dict, 1, dict_len, file) != dict_len) {
+        perror(path);
+        fclose(file);
+        goto cleanup;
+    }
+    if (fclose(file) != 0) {
+        perror(path);
+        goto cleanup;
+    }
+
+    printf("%s\n", path);
+    ret = EXIT_SUCCESS;
+
+cleanup:
+    free(samples);
+    free(sample_sizes);
+    free(dict);
+    free(path);
+
+    return ret;
+}
@@ -0,0 +1,616 @@
+/*
+    Copyright (C) 2026 Red Hat
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2.1 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Makes DeltaRPMs on request over a UNIX socket, keeping decompressed
+ * payloads and match indexes of recently used RPMs in memory, so that
+ * popular base RPMs are not decompressed and indexed for every delta.
+ *
+ * Each connection carries one request line, fields separated by tabs:
+ *
+ *   MAKE <standard|rpmonly> <OLDRPM|-> <NEWRPM>
+ *   STATS
+ *
+ * ("-" as old RPM makes an identity DeltaRPM of the new one).
+ * The reply is either "OK <LENGTH>" followed by LENGTH bytes (the
+ * DeltaRPM, or a line of statistics), or "ERR <CODE> <MESSAGE>" with
+ * CODE being one of DRPM_ERR_*. Both are terminated by a newline.
+ *
+ * Requests make the daemon read RPMs with its own privileges, so the
+ * socket is only accessible to the user running it (and to root), and
+ * connections from other users are dropped. */
+
+#define _GNU_SOURCE
+
+#include "drpm.h"
+#include "drpm_private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define CACHE_MBYTES_DEFAULT 1024
+#define QUEUE_MAX 64
+#define REQUEST_MAX (2 * PATH_MAX + 32)
+#define RECV_TIMEOUT_SECS 30
+#define STREAM_BUFFER_SIZE (64 * 1024)
+
+struct request {
+    bool rpm_only;
+    const char *old_rpm; // NULL for identity deltas
+    const char *new_rpm;
+};
+
+struct daemon {
+    pthread_mutex_t lock;
+    pthread_cond_t queued; // clients queued or stopping
+    pthread_cond_t released; // memory of a finished make released
+    int queue[QUEUE_MAX];
+    size_t queue_head;
+    size_t queue_len;
+    bool stopping;
+    uint64_t mem_limit; // for running makes, 0 for no limit
+    uint64_t mem_used;
+    unsigned running;
+    unsigned threads; // per make
+    unsigned short effort;
+    const char *tmpdir;
+    struct cache *cache;
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s -s SOCKET [-j WORKERS] [-t THREADS] [-c MBYTES] [-m MBYTES] [-T DIR] [-C DIR] [-e LEVEL]\n"
+            "Makes DeltaRPMs on request, keeping popular RPMs decompressed and indexed.\n\n"
+            "  -s SOCKET   path of the UNIX socket to listen on (created with mode 0600)\n"
+            "  -j WORKERS  number of DeltaRPMs made at once (default: number of CPUs)\n"
+            "  -t THREADS  threads used by each make (default: 1)\n"
+            "  -c MBYTES   size of the payload and index cache (default: %u)\n"
+            "  -m MBYTES   memory for running makes, on top of the cache (default: no limit)\n"
+            "  -T DIR      directory for DeltaRPMs being made (default: $TMPDIR or /tmp)\n"
+            "  -C DIR      directory to keep cached payloads in across restarts\n"
+            "  -e LEVEL    diff effort level, %u to %u (default: %u)\n",
+            prog, CACHE_MBYTES_DEFAULT, DRPM_EFFORT_MIN, DRPM_EFFORT_MAX, DRPM_EFFORT_DEFAULT);
+}
+
+static void stop_handler(int signum)
+{
+    (void)signum;
+    stop_requested = 1;
+}
+
+static bool send_all(int client, const void *buffer, size_t len)
+{
+    const char *ptr = buffer;
+    ssize_t sent;
+
+    while (len > 0) {
+        if ((sent = send(client, ptr, len, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        ptr += sent;
+        len -= sent;
+    }
+
+    return true;
+}
+
+static void send_error(int client, int error)
+{
+    char line[128];
+
+    snprintf(line, sizeof(line), "ERR %d %s\n", error, drpm_strerror(error));
+    send_all(client, line, strlen(line));
+}
+
+/* reads the request line (up to the newline, which is cut off) */
+static bool recv_line(int client, char *line, size_t size)
+{
+    size_t len = 0;
+    ssize_t received;
+    char *newline;
+
+    while (len < size - 1) {
+        if ((received = recv(client, line + len, size - 1 - len, 0)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        if (received == 0)
+            return false;
+        len += received;
+        line[len] = '\0';
+        if ((newline = strchr(line, '\n')) != NULL) {
+            *newline = '\0';
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool parse_make(char *args, struct request *req)
+{
+    char *type;
+    char *saveptr;
+
+    if ((type = strtok_r(args, "\t", &saveptr)) == NULL ||
+        (req->old_rpm = strtok_r(NULL, "\t", &saveptr)) == NULL ||
+        (req->new_rpm = strtok_r(NULL, "\t", &saveptr)) == NULL ||
+        strtok_r(NULL, "\t", &saveptr) != NULL)
+        return false;
+
+    if (strcmp(type, "standard") == 0)
+        req->rpm_only = false;
+    else if (strcmp(type, "rpmonly") == 0)
+        req->rpm_only = true;
+    else
+        return false;
+
+    if (strcmp(req->old_rpm, "-") == 0)
+        req->old_rpm = NULL;
+
+    return true;
+}
+
+/* uncompressed payload size of an RPM, guessed if not recorded */
+static uint64_t payload_size(const char *name)
+{
+    struct rpm *rpmst;
+    struct stat stats;
+    uint64_t size = 0;
+
+    if (name == NULL)
+        return 0;
+
+    if (rpm_read(&rpmst, name, RPM_ARCHIVE_DONT_READ, 1, NULL, NULL, NULL, NULL, NULL) == DRPM_ERR_OK) {
+        size = rpm_size_archive(rpmst);
+        rpm_destroy(&rpmst);
+    }
+
+    if (size == 0 && stat(name, &stats) == 0)
+        size = 4 * (uint64_t)stats.st_size;
+
+    return size;
+}
+
+/* Estimates the memory needed to make a DeltaRPM: both payloads are held
+ * decompressed and copied into diff inputs, and the match index takes
+ * about twice the old input. */
+static uint64_t make_estimate(const struct request *req)
+{
+    const uint64_t old_size = payload_size(req->old_rpm);
+    const uint64_t new_size = payload_size(req->new_rpm);
+
+    return 4 * old_size + 2 * new_size;
+}
+
+/* Waits until <need> bytes fit within the memory limit.
+ * A make is always admitted when nothing else runs, so that
+ * ones larger than the limit still get their turn. */
+static void admit(struct daemon *dmn, uint64_t need)
+{
+    pthread_mutex_lock(&dmn->lock);
+    while (dmn->mem_limit > 0 && dmn->running > 0 && dmn->mem_used + need > dmn->mem_limit)
+        pthread_cond_wait(&dmn->released, &dmn->lock);
+    dmn->running++;
+    dmn->mem_used += need;
+    pthread_mutex_unlock(&dmn->lock);
+}
+
+static void release(struct daemon *dmn, uint64_t need)
+{
+    pthread_mutex_lock(&dmn->lock);
+    dmn->running--;
+    dmn->mem_used -= need;
+    pthread_cond_broadcast(&dmn->released);
+    pthread_mutex_unlock(&dmn->lock);
+}
+
+static int serve_make(struct daemon *dmn, int client, const struct request *req)
+{
+    drpm_make_options *opts = NULL;
+    char *path;
+    char line[64];
+    unsigned char *buffer = NULL;
+    struct stat stats;
+    ssize_t bytes_read;
+    uint64_t need;
+    int filedesc;
+    int error;
+
+    if ((path = malloc(strlen(dmn->tmpdir) + 16)) == NULL)
+        return DRPM_ERR_MEMORY;
+    sprintf(path, "%s/drpmd.XXXXXX", dmn->tmpdir);
+
+    if ((filedesc = mkstemp(path)) < 0) {
+        free(path);
+        return DRPM_ERR_IO;
+    }
+    close(filedesc);
+
+    if ((error = drpm_make_options_init(&opts)) != DRPM_ERR_OK ||
+        (error = drpm_make_options_set_threads(opts, dmn->threads)) != DRPM_ERR_OK ||
+        (error = drpm_make_options_set_effort(opts, dmn->effort)) != DRPM_ERR_OK ||
+        (req->rpm_only && (error = drpm_make_options_set_type(opts, DRPM_TYPE_RPMONLY)) != DRPM_ERR_OK))
+        goto cleanup;
+    opts->cache = dmn->cache;
+
+    need = make_estimate(req);
+    admit(dmn, need);
+    error = drpm_make(req->old_rpm, req->new_rpm, path, opts);
+    release(dmn, need);
+
+    if (error != DRPM_ERR_OK)
+        goto cleanup;
+
+    /* streaming the DeltaRPM back */
+    if ((filedesc = open(path, O_RDONLY)) < 0) {
+        error = DRPM_ERR_IO;
+        goto cleanup;
+    }
+    if (fstat(filedesc, &stats) != 0 ||
+        (buffer = malloc(STREAM_BUFFER_SIZE)) == NULL) {
+        error = (buffer == NULL) ? DRPM_ERR_MEMORY : DRPM_ERR_IO;
+        close(filedesc);
+        goto cleanup;
+    }
+
+    snprintf(line, sizeof(line), "OK %llu\n", (unsigned long long)stats.st_size);
+    if (send_all(client, line, strlen(line))) {
+        while ((bytes_read = read(filedesc, buffer, STREAM_BUFFER_SIZE)) > 0 &&
+               send_all(client, buffer, bytes_read))
+            ;
+    }
+    close(filedesc);
+
+cleanup:
+    unlink(path);
+    free(path);
+    free(buffer);
+    if (opts != NULL)
+        drpm_make_options_destroy(&opts);
+
+    return error;
+}
+
+static void serve_stats(struct daemon *dmn, int client)
+{
+    char stats[256];
+    char line[64];
+    size_t count;
+    size_t size;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned running;
+    unsigned long long mem_used;
+
+    cache_get_stats(dmn->cache, &count, &size, &hits, &misses);
+
+    pthread_mutex_lock(&dmn->lock);
+    running = dmn->running;
+    mem_used = dmn->mem_used;
+    pthread_mutex_unlock(&dmn->lock);
+
+    snprintf(stats, sizeof(stats),
+             "cached=%zu cache_bytes=%zu hits=%lu misses=%lu running=%u running_bytes=%llu\n",
+             count, size, hits, misses, running, mem_used);
+    snprintf(line, sizeof(line), "OK %zu\n", strlen(stats));
+
+    if (send_all(client, line, strlen(line)))
+        send_all(client, stats, strlen(stats));
+}
+
+static void serve(struct daemon *dmn, int client)
+{
+    char line[REQUEST_MAX];
+    struct request req;
+    int error;
+
+    if (!recv_line(client, line, sizeof(line))) {
+        send_error(client, DRPM_ERR_ARGS);
+        return;
+    }
+
+    if (strcmp(line, "STATS") == 0) {
+        serve_stats(dmn, client);
+        return;
+    }
+
+    if (strncmp(line, "MAKE\t", 5) != 0 || !parse_make(line + 5, &req)) {
+        send_error(client, DRPM_ERR_ARGS);
+        return;
+    }
+
+    if ((error = serve_make(dmn, client, &req)) != DRPM_ERR_OK)
+        send_error(client, error);
+}
+
+static void *worker(void *arg)
+{
+    struct daemon *dmn = arg;
+    int client;
+
+    for (;;) {
+        pthread_mutex_lock(&dmn->lock);
+        while (dmn->queue_len == 0 && !dmn->stopping)
+            pthread_cond_wait(&dmn->queued, &dmn->lock);
+        if (dmn->queue_len == 0) {
+            pthread_mutex_unlock(&dmn->lock);
+            break;
+        }
+        client = dmn->queue[dmn->queue_head];
+        dmn->queue_head = (dmn->queue_head + 1) % QUEUE_MAX;
+        dmn->queue_len--;
+        pthread_mutex_unlock(&dmn->lock);
+
+        serve(dmn, client);
+        close(client);
+    }
+
+    return NULL;
+}
+
+static bool enqueue(struct daemon *dmn, int client)
+{
+    bool queued = false;
+
+    pthread_mutex_lock(&dmn->lock);
+    if (dmn->queue_len < QUEUE_MAX) {
+        dmn->queue[(dmn->queue_head + dmn->queue_len) % QUEUE_MAX] = client;
+        dmn->queue_len++;
+        pthread_cond_signal(&dmn->queued);
+        queued = true;
+    }
+    pthread_mutex_unlock(&dmn->lock);
+
+    return queued;
+}
+
+/* the daemon's own user and root may make requests */
+static bool peer_allowed(int client)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    return getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+           (cred.uid == 0 || cred.uid == geteuid());
+}
+
+static int listen_on(const char *socket_path)
+{
+    struct sockaddr_un addr = {0};
+    struct stat stats;
+    mode_t mask;
+    int sock;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", socket_path);
+        return -1;
+    }
+
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    /* non-blocking, as a connection reported by poll may be gone by accept */
+    if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    /* a socket left behind by a previous instance, but nothing else */
+    if (lstat(socket_path, &stats) == 0) {
+        if (!S_ISSOCK(stats.st_mode)) {
+            fprintf(stderr, "%s: exists and is not a socket\n", socket_path);
+            close(sock);
+            return -1;
+        }
+        unlink(socket_path);
+    }
+
+    mask = umask(S_IRWXG | S_IRWXO | S_IXUSR);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror(socket_path);
+        umask(mask);
+        close(sock);
+        return -1;
+    }
+    umask(mask);
+
+    if (listen(sock, QUEUE_MAX) != 0) {
+        perror(socket_path);
+        close(sock);
+        unlink(socket_path);
+        return -1;
+    }
+
+    return sock;
+}
+
+int main(int argc, char *argv[])
+{
+    struct daemon dmn = {0};
+    const char *socket_path = NULL;
+    unsigned workers = 0;
+    unsigned long cache_mbytes = CACHE_MBYTES_DEFAULT;
+    unsigned long mem_mbytes = 0;
+    const char *cache_dir = NULL;
+    pthread_t *threads = NULL;
+    unsigned started = 0;
+    struct sigaction action = {0};
+    sigset_t stop_signals;
+    sigset_t wait_signals;
+    struct pollfd listener;
+    const struct timeval timeout = {RECV_TIMEOUT_SECS, 0};
+    int sock = -1;
+    int client;
+    int opt;
+    int ret = EXIT_FAILURE;
+
+    dmn.threads = 1;
+    dmn.effort = DRPM_EFFORT_DEFAULT;
+    if ((dmn.tmpdir = getenv("TMPDIR")) == NULL)
+        dmn.tmpdir = "/tmp";
+
+    while ((opt = getopt(argc, argv, "s:j:t:c:m:T:C:e:h")) != -1) {
+        switch (opt) {
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'j':
+            workers = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            dmn.threads = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            cache_mbytes = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            mem_mbytes = strtoul(optarg, NULL, 10);
+            break;
+        case 'T':
+            dmn.tmpdir = optarg;
+            break;
+        case 'C':
+            cache_dir = optarg;
+            break;
+        case 'e':
+            dmn.effort = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (socket_path == NULL || optind != argc ||
+        dmn.effort < DRPM_EFFORT_MIN || dmn.effort > DRPM_EFFORT_MAX) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    workers = threads_resolve(workers);
+    dmn.mem_limit = (uint64_t)mem_mbytes * 1024 * 1024;
+
+    if (cache_create(&dmn.cache, (size_t)cache_mbytes * 1024 * 1024) != DRPM_ERR_OK ||
+        (cache_dir != NULL && cache_set_dir(dmn.cache, cache_dir) != DRPM_ERR_OK) ||
+        pthread_mutex_init(&dmn.lock, NULL) != 0 ||
+        pthread_cond_init(&dmn.queued, NULL) != 0 ||
+        pthread_cond_init(&dmn.released, NULL) != 0 ||
+        (threads = malloc(workers * sizeof(pthread_t))) == NULL) {
+        fprintf(stderr, "%s: initialization failed\n", argv[0]);
+        goto cleanup;
+    }
+
+    action.sa_handler = stop_handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+
+    if ((sock = listen_on(socket_path)) < 0)
+        goto cleanup;
+
+    /* Stop signals stay blocked everywhere and are only let through
+     * atomically while ppoll() waits, so a signal arriving between
+     * checking stop_requested and waiting is not lost. Workers inherit
+     * the mask and never see them. */
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &wait_signals);
+    sigdelset(&wait_signals, SIGINT);
+    sigdelset(&wait_signals, SIGTERM);
+
+    for (; started < workers; started++)
+        if (pthread_create(&threads[started], NULL, worker, &dmn) != 0)
+            break;
+    if (started == 0) {
+        fprintf(stderr, "%s: cannot start workers\n", argv[0]);
+        goto cleanup;
+    }
+
+    listener.fd = sock;
+    listener.events = POLLIN;
+
+    while (!stop_requested) {
+        if (ppoll(&listener, 1, NULL, &wait_signals) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+        if ((client = accept4(sock, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            break;
+        }
+        if (!peer_allowed(client)) {
+            close(client);
+            continue;
+        }
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        if (!enqueue(&dmn, client)) {
+            send_error(client, DRPM_ERR_OTHER);
+            close(client);
+        }
+    }
+
+    ret = EXIT_SUCCESS;
+
+cleanup:
+    /* serving clients that are already queued before stopping */
+    if (started > 0) {
+        pthread_mutex_lock(&dmn.lock);
+        dmn.stopping = true;
+        pthread_cond_broadcast(&dmn.queued);
+        pthread_mutex_unlock(&dmn.lock);
+        for (unsigned i = 0; i < started; i++)
+            pthread_join(threads[i], NULL);
+    }
+
+    if (sock >= 0) {
+        close(sock);
+        unlink(socket_path);
+    }
+
+    free(threads);
+    if (dmn.cache != NULL)
+        cache_destroy(&dmn.cache);
+
+    return ret;
+}